@@ -0,0 +1,746 @@
+/** @file khbench.c
+ * Comparative transport benchmark: the same one-way record stream through the khello2 module and through stock Linux IPC.
+ *
+ * The parent produces records and a forked child consumes them. Each record carries its sequence number and the time it was built, so the consumer measures
+ * the latency of every record and the throughput of the whole stream. The transports are measured in turn, for each record size:
+ * rw     write() per record to the device, read() of every queued record (dev_write and dev_read).
+ * batch  KHELLO_IOC_SEND_BATCH per burst of records, read() as for rw.
+ * ring   the shared ring of the device (page KHELLO_MMAP_RING_PGOFF) with libkhello, sleeping in KHELLO_IOC_RING_WAIT.
+ * pipe   write() per record to a pipe, read() of whatever is buffered.
+ * unix   send() and recv() per record on a SOCK_SEQPACKET socket pair, which keeps record boundaries like the device.
+ * shm    struct khello_ring in shared anonymous memory, the same protocol as ring with futexes instead of the ioctls: no module involved.
+ * The device rings drop records when full, so every transport runs with the same flow control: the producer keeps at most a window of records
+ * in flight, counted against what the consumer has acknowledged in shared memory. The device transports are skipped when the device is missing.
+ *
+ * Usage:
+ * After loading the kernel module: "insmod khello.ko"
+ * Run every transport for records of 16, 32 and 56 bytes: "./khbench"
+ * Compare the device against a pipe and shared memory for 32-byte records, producer on CPU 2 and consumer on CPU 3: "./khbench -m rw -m pipe -m shm -s 32 -c 2,3"
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include "../libkhello/libkhello.h"
+#include "../say_hello/rt.h"
+
+
+#define TIMEOUT_MS 1000 /**< A consumer receiving nothing for this long ends the run with an error. */
+#define MAX_SIZES 16 /**< Most record sizes in one run. */
+#define REC_HDR 16 /**< Sequence number and build time at the start of every record, so the smallest record size. */
+
+#define MODE_RW 0 /**< read() and write() on the device. */
+#define MODE_BATCH 1 /**< KHELLO_IOC_SEND_BATCH and read() on the device. */
+#define MODE_RING 2 /**< Shared ring of the device. */
+#define MODE_PIPE 3 /**< Pipe. */
+#define MODE_UNIX 4 /**< Unix socket pair. */
+#define MODE_SHM 5 /**< Ring in shared memory with futexes. */
+#define NUM_MODES 6
+
+
+/** Options of a run. */
+struct options {
+	const char *device; /**< The device of the rw, batch and ring transports. */
+	int sizes[MAX_SIZES]; /**< Record sizes. */
+	int num_sizes; /**< Number of record sizes. */
+	long count; /**< Measured records per transport and size. */
+	long warmup; /**< Records sent before measuring. */
+	int window; /**< Most records in flight. */
+	int burst; /**< Records per KHELLO_IOC_SEND_BATCH. */
+	int cpu[2]; /**< CPUs of the producer and the consumer. -1 to leave unpinned. */
+	int modes[NUM_MODES]; /**< Transports to run. */
+};
+
+/** State shared by the producer and the consumer, in an anonymous shared mapping. */
+struct shared {
+	unsigned long long acked; /**< Sequence number after the last record consumed. Written by the consumer. */
+	char pad[56]; /**< Keeps acked on its own cache line. */
+	struct khello_ring ring; /**< The ring of MODE_SHM. */
+	struct rt_hist hist; /**< Latency of the measured records. Written by the consumer. */
+	unsigned long long lost; /**< Records skipped in the sequence, dropped by a full device ring. */
+	unsigned long long disorder; /**< Records older than one already consumed, or of the wrong size. */
+	unsigned long long first_ns; /**< Build time of the first measured record. */
+	unsigned long long end_ns; /**< Time the last record was consumed. */
+};
+
+/** One side of a transport. */
+struct transport {
+	int mode; /**< MODE_*. */
+	int size; /**< Record size. */
+	struct khl_channel chan; /**< The device, for MODE_RW, MODE_BATCH and MODE_RING. */
+	int opened; /**< 1 once chan is open. */
+	int fds[2]; /**< Read and write ends of MODE_PIPE and MODE_UNIX. -1 when closed. */
+	struct shared *shared; /**< The shared state. */
+	unsigned long long next; /**< Consumer: sequence number expected next. */
+	long warmup; /**< Consumer: records before measuring. */
+};
+
+
+static const char *const g_mode_names[NUM_MODES] = { "rw", "batch", "ring", "pipe", "unix", "shm" };
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @param p_opt Returns the options.
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[], struct options *const p_opt);
+
+/** Runs one transport for one record size: sets it up, forks the consumer, produces the stream and prints the results.
+ *  @param p_opt The options.
+ *  @param p_mode MODE_*.
+ *  @param p_size Record size.
+ *  @return 0 if OK or skipped. Else -1.
+ */
+static int run(const struct options *const p_opt, const int p_mode, const int p_size);
+
+/** Sets up a transport before the fork.
+ *  @param p_opt The options.
+ *  @param p_tr The transport, with mode, size and shared set.
+ *  @param p_window Returns the window to use, lowered to what a device ring holds.
+ *  @return 0 if OK. 1 if the transport is not available, after printing why. -1 on error.
+ */
+static int setup(const struct options *const p_opt, struct transport *const p_tr, int *const p_window);
+
+/** Writes the stream: records numbered from 0, never more than p_window ahead of shared->acked.
+ *  @param p_tr The transport.
+ *  @param p_total Number of records.
+ *  @param p_window Most records in flight.
+ *  @param p_burst Records per KHELLO_IOC_SEND_BATCH.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+static int produce(struct transport *const p_tr, const long p_total, const int p_window, const int p_burst);
+
+/** Reads the stream until every record is consumed or lost, acknowledging after each receive call.
+ *  @param p_tr The transport.
+ *  @param p_total Number of records.
+ *  @return 0 if OK. Else -1 with errno set. ETIMEDOUT means no record came within TIMEOUT_MS.
+ */
+static int consume(struct transport *const p_tr, const long p_total);
+
+/** Checks a received record and adds its latency to the histogram. A khl_ring_fn.
+ *  @param p_arg The transport.
+ *  @param p_data The record.
+ *  @param p_len Its length.
+ */
+static void take_record(void *p_arg, const unsigned char *p_data, __u32 p_len);
+
+/** Writes one record to a pipe or socket, resuming after short writes.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+static int write_all(const int p_fd, const unsigned char *p_data, const size_t p_len);
+
+/** Writes one record to the shared memory ring. The same protocol as khl_ring_send() with shm_wait() and shm_notify() as the doorbell.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+static int shm_send(struct khello_ring *const p_ring, const unsigned char *const p_data, const int p_len);
+
+/** Reads every record published in the shared memory ring, up to p_max. The same protocol as khl_ring_recv().
+ *  @return Number of records read. -1 with errno set.
+ */
+static int shm_recv(struct khello_ring *const p_ring, const khl_ring_fn p_fn, void *const p_arg, const int p_max);
+
+/** Sleeps on a futex until a ring event, following the doorbell protocol of struct khello_ring.
+ *  @param p_event KHELLO_RING_EV_DATA or KHELLO_RING_EV_SPACE.
+ *  @return 0 if the event may have happened. -1 with errno set to ETIMEDOUT after TIMEOUT_MS.
+ */
+static int shm_wait(struct khello_ring *const p_ring, const __u32 p_event);
+
+/** Wakes the peer if it sleeps on a ring event, clearing its flag.
+ *  @param p_event KHELLO_RING_EV_DATA to wake the consumer, KHELLO_RING_EV_SPACE to wake the producer.
+ */
+static void shm_notify(struct khello_ring *const p_ring, const __u32 p_event);
+
+/** Reads and discards anything queued on the device. */
+static void drain(struct khl_channel *const p_chan);
+
+/** Releases what setup() acquired. */
+static void teardown(struct transport *const p_tr);
+
+/** Prints the results of a run.
+ *  @param p_mode MODE_*.
+ *  @param p_size Record size.
+ *  @param p_shared Results written by the consumer.
+ */
+static void report(const int p_mode, const int p_size, const struct shared *const p_shared);
+
+/** Pins the calling process to a CPU.
+ *  @param p_cpu The CPU. -1 does nothing.
+ */
+static void pin(const int p_cpu);
+
+/** Returns CLOCK_MONOTONIC_RAW in nanoseconds. */
+static unsigned long long now_ns();
+
+/** Process the value set in erno.
+ *  @param The errno itself.
+ */
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	struct options opt;
+	int i, mode;
+
+	if(check_args(argc, argv, &opt) == -1) {
+		printf("Usage: khbench [-d device] [-m rw|batch|ring|pipe|unix|shm|all] [-s size[,size...]] [-n count] [-w warmup] [-W window] [-k burst] [-c cpu,cpu]\n");
+		return 0;
+	}
+	signal(SIGPIPE, SIG_IGN); /* A consumer that fails closes its end: report EPIPE rather than die. */
+	pin(opt.cpu[0]);
+	printf("%ld records per run after %ld warmup, window %d, burst %d\n", opt.count, opt.warmup, opt.window, opt.burst);
+	printf("%-6s %5s %10s %8s %12s %9s %8s %8s %8s %8s %10s\n", "mode", "size", "records", "lost", "records/s", "MB/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+	fflush(stdout);
+	for(i = 0; i < opt.num_sizes; ++i) {
+		for(mode = 0; mode < NUM_MODES; ++mode) {
+			if(opt.modes[mode] && (run(&opt, mode, opt.sizes[i]) == -1))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[], struct options *const p_opt)
+{
+	char *size, *save;
+	int c, mode;
+
+	memset(p_opt, 0, sizeof(struct options));
+	p_opt->device = KHL_DEVICE;
+	p_opt->sizes[0] = REC_HDR;
+	p_opt->sizes[1] = KHELLO_RECORD_MAX;
+	p_opt->sizes[2] = KHELLO_RING_DATA_MAX;
+	p_opt->num_sizes = 3;
+	p_opt->count = 500000;
+	p_opt->warmup = 10000;
+	p_opt->window = 32;
+	p_opt->burst = 16;
+	p_opt->cpu[0] = p_opt->cpu[1] = -1;
+	while((c = getopt(p_num, p_args, "d:m:s:n:w:W:k:c:")) != -1) {
+		switch(c) {
+			case 'd':
+				p_opt->device = optarg;
+				break;
+			case 'm':
+				for(mode = 0; mode < NUM_MODES; ++mode) {
+					if((strcmp(optarg, g_mode_names[mode]) == 0) || (strcmp(optarg, "all") == 0))
+						p_opt->modes[mode] = 1;
+				}
+				break;
+			case 's':
+				p_opt->num_sizes = 0;
+				for(size = strtok_r(optarg, ",", &save); size != NULL; size = strtok_r(NULL, ",", &save)) {
+					if(p_opt->num_sizes == MAX_SIZES)
+						return -1;
+					p_opt->sizes[p_opt->num_sizes] = atoi(size);
+					if((p_opt->sizes[p_opt->num_sizes] < REC_HDR) || (p_opt->sizes[p_opt->num_sizes] > KHELLO_RING_DATA_MAX))
+						return -1;
+					++p_opt->num_sizes;
+				}
+				if(p_opt->num_sizes == 0)
+					return -1;
+				break;
+			case 'n':
+				if((p_opt->count = atol(optarg)) < 1)
+					return -1;
+				break;
+			case 'w':
+				if((p_opt->warmup = atol(optarg)) < 0)
+					return -1;
+				break;
+			case 'W':
+				if((p_opt->window = atoi(optarg)) < 1)
+					return -1;
+				break;
+			case 'k':
+				if(((p_opt->burst = atoi(optarg)) < 1) || (p_opt->burst > KHELLO_BATCH_MAX))
+					return -1;
+				break;
+			case 'c':
+				if(sscanf(optarg, "%d,%d", &p_opt->cpu[0], &p_opt->cpu[1]) != 2)
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	for(mode = 0; (mode < NUM_MODES) && !p_opt->modes[mode]; ++mode);
+	if(mode == NUM_MODES) { /* No -m means all transports. */
+		for(mode = 0; mode < NUM_MODES; ++mode)
+			p_opt->modes[mode] = 1;
+	}
+	return 0;
+}
+
+
+
+static int run(const struct options *const p_opt, const int p_mode, const int p_size)
+{
+	struct transport tr;
+	struct shared *shared;
+	long total = p_opt->warmup + p_opt->count;
+	int window = p_opt->window, status, ready, result = -1;
+	pid_t pid;
+
+	shared = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(shared == MAP_FAILED) {
+		process_errnum(errno);
+		return -1;
+	}
+	memset(&tr, 0, sizeof(tr));
+	tr.mode = p_mode;
+	tr.size = p_size;
+	tr.fds[0] = tr.fds[1] = -1;
+	tr.shared = shared;
+	tr.warmup = p_opt->warmup;
+	if((ready = setup(p_opt, &tr, &window)) != 0) {
+		result = (ready == 1) ? 0 : -1;
+		goto do_exit;
+	}
+
+	if((pid = fork()) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if(pid == 0) { /* Consumer. */
+		pin(p_opt->cpu[1]);
+		if(tr.fds[1] != -1)
+			close(tr.fds[1]);
+		if(consume(&tr, total) == -1) {
+			fprintf(stderr, "%s %d: consumer: %s\n", g_mode_names[p_mode], p_size, strerror(errno));
+			_exit(1);
+		}
+		_exit(0);
+	}
+	if(tr.fds[0] != -1) {
+		close(tr.fds[0]);
+		tr.fds[0] = -1;
+	}
+	if(produce(&tr, total, window, p_opt->burst) == -1) {
+		fprintf(stderr, "%s %d: producer: %s\n", g_mode_names[p_mode], p_size, strerror(errno));
+		kill(pid, SIGTERM);
+	}
+	waitpid(pid, &status, 0);
+	if(WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+		report(p_mode, p_size, shared);
+		result = 0;
+	}
+
+do_exit:
+	teardown(&tr);
+	munmap(shared, sizeof(struct shared));
+	return result;
+}
+
+
+
+static int setup(const struct options *const p_opt, struct transport *const p_tr, int *const p_window)
+{
+	struct khello_stats_page stats;
+
+	switch(p_tr->mode) {
+		case MODE_RW:
+		case MODE_BATCH:
+		case MODE_RING:
+			if((p_tr->mode != MODE_RING) && (p_tr->size > KHELLO_RECORD_MAX)) {
+				printf("%-6s %5d skipped: device records hold at most %d bytes\n", g_mode_names[p_tr->mode], p_tr->size, KHELLO_RECORD_MAX);
+				return 1;
+			}
+			if(khl_open(&p_tr->chan, p_opt->device, O_RDWR | O_NONBLOCK) == -1) {
+				printf("%-6s %5d skipped: %s: %s\n", g_mode_names[p_tr->mode], p_tr->size, p_opt->device, strerror(errno));
+				return 1;
+			}
+			p_tr->opened = 1;
+			if((p_tr->mode == MODE_BATCH) && !(p_tr->chan.caps & KHL_CAP_BATCH)) {
+				printf("%-6s %5d skipped: the module has no KHELLO_IOC_SEND_BATCH\n", g_mode_names[p_tr->mode], p_tr->size);
+				return 1;
+			}
+			if(p_tr->mode == MODE_RING) {
+				if(khl_ring_map(&p_tr->chan) == -1) {
+					printf("%-6s %5d skipped: no shared ring: %s\n", g_mode_names[p_tr->mode], p_tr->size, strerror(errno));
+					return 1;
+				}
+				/* Drop what an earlier client left. khbench is the only user of the ring while it runs. */
+				p_tr->chan.ring->tail = p_tr->chan.ring->head;
+				p_tr->chan.ring->cons_wait = p_tr->chan.ring->prod_wait = 0;
+				return 0;
+			}
+			drain(&p_tr->chan);
+			/* More records in flight than the device holds would only measure drops. */
+			if((khl_stats(&p_tr->chan, &stats) == 0) && (stats.ring_size > 0) && ((__u32)*p_window > stats.ring_size))
+				*p_window = stats.ring_size;
+			return 0;
+		case MODE_PIPE:
+			if(pipe(p_tr->fds) == -1)
+				break;
+			return 0;
+		case MODE_UNIX:
+			if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, p_tr->fds) == -1)
+				break;
+			return 0;
+		case MODE_SHM:
+			/* Only the fields the protocol uses: shared memory needs no layout check. */
+			p_tr->shared->ring.slots = KHELLO_RING_SLOTS;
+			p_tr->shared->ring.slot_size = sizeof(struct khello_ring_slot);
+			return 0;
+	}
+	process_errnum(errno);
+	return -1;
+}
+
+
+
+static int produce(struct transport *const p_tr, const long p_total, const int p_window, const int p_burst)
+{
+	unsigned char recs[KHELLO_BATCH_MAX][KHELLO_RING_DATA_MAX];
+	struct iovec iov[KHELLO_BATCH_MAX];
+	unsigned long long seq, rseq, stamp, acked, last_acked = 0, deadline = 0;
+	unsigned int spins = 0;
+	int i, num, result = 0;
+
+	for(i = 0; i < KHELLO_BATCH_MAX; ++i) {
+		iov[i].iov_base = recs[i];
+		iov[i].iov_len = p_tr->size;
+	}
+	for(seq = 0; seq < (unsigned long long)p_total; seq += num) {
+		num = 1;
+		if(p_tr->mode == MODE_BATCH) {
+			num = (p_burst < p_window) ? p_burst : p_window;
+			if(seq + num > (unsigned long long)p_total)
+				num = p_total - seq;
+		}
+		/* Flow control: wait for the consumer to acknowledge, letting it run if both share a CPU. A consumer that stops acknowledging ends the run. */
+		while(seq + num - (acked = __atomic_load_n(&p_tr->shared->acked, __ATOMIC_ACQUIRE)) > (unsigned long long)p_window) {
+			if((++spins & 0x3f) == 0)
+				sched_yield();
+			if((spins & 0xffff) != 0)
+				continue;
+			if((deadline == 0) || (acked != last_acked)) {
+				deadline = now_ns() + 2 * TIMEOUT_MS * 1000000ULL;
+				last_acked = acked;
+			} else if(now_ns() > deadline) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+		deadline = 0;
+
+		/* Identical records for every transport: sequence number, build time, then a pattern. */
+		for(i = 0; i < num; ++i) {
+			rseq = seq + i;
+			stamp = now_ns();
+			memcpy(recs[i], &rseq, sizeof(rseq));
+			memcpy(recs[i] + 8, &stamp, sizeof(stamp));
+			memset(recs[i] + REC_HDR, (unsigned char)rseq, p_tr->size - REC_HDR);
+		}
+		switch(p_tr->mode) {
+			case MODE_RW:
+				result = khl_send(&p_tr->chan, recs[0], p_tr->size);
+				break;
+			case MODE_BATCH:
+				result = (khl_send_batch(&p_tr->chan, iov, num) == num) ? 0 : -1;
+				break;
+			case MODE_RING:
+				result = khl_ring_send(&p_tr->chan, recs[0], p_tr->size);
+				break;
+			case MODE_PIPE:
+			case MODE_UNIX:
+				result = write_all(p_tr->fds[1], recs[0], p_tr->size);
+				break;
+			case MODE_SHM:
+				result = shm_send(&p_tr->shared->ring, recs[0], p_tr->size);
+				break;
+		}
+		if(result == -1)
+			return -1;
+	}
+	return 0;
+}
+
+
+
+static int consume(struct transport *const p_tr, const long p_total)
+{
+	unsigned char buf[KHELLO_RING_DATA_MAX * KHELLO_BATCH_MAX];
+	struct khl_record recs[KHELLO_BATCH_MAX];
+	size_t have = 0, pos;
+	ssize_t count;
+	int i, num;
+
+	while(p_tr->next < (unsigned long long)p_total) {
+		switch(p_tr->mode) {
+			case MODE_RW:
+			case MODE_BATCH:
+				num = khl_recv(&p_tr->chan, buf, sizeof(buf), recs, KHELLO_BATCH_MAX);
+				if((num == -1) && (errno != EAGAIN))
+					return -1;
+				if(num <= 0) {
+					if((num = khl_wait_readable(&p_tr->chan, TIMEOUT_MS)) == 0)
+						errno = ETIMEDOUT;
+					if(num <= 0)
+						return -1;
+					continue;
+				}
+				for(i = 0; i < num; ++i)
+					take_record(p_tr, recs[i].data, recs[i].len);
+				break;
+			case MODE_RING:
+				if(khl_ring_recv(&p_tr->chan, take_record, p_tr, KHELLO_RING_SLOTS) == -1)
+					return -1;
+				break;
+			case MODE_PIPE:
+				/* A byte stream: keep a partial record for the next read. */
+				if((count = read(p_tr->fds[0], buf + have, sizeof(buf) - have)) <= 0) {
+					if(count == 0)
+						errno = EPIPE;
+					if((count == 0) || (errno != EINTR))
+						return -1;
+					continue;
+				}
+				have += count;
+				for(pos = 0; pos + p_tr->size <= have; pos += p_tr->size)
+					take_record(p_tr, buf + pos, p_tr->size);
+				memmove(buf, buf + pos, have - pos);
+				have -= pos;
+				break;
+			case MODE_UNIX:
+				if((count = recv(p_tr->fds[0], buf, sizeof(buf), 0)) <= 0) {
+					if(count == 0)
+						errno = EPIPE;
+					if((count == 0) || (errno != EINTR))
+						return -1;
+					continue;
+				}
+				take_record(p_tr, buf, count);
+				break;
+			case MODE_SHM:
+				if(shm_recv(&p_tr->shared->ring, take_record, p_tr, KHELLO_RING_SLOTS) == -1)
+					return -1;
+				break;
+		}
+		/* Acknowledge once per receive call, as a real consumer would after processing what it got. */
+		__atomic_store_n(&p_tr->shared->acked, p_tr->next, __ATOMIC_RELEASE);
+	}
+	p_tr->shared->end_ns = now_ns();
+	return 0;
+}
+
+
+
+static void take_record(void *p_arg, const unsigned char *p_data, __u32 p_len)
+{
+	struct transport *tr = p_arg;
+	struct shared *shared = tr->shared;
+	unsigned char rec[KHELLO_RING_DATA_MAX];
+	unsigned long long seq, stamp, now = now_ns();
+
+	if(p_len != (__u32)tr->size) {
+		++shared->disorder;
+		return;
+	}
+	/* Copy the record out as a consumer of a read() would have it. */
+	memcpy(rec, p_data, p_len);
+	memcpy(&seq, rec, sizeof(seq));
+	memcpy(&stamp, rec + 8, sizeof(stamp));
+	if(seq < tr->next) {
+		++shared->disorder;
+		return;
+	}
+	shared->lost += seq - tr->next;
+	tr->next = seq + 1;
+	if(seq < (unsigned long long)tr->warmup)
+		return;
+	if(shared->first_ns == 0)
+		shared->first_ns = stamp;
+	rt_hist_add(&shared->hist, (now > stamp) ? now - stamp : 0);
+}
+
+
+
+static int write_all(const int p_fd, const unsigned char *p_data, const size_t p_len)
+{
+	size_t done = 0;
+	ssize_t count;
+
+	while(done < p_len) {
+		if((count = write(p_fd, p_data + done, p_len - done)) == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += count;
+	}
+	return 0;
+}
+
+
+
+static int shm_send(struct khello_ring *const p_ring, const unsigned char *const p_data, const int p_len)
+{
+	struct khello_ring_slot *slot;
+	__u32 head = p_ring->head; /* Only the producer writes head. */
+	int spins = 0;
+
+	while(head - __atomic_load_n(&p_ring->tail, __ATOMIC_ACQUIRE) >= KHELLO_RING_SLOTS) {
+		if(++spins < KHL_SPIN_LIMIT)
+			continue;
+		if(shm_wait(p_ring, KHELLO_RING_EV_SPACE) == -1)
+			return -1;
+		spins = 0;
+	}
+	slot = &p_ring->slot[head & (KHELLO_RING_SLOTS - 1)];
+	memcpy(slot->data, p_data, p_len);
+	slot->len = p_len;
+	__atomic_store_n(&p_ring->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	shm_notify(p_ring, KHELLO_RING_EV_DATA);
+	return 0;
+}
+
+
+
+static int shm_recv(struct khello_ring *const p_ring, const khl_ring_fn p_fn, void *const p_arg, const int p_max)
+{
+	struct khello_ring_slot *slot;
+	__u32 tail = p_ring->tail, head; /* Only the consumer writes tail. */
+	int spins = 0, num = 0;
+
+	while((head = __atomic_load_n(&p_ring->head, __ATOMIC_ACQUIRE)) == tail) {
+		if(++spins < KHL_SPIN_LIMIT)
+			continue;
+		if(shm_wait(p_ring, KHELLO_RING_EV_DATA) == -1)
+			return -1;
+		spins = 0;
+	}
+	for(; (tail != head) && (num < p_max); ++tail, ++num) {
+		slot = &p_ring->slot[tail & (KHELLO_RING_SLOTS - 1)];
+		p_fn(p_arg, slot->data, (slot->len < KHELLO_RING_DATA_MAX) ? slot->len : KHELLO_RING_DATA_MAX);
+	}
+	__atomic_store_n(&p_ring->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	shm_notify(p_ring, KHELLO_RING_EV_SPACE);
+	return num;
+}
+
+
+
+static int shm_wait(struct khello_ring *const p_ring, const __u32 p_event)
+{
+	struct timespec timeout = { TIMEOUT_MS / 1000, (TIMEOUT_MS % 1000) * 1000000L };
+	__u32 *flag = (p_event == KHELLO_RING_EV_DATA) ? &p_ring->cons_wait : &p_ring->prod_wait;
+	__u32 *word = (p_event == KHELLO_RING_EV_DATA) ? &p_ring->head : &p_ring->tail;
+	__u32 seen;
+	int ready, result = 0;
+
+	/* Set the flag, then look again. Either the peer sees the flag or this side sees the peer's update. */
+	__atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	seen = __atomic_load_n(word, __ATOMIC_RELAXED);
+	if(p_event == KHELLO_RING_EV_DATA)
+		ready = (seen != p_ring->tail);
+	else
+		ready = (p_ring->head - seen < KHELLO_RING_SLOTS);
+	/* The futex sleeps only while the peer's index still holds the value seen, so an update after the check is not missed.
+	 * The mapping is shared between processes, so the futex is not FUTEX_PRIVATE_FLAG. */
+	if(!ready && (syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0) == -1) && (errno == ETIMEDOUT))
+		result = -1;
+	__atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+	return result;
+}
+
+
+
+static void shm_notify(struct khello_ring *const p_ring, const __u32 p_event)
+{
+	__u32 *flag = (p_event == KHELLO_RING_EV_DATA) ? &p_ring->cons_wait : &p_ring->prod_wait;
+
+	if((__atomic_load_n(flag, __ATOMIC_RELAXED) == 0) || (__atomic_exchange_n(flag, 0, __ATOMIC_ACQ_REL) == 0))
+		return;
+	syscall(SYS_futex, (p_event == KHELLO_RING_EV_DATA) ? &p_ring->head : &p_ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+
+static void drain(struct khl_channel *const p_chan)
+{
+	unsigned char buf[4096];
+
+	while(read(p_chan->fd, buf, sizeof(buf)) > 0);
+}
+
+
+
+static void teardown(struct transport *const p_tr)
+{
+	if(p_tr->opened)
+		khl_close(&p_tr->chan);
+	if(p_tr->fds[0] != -1)
+		close(p_tr->fds[0]);
+	if(p_tr->fds[1] != -1)
+		close(p_tr->fds[1]);
+}
+
+
+
+static void report(const int p_mode, const int p_size, const struct shared *const p_shared)
+{
+	double secs = (p_shared->end_ns - p_shared->first_ns) / 1e9;
+
+	printf("%-6s %5d %10llu %8llu %12.0f %9.1f %8llu %8llu %8llu %8llu %10llu", g_mode_names[p_mode], p_size, p_shared->hist.n, p_shared->lost,
+		p_shared->hist.n / secs, p_shared->hist.n * p_size / secs / 1e6, rt_hist_percentile(&p_shared->hist, 0.5), rt_hist_percentile(&p_shared->hist, 0.9),
+		rt_hist_percentile(&p_shared->hist, 0.99), rt_hist_percentile(&p_shared->hist, 0.999), p_shared->hist.max);
+	if(p_shared->disorder > 0)
+		printf("  %llu out of order or wrong size", p_shared->disorder);
+	printf("\n");
+	fflush(stdout);
+}
+
+
+
+static void pin(const int p_cpu)
+{
+	cpu_set_t set;
+
+	if(p_cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(p_cpu, &set);
+	if(sched_setaffinity(0, sizeof(set), &set) == -1)
+		process_errnum(errno);
+}
+
+
+
+static unsigned long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
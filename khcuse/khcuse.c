@@ -0,0 +1,547 @@
+/** @file khcuse.c
+ * Userspace stand-in for a khello device, built on CUSE (character devices in userspace).
+ *
+ * Creates /dev/<name> served by this process instead of the khello2 kernel module, for machines where the module cannot be loaded, such as CI and sandboxes.
+ * It speaks the same protocol as one channel of the module: one record of up to KHELLO_RECORD_MAX bytes per write(), whole records per read() with the optional
+ * struct khello_rec_hdr, poll(), and the KHELLO_IOC_SET_RECV, KHELLO_IOC_GET_RECV and KHELLO_IOC_SEND_BATCH ioctls. Client tools run against it unchanged.
+ * Every call goes through the FUSE daemon, so throughput and latency are much worse than with the module; use it to test client logic, not to measure the module.
+ * CUSE cannot map memory into clients: the shared ring, statistics page and arena are not available, and KHELLO_IOC_RING_WAIT and KHELLO_IOC_RING_NOTIFY fail with ENOTTY.
+ *
+ * Usage:
+ * Serve /dev/khello until Ctrl-C (needs access to /dev/cuse, usually root): "./khcuse"
+ * Serve /dev/khello1 with 1024 records and CLOCK_REALTIME timestamps: "./khcuse -n khello1 -r 1024 -c 2"
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <cuse_lowlevel.h>
+#include "../khello2/khello.h"
+
+
+#define RING_RECORDS_MAX 65536 /**< Largest ring, as in the module. */
+#define BATCH_IOV_MAX 254 /**< Records taken by one KHELLO_IOC_SEND_BATCH: FUSE fetches at most 256 buffers per ioctl, two of them for the batch and its messages. */
+
+
+/** A record queued in the device. */
+struct record {
+	__u32 len; /**< Number of bytes in data. */
+	__u32 clock; /**< KHELLO_CLOCK_* used for enq_ns. */
+	__u64 enq_ns; /**< Time the record was written. */
+	unsigned char data[KHELLO_RECORD_MAX]; /**< The record payload. */
+};
+
+/** Per file handle state. */
+struct khcuse_file {
+	struct khcuse_file *next; /**< Next open file handle. */
+	struct khcuse_file *prev; /**< Previous open file handle. */
+	__u32 recv_flags; /**< KHELLO_RECV_* flags. */
+	int flags; /**< Open flags. */
+	struct fuse_pollhandle *poll; /**< Pending poll waiting for records, or NULL. */
+};
+
+
+static struct record *g_ring = NULL; /**< Ring of records sent to the device. */
+static unsigned int g_ring_mask; /**< Number of records in the ring minus 1. */
+static unsigned int g_head = 0; /**< Index of the next record to write. Wraps freely, masked on access. */
+static unsigned int g_tail = 0; /**< Index of the next record to read. Wraps freely, masked on access. */
+static size_t g_bytes_queued = 0; /**< Number of payload bytes in the ring not yet read. */
+static __u32 g_clock = KHELLO_CLOCK_MONOTONIC; /**< Clock used to timestamp records. */
+static struct khello_stats_page g_stats; /**< Statistics, the same counters as the module's statistics page. */
+static struct khcuse_file *g_files = NULL; /**< Open file handles. */
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER; /**< Protects everything above. Requests are served by several threads. */
+
+
+/** Opens the device. Implements cuse_lowlevel_ops.open. */
+static void dev_open(fuse_req_t p_req, struct fuse_file_info *p_fi);
+
+/** Releases the device. Implements cuse_lowlevel_ops.release. */
+static void dev_release(fuse_req_t p_req, struct fuse_file_info *p_fi);
+
+/** Reads whole records from the device. Implements cuse_lowlevel_ops.read. */
+static void dev_read(fuse_req_t p_req, size_t p_size, off_t p_off, struct fuse_file_info *p_fi);
+
+/** Writes one record to the device. Implements cuse_lowlevel_ops.write. */
+static void dev_write(fuse_req_t p_req, const char *p_buf, size_t p_size, off_t p_off, struct fuse_file_info *p_fi);
+
+/** Implements ioctl operations. Implements cuse_lowlevel_ops.ioctl.
+ *  CUSE does not copy ioctl arguments itself: each handler first asks for the user buffers it needs with fuse_reply_ioctl_retry() and is called again with them.
+ */
+static void dev_ioctl(fuse_req_t p_req, int p_cmd, void *p_arg, struct fuse_file_info *p_fi, unsigned int p_flags, const void *p_in, size_t p_in_size, size_t p_out_size);
+
+/** Returns results to a poll or select call. Implements cuse_lowlevel_ops.poll. */
+static void dev_poll(fuse_req_t p_req, struct fuse_file_info *p_fi, struct fuse_pollhandle *p_poll);
+
+/** Implements KHELLO_IOC_SEND_BATCH. Takes three retries: the batch, then its messages, then their payloads. All records are queued under one lock and share one timestamp.
+ *  @param p_req The request.
+ *  @param p_arg Address of the struct khello_batch in the client.
+ *  @param p_in Buffers fetched so far: the batch, its messages, their payloads.
+ *  @param p_in_size Size of p_in.
+ */
+static void send_batch(fuse_req_t p_req, void *p_arg, const unsigned char *p_in, const size_t p_in_size);
+
+/** Queues one record, replacing the oldest record if the ring is full. Called with g_mutex held.
+ *  @param p_data The payload.
+ *  @param p_size Size of the payload. At most KHELLO_RECORD_MAX.
+ *  @param p_clock KHELLO_CLOCK_* used for p_ns.
+ *  @param p_ns Enqueue timestamp.
+ */
+static void enqueue(const void *p_data, const size_t p_size, const __u32 p_clock, const __u64 p_ns);
+
+/** Wakes the pollers waiting for records. Called with g_mutex held. */
+static void wake_pollers(void);
+
+/** Returns the current time of a clock.
+ *  @param p_clock The KHELLO_CLOCK_* to read.
+ *  @return Time in nanoseconds.
+ */
+static __u64 now_ns(const __u32 p_clock);
+
+/** Prints the statistics of the device. */
+static void print_stats(const char *const p_name);
+
+
+
+/** Operations of the device. */
+static const struct cuse_lowlevel_ops g_ops = {
+	.open = dev_open,
+	.read = dev_read,
+	.write = dev_write,
+	.release = dev_release,
+	.ioctl = dev_ioctl,
+	.poll = dev_poll,
+};
+
+
+
+int main(int argc, char *argv[])
+{
+	const char *name = "khello";
+	char dev_name[128], *fuse_argv[4];
+	const char *dev_info[1];
+	struct cuse_info info;
+	unsigned int records = 64, size = 1;
+	int opt, fuse_argc = 0, single = 0, debug = 0, result = 1;
+
+	while((opt = getopt(argc, argv, "n:r:c:sd")) != -1) {
+		switch(opt) {
+			case 'n':
+				name = optarg;
+				break;
+			case 'r':
+				records = atoi(optarg);
+				break;
+			case 'c':
+				g_clock = atoi(optarg);
+				if(g_clock > KHELLO_CLOCK_REALTIME)
+					goto do_usage;
+				break;
+			case 's':
+				single = 1;
+				break;
+			case 'd':
+				debug = 1;
+				break;
+			default:
+				goto do_usage;
+		}
+	}
+
+	/* The ring size is a power of 2 so indices can be masked, as in the module. */
+	if(records < 1)
+		records = 1;
+	if(records > RING_RECORDS_MAX)
+		records = RING_RECORDS_MAX;
+	while(size < records)
+		size <<= 1;
+	g_ring_mask = size - 1;
+	if((g_ring = calloc(size, sizeof(struct record))) == NULL) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		return 1;
+	}
+	g_stats.ring_size = size;
+	g_stats.mode = KHELLO_MODE_OVERWRITE;
+
+	/* Stay in the foreground so the statistics are printed when the device is removed. */
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = "-f";
+	if(single)
+		fuse_argv[fuse_argc++] = "-s";
+	if(debug)
+		fuse_argv[fuse_argc++] = "-d";
+	snprintf(dev_name, sizeof(dev_name), "DEVNAME=%s", name);
+	dev_info[0] = dev_name;
+	memset(&info, 0, sizeof(info));
+	info.dev_info_argc = 1;
+	info.dev_info_argv = dev_info;
+	info.flags = CUSE_UNRESTRICTED_IOCTL;
+
+	printf("Serving /dev/%s, %u records. Ctrl-C to stop.\n", name, size);
+	fflush(stdout);
+	result = cuse_lowlevel_main(fuse_argc, fuse_argv, &info, &g_ops, NULL);
+	print_stats(name);
+	free(g_ring);
+	return result;
+
+do_usage:
+	printf("Usage: khcuse [-n name] [-r records] [-c clock] [-s] [-d]\n");
+	return 0;
+}
+
+
+
+static void dev_open(fuse_req_t p_req, struct fuse_file_info *p_fi)
+{
+	struct khcuse_file *file;
+
+	if((file = calloc(1, sizeof(struct khcuse_file))) == NULL) {
+		fuse_reply_err(p_req, ENOMEM);
+		return;
+	}
+	file->flags = p_fi->flags;
+	p_fi->fh = (uintptr_t)file;
+	/* Reads and writes are served directly, bypassing the page cache. */
+	p_fi->direct_io = 1;
+	p_fi->nonseekable = 1;
+
+	pthread_mutex_lock(&g_mutex);
+	file->next = g_files;
+	if(g_files != NULL)
+		g_files->prev = file;
+	g_files = file;
+	if((file->flags & O_ACCMODE) != O_WRONLY)
+		++g_stats.readers;
+	if((file->flags & O_ACCMODE) != O_RDONLY)
+		++g_stats.writers;
+	pthread_mutex_unlock(&g_mutex);
+	fuse_reply_open(p_req, p_fi);
+}
+
+
+
+static void dev_release(fuse_req_t p_req, struct fuse_file_info *p_fi)
+{
+	struct khcuse_file *file = (struct khcuse_file*)(uintptr_t)p_fi->fh;
+
+	pthread_mutex_lock(&g_mutex);
+	if(file->prev != NULL)
+		file->prev->next = file->next;
+	else
+		g_files = file->next;
+	if(file->next != NULL)
+		file->next->prev = file->prev;
+	if((file->flags & O_ACCMODE) != O_WRONLY)
+		--g_stats.readers;
+	if((file->flags & O_ACCMODE) != O_RDONLY)
+		--g_stats.writers;
+	pthread_mutex_unlock(&g_mutex);
+	if(file->poll != NULL)
+		fuse_pollhandle_destroy(file->poll);
+	free(file);
+	fuse_reply_err(p_req, 0);
+}
+
+
+
+static void dev_read(fuse_req_t p_req, size_t p_size, off_t p_off, struct fuse_file_info *p_fi)
+{
+	struct khcuse_file *file = (struct khcuse_file*)(uintptr_t)p_fi->fh;
+	struct record *rec;
+	struct khello_rec_hdr hdr;
+	unsigned char *buf;
+	size_t copied = 0, hdr_size = 0, need;
+	__u32 deq_clock = 0;
+	__u64 deq_ns = 0, latency;
+	int err = 0;
+
+	/* An empty device returns end of file, or EAGAIN to non-blocking readers driven by poll. */
+	if(file->recv_flags & KHELLO_RECV_HDR)
+		hdr_size = sizeof(struct khello_rec_hdr);
+	if((buf = malloc(p_size)) == NULL) {
+		fuse_reply_err(p_req, ENOMEM);
+		return;
+	}
+
+	pthread_mutex_lock(&g_mutex);
+	if((g_head == g_tail) && (p_fi->flags & O_NONBLOCK))
+		err = EAGAIN;
+
+	/* Dequeue as many whole records as fit in the user buffer. */
+	while(g_head != g_tail) {
+		rec = &g_ring[g_tail & g_ring_mask];
+		need = hdr_size + rec->len;
+		if(copied + need > p_size) {
+			if(copied == 0) /* Buffer cannot hold even one record. */
+				err = EINVAL;
+			break;
+		}
+		/* Read the clock once per call unless records use different clocks. */
+		if((deq_ns == 0) || (deq_clock != rec->clock)) {
+			deq_clock = rec->clock;
+			deq_ns = now_ns(deq_clock);
+		}
+		if(hdr_size > 0) {
+			hdr.len = rec->len;
+			hdr.clock = rec->clock;
+			hdr.enq_ns = rec->enq_ns;
+			hdr.deq_ns = (file->recv_flags & KHELLO_RECV_DEQ_STAMP) ? deq_ns : 0;
+			memcpy(buf + copied, &hdr, hdr_size);
+		}
+		memcpy(buf + copied + hdr_size, rec->data, rec->len);
+		copied += need;
+		g_bytes_queued -= rec->len;
+		latency = (deq_ns > rec->enq_ns) ? deq_ns - rec->enq_ns : 1;
+		++g_stats.seq;
+		g_stats.bytes_out += rec->len;
+		++g_stats.records_out;
+		++g_stats.latency_hist[(63 - __builtin_clzll(latency) < KHELLO_LAT_BUCKETS - 1) ? 63 - __builtin_clzll(latency) : KHELLO_LAT_BUCKETS - 1];
+		++g_tail;
+		g_stats.records_queued = g_head - g_tail;
+		g_stats.bytes_queued = g_bytes_queued;
+		++g_stats.seq;
+	}
+	pthread_mutex_unlock(&g_mutex);
+
+	if((copied == 0) && (err != 0))
+		fuse_reply_err(p_req, err);
+	else
+		fuse_reply_buf(p_req, (const char*)buf, copied);
+	free(buf);
+}
+
+
+
+static void dev_write(fuse_req_t p_req, const char *p_buf, size_t p_size, off_t p_off, struct fuse_file_info *p_fi)
+{
+	__u64 enq_ns = now_ns(g_clock);
+
+	if(p_size > KHELLO_RECORD_MAX)
+		p_size = KHELLO_RECORD_MAX;
+	pthread_mutex_lock(&g_mutex);
+	enqueue(p_buf, p_size, g_clock, enq_ns);
+	wake_pollers();
+	pthread_mutex_unlock(&g_mutex);
+	fuse_reply_write(p_req, p_size);
+}
+
+
+
+static void dev_ioctl(fuse_req_t p_req, int p_cmd, void *p_arg, struct fuse_file_info *p_fi, unsigned int p_flags, const void *p_in, size_t p_in_size, size_t p_out_size)
+{
+	struct khcuse_file *file = (struct khcuse_file*)(uintptr_t)p_fi->fh;
+	struct iovec iov = { p_arg, sizeof(__u32) };
+	__u32 flags;
+
+	if(p_flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(p_req, ENOSYS);
+		return;
+	}
+	switch((unsigned int)p_cmd) {
+		case KHELLO_IOC_SET_RECV:
+			if(p_in_size < sizeof(flags)) {
+				fuse_reply_ioctl_retry(p_req, &iov, 1, NULL, 0);
+				return;
+			}
+			memcpy(&flags, p_in, sizeof(flags));
+			if(flags & ~(KHELLO_RECV_HDR | KHELLO_RECV_DEQ_STAMP)) {
+				fuse_reply_err(p_req, EINVAL);
+				return;
+			}
+			file->recv_flags = flags;
+			fuse_reply_ioctl(p_req, 0, NULL, 0);
+			return;
+		case KHELLO_IOC_GET_RECV:
+			if(p_out_size < sizeof(flags)) {
+				fuse_reply_ioctl_retry(p_req, NULL, 0, &iov, 1);
+				return;
+			}
+			fuse_reply_ioctl(p_req, 0, &file->recv_flags, sizeof(file->recv_flags));
+			return;
+		case KHELLO_IOC_SEND_BATCH:
+			if((file->flags & O_ACCMODE) == O_RDONLY) {
+				fuse_reply_err(p_req, EBADF);
+				return;
+			}
+			send_batch(p_req, p_arg, p_in, p_in_size);
+			return;
+		default:
+			/* KHELLO_IOC_RING_WAIT and KHELLO_IOC_RING_NOTIFY included: there is no shared ring to wait on. */
+			fuse_reply_err(p_req, ENOTTY);
+			return;
+	}
+}
+
+
+
+static void send_batch(fuse_req_t p_req, void *p_arg, const unsigned char *p_in, const size_t p_in_size)
+{
+	struct khello_batch batch;
+	struct khello_msg msg;
+	struct iovec in[BATCH_IOV_MAX + 2], out = { p_arg, sizeof(struct khello_batch) };
+	const unsigned char *data;
+	size_t msgs_size, need;
+	__u64 enq_ns;
+	__u32 i;
+
+	/* First call: fetch the batch itself. */
+	in[0].iov_base = p_arg;
+	in[0].iov_len = sizeof(struct khello_batch);
+	if(p_in_size < sizeof(struct khello_batch)) {
+		fuse_reply_ioctl_retry(p_req, in, 1, &out, 1);
+		return;
+	}
+	memcpy(&batch, p_in, sizeof(batch));
+	if(batch.count > BATCH_IOV_MAX)
+		batch.count = BATCH_IOV_MAX;
+	msgs_size = batch.count * sizeof(struct khello_msg);
+	in[1].iov_base = (void*)(uintptr_t)batch.msgs;
+	in[1].iov_len = msgs_size;
+
+	/* Second call: fetch the messages. */
+	if(p_in_size < sizeof(struct khello_batch) + msgs_size) {
+		fuse_reply_ioctl_retry(p_req, in, 2, &out, 1);
+		return;
+	}
+
+	/* Third call: fetch the payloads. The call is complete once they are all there. As in the module, the batch stops at a non-zero reserved field. */
+	need = sizeof(struct khello_batch) + msgs_size;
+	for(i = 0; i < batch.count; ++i) {
+		memcpy(&msg, p_in + sizeof(struct khello_batch) + i * sizeof(struct khello_msg), sizeof(msg));
+		if(msg.reserved != 0) {
+			batch.count = i;
+			if(i == 0) {
+				fuse_reply_err(p_req, EINVAL);
+				return;
+			}
+			break;
+		}
+		in[2 + i].iov_base = (void*)(uintptr_t)msg.addr;
+		in[2 + i].iov_len = (msg.len < KHELLO_RECORD_MAX) ? msg.len : KHELLO_RECORD_MAX;
+		need += in[2 + i].iov_len;
+	}
+	if(p_in_size != need) {
+		fuse_reply_ioctl_retry(p_req, in, 2 + batch.count, &out, 1);
+		return;
+	}
+
+	enq_ns = now_ns(g_clock);
+	data = p_in + sizeof(struct khello_batch) + msgs_size;
+	pthread_mutex_lock(&g_mutex);
+	for(i = 0; i < batch.count; ++i) {
+		enqueue(data, in[2 + i].iov_len, g_clock, enq_ns);
+		data += in[2 + i].iov_len;
+	}
+	if(batch.count > 0)
+		wake_pollers();
+	pthread_mutex_unlock(&g_mutex);
+	batch.done = batch.count;
+	fuse_reply_ioctl(p_req, batch.done, &batch, sizeof(batch));
+}
+
+
+
+static void dev_poll(fuse_req_t p_req, struct fuse_file_info *p_fi, struct fuse_pollhandle *p_poll)
+{
+	struct khcuse_file *file = (struct khcuse_file*)(uintptr_t)p_fi->fh;
+	unsigned int result = POLLOUT | POLLWRNORM; /* Writes never block, a full ring drops its oldest record. */
+
+	pthread_mutex_lock(&g_mutex);
+	if(g_head != g_tail) /* Data is availalable for reading. */
+		result |= POLLIN | POLLRDNORM;
+	/* Keep only the latest poll of each file handle; it is notified by the next write. */
+	if(p_poll != NULL) {
+		if(file->poll != NULL)
+			fuse_pollhandle_destroy(file->poll);
+		file->poll = p_poll;
+	}
+	pthread_mutex_unlock(&g_mutex);
+	fuse_reply_poll(p_req, result);
+}
+
+
+
+static void enqueue(const void *p_data, const size_t p_size, const __u32 p_clock, const __u64 p_ns)
+{
+	struct record *rec;
+
+	++g_stats.seq;
+	if(g_head - g_tail > g_ring_mask) { /* Ring is full so replace the oldest record. */
+		g_bytes_queued -= g_ring[g_tail & g_ring_mask].len;
+		++g_tail;
+		++g_stats.drops;
+	}
+	rec = &g_ring[g_head & g_ring_mask];
+	memcpy(rec->data, p_data, p_size);
+	rec->len = p_size;
+	rec->clock = p_clock;
+	rec->enq_ns = p_ns;
+	++g_head;
+	g_bytes_queued += p_size;
+	if(g_bytes_queued > g_stats.high_water)
+		g_stats.high_water = g_bytes_queued;
+	g_stats.bytes_in += p_size;
+	++g_stats.records_in;
+	g_stats.records_queued = g_head - g_tail;
+	g_stats.bytes_queued = g_bytes_queued;
+	++g_stats.seq;
+}
+
+
+
+static void wake_pollers(void)
+{
+	struct khcuse_file *file;
+
+	for(file = g_files; file != NULL; file = file->next) {
+		if(file->poll == NULL)
+			continue;
+		fuse_lowlevel_notify_poll(file->poll);
+		fuse_pollhandle_destroy(file->poll);
+		file->poll = NULL;
+	}
+}
+
+
+
+static __u64 now_ns(const __u32 p_clock)
+{
+	struct timespec now;
+
+	switch(p_clock) {
+		case KHELLO_CLOCK_MONOTONIC_RAW:
+			clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+			break;
+		case KHELLO_CLOCK_REALTIME:
+			clock_gettime(CLOCK_REALTIME, &now);
+			break;
+		default:
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			break;
+	}
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+
+static void print_stats(const char *const p_name)
+{
+	pthread_mutex_lock(&g_mutex);
+	printf("/dev/%s removed.\n", p_name);
+	printf("records in      %llu\n", (unsigned long long)g_stats.records_in);
+	printf("records out     %llu\n", (unsigned long long)g_stats.records_out);
+	printf("records queued  %llu\n", (unsigned long long)g_stats.records_queued);
+	printf("bytes in        %llu\n", (unsigned long long)g_stats.bytes_in);
+	printf("bytes out       %llu\n", (unsigned long long)g_stats.bytes_out);
+	printf("high water      %llu\n", (unsigned long long)g_stats.high_water);
+	printf("drops           %llu\n", (unsigned long long)g_stats.drops);
+	pthread_mutex_unlock(&g_mutex);
+}
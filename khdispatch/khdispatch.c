@@ -0,0 +1,302 @@
+/** @file khdispatch.c
+ * Stress run of the libkhello work-stealing dispatcher without the khello2 kernel module.
+ *
+ * Each channel is a SOCK_SEQPACKET socket pair standing in for a device: a producer thread per channel writes messages framed as the module frames a read
+ * with KHELLO_RECV_HDR, several records each, so the dispatcher's I/O threads read whole batches exactly as from /dev/khello. Every record carries a sequence
+ * number unique across channels. The handler counts each sequence number it sees and spins on a few records, so some workers fall behind and the others steal.
+ * At the end every sequence number must have been handled exactly once: a run is a correctness oracle for the deques, the inboxes and the sleep and wake protocol.
+ *
+ * Usage:
+ * 1000000 records over 4 channels and 4 workers: "./khdispatch"
+ * 5000000 records over 2 channels and 16 workers, one record in 50 taking 100 us: "./khdispatch -n 5000000 -c 2 -w 16 -e 50 -u 100"
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../libkhello/libkhello.h"
+#include "../libkhello/dispatch.h"
+
+
+#define MSG_BYTES 4096 /**< Largest message written, the size of the dispatcher's read buffer. A read never splits a message. */
+#define PROGRESS_S 10 /**< The run fails if no record is handled for this long. */
+
+
+/** Options of the run. */
+struct options {
+	long count; /**< Records in total. */
+	int chans; /**< Channels, one producer thread each. */
+	int workers; /**< Worker threads of the dispatcher. */
+	int every; /**< One record in this many is slow. 0 for none. */
+	int slow_us; /**< Time the handler spins on a slow record. */
+};
+
+/** A producer thread. */
+struct producer {
+	pthread_t thread; /**< The thread. */
+	int fd; /**< Write end of the channel's socket pair. */
+	int index; /**< Channel index. Writes sequence numbers index, index + chans... */
+	int error; /**< errno of a failed write, else 0. */
+};
+
+/** State shared with the handler. */
+struct check {
+	unsigned int *seen; /**< Times each sequence number was handled. */
+	unsigned long long corrupt; /**< Records with a wrong length, sequence number or channel. */
+};
+
+
+static struct options g_opt = { 1000000, 4, 4, 100, 20 };
+
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[]);
+
+/** Writes the records of one channel, as many per message as fit in MSG_BYTES. A pthread start routine.
+ *  @param p_prod The producer.
+ *  @return NULL.
+ */
+static void *produce(void *p_prod);
+
+/** Counts a record handled by the dispatcher, and spins if it is a slow one. A khl_handler.
+ *  @param p_arg The struct check.
+ *  @param p_item The record.
+ *  @param p_worker Index of the worker.
+ */
+static void handle(void *p_arg, const struct khl_item *p_item, int p_worker);
+
+/** Returns CLOCK_MONOTONIC in seconds. */
+static double now_secs();
+
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	struct khl_channel chans[KHL_DISPATCH_CHANS_MAX];
+	struct producer prods[KHL_DISPATCH_CHANS_MAX];
+	struct khl_dispatch_stats stats;
+	struct khl_dispatch *disp = NULL;
+	struct timespec nap = { 0, 10000000 };
+	struct check check;
+	unsigned long long handled = 0, missing = 0, twice = 0;
+	double start, secs = 0, progress;
+	int sv[2], opened = 0, started = 0, i, result = 1;
+	long seq;
+
+	if(check_args(argc, argv) == -1) {
+		printf("Usage: khdispatch [-n count] [-c channels] [-w workers] [-e slow_every] [-u slow_us]\n");
+		return 0;
+	}
+	memset(&check, 0, sizeof(check));
+	if((check.seen = calloc(g_opt.count, sizeof(unsigned int))) == NULL) {
+		process_errnum(ENOMEM);
+		return 1;
+	}
+	for(; opened < g_opt.chans; ++opened) {
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+			process_errnum(errno);
+			goto do_exit;
+		}
+		khl_attach(&chans[opened], sv[0], NULL);
+		chans[opened].owned = 1;
+		/* A socket answers none of the probes. Its messages carry the headers the module would, so read them as such. */
+		chans[opened].caps = KHL_CAP_HDR;
+		prods[opened].fd = sv[1];
+		prods[opened].index = opened;
+		prods[opened].error = 0;
+	}
+	printf("%ld records over %d channels, %d workers, one in %d taking %d us\n", g_opt.count, g_opt.chans, g_opt.workers, g_opt.every, g_opt.slow_us);
+	fflush(stdout);
+
+	start = now_secs();
+	if((disp = khl_dispatch_start(chans, g_opt.chans, g_opt.workers, handle, &check)) == NULL) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	for(; started < g_opt.chans; ++started) {
+		if((errno = pthread_create(&prods[started].thread, NULL, produce, &prods[started])) != 0) {
+			process_errnum(errno);
+			goto do_exit;
+		}
+	}
+
+	/* Wait until every record is handled, or handling stops making progress. */
+	progress = now_secs();
+	for(;;) {
+		khl_dispatch_stats(disp, &stats);
+		if(stats.handled >= (unsigned long long)g_opt.count)
+			break;
+		if(stats.handled != handled) {
+			handled = stats.handled;
+			progress = now_secs();
+		} else if(now_secs() - progress > PROGRESS_S) {
+			fprintf(stderr, "No progress for %d s\n", PROGRESS_S);
+			break;
+		}
+		nanosleep(&nap, NULL);
+	}
+	secs = now_secs() - start;
+	result = 0;
+
+do_exit:
+	if(disp != NULL) {
+		khl_dispatch_stats(disp, &stats);
+		if(khl_dispatch_stop(disp) == -1) {
+			process_errnum(errno);
+			result = 1;
+		}
+	}
+	/* Closing the read ends fails the writes of producers still blocked on a stopped run with EPIPE. */
+	for(i = 0; i < opened; ++i)
+		khl_close(&chans[i]);
+	for(i = 0; i < started; ++i) {
+		pthread_join(prods[i].thread, NULL);
+		if(prods[i].error != 0) {
+			process_errnum(prods[i].error);
+			result = 1;
+		}
+	}
+	for(i = 0; i < opened; ++i)
+		close(prods[i].fd);
+	if((result == 0) && (disp != NULL)) {
+		for(seq = 0; seq < g_opt.count; ++seq) {
+			if(check.seen[seq] == 0)
+				++missing;
+			else if(check.seen[seq] > 1)
+				++twice;
+		}
+		printf("%llu records in %.3f s, %.0f records/s, %llu batches, %llu steals, %llu sleeps, %llu stalls\n", stats.handled, secs, stats.handled / secs,
+			stats.batches, stats.steals, stats.sleeps, stats.stalls);
+		printf("per worker:");
+		for(i = 0; i < g_opt.workers; ++i)
+			printf(" %llu", stats.handled_by[i]);
+		printf("\n%llu missing, %llu handled more than once, %llu corrupt\n", missing, twice, check.corrupt);
+		result = ((missing == 0) && (twice == 0) && (check.corrupt == 0)) ? 0 : 1;
+	}
+	free(check.seen);
+	return result;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[])
+{
+	int opt;
+
+	while((opt = getopt(p_num, p_args, "n:c:w:e:u:")) != -1) {
+		switch(opt) {
+			case 'n':
+				if((g_opt.count = atol(optarg)) < 1)
+					return -1;
+				break;
+			case 'c':
+				if(((g_opt.chans = atoi(optarg)) < 1) || (g_opt.chans > KHL_DISPATCH_CHANS_MAX))
+					return -1;
+				break;
+			case 'w':
+				if(((g_opt.workers = atoi(optarg)) < 1) || (g_opt.workers > KHL_DISPATCH_WORKERS_MAX))
+					return -1;
+				break;
+			case 'e':
+				if((g_opt.every = atoi(optarg)) < 0)
+					return -1;
+				break;
+			case 'u':
+				if((g_opt.slow_us = atoi(optarg)) < 0)
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+
+static void *produce(void *p_prod)
+{
+	struct producer *prod = p_prod;
+	unsigned char msg[MSG_BYTES];
+	struct khello_rec_hdr hdr;
+	unsigned long long seq;
+	size_t len = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.len = sizeof(seq);
+	hdr.clock = KHELLO_CLOCK_MONOTONIC;
+	for(seq = prod->index; ; seq += g_opt.chans) {
+		/* Write the message when full, or after the last record. */
+		if((len > 0) && ((seq >= (unsigned long long)g_opt.count) || (len + sizeof(hdr) + sizeof(seq) > MSG_BYTES))) {
+			if(send(prod->fd, msg, len, MSG_NOSIGNAL) != (ssize_t)len) {
+				if(errno == EINTR) {
+					seq -= g_opt.chans;
+					continue;
+				}
+				prod->error = errno;
+				return NULL;
+			}
+			len = 0;
+		}
+		if(seq >= (unsigned long long)g_opt.count)
+			break;
+		memcpy(msg + len, &hdr, sizeof(hdr));
+		memcpy(msg + len + sizeof(hdr), &seq, sizeof(seq));
+		len += sizeof(hdr) + sizeof(seq);
+	}
+	return NULL;
+}
+
+
+
+static void handle(void *p_arg, const struct khl_item *p_item, int p_worker)
+{
+	struct check *check = p_arg;
+	unsigned long long seq;
+	double until;
+
+	if(p_item->rec.len != sizeof(seq)) {
+		__atomic_add_fetch(&check->corrupt, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	memcpy(&seq, p_item->rec.data, sizeof(seq));
+	if((seq >= (unsigned long long)g_opt.count) || ((int)(seq % g_opt.chans) != p_item->chan)) {
+		__atomic_add_fetch(&check->corrupt, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&check->seen[seq], 1, __ATOMIC_RELAXED);
+	if((g_opt.every > 0) && ((seq % g_opt.every) == 0))
+		for(until = now_secs() + g_opt.slow_us / 1e6; now_secs() < until; )
+			;
+}
+
+
+
+static double now_secs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
@@ -1,13 +1,18 @@
 /** @file khello.c
  * 
- * Simple kernel driver that creates a character device in /dev/ and allows receiving and sending data to-and-from userland.
+ * Simple kernel driver that creates character devices in /dev/ and allows receiving and sending data to-and-from userland.
+ * Each device is an independent channel with its own record ring, statistics and shared memory page.
  * 
  * Usage:
  * Load the module: "insmod khello.ko"
+ * Load the module with 8 channels /dev/khello, /dev/khello1 ... /dev/khello7: "insmod khello.ko channels=8"
  * See module messages: "tail -f /var/log/messages"
+ * See per-record messages: "echo 'module khello +p' > /sys/kernel/debug/dynamic_debug/control"
  * Unload the module: "rmmod khello.ko"
  * Write data to the module: "echo hello > /dev/khello"
  * Read data from the module: "cat /dev/khello" or open using an application.
+ * Select the timestamp clock: "insmod khello.ko clock=1" (see KHELLO_CLOCK_* in khello.h).
+ * See device statistics: "cd /sys/class/khello_class/khello && grep . *"
  */
 
 #include <linux/init.h> 
@@ -15,16 +20,32 @@
 #include <linux/device.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
 #include <linux/mutex.h>
 #include <linux/cdev.h>
 #include <linux/poll.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include "khello.h"
 
 
 #define DEVICE_NAME "khello" /**< Name of the device in /dev */
 #define CLASS_NAME "khello_class" /**< Device class. */
+#define CHANNELS_MAX 4096 /**< Maximum number of channels. */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0) /* sysfs_emit() and sysfs_emit_at() arrived in 5.10. sysfs buffers are one page. */
+#define sysfs_emit(p_buf, ...) scnprintf(p_buf, PAGE_SIZE, __VA_ARGS__)
+#define sysfs_emit_at(p_buf, p_at, ...) scnprintf((p_buf) + (p_at), PAGE_SIZE - (p_at), __VA_ARGS__)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0) /* copy_splice_read() replaced generic_file_splice_read() in 6.5. Both splice through read_iter. */
+#define copy_splice_read generic_file_splice_read
+#endif
 
 
 MODULE_LICENSE("Dual BSD/GPL");
@@ -33,15 +54,62 @@ MODULE_DESCRIPTION("Simple module with character device");
 MODULE_VERSION("0.1");
 
 
-static dev_t g_dev_num=0; /**< The dev number. */
-static struct cdev g_c_device; /**< Character device. */
+static unsigned int channels = 1;
+module_param(channels, uint, 0444);
+MODULE_PARM_DESC(channels, "Number of channels. Channel 0 is /dev/khello, channel n is /dev/khello<n>.");
+
+static unsigned int ring_records = 64;
+module_param(ring_records, uint, 0444);
+MODULE_PARM_DESC(ring_records, "Number of records each channel can queue. Rounded up to a power of 2.");
+
+static int g_clock = KHELLO_CLOCK_MONOTONIC;
+module_param_named(clock, g_clock, int, 0644);
+MODULE_PARM_DESC(clock, "Clock used to timestamp records: 0=monotonic, 1=monotonic raw, 2=realtime.");
+
+
+/** A record queued in the device. */
+struct khello_record {
+	u32 len; /**< Number of bytes in data. */
+	u32 clock; /**< KHELLO_CLOCK_* used for enq_ns. */
+	u64 enq_ns; /**< Time the record was written. */
+	unsigned char data[KHELLO_RECORD_MAX]; /**< The record payload. */
+};
+
+/** Reference counts of a channel. Published in its stats_page as they change. */
+struct khello_stats {
+	atomic_t readers; /**< Number of open file handles with read access. */
+	atomic_t writers; /**< Number of open file handles with write access. */
+	atomic_t mappings; /**< Number of active mmap areas. */
+};
+
+/** A channel: one device with its own ring of records. */
+struct khello_chan {
+	struct device *device; /**< The device itself. NULL until created. */
+	struct khello_record *ring; /**< Ring of records sent to this device. */
+	unsigned int ring_mask; /**< Number of records in ring minus 1. */
+	unsigned int head; /**< Index of the next record to write. Wraps freely, masked on access. */
+	unsigned int tail; /**< Index of the next record to read. Wraps freely, masked on access. */
+	size_t bytes_queued; /**< Number of payload bytes in ring not yet read. */
+	unsigned char *data2; /**< Page shared with userland through mmap. Holds a struct khello_ring. */
+	struct khello_arena *arena; /**< Data arena shared with userland through mmap, 2^KHELLO_ARENA_ORDER pages. */
+	struct mutex mutex; /**< Mutex for thread-safety. */
+	wait_queue_head_t readq; /**< Pollers waiting for records to read. */
+	wait_queue_head_t ringq; /**< Processes waiting in KHELLO_IOC_RING_WAIT. */
+	struct khello_stats stats; /**< Reference counts. */
+	struct khello_stats_page *stats_page; /**< Statistics, shared read-only with userland. Counters are updated under mutex. */
+};
+
+/** Per file handle state. */
+struct khello_file {
+	struct khello_chan *chan; /**< The channel opened. */
+	u32 recv_flags; /**< KHELLO_RECV_* flags. */
+};
+
+
+static dev_t g_dev_num=0; /**< The first dev number. Channel n uses minor number n. */
+static struct cdev g_c_device; /**< Character device covering all channels. */
 static struct class *g_class = NULL; /**< Device class. */
-static struct device *g_device = NULL; /**< The device itself. */
-static unsigned char g_data[32]; /**< A simple data buffer to hold data sent to this device. */
-static unsigned char *g_data2 = NULL;
-static size_t g_data_size; /**< Size of data in g_data. */
-static DEFINE_MUTEX(g_mutex); /**< Mutex for thread-safety. */
-static int g_lock=0;
+static struct khello_chan *g_chans = NULL; /**< The channels. */
 
 /**Opens the device. Implements the open function defined in linux/fs.h */
 static int dev_open(struct inode *p_inode, struct file *p_file);
@@ -49,12 +117,99 @@ static int dev_open(struct inode *p_inode, struct file *p_file);
 /**Releases the device. Implements the release function defined in linux/fs.h */
 static int dev_release(struct inode *p_inode, struct file *p_file);
 
-/**Reads data from the device. Implements the read function defined in linux/fs.h */
-static ssize_t dev_read(struct file *p_file, char *p_buf, size_t p_size, loff_t *p_off);
+/** Allocates the ring, statistics page, shared page and arena of a channel.
+ *  @param p_chan The channel, zeroed.
+ *  @param p_records Number of records the ring holds. A power of 2.
+ *  @return 0 if success, else negative error.
+ */
+static int khello_chan_alloc(struct khello_chan *p_chan, const unsigned int p_records);
+
+/** Frees what khello_chan_alloc() allocated. Safe on a partly allocated channel.
+ *  @param p_chan The channel.
+ */
+static void khello_chan_free(struct khello_chan *p_chan);
+
+/** Creates the device and sysfs attributes of a channel.
+ *  @param p_chan The channel.
+ *  @param p_index Index of the channel, used as minor number and in the device name.
+ *  @return 0 if success, else negative error.
+ */
+static int khello_chan_create(struct khello_chan *p_chan, const unsigned int p_index);
+
+/** Removes the device and sysfs attributes of a channel if they were created.
+ *  @param p_chan The channel.
+ *  @param p_index Index of the channel.
+ */
+static void khello_chan_destroy(struct khello_chan *p_chan, const unsigned int p_index);
+
+/** Implements KHELLO_IOC_RING_WAIT.
+ *  @param p_chan The channel.
+ *  @param p_uwait The struct khello_ring_wait in userland.
+ *  @return 0 when the event happened, -ETIMEDOUT, or another negative error.
+ */
+static long khello_ring_wait(struct khello_chan *p_chan, struct khello_ring_wait __user *p_uwait);
+
+/** Tells whether a shared ring event has happened. The indices are read from the shared page, so this is the condition the doorbell protocol relies on.
+ *  @param p_chan The channel.
+ *  @param p_event KHELLO_RING_EV_*.
+ *  @return Non-zero if the event happened.
+ */
+static int khello_ring_ready(struct khello_chan *p_chan, const u32 p_event);
+
+/** Returns the statistics page of the channel a device belongs to.
+ *  @param p_dev The device.
+ *  @return The statistics page.
+ */
+static struct khello_stats_page *khello_dev_stats(struct device *p_dev);
+
+/** Returns the clock selected by the clock module parameter.
+ *  @return A valid KHELLO_CLOCK_* value. Unknown values select KHELLO_CLOCK_MONOTONIC.
+ */
+static u32 khello_clock(void);
+
+/** Returns the current time of a clock.
+ *  @param p_clock The KHELLO_CLOCK_* to read.
+ *  @return Time in nanoseconds.
+ */
+static u64 khello_now(const u32 p_clock);
+
+/** Marks the start of an update to the counters in the stats_page of a channel. Called with the channel mutex held. */
+static void khello_stats_begin(struct khello_chan *p_chan);
+
+/** Marks the end of an update to the counters in the stats_page of a channel. Called with the channel mutex held. */
+static void khello_stats_end(struct khello_chan *p_chan);
+
+/** Queues one record, replacing the oldest record if the ring is full. Called with the channel mutex held.
+ *  @param p_chan The channel.
+ *  @param p_data The payload.
+ *  @param p_size Size of the payload. At most KHELLO_RECORD_MAX.
+ *  @param p_clock KHELLO_CLOCK_* used for p_ns.
+ *  @param p_ns Enqueue timestamp.
+ */
+static void khello_enqueue(struct khello_chan *p_chan, const unsigned char *p_data, const size_t p_size, const u32 p_clock, const u64 p_ns);
+
+/** Releases the oldest record once it has been copied out and accounts for it in the statistics. Called with the channel mutex held.
+ *  @param p_chan The channel. Must not be empty.
+ *  @param p_deq_ns Dequeue timestamp, in the clock of the record.
+ */
+static void khello_dequeue(struct khello_chan *p_chan, const u64 p_deq_ns);
+
+/** Implements KHELLO_IOC_SEND_BATCH. All records are queued under one lock and share one timestamp.
+ *  @param p_chan The channel.
+ *  @param p_ubatch The struct khello_batch in userland.
+ *  @return Number of records queued, or a negative error if none were.
+ */
+static long khello_send_batch(struct khello_chan *p_chan, struct khello_batch __user *p_ubatch);
+
+/**Reads data from the device. Implements the read_iter function defined in linux/fs.h, which serves both read() and splice(). */
+static ssize_t dev_read_iter(struct kiocb *p_iocb, struct iov_iter *p_to);
 
 /**Writes data to the device. Implements the write function defined in linux/fs.h */
 static ssize_t dev_write(struct file *p_file, const char *p_buf, size_t p_size, loff_t *p_off);
 
+/** Implements ioctl operations. Implements the unlocked_ioctl function defined in linux/fs.h */
+static long dev_ioctl(struct file *p_file, unsigned int p_cmd, unsigned long p_arg);
+
 /** Returns results to a poll or select call. Implements the function defined in linux/fs.h  */
 static unsigned int dev_poll(struct file *p_file, struct poll_table_struct *p_table);
 
@@ -70,6 +225,45 @@ static void khello_vma_close(struct vm_area_struct *p_vma);
 /** Implements vma falut operation. Currently not used. */
 static int khello_vma_fault(struct vm_area_struct *p_vma, struct vm_fault *p_fault);
 
+/** Shows the number of records the ring can hold in sysfs. */
+static ssize_t ring_size_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the number of bytes waiting to be read in sysfs. */
+static ssize_t bytes_queued_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the number of records waiting to be read in sysfs. */
+static ssize_t records_queued_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the high-water mark of queued bytes in sysfs. */
+static ssize_t high_water_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the number of dropped records in sysfs. */
+static ssize_t drops_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the total bytes written to the device in sysfs. */
+static ssize_t bytes_in_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the total bytes read from the device in sysfs. */
+static ssize_t bytes_out_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the total records written to the device in sysfs. */
+static ssize_t records_in_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the total records read from the device in sysfs. */
+static ssize_t records_out_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the queueing latency histogram in sysfs. */
+static ssize_t latency_hist_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the number of readers in sysfs. */
+static ssize_t readers_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the number of writers in sysfs. */
+static ssize_t writers_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
+/** Shows the KHELLO_MODE_* flags in sysfs. */
+static ssize_t mode_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf);
+
 
 
 /** Defines the file_operations structure for device operations.
@@ -78,8 +272,10 @@ static struct file_operations g_fops =
 {
 	.owner = THIS_MODULE,
 	.open = dev_open,
-	.read = dev_read,
+	.read_iter = dev_read_iter,
+	.splice_read = copy_splice_read,
 	.write = dev_write,
+	.unlocked_ioctl = dev_ioctl,
 	.poll = dev_poll,
 	.mmap = dev_mmap,
 	.release = dev_release,
@@ -97,6 +293,45 @@ static struct vm_operations_struct g_remap_vm_ops =
 
 
 
+static DEVICE_ATTR_RO(ring_size);
+static DEVICE_ATTR_RO(bytes_queued);
+static DEVICE_ATTR_RO(records_queued);
+static DEVICE_ATTR_RO(high_water);
+static DEVICE_ATTR_RO(drops);
+static DEVICE_ATTR_RO(bytes_in);
+static DEVICE_ATTR_RO(bytes_out);
+static DEVICE_ATTR_RO(records_in);
+static DEVICE_ATTR_RO(records_out);
+static DEVICE_ATTR_RO(latency_hist);
+static DEVICE_ATTR_RO(readers);
+static DEVICE_ATTR_RO(writers);
+static DEVICE_ATTR_RO(mode);
+
+/** Attributes created in the sysfs directory of the device.
+ */
+static struct attribute *g_attr_attrs[] =
+{
+	&dev_attr_ring_size.attr,
+	&dev_attr_bytes_queued.attr,
+	&dev_attr_records_queued.attr,
+	&dev_attr_high_water.attr,
+	&dev_attr_drops.attr,
+	&dev_attr_bytes_in.attr,
+	&dev_attr_bytes_out.attr,
+	&dev_attr_records_in.attr,
+	&dev_attr_records_out.attr,
+	&dev_attr_latency_hist.attr,
+	&dev_attr_readers.attr,
+	&dev_attr_writers.attr,
+	&dev_attr_mode.attr,
+	NULL,
+};
+
+/* g_attr_group and g_attr_groups, passed to device_create_with_groups() so the attributes exist before the device is announced to userland. */
+ATTRIBUTE_GROUPS(g_attr);
+
+
+
 
 /** Kernel module init funciton.
  * @return 0 if success, else non-zero value.
@@ -104,67 +339,86 @@ static struct vm_operations_struct g_remap_vm_ops =
 static int __init hello_init(void)
 {
 	int result = -1, progress = 0; 
-	memset(g_data, 0 ,32);
-	g_data_size = 0;
-	mutex_init(&g_mutex);
+	unsigned int i;
     printk(KERN_INFO "khello: Init\n");
 
+	/* Each ring size is a power of 2 so indices can be masked. */
+	if(ring_records < 1)
+		ring_records = 1;
+	if(ring_records > 65536)
+		ring_records = 65536;
+	ring_records = roundup_pow_of_two(ring_records);
+	if(channels < 1)
+		channels = 1;
+	if(channels > CHANNELS_MAX)
+		channels = CHANNELS_MAX;
+	
+	/* Allocate the channels. */
+	if((g_chans = kcalloc(channels, sizeof(struct khello_chan), GFP_KERNEL)) == NULL) {
+		printk(KERN_ALERT "khello: allocate channels error\n");
+		return -ENOMEM;
+	}
+	for(i = 0; i < channels; ++i) {
+		if((result = khello_chan_alloc(&g_chans[i], ring_records)) < 0) {
+			printk(KERN_ALERT "khello: allocate channel memory error\n");
+			goto do_exit;
+		}
+	}
+
 	/* Request major number from kernel. */
-	if((result = alloc_chrdev_region(&g_dev_num, 0, 1, DEVICE_NAME)) < 0) {
+	if((result = alloc_chrdev_region(&g_dev_num, 0, channels, DEVICE_NAME)) < 0) {
 		printk(KERN_ALERT "khello: request device number failed\n");
 		goto do_exit;
 	}
+	++progress;
 	
 	/* Create character device. */
 	cdev_init(&g_c_device, &g_fops);
 	g_c_device.owner = THIS_MODULE;
-	if((result = cdev_add(&g_c_device, g_dev_num, 1)) < 0) {
+	if((result = cdev_add(&g_c_device, g_dev_num, channels)) < 0) {
 		printk(KERN_ALERT "khello: character device creation failed\n");
 		goto do_exit;
 	}
 	++progress;
 	
 	/* Create device class */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	g_class = class_create(CLASS_NAME);
+#else
 	g_class = class_create(THIS_MODULE, CLASS_NAME);
+#endif
 	if(IS_ERR(g_class)) {
 		printk(KERN_ALERT "khello: device class creation failed\n");
+		result = PTR_ERR(g_class);
 		goto do_exit;
 	}
 	++progress;
 	
-	/* Create device itself. */
-	g_device = device_create(g_class, NULL, g_dev_num, NULL, DEVICE_NAME);
-	if(IS_ERR(g_device)) {
-		printk(KERN_ALERT "khello: device creation failed\n");
-		goto do_exit;		
-	}
-	++progress;
-	
-	printk(KERN_INFO "khello: device created\n");
-
-	/* Allocate page-aligned memory */
-	if((g_data2 = (unsigned char*)kmalloc(PAGE_SIZE, GFP_KERNEL)) == NULL) {
-		printk(KERN_ALERT "khello: allocate memory error\n");
-		goto do_exit;
+	/* Create the devices themselves. */
+	for(i = 0; i < channels; ++i) {
+		if((result = khello_chan_create(&g_chans[i], i)) < 0) {
+			printk(KERN_ALERT "khello: device creation failed\n");
+			goto do_exit;
+		}
 	}
-	++progress;
-	
 	
+	printk(KERN_INFO "khello: %u devices created\n", channels);
 	result = 0;
 do_exit:
 	/* Device creation failure so clean up. */
 	if(result < 0) {
-		if(progress >= 2) {
+		if(progress >= 3) {
+			for(i = 0; i < channels; ++i)
+				khello_chan_destroy(&g_chans[i], i);
 			class_destroy(g_class);
-			progress = 1;
 		}
-		if(progress == 1) {
+		if(progress >= 2)
 			cdev_del(&g_c_device);
-			progress = 0;
-		}
-		if(progress==0)
-			unregister_chrdev_region(g_dev_num, 1);
-		mutex_destroy(&g_mutex);
+		if(progress >= 1)
+			unregister_chrdev_region(g_dev_num, channels);
+		for(i = 0; i < channels; ++i)
+			khello_chan_free(&g_chans[i]);
+		kfree(g_chans);
 	}
 	
     return result;
@@ -176,22 +430,114 @@ do_exit:
  */
 static void __exit hello_cleanup(void)
 {
-	device_destroy(g_class, g_dev_num);
+	unsigned int i;
+	
+	for(i = 0; i < channels; ++i)
+		khello_chan_destroy(&g_chans[i], i);
 	class_destroy(g_class);
 	cdev_del(&g_c_device);
-	unregister_chrdev_region(g_dev_num, 1);
-	mutex_destroy(&g_mutex);
-	if(g_data2 != NULL) {
-		printk(KERN_INFO "khello g_data2: %s\n", g_data2);
-		kfree(g_data2);
-	}
+	unregister_chrdev_region(g_dev_num, channels);
+	for(i = 0; i < channels; ++i)
+		khello_chan_free(&g_chans[i]);
+	kfree(g_chans);
     printk(KERN_INFO "khello: Cleanup and exit\n");
 }
 
 
 
+static int khello_chan_alloc(struct khello_chan *p_chan, const unsigned int p_records)
+{
+	struct khello_ring *ring;
+	
+	mutex_init(&p_chan->mutex);
+	init_waitqueue_head(&p_chan->readq);
+	init_waitqueue_head(&p_chan->ringq);
+	if((p_chan->ring = kcalloc(p_records, sizeof(struct khello_record), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	p_chan->ring_mask = p_records - 1;
+	
+	/* The statistics page is mapped into userland so it must be a whole page. */
+	if((p_chan->stats_page = (struct khello_stats_page*)get_zeroed_page(GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	p_chan->stats_page->ring_size = p_records;
+	p_chan->stats_page->mode = KHELLO_MODE_OVERWRITE;
+	
+	/* Allocate page-aligned memory. Zeroed because it is mapped into userland. */
+	if((p_chan->data2 = (unsigned char*)kzalloc(PAGE_SIZE, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	
+	/* Describe the shared ring so userland can check the layout it was built with. */
+	BUILD_BUG_ON(sizeof(struct khello_ring) > PAGE_SIZE);
+	ring = (struct khello_ring*)p_chan->data2;
+	ring->magic = KHELLO_RING_MAGIC;
+	ring->slots = KHELLO_RING_SLOTS;
+	ring->slot_size = sizeof(struct khello_ring_slot);
+	ring->data_off = offsetof(struct khello_ring, slot);
+	
+	/* The arena is mapped as one range, so its pages must be contiguous. */
+	if((p_chan->arena = (struct khello_arena*)__get_free_pages(GFP_KERNEL | __GFP_ZERO, KHELLO_ARENA_ORDER)) == NULL)
+		return -ENOMEM;
+	p_chan->arena->magic = KHELLO_ARENA_MAGIC;
+	p_chan->arena->size = PAGE_SIZE << KHELLO_ARENA_ORDER;
+	p_chan->arena->data_off = sizeof(struct khello_arena);
+	return 0;
+}
+
+
+
+static void khello_chan_free(struct khello_chan *p_chan)
+{
+	if(p_chan->arena != NULL)
+		free_pages((unsigned long)p_chan->arena, KHELLO_ARENA_ORDER);
+	kfree(p_chan->data2);
+	free_page((unsigned long)p_chan->stats_page);
+	kfree(p_chan->ring);
+	mutex_destroy(&p_chan->mutex);
+}
+
+
+
+static int khello_chan_create(struct khello_chan *p_chan, const unsigned int p_index)
+{
+	struct device *device;
+	dev_t dev_num = MKDEV(MAJOR(g_dev_num), MINOR(g_dev_num) + p_index);
+	
+	/* Channel 0 keeps the original name so existing applications still find it. */
+	if(p_index == 0)
+		device = device_create_with_groups(g_class, NULL, dev_num, p_chan, g_attr_groups, DEVICE_NAME);
+	else
+		device = device_create_with_groups(g_class, NULL, dev_num, p_chan, g_attr_groups, DEVICE_NAME "%u", p_index);
+	if(IS_ERR(device))
+		return PTR_ERR(device);
+	p_chan->device = device;
+	return 0;
+}
+
+
+
+static void khello_chan_destroy(struct khello_chan *p_chan, const unsigned int p_index)
+{
+	if(p_chan->device == NULL)
+		return;
+	device_destroy(g_class, MKDEV(MAJOR(g_dev_num), MINOR(g_dev_num) + p_index));
+	p_chan->device = NULL;
+}
+
+
+
 static int dev_open(struct inode *p_inode, struct file *p_file)
 {
+	struct khello_file *kfile;
+	struct khello_chan *chan = &g_chans[iminor(p_inode) - MINOR(g_dev_num)];
+	
+	if((kfile = kzalloc(sizeof(struct khello_file), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	kfile->chan = chan;
+	p_file->private_data = kfile;
+	if(p_file->f_mode & FMODE_READ)
+		chan->stats_page->readers = atomic_inc_return(&chan->stats.readers);
+	if(p_file->f_mode & FMODE_WRITE)
+		chan->stats_page->writers = atomic_inc_return(&chan->stats.writers);
 	return 0;
 }
 
@@ -199,24 +545,118 @@ static int dev_open(struct inode *p_inode, struct file *p_file)
 
 static int dev_release(struct inode *p_inode, struct file *p_file)
 {
+	struct khello_chan *chan = ((struct khello_file*)p_file->private_data)->chan;
+	
+	if(p_file->f_mode & FMODE_READ)
+		chan->stats_page->readers = atomic_dec_return(&chan->stats.readers);
+	if(p_file->f_mode & FMODE_WRITE)
+		chan->stats_page->writers = atomic_dec_return(&chan->stats.writers);
+	kfree(p_file->private_data);
 	return 0;
 }
 
 
 
-static ssize_t dev_read(struct file *p_file, char *p_buf, size_t p_size, loff_t *p_off)
+static u32 khello_clock(void)
 {
-	unsigned long result;
+	int clock = g_clock;
 	
-	mutex_lock(&g_mutex); /* Mutex lock to access shared data. */
-	g_lock = 1;
-	result = copy_to_user(p_buf, g_data, g_data_size);
-	if(result == 0)
-		printk(KERN_INFO "khello: sent %zu bytes\n", g_data_size);
-	else
-		printk(KERN_ALERT "khello: failed to send %lu bytes\n", result);
-	g_lock = 0;
-	mutex_unlock(&g_mutex); /* Mutex unlock */ 
+	if((clock == KHELLO_CLOCK_MONOTONIC_RAW) || (clock == KHELLO_CLOCK_REALTIME))
+		return clock;
+	return KHELLO_CLOCK_MONOTONIC;
+}
+
+
+
+static u64 khello_now(const u32 p_clock)
+{
+	switch(p_clock) {
+		case KHELLO_CLOCK_MONOTONIC_RAW:
+			return ktime_get_raw_ns();
+		case KHELLO_CLOCK_REALTIME:
+			return ktime_get_real_ns();
+		default:
+			return ktime_get_ns();
+	}
+}
+
+
+
+static void khello_stats_begin(struct khello_chan *p_chan)
+{
+	++p_chan->stats_page->seq;
+	smp_wmb();
+}
+
+
+
+static void khello_stats_end(struct khello_chan *p_chan)
+{
+	smp_wmb();
+	++p_chan->stats_page->seq;
+}
+
+
+
+static ssize_t dev_read_iter(struct kiocb *p_iocb, struct iov_iter *p_to)
+{
+	struct file *file = p_iocb->ki_filp;
+	struct khello_file *kfile = file->private_data;
+	struct khello_chan *chan = kfile->chan;
+	struct khello_record *rec;
+	struct khello_rec_hdr hdr;
+	size_t size = iov_iter_count(p_to), copied = 0, hdr_size = 0, need;
+	u32 deq_clock = 0;
+	u64 deq_ns = 0;
+	ssize_t result = 0;
+	
+	/* An empty device returns end of file as before, or EAGAIN to non-blocking readers driven by poll. */
+	if((chan->head == chan->tail) && (file->f_flags & O_NONBLOCK))
+		return -EAGAIN;
+	if(kfile->recv_flags & KHELLO_RECV_HDR)
+		hdr_size = sizeof(struct khello_rec_hdr);
+	
+	mutex_lock(&chan->mutex); /* Mutex lock to access shared data. */
+	
+	/* Dequeue as many whole records as fit in the user buffer. */
+	while(chan->head != chan->tail) {
+		rec = &chan->ring[chan->tail & chan->ring_mask];
+		need = hdr_size + rec->len;
+		if(copied + need > size) {
+			if(copied == 0) /* Buffer cannot hold even one record. */
+				result = -EINVAL;
+			break;
+		}
+		/* Read the clock once per call unless records use different clocks. */
+		if((deq_ns == 0) || (deq_clock != rec->clock)) {
+			deq_clock = rec->clock;
+			deq_ns = khello_now(deq_clock);
+		}
+		if(hdr_size > 0) {
+			hdr.len = rec->len;
+			hdr.clock = rec->clock;
+			hdr.enq_ns = rec->enq_ns;
+			hdr.deq_ns = (kfile->recv_flags & KHELLO_RECV_DEQ_STAMP) ? deq_ns : 0;
+			if(copy_to_iter(&hdr, hdr_size, p_to) != hdr_size) {
+				result = -EFAULT;
+				break;
+			}
+		}
+		if(copy_to_iter(rec->data, rec->len, p_to) != rec->len) {
+			result = -EFAULT;
+			break;
+		}
+		copied += need;
+		khello_dequeue(chan, deq_ns);
+	}
+	mutex_unlock(&chan->mutex); /* Mutex unlock */ 
+	
+	if(copied > 0) {
+		pr_debug("khello: sent %zu bytes\n", copied);
+		return copied;
+	}
+	if(result < 0)
+		printk(KERN_ALERT "khello: failed to send, error %zd\n", result);
 	return result;
 }
 
@@ -224,29 +664,195 @@ static ssize_t dev_read(struct file *p_file, char *p_buf, size_t p_size, loff_t
 
 static ssize_t dev_write(struct file *p_file, const char *p_buf, size_t p_size, loff_t *p_off)
 {
-	if(p_size > 31)
-		p_size = 31;
-	mutex_lock(&g_mutex); /* Mutex lock to access shared data. */
-	g_lock = 1;
-	memcpy(g_data, p_buf, p_size);
-	g_data[p_size] = 0;
-	g_data_size = p_size;
-	printk(KERN_INFO "khello: Received from user:%s\n", g_data);
-	g_lock = 0;
-	mutex_unlock(&g_mutex); /* Mutex unlock. */
+	struct khello_chan *chan = ((struct khello_file*)p_file->private_data)->chan;
+	unsigned char data[KHELLO_RECORD_MAX];
+	u32 enq_clock;
+	u64 enq_ns;
+	
+	if(p_size > KHELLO_RECORD_MAX)
+		p_size = KHELLO_RECORD_MAX;
+	if(copy_from_user(data, p_buf, p_size) != 0)
+		return -EFAULT;
+	enq_clock = khello_clock();
+	enq_ns = khello_now(enq_clock);
+	
+	mutex_lock(&chan->mutex); /* Mutex lock to access shared data. */
+	khello_enqueue(chan, data, p_size, enq_clock, enq_ns);
+	mutex_unlock(&chan->mutex); /* Mutex unlock. */
+	wake_up_interruptible(&chan->readq);
+	pr_debug("khello: Received from user:%.*s\n", (int)p_size, data);
 	return p_size;
 }
 
 
 
+static void khello_enqueue(struct khello_chan *p_chan, const unsigned char *p_data, const size_t p_size, const u32 p_clock, const u64 p_ns)
+{
+	struct khello_stats_page *stats = p_chan->stats_page;
+	struct khello_record *rec;
+	
+	khello_stats_begin(p_chan);
+	if(p_chan->head - p_chan->tail > p_chan->ring_mask) { /* Ring is full so replace the oldest record. */
+		p_chan->bytes_queued -= p_chan->ring[p_chan->tail & p_chan->ring_mask].len;
+		++p_chan->tail;
+		++stats->drops;
+	}
+	rec = &p_chan->ring[p_chan->head & p_chan->ring_mask];
+	memcpy(rec->data, p_data, p_size);
+	rec->len = p_size;
+	rec->clock = p_clock;
+	rec->enq_ns = p_ns;
+	++p_chan->head;
+	p_chan->bytes_queued += p_size;
+	if(p_chan->bytes_queued > stats->high_water)
+		stats->high_water = p_chan->bytes_queued;
+	stats->bytes_in += p_size;
+	++stats->records_in;
+	stats->records_queued = p_chan->head - p_chan->tail;
+	stats->bytes_queued = p_chan->bytes_queued;
+	khello_stats_end(p_chan);
+}
+
+
+
+static void khello_dequeue(struct khello_chan *p_chan, const u64 p_deq_ns)
+{
+	struct khello_stats_page *stats = p_chan->stats_page;
+	struct khello_record *rec = &p_chan->ring[p_chan->tail & p_chan->ring_mask];
+	u64 latency = (p_deq_ns > rec->enq_ns) ? p_deq_ns - rec->enq_ns : 1;
+	
+	p_chan->bytes_queued -= rec->len;
+	khello_stats_begin(p_chan);
+	stats->bytes_out += rec->len;
+	++stats->records_out;
+	++stats->latency_hist[min_t(unsigned int, ilog2(latency), KHELLO_LAT_BUCKETS - 1)];
+	++p_chan->tail;
+	stats->records_queued = p_chan->head - p_chan->tail;
+	stats->bytes_queued = p_chan->bytes_queued;
+	khello_stats_end(p_chan);
+}
+
+
+
+static long khello_send_batch(struct khello_chan *p_chan, struct khello_batch __user *p_ubatch)
+{
+	struct khello_batch batch;
+	struct khello_msg msg;
+	struct khello_msg __user *umsgs;
+	unsigned char data[KHELLO_RECORD_MAX];
+	u32 enq_clock, size;
+	u64 enq_ns;
+	long result = 0;
+	
+	if(copy_from_user(&batch, p_ubatch, sizeof(batch)) != 0)
+		return -EFAULT;
+	if(batch.count > KHELLO_BATCH_MAX)
+		batch.count = KHELLO_BATCH_MAX;
+	umsgs = (struct khello_msg __user *)(uintptr_t)batch.msgs;
+	enq_clock = khello_clock();
+	enq_ns = khello_now(enq_clock);
+	
+	mutex_lock(&p_chan->mutex); /* Mutex lock to access shared data. */
+	for(batch.done = 0; batch.done < batch.count; ++batch.done) {
+		if(copy_from_user(&msg, umsgs + batch.done, sizeof(msg)) != 0) {
+			result = -EFAULT;
+			break;
+		}
+		if(msg.reserved != 0) { /* Rejected now so the field can be given a meaning later. */
+			result = -EINVAL;
+			break;
+		}
+		size = min_t(u32, msg.len, KHELLO_RECORD_MAX);
+		if(copy_from_user(data, (const void __user *)(uintptr_t)msg.addr, size) != 0) {
+			result = -EFAULT;
+			break;
+		}
+		khello_enqueue(p_chan, data, size, enq_clock, enq_ns);
+	}
+	mutex_unlock(&p_chan->mutex); /* Mutex unlock. */
+	
+	if(batch.done == 0)
+		return result;
+	wake_up_interruptible(&p_chan->readq);
+	if(put_user(batch.done, &p_ubatch->done) != 0)
+		return -EFAULT;
+	return batch.done;
+}
+
+
+
+static long dev_ioctl(struct file *p_file, unsigned int p_cmd, unsigned long p_arg)
+{
+	struct khello_file *kfile = p_file->private_data;
+	u32 flags;
+	
+	switch(p_cmd) {
+		case KHELLO_IOC_SET_RECV:
+			if(get_user(flags, (u32 __user *)p_arg))
+				return -EFAULT;
+			if(flags & ~(KHELLO_RECV_HDR | KHELLO_RECV_DEQ_STAMP))
+				return -EINVAL;
+			kfile->recv_flags = flags;
+			return 0;
+		case KHELLO_IOC_GET_RECV:
+			return put_user(kfile->recv_flags, (u32 __user *)p_arg);
+		case KHELLO_IOC_SEND_BATCH:
+			if(!(p_file->f_mode & FMODE_WRITE))
+				return -EBADF;
+			return khello_send_batch(kfile->chan, (struct khello_batch __user *)p_arg);
+		case KHELLO_IOC_RING_WAIT:
+			return khello_ring_wait(kfile->chan, (struct khello_ring_wait __user *)p_arg);
+		case KHELLO_IOC_RING_NOTIFY:
+			wake_up_interruptible_all(&kfile->chan->ringq);
+			return 0;
+		default:
+			return -ENOTTY;
+	}
+}
+
+
+
+static long khello_ring_wait(struct khello_chan *p_chan, struct khello_ring_wait __user *p_uwait)
+{
+	struct khello_ring_wait wait;
+	long result;
+	
+	if(copy_from_user(&wait, p_uwait, sizeof(wait)) != 0)
+		return -EFAULT;
+	if(wait.event > KHELLO_RING_EV_SPACE)
+		return -EINVAL;
+	if(wait.timeout_ms == 0)
+		return wait_event_interruptible(p_chan->ringq, khello_ring_ready(p_chan, wait.event));
+	
+	result = wait_event_interruptible_timeout(p_chan->ringq, khello_ring_ready(p_chan, wait.event), msecs_to_jiffies(wait.timeout_ms));
+	if(result == 0)
+		return -ETIMEDOUT;
+	return (result < 0) ? result : 0;
+}
+
+
+
+static int khello_ring_ready(struct khello_chan *p_chan, const u32 p_event)
+{
+	struct khello_ring *ring = (struct khello_ring*)p_chan->data2;
+	u32 head = READ_ONCE(ring->head), tail = READ_ONCE(ring->tail);
+	
+	/* Userland owns the indices, so only compare them. They are never used to address memory here. */
+	if(p_event == KHELLO_RING_EV_DATA)
+		return head != tail;
+	return head - tail < KHELLO_RING_SLOTS;
+}
+
+
+
 static unsigned int dev_poll(struct file *p_file, struct poll_table_struct *p_table)
 {
-	unsigned int result;
+	struct khello_chan *chan = ((struct khello_file*)p_file->private_data)->chan;
+	unsigned int result = POLLOUT | POLLWRNORM; /* Writes never block, a full ring drops its oldest record. */
 
-	if(g_data_size > 0) /* Data is availalable for reading. */
-		result = POLLIN;
-	if(g_lock == 0) /* Reading will not block */
-		result = POLLOUT;
+	poll_wait(p_file, &chan->readq, p_table);
+	if(chan->head != chan->tail) /* Data is availalable for reading. */
+		result |= POLLIN | POLLRDNORM;
 	
 	return result;
 }
@@ -255,20 +861,46 @@ static unsigned int dev_poll(struct file *p_file, struct poll_table_struct *p_ta
 
 static int dev_mmap(struct file *p_file, struct vm_area_struct *p_vma)
 {
-	unsigned long size = p_vma->vm_end - p_vma->vm_start;
+	struct khello_chan *chan = ((struct khello_file*)p_file->private_data)->chan;
+	unsigned long size = p_vma->vm_end - p_vma->vm_start, max = PAGE_SIZE;
+	void *area = chan->data2;
 	
 	
 	printk(KERN_INFO "khello: requested %ld bytes\n", size);
-	if(size > PAGE_SIZE) {
-		printk(KERN_INFO "khello: requested more than %ld bytes. Error.\n", PAGE_SIZE);
+	/* The arena is the only area larger than a page. */
+	if(p_vma->vm_pgoff == KHELLO_MMAP_ARENA_PGOFF) {
+		area = chan->arena;
+		max = PAGE_SIZE << KHELLO_ARENA_ORDER;
+	}
+	if(size > max) {
+		printk(KERN_INFO "khello: requested more than %ld bytes. Error.\n", max);
 		return -EAGAIN;
 	}
 	
-	if(remap_pfn_range(p_vma, p_vma->vm_start, __pa((void*)g_data2)>>PAGE_SHIFT, size, p_vma->vm_page_prot)) {
+	/* The statistics page is read-only and does not count as a data mapping. */
+	if(p_vma->vm_pgoff == KHELLO_MMAP_STATS_PGOFF) {
+		if(p_vma->vm_flags & VM_WRITE)
+			return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+		vm_flags_clear(p_vma, VM_MAYWRITE);
+#else
+		p_vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+		if(remap_pfn_range(p_vma, p_vma->vm_start, __pa((void*)chan->stats_page)>>PAGE_SHIFT, size, p_vma->vm_page_prot)) {
+			printk(KERN_ALERT "khello: Remap failed\n");
+			return -EAGAIN;
+		}
+		return 0;
+	}
+	if((p_vma->vm_pgoff != KHELLO_MMAP_RING_PGOFF) && (p_vma->vm_pgoff != KHELLO_MMAP_ARENA_PGOFF))
+		return -EINVAL;
+	
+	if(remap_pfn_range(p_vma, p_vma->vm_start, __pa(area)>>PAGE_SHIFT, size, p_vma->vm_page_prot)) {
 		printk(KERN_ALERT "khello: Remap failed\n");
 		return -EAGAIN;
 	}
 	p_vma->vm_ops = &g_remap_vm_ops;
+	p_vma->vm_private_data = chan;
 	khello_vma_open(p_vma);
     return 0;
 }
@@ -277,6 +909,10 @@ static int dev_mmap(struct file *p_file, struct vm_area_struct *p_vma)
 
 static void khello_vma_open(struct vm_area_struct *p_vma)
 {
+	struct khello_chan *chan = p_vma->vm_private_data;
+	
+	atomic_inc(&chan->stats.mappings);
+	chan->stats_page->mode = KHELLO_MODE_OVERWRITE | KHELLO_MODE_MMAP;
 	printk(KERN_INFO "khello: Mmap open\n");
 }
 
@@ -284,17 +920,21 @@ static void khello_vma_open(struct vm_area_struct *p_vma)
 
 static void khello_vma_close(struct vm_area_struct *p_vma)
 {
-	printk(KERN_INFO "khello: Mmap close: %s\n", g_data2);
+	struct khello_chan *chan = p_vma->vm_private_data;
+	
+	chan->stats_page->mode = KHELLO_MODE_OVERWRITE | ((atomic_dec_return(&chan->stats.mappings) > 0) ? KHELLO_MODE_MMAP : 0);
+	printk(KERN_INFO "khello: Mmap close\n");
 }
 
 
 
 static int khello_vma_fault(struct vm_area_struct *p_vma, struct vm_fault *p_fault)
 {
+	struct khello_chan *chan = p_vma->vm_private_data;
 	struct page *page;
 	
 	printk(KERN_INFO "In fault\n");	
-	page = virt_to_page(g_data2);
+	page = virt_to_page(chan->data2);
 	if(page == NULL) {
 		printk(KERN_ALERT "khello: No page\n");
 		return 0;		
@@ -307,7 +947,114 @@ static int khello_vma_fault(struct vm_area_struct *p_vma, struct vm_fault *p_fau
 
 
 
+static struct khello_stats_page *khello_dev_stats(struct device *p_dev)
+{
+	return ((struct khello_chan*)dev_get_drvdata(p_dev))->stats_page;
+}
+
+
+
+static ssize_t ring_size_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%u\n", khello_dev_stats(p_dev)->ring_size);
+}
+
+
+
+static ssize_t bytes_queued_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->bytes_queued);
+}
+
+
+
+static ssize_t records_queued_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->records_queued);
+}
+
+
+
+static ssize_t high_water_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->high_water);
+}
+
+
+
+static ssize_t drops_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->drops);
+}
+
+
+
+static ssize_t bytes_in_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->bytes_in);
+}
+
+
+
+static ssize_t bytes_out_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->bytes_out);
+}
+
+
+
+static ssize_t records_in_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->records_in);
+}
+
+
+
+static ssize_t records_out_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%llu\n", khello_dev_stats(p_dev)->records_out);
+}
+
+
+
+static ssize_t latency_hist_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	int i, len = 0;
+	
+	for(i = 0; i < KHELLO_LAT_BUCKETS; ++i)
+		len += sysfs_emit_at(p_buf, len, "%llu%c", khello_dev_stats(p_dev)->latency_hist[i], (i < KHELLO_LAT_BUCKETS - 1) ? ' ' : '\n');
+	return len;
+}
+
+
+
+static ssize_t readers_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%u\n", khello_dev_stats(p_dev)->readers);
+}
+
+
+
+static ssize_t writers_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "%u\n", khello_dev_stats(p_dev)->writers);
+}
+
+
+
+static ssize_t mode_show(struct device *p_dev, struct device_attribute *p_attr, char *p_buf)
+{
+	return sysfs_emit(p_buf, "0x%04x\n", khello_dev_stats(p_dev)->mode);
+}
+
+
+
+
 
+/* The KUnit suites test the static functions above, so they are built into this file. See khello_test.c. */
+#if IS_ENABLED(CONFIG_KHELLO_KUNIT_TEST) || defined(KHELLO_KUNIT)
+#include "khello_test.c"
+#endif
 
 module_init(hello_init);
 module_exit(hello_cleanup);
\ No newline at end of file
@@ -0,0 +1,183 @@
+/** @file khello.h
+ *
+ * Definitions shared between the khello kernel module and userland applications.
+ * Userland applications include this file to interpret values exported by the module.
+ */
+
+#ifndef KHELLO_H
+#define KHELLO_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+
+#define KHELLO_SYSFS_DIR "/sys/class/khello_class" /**< Directory holding the sysfs entries of all khello devices. */
+#define KHELLO_RECORD_MAX 32 /**< Maximum payload of a record. Longer writes are truncated. */
+#define KHELLO_LAT_BUCKETS 32 /**< Number of buckets in the "latency_hist" sysfs attribute. Bucket i counts queueing latencies in [2^i, 2^(i+1)) ns, the last bucket also counts anything longer. */
+
+
+/* Mode flags reported in the "mode" sysfs attribute. */
+#define KHELLO_MODE_OVERWRITE	0x0001 /**< A write to a full ring replaces the oldest record not yet read. */
+#define KHELLO_MODE_MMAP	0x0002 /**< The shared memory area is currently mapped by userland. */
+
+
+/* Clocks used to timestamp records. Selected with the "clock" module parameter. */
+#define KHELLO_CLOCK_MONOTONIC		0 /**< ktime_get_ns(), same as CLOCK_MONOTONIC in userland. */
+#define KHELLO_CLOCK_MONOTONIC_RAW	1 /**< ktime_get_raw_ns(), same as CLOCK_MONOTONIC_RAW in userland. */
+#define KHELLO_CLOCK_REALTIME		2 /**< ktime_get_real_ns(), same as CLOCK_REALTIME in userland. */
+
+
+/* Flags for KHELLO_IOC_SET_RECV. They apply to the file handle that sets them. */
+#define KHELLO_RECV_HDR		0x0001 /**< read() returns each record prefixed by a struct khello_rec_hdr. */
+#define KHELLO_RECV_DEQ_STAMP	0x0002 /**< Fill khello_rec_hdr.deq_ns with the time the record was read. */
+
+
+/** Header preceding each record returned by read() when KHELLO_RECV_HDR is set. */
+struct khello_rec_hdr {
+	__u32 len; /**< Number of payload bytes following the header. */
+	__u32 clock; /**< KHELLO_CLOCK_* used for the timestamps. */
+	__u64 enq_ns; /**< Time the record was written to the device. */
+	__u64 deq_ns; /**< Time the record was read from the device. 0 unless KHELLO_RECV_DEQ_STAMP is set. */
+};
+
+
+#define KHELLO_BATCH_MAX 1024 /**< Maximum number of records accepted by one KHELLO_IOC_SEND_BATCH. */
+
+/** One record of a KHELLO_IOC_SEND_BATCH. */
+struct khello_msg {
+	__u64 addr; /**< Address of the payload. */
+	__u32 len; /**< Length of the payload. Truncated to KHELLO_RECORD_MAX. */
+	__u32 reserved; /**< Must be 0. The batch stops with EINVAL at a record where it is not. */
+};
+
+/** Argument of KHELLO_IOC_SEND_BATCH. */
+struct khello_batch {
+	__u64 msgs; /**< Address of an array of struct khello_msg. */
+	__u32 count; /**< Number of entries in msgs. At most KHELLO_BATCH_MAX are used. */
+	__u32 done; /**< Returns the number of records queued. */
+};
+
+
+#define KHELLO_MMAP_STATS_PGOFF 1 /**< mmap() offset, in pages, of the read-only struct khello_stats_page. */
+
+/** Statistics of a device, mapped read-only by userland at page KHELLO_MMAP_STATS_PGOFF of the device.
+ *  The same values are exported as sysfs attributes. Reading them from the mapping costs no system call.
+ *  To get a consistent snapshot, read seq, copy the structure, then read seq again. Retry if seq was odd or changed.
+ */
+struct khello_stats_page {
+	__u32 seq; /**< Incremented before and after the counters below are updated. Odd while an update is in progress. */
+	__u32 ring_size; /**< Number of records the device can hold. */
+	__u32 readers; /**< Open file handles with read access. Updated outside seq. */
+	__u32 writers; /**< Open file handles with write access. Updated outside seq. */
+	__u32 mode; /**< KHELLO_MODE_* flags. Updated outside seq. */
+	__u32 reserved;
+	__u64 records_queued; /**< Records written but not yet read. */
+	__u64 bytes_queued; /**< Bytes written but not yet read. */
+	__u64 high_water; /**< Highest number of bytes ever queued. */
+	__u64 drops; /**< Records replaced before they were read. */
+	__u64 bytes_in; /**< Total bytes written. */
+	__u64 bytes_out; /**< Total bytes read. */
+	__u64 records_in; /**< Total records written. */
+	__u64 records_out; /**< Total records read. */
+	__u64 latency_hist[KHELLO_LAT_BUCKETS]; /**< Queueing latency histogram. See KHELLO_LAT_BUCKETS. */
+};
+
+
+#define KHELLO_MMAP_RING_PGOFF 0 /**< mmap() offset, in pages, of the shared struct khello_ring. */
+#define KHELLO_RING_MAGIC 0x6b68726e /**< khello_ring.magic, "khrn". */
+#define KHELLO_RING_SLOTS 32 /**< Number of slots in the shared ring. A power of 2. */
+#define KHELLO_RING_DATA_MAX 56 /**< Maximum payload of a shared ring slot. */
+
+/** One slot of the shared ring. */
+struct khello_ring_slot {
+	__u32 len; /**< Number of bytes in data. */
+	__u32 reserved;
+	unsigned char data[KHELLO_RING_DATA_MAX]; /**< The payload. */
+};
+
+/** Single-producer single-consumer ring in the shared memory page of a device, mapped read-write at page KHELLO_MMAP_RING_PGOFF.
+ *  Records pass between processes that map the same device without system calls. head and tail wrap freely and are masked with KHELLO_RING_SLOTS - 1.
+ *  The producer fills slot head, then stores head + 1 with release semantics. The consumer loads head with acquire semantics, reads slot tail, then stores tail + 1 with release semantics.
+ *  Doorbell: a consumer about to sleep sets cons_wait, issues a full barrier, checks head again, then calls KHELLO_IOC_RING_WAIT with KHELLO_RING_EV_DATA.
+ *  A producer issues a full barrier after storing head and, only if cons_wait is set, clears it and calls KHELLO_IOC_RING_NOTIFY. prod_wait and KHELLO_RING_EV_SPACE work the same way for a full ring.
+ *  The driver sets magic, slots, slot_size and data_off when the device is created and checks head and tail itself before sleeping, so a wakeup cannot be lost.
+ */
+struct khello_ring {
+	__u32 magic; /**< KHELLO_RING_MAGIC. */
+	__u32 slots; /**< KHELLO_RING_SLOTS. */
+	__u32 slot_size; /**< sizeof(struct khello_ring_slot). */
+	__u32 data_off; /**< Offset of the first slot from the start of the ring. */
+	__u32 pad0[12];
+	__u32 head; /**< Index of the next slot to fill. Written by the producer. */
+	__u32 pad1[15];
+	__u32 tail; /**< Index of the next slot to read. Written by the consumer. */
+	__u32 pad2[15];
+	__u32 cons_wait; /**< Non-zero while the consumer waits for data. Written by the consumer. */
+	__u32 prod_wait; /**< Non-zero while the producer waits for space. Written by the producer. */
+	__u32 pad3[14];
+	struct khello_ring_slot slot[KHELLO_RING_SLOTS]; /**< The slots. */
+};
+
+#define KHELLO_RING_EV_DATA 0 /**< Wait until the shared ring is not empty. */
+#define KHELLO_RING_EV_SPACE 1 /**< Wait until the shared ring is not full. */
+
+/** Argument of KHELLO_IOC_RING_WAIT. */
+struct khello_ring_wait {
+	__u32 event; /**< KHELLO_RING_EV_*. */
+	__u32 timeout_ms; /**< Longest wait. 0 waits until the event or a signal. */
+};
+
+
+#define KHELLO_MMAP_ARENA_PGOFF 2 /**< mmap() offset, in pages, of the shared struct khello_arena. */
+#define KHELLO_ARENA_ORDER 4 /**< The arena is 2^KHELLO_ARENA_ORDER pages, 64 KB with 4 KB pages. */
+#define KHELLO_ARENA_MAGIC 0x6b686172 /**< khello_arena.magic, "khar". */
+
+/** Header of the shared data arena of a device, mapped read-write at page KHELLO_MMAP_ARENA_PGOFF. The usable bytes follow it, from data_off to size.
+ *  The arena holds messages too large for a ring slot: the producer builds a message in place and publishes its offset, e.g. through the shared ring.
+ *  The driver only sets magic, size and data_off; the allocation protocol belongs to userland. libkhello/khello_arena.hpp uses alloc and freed
+ *  as the byte counters of a circular bump allocator: the producer allocates at alloc, the consumer advances freed past what it has consumed.
+ */
+struct khello_arena {
+	__u32 magic; /**< KHELLO_ARENA_MAGIC. */
+	__u32 size; /**< Size of the arena in bytes, header included. */
+	__u32 data_off; /**< Offset of the first usable byte from the start of the arena. */
+	__u32 pad0[13];
+	__u64 alloc; /**< Bytes handed out since the device was created. Written by the producer. */
+	__u64 pad1[7];
+	__u64 freed; /**< Bytes released since the device was created. Written by the consumer. */
+	__u64 pad2[7];
+};
+
+
+#define KHELLO_IOC_MAGIC 'k'
+#define KHELLO_IOC_SET_RECV _IOW(KHELLO_IOC_MAGIC, 1, __u32) /**< Sets the KHELLO_RECV_* flags of the file handle. */
+#define KHELLO_IOC_GET_RECV _IOR(KHELLO_IOC_MAGIC, 2, __u32) /**< Gets the KHELLO_RECV_* flags of the file handle. */
+#define KHELLO_IOC_SEND_BATCH _IOWR(KHELLO_IOC_MAGIC, 3, struct khello_batch) /**< Queues several records with one call. Returns the number queued. */
+#define KHELLO_IOC_RING_WAIT _IOW(KHELLO_IOC_MAGIC, 4, struct khello_ring_wait) /**< Sleeps until a shared ring event. Fails with ETIMEDOUT after the timeout. */
+#define KHELLO_IOC_RING_NOTIFY _IO(KHELLO_IOC_MAGIC, 5) /**< Wakes the processes sleeping in KHELLO_IOC_RING_WAIT on the device. */
+
+
+#ifndef __KERNEL__
+/* Static probe points for userland clients, provider "khello". Build with -DKHELLO_USDT and sys/sdt.h to enable them.
+ * Each probe is a single nop when no tracer is attached, and compiles away entirely without KHELLO_USDT.
+ * Probes used by the clients:
+ * send(fd, bytes)            After data is written to a device.
+ * receive(fd, bytes)         After data is read from a device.
+ * batch_start(fd, records)   Before a batch of records is submitted or drained. records is 0 when not known in advance.
+ * batch_end(fd, records)     After a batch of records is submitted or drained.
+ * wait_start(fd)             Before blocking for a device to become ready.
+ * wait_end(fd, ready)        After waking up.
+ * doorbell(fd, event)        Before ringing the shared ring doorbell with KHELLO_IOC_RING_NOTIFY. event is the KHELLO_RING_EV_* the peer waits for.
+ */
+#ifdef KHELLO_USDT
+#include <sys/sdt.h>
+#define KHELLO_PROBE1(p_name, p_a) DTRACE_PROBE1(khello, p_name, p_a)
+#define KHELLO_PROBE2(p_name, p_a, p_b) DTRACE_PROBE2(khello, p_name, p_a, p_b)
+#else
+#define KHELLO_PROBE1(p_name, p_a) do { (void)(p_a); } while(0)
+#define KHELLO_PROBE2(p_name, p_a, p_b) do { (void)(p_a); (void)(p_b); } while(0)
+#endif
+#endif
+
+
+#endif
@@ -0,0 +1,547 @@
+/** @file khello_test.c
+ * KUnit suites for the record ring of khello.c. Built into khello.c when CONFIG_KHELLO_KUNIT_TEST is set, or KHELLO_KUNIT is defined by "make KUNIT=1", so they can call its static functions.
+ *
+ * khello_ring checks enqueue and dequeue, index wraparound, replacement of the oldest record on a full ring (lossy mode), KHELLO_IOC_SEND_BATCH,
+ * concurrent producers, and the readiness test of the shared ring doorbell. Every test allocates its own channel: the devices created by the module are not touched.
+ * khello_ring_bench times enqueue, dequeue and enqueue into a full ring for several record sizes, taking the channel mutex as dev_write() and dev_read_iter() do,
+ * and reports the nanoseconds per record in the test log.
+ *
+ * Usage:
+ * Under UML, with khello2 in the kernel tree as drivers/misc/khello (see README): "./tools/testing/kunit/kunit.py run --kunitconfig=drivers/misc/khello"
+ * As a module on a kernel with CONFIG_KUNIT: "make KUNIT=1 && insmod khello.ko", then see dmesg or /sys/kernel/debug/kunit/khello_ring/results
+ */
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/mman.h>
+
+
+#define KHELLO_TEST_RECORDS 8 /**< Ring size of most tests, small so they wrap and fill quickly. */
+#define KHELLO_TEST_PRODUCERS 4 /**< Threads of the concurrent producer tests. */
+#define KHELLO_TEST_PER_PRODUCER 2000 /**< Records sent by each of them. */
+#define KHELLO_TEST_BIG_RECORDS 8192 /**< Ring holding every record of the concurrent producers, at least KHELLO_TEST_PRODUCERS * KHELLO_TEST_PER_PRODUCER. */
+#define KHELLO_TEST_SMALL_RECORDS 64 /**< Ring of the concurrent test with a consumer, small so it overflows. */
+#define KHELLO_TEST_BATCH 12 /**< Records of the batch test, more than the ring holds. */
+#define KHELLO_BENCH_RECORDS 1024 /**< Ring size of the benchmarks. */
+#define KHELLO_BENCH_ROUNDS 200 /**< Times the benchmark ring is filled and drained. */
+
+
+/** Payload of the records of the concurrent producer tests. */
+struct khello_test_rec {
+	u32 producer; /**< Index of the producer. */
+	u32 seq; /**< Sequence number within the producer. */
+};
+
+/** A producer thread. */
+struct khello_test_producer {
+	struct khello_chan *chan; /**< The channel. */
+	u32 index; /**< Index of the producer. */
+	struct completion done; /**< Completed when every record is queued. */
+};
+
+
+/** Sets up the channel of a test, not yet allocated. */
+static int khello_test_init(struct kunit *p_test);
+
+/** Frees the channel of a test. */
+static void khello_test_exit(struct kunit *p_test);
+
+/** Allocates the channel of a test.
+ *  @param p_test The test.
+ *  @param p_records Records the ring holds, a power of 2.
+ *  @return The channel. The test is aborted if it cannot be allocated.
+ */
+static struct khello_chan *khello_test_chan(struct kunit *p_test, const unsigned int p_records);
+
+/** Queues one record under the channel mutex, as dev_write() does. Its payload is p_size bytes of p_fill. */
+static void khello_test_put(struct khello_chan *p_chan, const unsigned char p_fill, const size_t p_size, const u64 p_ns);
+
+/** Dequeues the oldest record under the channel mutex, as dev_read_iter() does.
+ *  @param p_chan The channel.
+ *  @param p_rec Receives a copy of the record.
+ *  @return 1 if a record was dequeued, 0 if the ring was empty.
+ */
+static int khello_test_get(struct khello_chan *p_chan, struct khello_record *p_rec);
+
+/** Queues KHELLO_TEST_PER_PRODUCER records numbered from 0. A kthread function. */
+static int khello_test_producer_fn(void *p_arg);
+
+/** Starts the producer threads and returns once they are running.
+ *  @return 0 if OK, else the error of kthread_run().
+ */
+static int khello_test_start_producers(struct khello_chan *p_chan, struct khello_test_producer *p_producers);
+
+
+
+static int khello_test_init(struct kunit *p_test)
+{
+	p_test->priv = kunit_kzalloc(p_test, sizeof(struct khello_chan), GFP_KERNEL);
+	return (p_test->priv == NULL) ? -ENOMEM : 0;
+}
+
+
+
+static void khello_test_exit(struct kunit *p_test)
+{
+	struct khello_chan *chan = p_test->priv;
+
+	if(chan->ring != NULL)
+		khello_chan_free(chan);
+}
+
+
+
+static struct khello_chan *khello_test_chan(struct kunit *p_test, const unsigned int p_records)
+{
+	struct khello_chan *chan = p_test->priv;
+
+	KUNIT_ASSERT_EQ(p_test, khello_chan_alloc(chan, p_records), 0);
+	return chan;
+}
+
+
+
+static void khello_test_put(struct khello_chan *p_chan, const unsigned char p_fill, const size_t p_size, const u64 p_ns)
+{
+	unsigned char data[KHELLO_RECORD_MAX];
+
+	memset(data, p_fill, p_size);
+	mutex_lock(&p_chan->mutex);
+	khello_enqueue(p_chan, data, p_size, KHELLO_CLOCK_MONOTONIC, p_ns);
+	mutex_unlock(&p_chan->mutex);
+}
+
+
+
+static int khello_test_get(struct khello_chan *p_chan, struct khello_record *p_rec)
+{
+	int found = 0;
+
+	mutex_lock(&p_chan->mutex);
+	if(p_chan->head != p_chan->tail) {
+		*p_rec = p_chan->ring[p_chan->tail & p_chan->ring_mask];
+		khello_dequeue(p_chan, p_rec->enq_ns + 1);
+		found = 1;
+	}
+	mutex_unlock(&p_chan->mutex);
+	return found;
+}
+
+
+
+/** Records come out in the order they went in, with their payload, length, clock and timestamp, and the counters follow. */
+static void khello_test_enqueue_dequeue(struct kunit *p_test)
+{
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_TEST_RECORDS);
+	struct khello_stats_page *stats = chan->stats_page;
+	struct khello_record rec;
+	size_t bytes = 0;
+	unsigned int i, j;
+
+	for(i = 0; i < KHELLO_TEST_RECORDS; ++i) {
+		khello_test_put(chan, 'a' + i, i + 1, 1000 + i);
+		bytes += i + 1;
+	}
+	KUNIT_EXPECT_EQ(p_test, stats->records_queued, (u64)KHELLO_TEST_RECORDS);
+	KUNIT_EXPECT_EQ(p_test, stats->bytes_queued, (u64)bytes);
+	KUNIT_EXPECT_EQ(p_test, stats->records_in, (u64)KHELLO_TEST_RECORDS);
+	KUNIT_EXPECT_EQ(p_test, stats->high_water, (u64)bytes);
+	KUNIT_EXPECT_EQ(p_test, stats->drops, 0ULL);
+
+	for(i = 0; i < KHELLO_TEST_RECORDS; ++i) {
+		KUNIT_ASSERT_EQ(p_test, khello_test_get(chan, &rec), 1);
+		KUNIT_EXPECT_EQ(p_test, rec.len, i + 1);
+		KUNIT_EXPECT_EQ(p_test, rec.clock, (u32)KHELLO_CLOCK_MONOTONIC);
+		KUNIT_EXPECT_EQ(p_test, rec.enq_ns, 1000ULL + i);
+		for(j = 0; j < rec.len; ++j)
+			KUNIT_EXPECT_EQ(p_test, rec.data[j], (unsigned char)('a' + i));
+	}
+	KUNIT_EXPECT_EQ(p_test, khello_test_get(chan, &rec), 0);
+	KUNIT_EXPECT_EQ(p_test, stats->records_queued, 0ULL);
+	KUNIT_EXPECT_EQ(p_test, stats->bytes_queued, 0ULL);
+	KUNIT_EXPECT_EQ(p_test, stats->records_out, (u64)KHELLO_TEST_RECORDS);
+	KUNIT_EXPECT_EQ(p_test, stats->bytes_out, (u64)bytes);
+	/* Each record waited 1 ns, the first latency bucket. */
+	KUNIT_EXPECT_EQ(p_test, stats->latency_hist[0], (u64)KHELLO_TEST_RECORDS);
+	KUNIT_EXPECT_EQ(p_test, stats->seq % 2, 0U);
+}
+
+
+
+/** The indices wrap around the ring many times, and around the 32-bit range, without losing or reordering records. */
+static void khello_test_wraparound(struct kunit *p_test)
+{
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_TEST_RECORDS);
+	struct khello_record rec;
+	unsigned int round, i, next = 0, expect = 0;
+
+	/* Start just below the 32-bit wrap of the free-running indices. */
+	chan->head = chan->tail = UINT_MAX - 2 * KHELLO_TEST_RECORDS;
+	for(round = 0; round < 100; ++round) {
+		/* 5 in, 5 out: never full, never aligned with the ring size. */
+		for(i = 0; i < 5; ++i, ++next)
+			khello_test_put(chan, next, KHELLO_RECORD_MAX, next);
+		for(i = 0; i < 5; ++i, ++expect) {
+			KUNIT_ASSERT_EQ(p_test, khello_test_get(chan, &rec), 1);
+			KUNIT_ASSERT_EQ(p_test, rec.enq_ns, (u64)expect);
+			KUNIT_EXPECT_EQ(p_test, rec.data[KHELLO_RECORD_MAX - 1], (unsigned char)expect);
+		}
+		KUNIT_ASSERT_EQ(p_test, chan->stats_page->records_queued, 0ULL);
+	}
+	KUNIT_EXPECT_LT(p_test, chan->head, (unsigned int)KHELLO_TEST_RECORDS * 100);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->drops, 0ULL);
+	KUNIT_EXPECT_EQ(p_test, chan->bytes_queued, (size_t)0);
+}
+
+
+
+/** A full ring replaces its oldest record, counts the drop, and keeps the newest records in order. */
+static void khello_test_lossy(struct kunit *p_test)
+{
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_TEST_RECORDS);
+	struct khello_stats_page *stats = chan->stats_page;
+	struct khello_record rec;
+	const unsigned int extra = 5;
+	unsigned int i;
+
+	/* Start near the 32-bit wrap so the full test crosses it too. */
+	chan->head = chan->tail = UINT_MAX - 3;
+	for(i = 0; i < KHELLO_TEST_RECORDS + extra; ++i)
+		khello_test_put(chan, i, (i % KHELLO_RECORD_MAX) + 1, i);
+	KUNIT_EXPECT_EQ(p_test, stats->drops, (u64)extra);
+	KUNIT_EXPECT_EQ(p_test, stats->records_queued, (u64)KHELLO_TEST_RECORDS);
+	KUNIT_EXPECT_EQ(p_test, stats->records_in, (u64)KHELLO_TEST_RECORDS + extra);
+	KUNIT_EXPECT_EQ(p_test, chan->head - chan->tail, (unsigned int)KHELLO_TEST_RECORDS);
+
+	/* The survivors are the newest, oldest first, and bytes_queued counts exactly them. */
+	for(i = extra; i < KHELLO_TEST_RECORDS + extra; ++i) {
+		KUNIT_ASSERT_EQ(p_test, khello_test_get(chan, &rec), 1);
+		KUNIT_EXPECT_EQ(p_test, rec.enq_ns, (u64)i);
+		KUNIT_EXPECT_EQ(p_test, rec.len, (i % KHELLO_RECORD_MAX) + 1);
+		KUNIT_EXPECT_EQ(p_test, rec.data[0], (unsigned char)i);
+	}
+	KUNIT_EXPECT_EQ(p_test, khello_test_get(chan, &rec), 0);
+	KUNIT_EXPECT_EQ(p_test, chan->bytes_queued, (size_t)0);
+	KUNIT_EXPECT_EQ(p_test, stats->records_in, stats->records_out + stats->drops);
+}
+
+
+
+/** KHELLO_IOC_SEND_BATCH queues every record with one timestamp, truncates long ones, overwrites on a full ring, and stops at a bad address or a non-zero reserved field.
+ *  The batch is read from user memory, which KUnit can map from Linux 6.10.
+ */
+static void khello_test_batch(struct kunit *p_test)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_TEST_RECORDS);
+	struct khello_msg msgs[KHELLO_TEST_BATCH];
+	struct khello_batch batch;
+	struct khello_record rec;
+	unsigned char data[KHELLO_TEST_BATCH * 64];
+	unsigned long user;
+	u64 enq_ns = 0;
+	unsigned int i;
+
+	user = kunit_vm_mmap(p_test, NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	KUNIT_ASSERT_NE_MSG(p_test, user, 0UL, "could not map user memory");
+
+	/* Layout in user memory: the batch, the messages, then 64 bytes of payload per message. Message 3 is longer than a record. */
+	for(i = 0; i < KHELLO_TEST_BATCH; ++i) {
+		memset(data + i * 64, 'A' + i, 64);
+		msgs[i].addr = user + sizeof(batch) + sizeof(msgs) + i * 64;
+		msgs[i].len = (i == 3) ? 64 : i + 1;
+		msgs[i].reserved = 0;
+	}
+	batch.msgs = user + sizeof(batch);
+	batch.count = KHELLO_TEST_BATCH;
+	batch.done = 0;
+	KUNIT_ASSERT_EQ(p_test, copy_to_user((void __user *)user, &batch, sizeof(batch)), 0UL);
+	KUNIT_ASSERT_EQ(p_test, copy_to_user((void __user *)(user + sizeof(batch)), msgs, sizeof(msgs)), 0UL);
+	KUNIT_ASSERT_EQ(p_test, copy_to_user((void __user *)(user + sizeof(batch) + sizeof(msgs)), data, sizeof(data)), 0UL);
+
+	KUNIT_EXPECT_EQ(p_test, khello_send_batch(chan, (struct khello_batch __user *)user), (long)KHELLO_TEST_BATCH);
+	KUNIT_ASSERT_EQ(p_test, copy_from_user(&batch, (void __user *)user, sizeof(batch)), 0UL);
+	KUNIT_EXPECT_EQ(p_test, batch.done, (u32)KHELLO_TEST_BATCH);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->drops, (u64)(KHELLO_TEST_BATCH - KHELLO_TEST_RECORDS));
+	for(i = KHELLO_TEST_BATCH - KHELLO_TEST_RECORDS; i < KHELLO_TEST_BATCH; ++i) {
+		KUNIT_ASSERT_EQ(p_test, khello_test_get(chan, &rec), 1);
+		KUNIT_EXPECT_EQ(p_test, rec.len, (i == 3) ? (u32)KHELLO_RECORD_MAX : i + 1);
+		KUNIT_EXPECT_EQ(p_test, rec.data[0], (unsigned char)('A' + i));
+		if(enq_ns == 0)
+			enq_ns = rec.enq_ns;
+		KUNIT_EXPECT_EQ(p_test, rec.enq_ns, enq_ns);
+	}
+
+	/* A bad payload address stops the batch: the records before it are queued and counted. */
+	msgs[2].addr = 0;
+	KUNIT_ASSERT_EQ(p_test, copy_to_user((void __user *)(user + sizeof(batch)), msgs, sizeof(msgs)), 0UL);
+	KUNIT_EXPECT_EQ(p_test, khello_send_batch(chan, (struct khello_batch __user *)user), 2L);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->records_queued, 2ULL);
+
+	/* A non-zero reserved field stops the batch the same way, with EINVAL when it is the first record. */
+	msgs[2].addr = user + sizeof(batch) + sizeof(msgs) + 2 * 64;
+	msgs[1].reserved = 1;
+	KUNIT_ASSERT_EQ(p_test, copy_to_user((void __user *)(user + sizeof(batch)), msgs, sizeof(msgs)), 0UL);
+	KUNIT_EXPECT_EQ(p_test, khello_send_batch(chan, (struct khello_batch __user *)user), 1L);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->records_queued, 3ULL);
+	msgs[0].reserved = 1;
+	KUNIT_ASSERT_EQ(p_test, copy_to_user((void __user *)(user + sizeof(batch)), msgs, sizeof(msgs)), 0UL);
+	KUNIT_EXPECT_EQ(p_test, khello_send_batch(chan, (struct khello_batch __user *)user), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->records_queued, 3ULL);
+
+	/* A bad message array queues nothing and fails. */
+	batch.msgs = 0;
+	KUNIT_ASSERT_EQ(p_test, copy_to_user((void __user *)user, &batch, sizeof(batch)), 0UL);
+	KUNIT_EXPECT_EQ(p_test, khello_send_batch(chan, (struct khello_batch __user *)user), (long)-EFAULT);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->records_queued, 3ULL);
+#else
+	kunit_skip(p_test, "mapping user memory in a test needs Linux 6.10");
+#endif
+}
+
+
+
+static int khello_test_producer_fn(void *p_arg)
+{
+	struct khello_test_producer *producer = p_arg;
+	struct khello_test_rec payload;
+	u32 seq;
+
+	payload.producer = producer->index;
+	for(seq = 0; seq < KHELLO_TEST_PER_PRODUCER; ++seq) {
+		payload.seq = seq;
+		mutex_lock(&producer->chan->mutex);
+		khello_enqueue(producer->chan, (const unsigned char*)&payload, sizeof(payload), KHELLO_CLOCK_MONOTONIC, ktime_get_ns());
+		mutex_unlock(&producer->chan->mutex);
+		if((seq % 64) == 0)
+			cond_resched();
+	}
+	complete(&producer->done);
+	return 0;
+}
+
+
+
+static int khello_test_start_producers(struct khello_chan *p_chan, struct khello_test_producer *p_producers)
+{
+	struct task_struct *task;
+	int i;
+
+	for(i = 0; i < KHELLO_TEST_PRODUCERS; ++i) {
+		p_producers[i].chan = p_chan;
+		p_producers[i].index = i;
+		init_completion(&p_producers[i].done);
+	}
+	for(i = 0; i < KHELLO_TEST_PRODUCERS; ++i) {
+		task = kthread_run(khello_test_producer_fn, &p_producers[i], "khello_test/%d", i);
+		if(IS_ERR(task)) {
+			/* Let the threads already started finish before the test frees what they use. */
+			while(--i >= 0)
+				wait_for_completion(&p_producers[i].done);
+			return PTR_ERR(task);
+		}
+	}
+	return 0;
+}
+
+
+
+/** Producers writing at the same time lose nothing when the ring is large enough, and each producer's records stay in order. */
+static void khello_test_producers(struct kunit *p_test)
+{
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_TEST_BIG_RECORDS);
+	struct khello_test_producer producers[KHELLO_TEST_PRODUCERS];
+	u32 next[KHELLO_TEST_PRODUCERS] = { 0 };
+	struct khello_test_rec payload;
+	struct khello_record rec;
+	int i;
+
+	KUNIT_ASSERT_EQ(p_test, khello_test_start_producers(chan, producers), 0);
+	for(i = 0; i < KHELLO_TEST_PRODUCERS; ++i)
+		wait_for_completion(&producers[i].done);
+
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->records_in, (u64)KHELLO_TEST_PRODUCERS * KHELLO_TEST_PER_PRODUCER);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->drops, 0ULL);
+	while(khello_test_get(chan, &rec)) {
+		KUNIT_ASSERT_EQ(p_test, rec.len, (u32)sizeof(payload));
+		memcpy(&payload, rec.data, sizeof(payload));
+		KUNIT_ASSERT_LT(p_test, payload.producer, (u32)KHELLO_TEST_PRODUCERS);
+		KUNIT_ASSERT_EQ(p_test, payload.seq, next[payload.producer]);
+		++next[payload.producer];
+	}
+	for(i = 0; i < KHELLO_TEST_PRODUCERS; ++i)
+		KUNIT_EXPECT_EQ(p_test, next[i], (u32)KHELLO_TEST_PER_PRODUCER);
+}
+
+
+
+/** Producers and a consumer at the same time on a ring that overflows: what is read is whole and in order per producer, and every record is read or dropped. */
+static void khello_test_producers_consumer(struct kunit *p_test)
+{
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_TEST_SMALL_RECORDS);
+	struct khello_stats_page *stats = chan->stats_page;
+	struct khello_test_producer producers[KHELLO_TEST_PRODUCERS];
+	s64 last[KHELLO_TEST_PRODUCERS];
+	struct khello_test_rec payload;
+	struct khello_record rec;
+	u64 got = 0;
+	int i, running = KHELLO_TEST_PRODUCERS;
+
+	for(i = 0; i < KHELLO_TEST_PRODUCERS; ++i)
+		last[i] = -1;
+	KUNIT_ASSERT_EQ(p_test, khello_test_start_producers(chan, producers), 0);
+
+	/* Consume until every producer is done and the ring is empty. */
+	while(running > 0 || chan->head != chan->tail) {
+		if(!khello_test_get(chan, &rec)) {
+			for(i = 0, running = 0; i < KHELLO_TEST_PRODUCERS; ++i)
+				running += !completion_done(&producers[i].done);
+			cond_resched();
+			continue;
+		}
+		++got;
+		/* No assertion here: returning early would free the channel and producers[] under the running threads. */
+		KUNIT_EXPECT_EQ(p_test, rec.len, (u32)sizeof(payload));
+		if(rec.len != sizeof(payload))
+			break;
+		memcpy(&payload, rec.data, sizeof(payload));
+		KUNIT_EXPECT_LT(p_test, payload.producer, (u32)KHELLO_TEST_PRODUCERS);
+		if(payload.producer >= KHELLO_TEST_PRODUCERS)
+			break;
+		KUNIT_EXPECT_GT(p_test, (s64)payload.seq, last[payload.producer]);
+		if((s64)payload.seq <= last[payload.producer])
+			break;
+		last[payload.producer] = payload.seq;
+	}
+	for(i = 0; i < KHELLO_TEST_PRODUCERS; ++i)
+		wait_for_completion(&producers[i].done);
+	/* The counters only balance if the ring was drained. */
+	if(running > 0 || chan->head != chan->tail)
+		return;
+
+	KUNIT_EXPECT_EQ(p_test, stats->records_in, (u64)KHELLO_TEST_PRODUCERS * KHELLO_TEST_PER_PRODUCER);
+	KUNIT_EXPECT_EQ(p_test, stats->records_out, got);
+	KUNIT_EXPECT_EQ(p_test, stats->records_in, stats->records_out + stats->drops);
+	KUNIT_EXPECT_EQ(p_test, stats->bytes_queued, 0ULL);
+	kunit_info(p_test, "%llu records read, %llu dropped\n", got, stats->drops);
+}
+
+
+
+/** The readiness test of KHELLO_IOC_RING_WAIT follows the free-running indices of the shared ring across the 32-bit wrap. */
+static void khello_test_ring_ready(struct kunit *p_test)
+{
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_TEST_RECORDS);
+	struct khello_ring *ring = (struct khello_ring*)chan->data2;
+
+	KUNIT_EXPECT_EQ(p_test, ring->magic, (u32)KHELLO_RING_MAGIC);
+	KUNIT_EXPECT_EQ(p_test, ring->data_off, (u32)offsetof(struct khello_ring, slot));
+	ring->head = ring->tail = UINT_MAX;
+	KUNIT_EXPECT_FALSE(p_test, khello_ring_ready(chan, KHELLO_RING_EV_DATA));
+	KUNIT_EXPECT_TRUE(p_test, khello_ring_ready(chan, KHELLO_RING_EV_SPACE));
+	ring->head = UINT_MAX + KHELLO_RING_SLOTS; /* Full, across the wrap. */
+	KUNIT_EXPECT_TRUE(p_test, khello_ring_ready(chan, KHELLO_RING_EV_DATA));
+	KUNIT_EXPECT_FALSE(p_test, khello_ring_ready(chan, KHELLO_RING_EV_SPACE));
+	ring->tail += 1;
+	KUNIT_EXPECT_TRUE(p_test, khello_ring_ready(chan, KHELLO_RING_EV_SPACE));
+}
+
+
+
+/** Record sizes of the benchmarks. */
+static const unsigned int g_bench_sizes[] = { 1, 8, 16, KHELLO_RECORD_MAX };
+
+/** Names a benchmark after its record size. */
+static void khello_bench_desc(const unsigned int *p_size, char *p_desc)
+{
+	snprintf(p_desc, KUNIT_PARAM_DESC_SIZE, "%u bytes", *p_size);
+}
+
+KUNIT_ARRAY_PARAM(khello_bench, g_bench_sizes, khello_bench_desc);
+
+
+
+/** Times enqueue and dequeue of one record size, each with the channel mutex taken and released per record, as dev_write() and a one-record dev_read_iter() do.
+ *  Enqueue into a full ring is timed separately since it also drops a record.
+ */
+static void khello_bench_ring(struct kunit *p_test)
+{
+	const unsigned int size = *(const unsigned int*)p_test->param_value;
+	struct khello_chan *chan = khello_test_chan(p_test, KHELLO_BENCH_RECORDS);
+	unsigned char data[KHELLO_RECORD_MAX], out[KHELLO_RECORD_MAX];
+	struct khello_record *rec;
+	u64 start, enq = 0, deq = 0, full = 0, ops = (u64)KHELLO_BENCH_ROUNDS * KHELLO_BENCH_RECORDS, deq_ns;
+	unsigned int round, i;
+
+	memset(data, 'b', sizeof(data));
+	for(round = 0; round < KHELLO_BENCH_ROUNDS; ++round) {
+		start = ktime_get_ns();
+		for(i = 0; i < KHELLO_BENCH_RECORDS; ++i) {
+			mutex_lock(&chan->mutex);
+			khello_enqueue(chan, data, size, KHELLO_CLOCK_MONOTONIC, start);
+			mutex_unlock(&chan->mutex);
+		}
+		enq += ktime_get_ns() - start;
+
+		/* The ring is full: each write now replaces the oldest record. */
+		start = ktime_get_ns();
+		for(i = 0; i < KHELLO_BENCH_RECORDS; ++i) {
+			mutex_lock(&chan->mutex);
+			khello_enqueue(chan, data, size, KHELLO_CLOCK_MONOTONIC, start);
+			mutex_unlock(&chan->mutex);
+		}
+		full += ktime_get_ns() - start;
+
+		start = deq_ns = ktime_get_ns();
+		for(i = 0; i < KHELLO_BENCH_RECORDS; ++i) {
+			mutex_lock(&chan->mutex);
+			rec = &chan->ring[chan->tail & chan->ring_mask];
+			memcpy(out, rec->data, rec->len);
+			khello_dequeue(chan, deq_ns);
+			mutex_unlock(&chan->mutex);
+		}
+		deq += ktime_get_ns() - start;
+		cond_resched();
+	}
+
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->records_out, ops);
+	KUNIT_EXPECT_EQ(p_test, chan->stats_page->drops, ops);
+	KUNIT_EXPECT_EQ(p_test, out[size - 1], (unsigned char)'b');
+	kunit_info(p_test, "%u bytes: enqueue %llu ns, dequeue %llu ns, enqueue into a full ring %llu ns per record\n",
+		size, div64_u64(enq, ops), div64_u64(deq, ops), div64_u64(full, ops));
+}
+
+
+
+static struct kunit_case g_ring_cases[] = {
+	KUNIT_CASE(khello_test_enqueue_dequeue),
+	KUNIT_CASE(khello_test_wraparound),
+	KUNIT_CASE(khello_test_lossy),
+	KUNIT_CASE(khello_test_batch),
+	KUNIT_CASE(khello_test_producers),
+	KUNIT_CASE(khello_test_producers_consumer),
+	KUNIT_CASE(khello_test_ring_ready),
+	{}
+};
+
+static struct kunit_case g_bench_cases[] = {
+	KUNIT_CASE_PARAM(khello_bench_ring, khello_bench_gen_params),
+	{}
+};
+
+static struct kunit_suite g_ring_suite = {
+	.name = "khello_ring",
+	.init = khello_test_init,
+	.exit = khello_test_exit,
+	.test_cases = g_ring_cases,
+};
+
+static struct kunit_suite g_bench_suite = {
+	.name = "khello_ring_bench",
+	.init = khello_test_init,
+	.exit = khello_test_exit,
+	.test_cases = g_bench_cases,
+};
+
+kunit_test_suites(&g_ring_suite, &g_bench_suite);
@@ -0,0 +1,262 @@
+/** @file khemu.c
+ * Reference run of the shared ring protocol without the khello2 kernel module.
+ *
+ * Sets up the device mapping in a memfd with khl_emu_create(), eventfds standing in for KHELLO_IOC_RING_WAIT and KHELLO_IOC_RING_NOTIFY, forks,
+ * and passes records from the parent to the child with the same libkhello ring code that runs over a device. The consumer checks the length,
+ * sequence number and every payload byte of each record, so a run is a correctness oracle for the protocol, and its rate is an upper bound
+ * for the module's dev_mmap path: same layout and protocol, with no driver involved. Give a device to run the same test over the module for comparison.
+ *
+ * Usage:
+ * Pass 1000000 records of 32 bytes through the emulated ring: "./khemu"
+ * Pass 5000000 records of 8 bytes: "./khemu -n 5000000 -s 8"
+ * Run the same test over the ring of /dev/khello: "./khemu -d /dev/khello"
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../libkhello/libkhello.h"
+
+
+#define MIN_SIZE 8 /**< Records carry a 64-bit sequence number. */
+
+
+/** Counters of one side of the ring. */
+struct counters {
+	unsigned long long records; /**< Records produced or consumed. */
+	unsigned long long bytes; /**< Payload bytes produced or consumed. */
+	unsigned long long doorbells; /**< Doorbells rung. */
+	unsigned long long waits; /**< Sleeps taken. */
+	unsigned long long disorder; /**< Records not following the previous one, consumer only. */
+	unsigned long long corrupt; /**< Records with a wrong length or payload, consumer only. */
+	unsigned long long expect; /**< Sequence number of the next record, consumer only. */
+	int size; /**< Expected payload size, consumer only. */
+};
+
+
+/** Writes records to the ring. Byte i of record seq is (seq + i) & 0xff after the sequence number.
+ *  @param p_chan The channel, with the ring mapped.
+ *  @param p_count Number of records.
+ *  @param p_size Payload size of each record.
+ *  @param p_cnt Returns the counters.
+ *  @return 0 if OK. Else -1.
+ */
+static int produce(struct khl_channel *const p_chan, const long p_count, const int p_size, struct counters *const p_cnt);
+
+/** Reads records from the ring.
+ *  @param p_chan The channel, with the ring mapped.
+ *  @param p_count Number of records.
+ *  @param p_cnt Returns the counters. size must be set.
+ *  @return 0 if OK. Else -1.
+ */
+static int consume(struct khl_channel *const p_chan, const long p_count, struct counters *const p_cnt);
+
+/** Checks a record read from the ring against what the producer wrote. A khl_ring_fn.
+ *  @param p_arg The counters.
+ *  @param p_data The payload.
+ *  @param p_len Payload length.
+ */
+static void check_record(void *p_arg, const unsigned char *p_data, __u32 p_len);
+
+/** Prints the rate of one side. */
+static void report(const char *const p_side, const struct counters *const p_cnt, const double p_secs);
+
+/** Returns CLOCK_MONOTONIC in seconds. */
+static double now_secs();
+
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	const char *device = NULL;
+	int opt, opened = 0, size = 32, status, result = 1;
+	long count = 1000000;
+	double start;
+	struct khl_channel chan;
+	struct counters cnt;
+	pid_t pid;
+
+	while((opt = getopt(argc, argv, "n:s:d:")) != -1) {
+		switch(opt) {
+			case 'n':
+				if((count = atol(optarg)) < 1)
+					count = 1;
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			default:
+				printf("Usage: khemu [-n count] [-s size] [-d device]\n");
+				return 0;
+		}
+	}
+	if(size < MIN_SIZE)
+		size = MIN_SIZE;
+	if(size > KHELLO_RING_DATA_MAX)
+		size = KHELLO_RING_DATA_MAX;
+
+	if(device != NULL) {
+		if(khl_open(&chan, device, O_RDWR) == -1) {
+			fprintf(stderr, "%s: ", device);
+			process_errnum(errno);
+			goto do_exit;
+		}
+	} else if(khl_emu_create(&chan) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	opened = 1;
+	if(khl_ring_map(&chan) == -1) {
+		if(errno == ENOTSUP)
+			printf("The module has no shared ring or a different layout. Rebuild with its khello.h.\n");
+		else
+			process_errnum(errno);
+		goto do_exit;
+	}
+	printf("%s ring, %ld records of %d bytes\n", (device != NULL) ? device : "emulated", count, size);
+	fflush(stdout);
+
+	/* The child consumes, the parent produces. */
+	if((pid = fork()) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	memset(&cnt, 0, sizeof(cnt));
+	cnt.size = size;
+	start = now_secs();
+	if(pid == 0) {
+		result = consume(&chan, count, &cnt);
+		cnt.doorbells = chan.doorbells;
+		cnt.waits = chan.waits;
+		if(result == 0)
+			report("consumer", &cnt, now_secs() - start);
+		fflush(stdout);
+		_exit(((result == 0) && (cnt.disorder == 0) && (cnt.corrupt == 0)) ? 0 : 1);
+	}
+	result = produce(&chan, count, size, &cnt);
+	cnt.doorbells = chan.doorbells;
+	cnt.waits = chan.waits;
+	if(result == 0)
+		report("producer", &cnt, now_secs() - start);
+	fflush(stdout);
+	if(waitpid(pid, &status, 0) == -1)
+		result = -1;
+	else if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+		result = -1;
+	result = (result == 0) ? 0 : 1;
+
+do_exit:
+	if(opened)
+		khl_close(&chan);
+	return result;
+}
+
+
+
+static int produce(struct khl_channel *const p_chan, const long p_count, const int p_size, struct counters *const p_cnt)
+{
+	unsigned char data[KHELLO_RING_DATA_MAX];
+	unsigned long long seq;
+	long i;
+	int j;
+
+	for(i = 0; i < p_count; ++i) {
+		seq = i;
+		memcpy(data, &seq, sizeof(seq));
+		for(j = sizeof(seq); j < p_size; ++j)
+			data[j] = seq + j;
+		if(khl_ring_send(p_chan, data, p_size) == -1) {
+			if(errno == EINTR) {
+				--i;
+				continue;
+			}
+			process_errnum(errno);
+			return -1;
+		}
+		++p_cnt->records;
+		p_cnt->bytes += p_size;
+	}
+	return 0;
+}
+
+
+
+static int consume(struct khl_channel *const p_chan, const long p_count, struct counters *const p_cnt)
+{
+	unsigned long long left;
+
+	while((left = p_count - p_cnt->records) > 0) {
+		if(khl_ring_recv(p_chan, check_record, p_cnt, (left < KHELLO_RING_SLOTS) ? left : KHELLO_RING_SLOTS) == -1) {
+			if(errno == EINTR)
+				continue;
+			process_errnum(errno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+
+static void check_record(void *p_arg, const unsigned char *p_data, __u32 p_len)
+{
+	struct counters *cnt = p_arg;
+	unsigned long long seq;
+	__u32 i;
+
+	++cnt->records;
+	cnt->bytes += p_len;
+	if(p_len != (__u32)cnt->size) {
+		++cnt->corrupt;
+		return;
+	}
+	memcpy(&seq, p_data, sizeof(seq));
+	if(seq != cnt->expect)
+		++cnt->disorder;
+	cnt->expect = seq + 1;
+	for(i = sizeof(seq); i < p_len; ++i) {
+		if(p_data[i] != (unsigned char)(seq + i)) {
+			++cnt->corrupt;
+			break;
+		}
+	}
+}
+
+
+
+static void report(const char *const p_side, const struct counters *const p_cnt, const double p_secs)
+{
+	printf("%s: %llu records in %.3f s, %.0f msgs/s, %.1f MB/s, %llu doorbells, %llu waits", p_side, p_cnt->records, p_secs,
+		p_cnt->records / p_secs, p_cnt->bytes / p_secs / 1e6, p_cnt->doorbells, p_cnt->waits);
+	if(strcmp(p_side, "consumer") == 0)
+		printf(", %llu out of order, %llu corrupt", p_cnt->disorder, p_cnt->corrupt);
+	printf("\n");
+}
+
+
+
+static double now_secs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
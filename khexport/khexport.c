@@ -0,0 +1,494 @@
+/** @file khexport.c
+ * Metrics exporter for khello devices. Periodically samples the statistics of every khello device and writes them to a file in the Prometheus text exposition format.
+ *
+ * Each device's statistics page is mapped read-only once (see KHELLO_MMAP_STATS_PGOFF in khello.h), so a sample is a memory copy with no system call.
+ * Devices that cannot be mapped, for example because /dev is not accessible, are read from sysfs instead.
+ * The output file is written to a temporary file and renamed over the previous one, so a collector never sees a partial file.
+ *
+ * Usage:
+ * After loading the kernel module.
+ * Write /var/lib/node_exporter/khello.prom every second: "./khexport -o /var/lib/node_exporter/khello.prom"
+ * Same, running in the background: "./khexport -d -o /var/lib/node_exporter/khello.prom"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include "../khello2/khello.h"
+
+
+#define MAX_CHANNELS 65536 /**< Maximum number of devices exported. */
+#define MAX_RETRY 100 /**< Attempts to get a consistent snapshot of a statistics page. */
+
+
+/** Attributes read from sysfs when the statistics page cannot be mapped. The order matches g_attr_names. */
+enum attr_index {
+	A_RING_SIZE,
+	A_RECORDS_QUEUED,
+	A_BYTES_QUEUED,
+	A_HIGH_WATER,
+	A_DROPS,
+	A_BYTES_IN,
+	A_BYTES_OUT,
+	A_RECORDS_IN,
+	A_RECORDS_OUT,
+	A_READERS,
+	A_WRITERS,
+	A_MODE,
+	A_LATENCY_HIST,
+	NUM_ATTRS
+};
+
+static const char *const g_attr_names[NUM_ATTRS] = {
+	"ring_size", "records_queued", "bytes_queued", "high_water", "drops", "bytes_in", "bytes_out",
+	"records_in", "records_out", "readers", "writers", "mode", "latency_hist"
+};
+
+
+/** A sampled device. */
+struct channel {
+	char name[64]; /**< Device name. */
+	const volatile struct khello_stats_page *page; /**< Mapped statistics page, or NULL to use sysfs. */
+	int fd[NUM_ATTRS]; /**< Open sysfs attribute files when page is NULL. */
+	struct khello_stats_page snap; /**< Latest consistent sample. */
+	int valid; /**< 1 once snap holds a consistent sample. Channels without one are not exported. */
+};
+
+
+static struct channel *g_channels = NULL; /**< Sampled devices. */
+static int g_num_channels = 0; /**< Number of entries in g_channels. */
+static int g_max_channels = 0; /**< Allocated entries in g_channels. Grown by scan_channels() as devices appear. */
+static long g_page_size; /**< System page size. */
+static char *g_out = NULL; /**< Output buffer. */
+static size_t g_out_size = 0; /**< Allocated size of g_out. */
+static size_t g_out_len = 0; /**< Bytes used in g_out. */
+static volatile sig_atomic_t g_stop = 0; /**< Set by the signal handler to stop the daemon. */
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @param p_path Returns the output file.
+ *  @param p_interval Returns the sampling interval in milliseconds.
+ *  @param p_rescan Returns the number of intervals between scans for new devices.
+ *  @param p_daemon Returns 1 if the program should run in the background.
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[], const char **p_path, long *p_interval, long *p_rescan, int *p_daemon);
+
+/** Finds all devices under KHELLO_SYSFS_DIR and maps their statistics pages. Releases previously found devices.
+ *  @return Number of devices found, or -1 on error.
+ */
+static int scan_channels();
+
+/** Releases the mappings and files of all devices. */
+static void close_channels();
+
+/** Maps the statistics page of a device, or opens its sysfs attributes if that fails.
+ *  @param p_chan The device, with its name set.
+ *  @return 0 if OK. Else -1.
+ */
+static int open_channel(struct channel *const p_chan);
+
+/** Takes a consistent copy of a mapped statistics page. snap is only replaced by a consistent copy, so it keeps the last good one otherwise.
+ *  @param p_chan The device.
+ *  @return 0 if OK. -1 if no consistent copy could be taken.
+ */
+static int sample_page(struct channel *const p_chan);
+
+/** Reads the statistics of a device from sysfs.
+ *  @param p_chan The device.
+ *  @return 0 if OK. -1 if an attribute could not be read.
+ */
+static int sample_sysfs(struct channel *const p_chan);
+
+/** Appends formatted text to g_out, growing it as needed. */
+static void out_printf(const char *p_fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/** Appends one metric family of all devices to g_out.
+ *  @param p_name Metric name.
+ *  @param p_type Metric type, "counter" or "gauge".
+ *  @param p_help Metric description.
+ *  @param p_offset Offset of the __u64 or __u32 field in struct khello_stats_page.
+ *  @param p_is_u32 1 if the field is a __u32.
+ */
+static void write_family(const char *p_name, const char *p_type, const char *p_help, const size_t p_offset, const int p_is_u32);
+
+/** Writes the samples of all devices to a temporary file and renames it to p_path.
+ *  @param p_path Output file.
+ *  @return 0 if OK. Else -1.
+ */
+static int write_snapshot(const char *p_path);
+
+/** Stops the main loop on SIGTERM or SIGINT. */
+static void handle_signal(int p_sig);
+
+/** Process the value set in erno.
+ *  @param The errno itself.
+ */
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	const char *path;
+	long interval, rescan, i;
+	int daemonize, c;
+	struct timespec next;
+	struct sigaction action;
+
+	if(check_args(argc, argv, &path, &interval, &rescan, &daemonize) == -1) {
+		printf("Usage: khexport [-o file] [-i interval_ms] [-r rescan_intervals] [-d]\n");
+		return 0;
+	}
+	if(daemonize && (daemon(1, 0) == -1)) {
+		process_errnum(errno);
+		return 0;
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	g_page_size = sysconf(_SC_PAGE_SIZE);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for(i = 0; !g_stop; ++i) {
+		if((i % rescan) == 0)
+			scan_channels();
+		for(c = 0; c < g_num_channels; ++c) {
+			/* A page updated too often to copy keeps its last good snapshot, or is left out until it has one. */
+			if(g_channels[c].page != NULL)
+				sample_page(&g_channels[c]);
+			else if(sample_sysfs(&g_channels[c]) == -1)
+				i = -1; /* A device went away. Scan again at the next interval. */
+		}
+		write_snapshot(path);
+
+		/* Sleep until the next interval boundary so sampling does not drift. */
+		next.tv_sec += interval / 1000;
+		next.tv_nsec += (interval % 1000) * 1000000;
+		if(next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			++next.tv_sec;
+		}
+		while(!g_stop && (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR))
+			;
+	}
+
+	close_channels();
+	free(g_channels);
+	free(g_out);
+	return 0;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[], const char **p_path, long *p_interval, long *p_rescan, int *p_daemon)
+{
+	int c;
+
+	*p_path = "khello.prom";
+	*p_interval = 1000;
+	*p_rescan = 10;
+	*p_daemon = 0;
+	while((c = getopt(p_num, p_args, "o:i:r:d")) != -1) {
+		switch(c) {
+			case 'o':
+				*p_path = optarg;
+				break;
+			case 'i':
+				if((*p_interval = atol(optarg)) < 10)
+					return -1;
+				break;
+			case 'r':
+				if((*p_rescan = atol(optarg)) < 1)
+					return -1;
+				break;
+			case 'd':
+				*p_daemon = 1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+
+static int scan_channels()
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct channel *chan, *grown;
+
+	close_channels();
+	if((dir = opendir(KHELLO_SYSFS_DIR)) == NULL) {
+		process_errnum(errno);
+		return -1;
+	}
+	while(((entry = readdir(dir)) != NULL) && (g_num_channels < MAX_CHANNELS)) {
+		if(entry->d_name[0] == '.')
+			continue;
+		if(g_num_channels == g_max_channels) {
+			if((grown = realloc(g_channels, (g_max_channels * 2 + 16) * sizeof(struct channel))) == NULL) {
+				process_errnum(ENOMEM);
+				break;
+			}
+			g_channels = grown;
+			g_max_channels = g_max_channels * 2 + 16;
+		}
+		chan = &g_channels[g_num_channels];
+		memset(chan, 0, sizeof(struct channel));
+		snprintf(chan->name, sizeof(chan->name), "%.63s", entry->d_name);
+		if(open_channel(chan) == 0)
+			++g_num_channels;
+	}
+	closedir(dir);
+	return g_num_channels;
+}
+
+
+
+static void close_channels()
+{
+	int c, i;
+
+	for(c = 0; c < g_num_channels; ++c) {
+		if(g_channels[c].page != NULL)
+			munmap((void*)g_channels[c].page, g_page_size);
+		else
+			for(i = 0; i < NUM_ATTRS; ++i)
+				close(g_channels[c].fd[i]);
+	}
+	g_num_channels = 0;
+}
+
+
+
+static int open_channel(struct channel *const p_chan)
+{
+	char path[512];
+	void *page;
+	int fd, i;
+
+	/* The mapping stays valid after the device is closed, so the exporter is not counted as a reader. */
+	snprintf(path, sizeof(path), "/dev/%s", p_chan->name);
+	if((fd = open(path, O_RDONLY)) != -1) {
+		page = mmap(NULL, g_page_size, PROT_READ, MAP_SHARED, fd, KHELLO_MMAP_STATS_PGOFF * g_page_size);
+		close(fd);
+		if(page != MAP_FAILED) {
+			p_chan->page = page;
+			return 0;
+		}
+	}
+
+	for(i = 0; i < NUM_ATTRS; ++i) {
+		snprintf(path, sizeof(path), "%s/%s/%s", KHELLO_SYSFS_DIR, p_chan->name, g_attr_names[i]);
+		if((p_chan->fd[i] = open(path, O_RDONLY)) == -1)
+			break;
+	}
+	if(i < NUM_ATTRS) { /* Not a khello device, or from an older module. */
+		while(--i >= 0)
+			close(p_chan->fd[i]);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static int sample_page(struct channel *const p_chan)
+{
+	struct khello_stats_page copy;
+	__u32 seq;
+	int i;
+
+	for(i = 0; i < MAX_RETRY; ++i) {
+		seq = __atomic_load_n(&p_chan->page->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue;
+		memcpy(&copy, (const void*)p_chan->page, sizeof(struct khello_stats_page));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(seq == p_chan->page->seq) {
+			p_chan->snap = copy;
+			p_chan->valid = 1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+
+static int sample_sysfs(struct channel *const p_chan)
+{
+	struct khello_stats_page *snap = &p_chan->snap;
+	unsigned long long val;
+	char buf[1024], *pos, *end;
+	ssize_t count;
+	int i, b;
+
+	for(i = 0; i < NUM_ATTRS; ++i) {
+		if((count = pread(p_chan->fd[i], buf, sizeof(buf) - 1, 0)) <= 0)
+			return -1;
+		buf[count] = 0;
+		val = strtoull(buf, NULL, 0);
+		switch(i) {
+			case A_RING_SIZE: snap->ring_size = val; break;
+			case A_RECORDS_QUEUED: snap->records_queued = val; break;
+			case A_BYTES_QUEUED: snap->bytes_queued = val; break;
+			case A_HIGH_WATER: snap->high_water = val; break;
+			case A_DROPS: snap->drops = val; break;
+			case A_BYTES_IN: snap->bytes_in = val; break;
+			case A_BYTES_OUT: snap->bytes_out = val; break;
+			case A_RECORDS_IN: snap->records_in = val; break;
+			case A_RECORDS_OUT: snap->records_out = val; break;
+			case A_READERS: snap->readers = val; break;
+			case A_WRITERS: snap->writers = val; break;
+			case A_MODE: snap->mode = val; break;
+			case A_LATENCY_HIST:
+				pos = buf;
+				for(b = 0; b < KHELLO_LAT_BUCKETS; ++b) {
+					snap->latency_hist[b] = strtoull(pos, &end, 10);
+					if(end == pos)
+						break;
+					pos = end;
+				}
+				break;
+		}
+	}
+	p_chan->valid = 1;
+	return 0;
+}
+
+
+
+static void out_printf(const char *p_fmt, ...)
+{
+	va_list args;
+	char *grown;
+	int len;
+
+	for(;;) {
+		va_start(args, p_fmt);
+		len = vsnprintf(g_out + g_out_len, g_out_size - g_out_len, p_fmt, args);
+		va_end(args);
+		if((len >= 0) && (g_out_len + len < g_out_size)) {
+			g_out_len += len;
+			return;
+		}
+		if((grown = realloc(g_out, g_out_size * 2 + 65536)) == NULL)
+			return;
+		g_out = grown;
+		g_out_size = g_out_size * 2 + 65536;
+	}
+}
+
+
+
+static void write_family(const char *p_name, const char *p_type, const char *p_help, const size_t p_offset, const int p_is_u32)
+{
+	const char *field;
+	unsigned long long val;
+	int c;
+
+	out_printf("# HELP %s %s\n# TYPE %s %s\n", p_name, p_help, p_name, p_type);
+	for(c = 0; c < g_num_channels; ++c) {
+		if(!g_channels[c].valid)
+			continue;
+		field = (const char*)&g_channels[c].snap + p_offset;
+		val = p_is_u32 ? *(const __u32*)field : *(const __u64*)field;
+		out_printf("%s{device=\"%s\"} %llu\n", p_name, g_channels[c].name, val);
+	}
+}
+
+
+
+static int write_snapshot(const char *p_path)
+{
+	char tmp[4096];
+	unsigned long long count;
+	double sum;
+	int c, b, fd;
+
+	g_out_len = 0;
+	write_family("khello_ring_size", "gauge", "Number of records the device can hold.", offsetof(struct khello_stats_page, ring_size), 1);
+	write_family("khello_records_queued", "gauge", "Records written but not yet read.", offsetof(struct khello_stats_page, records_queued), 0);
+	write_family("khello_bytes_queued", "gauge", "Bytes written but not yet read.", offsetof(struct khello_stats_page, bytes_queued), 0);
+	write_family("khello_high_water_bytes", "gauge", "Highest number of bytes ever queued.", offsetof(struct khello_stats_page, high_water), 0);
+	write_family("khello_drops_total", "counter", "Records replaced before they were read.", offsetof(struct khello_stats_page, drops), 0);
+	write_family("khello_bytes_in_total", "counter", "Bytes written to the device.", offsetof(struct khello_stats_page, bytes_in), 0);
+	write_family("khello_bytes_out_total", "counter", "Bytes read from the device.", offsetof(struct khello_stats_page, bytes_out), 0);
+	write_family("khello_records_in_total", "counter", "Records written to the device.", offsetof(struct khello_stats_page, records_in), 0);
+	write_family("khello_records_out_total", "counter", "Records read from the device.", offsetof(struct khello_stats_page, records_out), 0);
+	write_family("khello_readers", "gauge", "Open file handles with read access.", offsetof(struct khello_stats_page, readers), 1);
+	write_family("khello_writers", "gauge", "Open file handles with write access.", offsetof(struct khello_stats_page, writers), 1);
+	write_family("khello_mode", "gauge", "KHELLO_MODE_* flags of the device.", offsetof(struct khello_stats_page, mode), 1);
+
+	/* Bucket b of the device histogram holds latencies in [2^b, 2^(b+1)) ns. The device keeps no total, so the sum is approximated
+	 * with the midpoint of each bucket, 1.5 * 2^b ns, the last bucket included. */
+	out_printf("# HELP khello_queue_latency_seconds Time records spent queued in the device. The sum is estimated from bucket midpoints.\n# TYPE khello_queue_latency_seconds histogram\n");
+	for(c = 0; c < g_num_channels; ++c) {
+		if(!g_channels[c].valid)
+			continue;
+		count = 0;
+		sum = 0;
+		for(b = 0; b < KHELLO_LAT_BUCKETS; ++b) {
+			count += g_channels[c].snap.latency_hist[b];
+			sum += g_channels[c].snap.latency_hist[b] * (1.5 * (1ULL << b) / 1e9);
+			if(b < KHELLO_LAT_BUCKETS - 1)
+				out_printf("khello_queue_latency_seconds_bucket{device=\"%s\",le=\"%.9g\"} %llu\n", g_channels[c].name, (2ULL << b) / 1e9, count);
+		}
+		out_printf("khello_queue_latency_seconds_bucket{device=\"%s\",le=\"+Inf\"} %llu\n", g_channels[c].name, count);
+		out_printf("khello_queue_latency_seconds_sum{device=\"%s\"} %.9g\n", g_channels[c].name, sum);
+		out_printf("khello_queue_latency_seconds_count{device=\"%s\"} %llu\n", g_channels[c].name, count);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", p_path);
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		process_errnum(errno);
+		return -1;
+	}
+	if(write(fd, g_out, g_out_len) != (ssize_t)g_out_len) {
+		process_errnum(errno);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if(rename(tmp, p_path) == -1) {
+		process_errnum(errno);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static void handle_signal(int p_sig)
+{
+	g_stop = 1;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	printf("%s\n", strerror(p_errnum));
+}
@@ -0,0 +1,564 @@
+/** @file khping.c
+ * Two-process ping-pong latency benchmark for khello devices.
+ *
+ * The benchmark forks a partner process. The parent sends a message to device A, the partner reads it and sends it back on device B,
+ * and the parent measures each round trip with clock_gettime(CLOCK_MONOTONIC_RAW). The transports are measured in turn:
+ * rw     One write() and one read() per message.
+ * batch  A burst of messages queued with one KHELLO_IOC_SEND_BATCH ioctl and drained with read().
+ * mmap   The message goes through the shared rings of devices A and B (struct khello_ring), without system calls. Both sides spin.
+ *
+ * Usage:
+ * After loading the kernel module with at least 2 channels: "insmod khello.ko channels=2"
+ * Run all transports: "./khping"
+ * One million 16-byte round trips over read/write with both processes pinned: "./khping -m rw -s 16 -n 1000000 -c 2,3"
+ * Best-case baseline with the real-time profile of say_hello/rt.h, which also busy-polls: "./khping --rt"
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include "../khello2/khello.h"
+#include "../say_hello/rt.h"
+
+
+#define DEVICE "/dev/khello" /**< The character device. Used as device A. */
+#define DEVICE_B "/dev/khello1" /**< Default device B. */
+#define TIMEOUT_MS 1000 /**< A message not returned within this time is taken as lost. */
+
+#define MODE_RW 0 /**< read() and write(). */
+#define MODE_BATCH 1 /**< KHELLO_IOC_SEND_BATCH and read(). */
+#define MODE_MMAP 2 /**< Shared rings. */
+#define NUM_MODES 3
+
+
+/** Options of a run. */
+struct options {
+	const char *dev_a; /**< Device carrying messages from the parent to the partner. */
+	const char *dev_b; /**< Device carrying messages back. */
+	int size; /**< Message size in bytes. */
+	int burst; /**< Messages per round trip in batch mode. */
+	long count; /**< Measured round trips. */
+	long warmup; /**< Round trips before measuring. */
+	int cpu[2]; /**< CPUs of the parent and the partner. -1 to leave unpinned. */
+	int spin; /**< Busy-poll the devices instead of waiting in poll(). */
+	int detail; /**< Print every non-empty histogram bucket. */
+	int rt; /**< Apply the real-time profile to both processes and busy-poll. */
+	int modes[NUM_MODES]; /**< Transports to run. */
+};
+
+
+static const char *const g_mode_names[NUM_MODES] = { "rw", "batch", "mmap" };
+static const struct option g_long_options[] = { { "rt", no_argument, NULL, 'r' }, { NULL, 0, NULL, 0 } }; /**< Options without a short form. */
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @param p_opt Returns the options.
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[], struct options *const p_opt);
+
+/** Runs one transport: forks the partner, measures the round trips and prints the distribution.
+ *  @param p_opt The options.
+ *  @param p_mode MODE_RW, MODE_BATCH or MODE_MMAP.
+ *  @return 0 if OK. Else -1.
+ */
+static int run(const struct options *const p_opt, const int p_mode);
+
+/** Sends one round trip worth of messages from one side.
+ *  @param p_fd The device to send to.
+ *  @param p_mode MODE_RW or MODE_BATCH.
+ *  @param p_msg The messages, back to back. MODE_RW sends only the first.
+ *  @param p_size Message size.
+ *  @param p_burst Number of messages.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+static int send_msgs(const int p_fd, const int p_mode, const unsigned char *const p_msg, const int p_size, const int p_burst);
+
+/** Reads an exact number of bytes from a device, waiting for them as needed.
+ *  @param p_fd The device, opened with O_NONBLOCK.
+ *  @param p_buf The buffer.
+ *  @param p_want Number of bytes to read. A multiple of the message size.
+ *  @param p_spin Busy-poll instead of waiting in poll().
+ *  @return 0 if OK. Else -1 with errno set. ETIMEDOUT means the messages did not arrive, usually because the ring overflowed.
+ */
+static int recv_msgs(const int p_fd, unsigned char *const p_buf, const size_t p_want, const int p_spin);
+
+/** Maps the shared ring of a device and empties it.
+ *  @param p_fd The device.
+ *  @param p_name Name of the device, for errors.
+ *  @return The ring, or NULL on error.
+ */
+static struct khello_ring *map_ring(const int p_fd, const char *const p_name);
+
+/** Sends a message through a shared ring. A ping-pong keeps at most one message in flight, so the ring is never full.
+ *  @param p_ring The ring.
+ *  @param p_msg The message.
+ *  @param p_size Message size.
+ */
+static void ring_send(struct khello_ring *const p_ring, const unsigned char *const p_msg, const int p_size);
+
+/** Waits for a message on a shared ring by spinning, and copies it out.
+ *  @param p_ring The ring.
+ *  @param p_buf The buffer.
+ *  @param p_size Size of p_buf.
+ *  @return 0 if OK. -1 on timeout.
+ */
+static int ring_recv(struct khello_ring *const p_ring, unsigned char *const p_buf, const int p_size);
+
+/** Returns the message size used by a transport.
+ *  @param p_opt The options.
+ *  @param p_mode MODE_RW, MODE_BATCH or MODE_MMAP.
+ */
+static int msg_size(const struct options *const p_opt, const int p_mode);
+
+/** Reads and discards anything queued on a device. */
+static void drain(const int p_fd);
+
+/** Pins the calling process to a CPU.
+ *  @param p_cpu The CPU. -1 does nothing.
+ */
+static void pin(const int p_cpu);
+
+/** Returns CLOCK_MONOTONIC_RAW in nanoseconds. */
+static unsigned long long now_ns();
+
+/** Prints the latency distribution of a run. */
+static void report(const struct options *const p_opt, const int p_mode, const struct rt_hist *const p_hist);
+
+/** Process the value set in erno.
+ *  @param The errno itself.
+ */
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	struct options opt;
+	int mode;
+
+	if(check_args(argc, argv, &opt) == -1) {
+		printf("Usage: khping [-a device] [-b device] [-m rw|batch|mmap|all] [-s size] [-k burst] [-n count] [-w warmup] [-c cpu,cpu] [-p] [-d] [--rt]\n");
+		return 0;
+	}
+	if(opt.rt)
+		rt_enter(opt.cpu[0], 0);
+	else
+		pin(opt.cpu[0]);
+	for(mode = 0; mode < NUM_MODES; ++mode) {
+		if(opt.modes[mode] && (run(&opt, mode) == -1))
+			return 1;
+	}
+	return 0;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[], struct options *const p_opt)
+{
+	int c, mode;
+
+	memset(p_opt, 0, sizeof(struct options));
+	p_opt->dev_a = DEVICE;
+	p_opt->dev_b = DEVICE_B;
+	p_opt->size = KHELLO_RECORD_MAX;
+	p_opt->burst = 8;
+	p_opt->count = 1000000;
+	p_opt->warmup = 10000;
+	p_opt->cpu[0] = p_opt->cpu[1] = -1;
+	while((c = getopt_long(p_num, p_args, "a:b:m:s:k:n:w:c:pd", g_long_options, NULL)) != -1) {
+		switch(c) {
+			case 'a':
+				p_opt->dev_a = optarg;
+				break;
+			case 'b':
+				p_opt->dev_b = optarg;
+				break;
+			case 'm':
+				for(mode = 0; mode < NUM_MODES; ++mode) {
+					if((strcmp(optarg, g_mode_names[mode]) == 0) || (strcmp(optarg, "all") == 0))
+						p_opt->modes[mode] = 1;
+				}
+				break;
+			case 's':
+				if(((p_opt->size = atoi(optarg)) < 1) || (p_opt->size > KHELLO_RING_DATA_MAX))
+					return -1;
+				break;
+			case 'k':
+				if(((p_opt->burst = atoi(optarg)) < 1) || (p_opt->burst > KHELLO_BATCH_MAX))
+					return -1;
+				break;
+			case 'n':
+				if((p_opt->count = atol(optarg)) < 1)
+					return -1;
+				break;
+			case 'w':
+				if((p_opt->warmup = atol(optarg)) < 0)
+					return -1;
+				break;
+			case 'c':
+				if(sscanf(optarg, "%d,%d", &p_opt->cpu[0], &p_opt->cpu[1]) != 2)
+					return -1;
+				break;
+			case 'p':
+				p_opt->spin = 1;
+				break;
+			case 'd':
+				p_opt->detail = 1;
+				break;
+			case 'r':
+				p_opt->rt = 1;
+				p_opt->spin = 1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	for(mode = 0; (mode < NUM_MODES) && !p_opt->modes[mode]; ++mode);
+	if(mode == NUM_MODES) { /* No -m means all transports. */
+		for(mode = 0; mode < NUM_MODES; ++mode)
+			p_opt->modes[mode] = 1;
+	}
+	return 0;
+}
+
+
+
+static int run(const struct options *const p_opt, const int p_mode)
+{
+	int fd_a = -1, fd_b = -1, status, result = -1, size = msg_size(p_opt, p_mode), burst = 1;
+	long i, rounds = p_opt->warmup + p_opt->count;
+	unsigned long long start;
+	unsigned char *msg = NULL, *buf = NULL;
+	struct khello_ring *ring_a = NULL, *ring_b = NULL;
+	size_t map_size = sysconf(_SC_PAGE_SIZE);
+	struct rt_hist *hist = NULL;
+	pid_t pid = -1;
+
+	if(p_mode == MODE_BATCH)
+		burst = p_opt->burst;
+	if(((msg = malloc(size * burst)) == NULL) || ((buf = malloc(size * burst)) == NULL) || ((hist = calloc(1, sizeof(struct rt_hist))) == NULL)) {
+		process_errnum(ENOMEM);
+		goto do_exit;
+	}
+	memset(msg, 'p', size * burst);
+	if(p_opt->rt)
+		rt_prefault(buf, size * burst);
+
+	if((fd_a = open(p_opt->dev_a, O_RDWR | O_NONBLOCK)) == -1) {
+		fprintf(stderr, "%s: ", p_opt->dev_a);
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if((fd_b = open(p_opt->dev_b, O_RDWR | O_NONBLOCK)) == -1) {
+		fprintf(stderr, "%s: ", p_opt->dev_b);
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if(p_mode == MODE_MMAP) {
+		if(((ring_a = map_ring(fd_a, p_opt->dev_a)) == NULL) || ((ring_b = map_ring(fd_b, p_opt->dev_b)) == NULL))
+			goto do_exit;
+	} else {
+		drain(fd_a);
+		drain(fd_b);
+		if(p_mode == MODE_BATCH) { /* Probe for the ioctl so older modules are skipped rather than timed out. */
+			struct khello_batch batch = { 0, 0, 0 };
+			if(ioctl(fd_a, KHELLO_IOC_SEND_BATCH, &batch) == -1) {
+				printf("%-6s skipped: %s\n", g_mode_names[p_mode], strerror(errno));
+				result = 0;
+				goto do_exit;
+			}
+		}
+	}
+
+	if((pid = fork()) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if(pid == 0) { /* Partner: return every message on the other channel. */
+		/* Memory locks are not inherited, and the partner needs a CPU of its own. */
+		if(p_opt->rt)
+			rt_enter(p_opt->cpu[1], 1);
+		else
+			pin(p_opt->cpu[1]);
+		for(i = 0; i < rounds; ++i) {
+			if(p_mode == MODE_MMAP) {
+				if(ring_recv(ring_a, buf, size) == -1)
+					_exit(1);
+				ring_send(ring_b, buf, size);
+			} else if((recv_msgs(fd_a, buf, size * burst, p_opt->spin) == -1) || (send_msgs(fd_b, p_mode, buf, size, burst) == -1))
+				_exit(1);
+		}
+		_exit(0);
+	}
+
+	for(i = 0; i < rounds; ++i) {
+		start = now_ns();
+		if(p_mode == MODE_MMAP) {
+			ring_send(ring_a, msg, size);
+			if(ring_recv(ring_b, buf, size) == -1) {
+				errno = ETIMEDOUT;
+				break;
+			}
+		} else if((send_msgs(fd_a, p_mode, msg, size, burst) == -1) || (recv_msgs(fd_b, buf, size * burst, p_opt->spin) == -1))
+			break;
+		if(i >= p_opt->warmup)
+			rt_hist_add(hist, now_ns() - start);
+	}
+	if(i < rounds) {
+		fprintf(stderr, "%s: round trip %ld failed: %s\n", g_mode_names[p_mode], i, strerror(errno));
+		kill(pid, SIGTERM);
+	}
+	waitpid(pid, &status, 0);
+	if((i == rounds) && WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+		report(p_opt, p_mode, hist);
+		result = 0;
+	}
+
+do_exit:
+	if(ring_a != NULL)
+		munmap(ring_a, map_size);
+	if(ring_b != NULL)
+		munmap(ring_b, map_size);
+	if(fd_b != -1)
+		close(fd_b);
+	if(fd_a != -1)
+		close(fd_a);
+	free(msg);
+	free(buf);
+	free(hist);
+	return result;
+}
+
+
+
+static int send_msgs(const int p_fd, const int p_mode, const unsigned char *const p_msg, const int p_size, const int p_burst)
+{
+	struct khello_msg msgs[KHELLO_BATCH_MAX];
+	struct khello_batch batch;
+	int i;
+
+	if(p_mode == MODE_RW) {
+		if(write(p_fd, p_msg, p_size) != p_size)
+			return -1;
+		KHELLO_PROBE2(send, p_fd, p_size);
+		return 0;
+	}
+	for(i = 0; i < p_burst; ++i) {
+		msgs[i].addr = (uintptr_t)(p_msg + i * p_size);
+		msgs[i].len = p_size;
+		msgs[i].reserved = 0;
+	}
+	batch.msgs = (uintptr_t)msgs;
+	batch.count = p_burst;
+	batch.done = 0;
+	KHELLO_PROBE2(batch_start, p_fd, p_burst);
+	if(ioctl(p_fd, KHELLO_IOC_SEND_BATCH, &batch) != p_burst)
+		return -1;
+	KHELLO_PROBE2(batch_end, p_fd, p_burst);
+	return 0;
+}
+
+
+
+static int recv_msgs(const int p_fd, unsigned char *const p_buf, const size_t p_want, const int p_spin)
+{
+	struct pollfd pfd;
+	size_t got = 0;
+	ssize_t count;
+	unsigned long long deadline = 0;
+	unsigned int spins = 0;
+	int ready;
+
+	pfd.fd = p_fd;
+	pfd.events = POLLIN;
+	while(got < p_want) {
+		if((count = read(p_fd, p_buf + got, p_want - got)) > 0) {
+			KHELLO_PROBE2(receive, p_fd, count);
+			got += count;
+			continue;
+		}
+		if((count == -1) && (errno != EAGAIN))
+			return -1;
+		if(p_spin) {
+			/* Check the clock only now and then so spinning stays cheap, and let the partner run if both sides share a CPU. */
+			if((++spins & 0x3ff) == 0)
+				sched_yield();
+			if((spins & 0xffff) == 0) {
+				if(deadline == 0)
+					deadline = now_ns() + TIMEOUT_MS * 1000000ULL;
+				else if(now_ns() > deadline) {
+					errno = ETIMEDOUT;
+					return -1;
+				}
+			}
+			continue;
+		}
+		KHELLO_PROBE1(wait_start, p_fd);
+		ready = poll(&pfd, 1, TIMEOUT_MS);
+		KHELLO_PROBE2(wait_end, p_fd, ready);
+		if(ready == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if((ready == -1) && (errno != EINTR))
+			return -1;
+	}
+	return 0;
+}
+
+
+
+static struct khello_ring *map_ring(const int p_fd, const char *const p_name)
+{
+	struct khello_ring *ring;
+	size_t map_size = sysconf(_SC_PAGE_SIZE);
+
+	ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, p_fd, KHELLO_MMAP_RING_PGOFF * map_size);
+	if(ring == MAP_FAILED) {
+		fprintf(stderr, "%s: ", p_name);
+		process_errnum(errno);
+		return NULL;
+	}
+	if((ring->magic != KHELLO_RING_MAGIC) || (ring->slots != KHELLO_RING_SLOTS) || (ring->slot_size != sizeof(struct khello_ring_slot))) {
+		fprintf(stderr, "%s: no shared ring or a different layout\n", p_name);
+		munmap(ring, map_size);
+		return NULL;
+	}
+	/* Drop what an earlier client left. khping is the only user of the ring while it runs. */
+	ring->tail = ring->head;
+	ring->cons_wait = ring->prod_wait = 0;
+	return ring;
+}
+
+
+
+static void ring_send(struct khello_ring *const p_ring, const unsigned char *const p_msg, const int p_size)
+{
+	struct khello_ring_slot *slot = &p_ring->slot[p_ring->head & (KHELLO_RING_SLOTS - 1)];
+
+	memcpy(slot->data, p_msg, p_size);
+	slot->len = p_size;
+	__atomic_store_n(&p_ring->head, p_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+
+
+static int ring_recv(struct khello_ring *const p_ring, unsigned char *const p_buf, const int p_size)
+{
+	unsigned long long deadline = 0;
+	unsigned int spins = 0;
+	__u32 tail = p_ring->tail;
+	struct khello_ring_slot *slot;
+
+	while(__atomic_load_n(&p_ring->head, __ATOMIC_ACQUIRE) == tail) {
+		/* Check the clock only now and then, and let the partner run if both sides share a CPU. */
+		if((++spins & 0x3ff) == 0)
+			sched_yield();
+		if((spins & 0xffff) == 0) {
+			if(deadline == 0)
+				deadline = now_ns() + TIMEOUT_MS * 1000000ULL;
+			else if(now_ns() > deadline)
+				return -1;
+		}
+	}
+	slot = &p_ring->slot[tail & (KHELLO_RING_SLOTS - 1)];
+	memcpy(p_buf, slot->data, (slot->len < (__u32)p_size) ? slot->len : (__u32)p_size);
+	__atomic_store_n(&p_ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+
+static int msg_size(const struct options *const p_opt, const int p_mode)
+{
+	/* Records carry at most KHELLO_RECORD_MAX bytes, shared ring slots KHELLO_RING_DATA_MAX. */
+	if((p_mode != MODE_MMAP) && (p_opt->size > KHELLO_RECORD_MAX))
+		return KHELLO_RECORD_MAX;
+	return p_opt->size;
+}
+
+
+
+static void drain(const int p_fd)
+{
+	unsigned char buf[4096];
+
+	while(read(p_fd, buf, sizeof(buf)) > 0);
+}
+
+
+
+static void pin(const int p_cpu)
+{
+	cpu_set_t set;
+
+	if(p_cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(p_cpu, &set);
+	if(sched_setaffinity(0, sizeof(set), &set) == -1)
+		process_errnum(errno);
+}
+
+
+
+static unsigned long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+static void report(const struct options *const p_opt, const int p_mode, const struct rt_hist *const p_hist)
+{
+	static const double pcts[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+	unsigned long long seen = 0;
+	int i, size = msg_size(p_opt, p_mode);
+
+	printf("%-6s size %d x %d  round trips %llu  min %llu  mean %.0f", g_mode_names[p_mode], size, (p_mode == MODE_BATCH) ? p_opt->burst : 1,
+		p_hist->n, p_hist->min, p_hist->sum / p_hist->n);
+	for(i = 0; i < (int)(sizeof(pcts) / sizeof(pcts[0])); ++i)
+		printf("  p%g %llu", pcts[i] * 100, rt_hist_percentile(p_hist, pcts[i]));
+	printf("  max %llu ns\n", p_hist->max);
+	if(p_opt->rt)
+		printf("%-6s jitter  p99.99 - p50 %llu  max - min %llu ns\n", g_mode_names[p_mode],
+			rt_hist_percentile(p_hist, 0.9999) - rt_hist_percentile(p_hist, 0.5), p_hist->max - p_hist->min);
+	if(!p_opt->detail)
+		return;
+
+	/* Full distribution: bucket upper bound, count, cumulative percentage. */
+	for(i = 0; i < RT_HIST_BUCKETS; ++i) {
+		if(p_hist->count[i] == 0)
+			continue;
+		seen += p_hist->count[i];
+		printf("  <= %12llu ns %12llu %8.4f%%\n", rt_hist_value(i), p_hist->count[i], 100.0 * seen / p_hist->n);
+	}
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
@@ -0,0 +1,561 @@
+/** @file khrec.c
+ * Stream recorder for khello devices.
+ *
+ * Captures everything written to one channel into a series of files for later replay, rotating them by size or age. See khrec.h for the format.
+ * The recorder must not become the slowest consumer of the channel, so the data path avoids copies where it can:
+ * splice  device -> pipe -> file inside the kernel, without copying through user space. Used when the device supports splice.
+ * read    large non-blocking reads into one of two buffers while a writer thread writes out the other one, so disk stalls do not stop the reads.
+ * The default tries splice and falls back to read.
+ *
+ * Usage:
+ * After loading the kernel module.
+ * Record /dev/khello into khello.000000.khr, khello.000001.khr... of up to 256 MB each until Ctrl-C: "./khrec"
+ * Record /dev/khello1 into capture.*.khr, a new file every 60 s: "./khrec -d /dev/khello1 -o capture -t 60"
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <time.h>
+#include "../khello2/khello.h"
+#include "khrec.h"
+
+
+#define DEVICE "/dev/khello" /**< The character device. */
+#define PREFIX "khello" /**< Default prefix of the recording files. */
+#define MAX_MB 256 /**< Default size limit of a file in MB. */
+#define BUF_KB 1024 /**< Default size of the pipe or of each read buffer in KB. */
+#define READ_MIN (4 * 1024) /**< A read buffer is handed to the writer when less than this is left. */
+#define POLL_MS 100 /**< Longest wait for data, so signals are seen. */
+
+#define MODE_AUTO 0 /**< splice, falling back to read. */
+#define MODE_SPLICE 1 /**< splice only. */
+#define MODE_READ 2 /**< read and a writer thread. */
+
+
+/** Options of the run. */
+struct options {
+	const char *device; /**< Device to record. */
+	const char *prefix; /**< Prefix of the recording files. */
+	unsigned long long max_bytes; /**< Size after which a file is rotated. */
+	unsigned long long max_ns; /**< Age after which a file is rotated. 0 = no limit. */
+	size_t buf_size; /**< Size of the pipe or of each read buffer. */
+	int mode; /**< MODE_*. */
+};
+
+/** The recording file being written. */
+struct output {
+	int fd; /**< The file, -1 before the first one is opened. */
+	__u32 flags; /**< KHREC_F_* flags written to every file. */
+	unsigned int seq; /**< Sequence number of the next file. */
+	unsigned long long bytes; /**< Bytes written to the current file after its header. */
+	unsigned long long opened_ns; /**< When the current file was opened. */
+	unsigned long long total; /**< Bytes written to all files after their headers. */
+};
+
+/** Hand-over between the reader and the writer thread in read mode. */
+struct writer {
+	pthread_t id; /**< The writer thread. */
+	pthread_mutex_t lock; /**< Protects full, len, done and error. */
+	pthread_cond_t cond; /**< Signalled when a buffer is handed over in either direction. */
+	unsigned char *buf[2]; /**< The two buffers. */
+	size_t len[2]; /**< Bytes in each buffer. */
+	int full[2]; /**< 1 while a buffer belongs to the writer. */
+	int done; /**< Set by the reader when no more buffers come. */
+	int error; /**< errno of a failed write, else 0. */
+	unsigned long long stalls; /**< Times the reader had to wait for the writer. */
+	struct output *out; /**< Where to write. */
+};
+
+
+static struct options g_opt; /**< Options of the run. */
+static volatile sig_atomic_t g_stop = 0; /**< Set by the signal handler to end the recording. */
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[]);
+
+/** Records with splice until stopped.
+ *  @param p_fd The device.
+ *  @param p_out The output.
+ *  @return 0 if OK. 1 if the device does not support splice and nothing was recorded. Else -1.
+ */
+static int record_splice(const int p_fd, struct output *const p_out);
+
+/** Records with read() and a writer thread until stopped.
+ *  @param p_fd The device.
+ *  @param p_out The output.
+ *  @param p_stalls Receives the number of times the reader waited for the writer.
+ *  @return 0 if OK. Else -1.
+ */
+static int record_read(const int p_fd, struct output *const p_out, unsigned long long *const p_stalls);
+
+/** Writes buffers handed over by record_read().
+ *  @param p_arg The struct writer.
+ *  @return NULL.
+ */
+static void *writer_main(void *p_arg);
+
+/** Waits until the device has data or POLL_MS passed.
+ *  @param p_fd The device.
+ *  @return 0 if OK or interrupted. Else -1.
+ */
+static int wait_input(const int p_fd);
+
+/** Opens the first recording file, or the next one if the current file is due for rotation.
+ *  @param p_out The output.
+ *  @return 0 if OK. Else -1.
+ */
+static int rotate(struct output *const p_out);
+
+/** Writes a whole buffer to a file.
+ *  @param p_fd The file.
+ *  @param p_buf The buffer.
+ *  @param p_len Number of bytes.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+static int write_all(const int p_fd, const unsigned char *p_buf, size_t p_len);
+
+/** Reads the drops counter of a device from sysfs.
+ *  @return The counter, or 0 if it cannot be read.
+ */
+static unsigned long long read_drops(const char *const p_device);
+
+/** Returns the current time in ns.
+ *  @param p_clock The clock.
+ */
+static unsigned long long now_ns(const clockid_t p_clock);
+
+/** Stops the recording on SIGINT or SIGTERM. */
+static void handle_signal(int p_sig);
+
+/** Process the value set in erno.
+ *  @param The errno itself.
+ */
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	int fd = -1, result = 1, status = -1;
+	__u32 recv = KHELLO_RECV_HDR;
+	struct output out;
+	struct sigaction action;
+	unsigned long long start, elapsed, drops, stalls = 0;
+	const char *mode = "splice";
+
+	if(check_args(argc, argv) == -1) {
+		printf("Usage: khrec [-d device] [-o prefix] [-s max_mb] [-t max_s] [-m auto|splice|read] [-b buffer_kb]\n");
+		return 0;
+	}
+	memset(&out, 0, sizeof(out));
+	out.fd = -1;
+	out.flags = KHREC_F_HDR;
+
+	if((fd = open(g_opt.device, O_RDONLY | O_NONBLOCK)) == -1) {
+		fprintf(stderr, "%s: ", g_opt.device);
+		process_errnum(errno);
+		goto do_exit;
+	}
+	/* Ask for record headers so replay knows the record boundaries and timing. Anything else is recorded as a raw byte stream. */
+	if(ioctl(fd, KHELLO_IOC_SET_RECV, &recv) == -1) {
+		if(errno != ENOTTY) {
+			process_errnum(errno);
+			goto do_exit;
+		}
+		fprintf(stderr, "%s: not a khello device, recording raw bytes\n", g_opt.device);
+		out.flags = 0;
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	drops = read_drops(g_opt.device);
+	start = now_ns(CLOCK_MONOTONIC);
+	if(g_opt.mode != MODE_READ) {
+		status = record_splice(fd, &out);
+		if((status == 1) && (g_opt.mode == MODE_AUTO))
+			fprintf(stderr, "%s: splice not supported, falling back to read\n", g_opt.device);
+		else if(status == 1)
+			fprintf(stderr, "%s: splice not supported\n", g_opt.device);
+	}
+	if((g_opt.mode == MODE_READ) || ((status == 1) && (g_opt.mode == MODE_AUTO))) {
+		mode = "read";
+		status = record_read(fd, &out, &stalls);
+	}
+	elapsed = now_ns(CLOCK_MONOTONIC) - start;
+	drops = read_drops(g_opt.device) - drops;
+
+	printf("mode %s  files %u  bytes %llu  %.2f MB/s  writer stalls %llu  records dropped by the device %llu\n", mode, out.seq,
+		out.total, elapsed ? out.total * 1e3 / elapsed : 0.0, stalls, drops);
+	if(status == 0)
+		result = 0;
+
+do_exit:
+	if(out.fd != -1)
+		close(out.fd);
+	if(fd != -1)
+		close(fd);
+	return result;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[])
+{
+	int c;
+
+	g_opt.device = DEVICE;
+	g_opt.prefix = PREFIX;
+	g_opt.max_bytes = MAX_MB * 1024ULL * 1024;
+	g_opt.max_ns = 0;
+	g_opt.buf_size = BUF_KB * 1024;
+	g_opt.mode = MODE_AUTO;
+
+	while((c = getopt(p_num, p_args, "d:o:s:t:m:b:")) != -1) {
+		switch(c) {
+			case 'd':
+				g_opt.device = optarg;
+				break;
+			case 'o':
+				g_opt.prefix = optarg;
+				break;
+			case 's':
+				if(atoi(optarg) < 1)
+					return -1;
+				g_opt.max_bytes = atoi(optarg) * 1024ULL * 1024;
+				break;
+			case 't':
+				if(atoi(optarg) < 0)
+					return -1;
+				g_opt.max_ns = atoi(optarg) * 1000000000ULL;
+				break;
+			case 'm':
+				if(strcmp(optarg, "auto") == 0)
+					g_opt.mode = MODE_AUTO;
+				else if(strcmp(optarg, "splice") == 0)
+					g_opt.mode = MODE_SPLICE;
+				else if(strcmp(optarg, "read") == 0)
+					g_opt.mode = MODE_READ;
+				else
+					return -1;
+				break;
+			case 'b':
+				/* A buffer must hold at least a few reads. */
+				if(atoi(optarg) < 16)
+					return -1;
+				g_opt.buf_size = atoi(optarg) * 1024UL;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return (optind == p_num) ? 0 : -1;
+}
+
+
+
+static int record_splice(const int p_fd, struct output *const p_out)
+{
+	int pipefd[2], result = -1;
+	ssize_t count, moved;
+	long pipe_size;
+
+	if(pipe(pipefd) == -1) {
+		process_errnum(errno);
+		return -1;
+	}
+	/* A larger pipe moves more records per splice. The size may be capped by /proc/sys/fs/pipe-max-size. */
+	fcntl(pipefd[1], F_SETPIPE_SZ, g_opt.buf_size);
+	if((pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ)) == -1)
+		pipe_size = 64 * 1024;
+
+	while(!g_stop) {
+		/* The pipe is always drained below, so EAGAIN means the device is empty. */
+		count = splice(p_fd, NULL, pipefd[1], NULL, pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(count == -1) {
+			if(errno == EAGAIN) {
+				if(wait_input(p_fd) == -1)
+					goto do_exit;
+				continue;
+			}
+			if(errno == EINTR)
+				continue;
+			if(((errno == EINVAL) || (errno == ENOSYS)) && (p_out->total == 0)) {
+				result = 1;
+				goto do_exit;
+			}
+			process_errnum(errno);
+			goto do_exit;
+		}
+		if(count == 0) /* End of input. */
+			break;
+
+		if(rotate(p_out) == -1)
+			goto do_exit;
+		while(count > 0) {
+			if((moved = splice(pipefd[0], NULL, p_out->fd, NULL, count, SPLICE_F_MOVE)) == -1) {
+				if(errno == EINTR)
+					continue;
+				process_errnum(errno);
+				goto do_exit;
+			}
+			count -= moved;
+			p_out->bytes += moved;
+			p_out->total += moved;
+		}
+	}
+	result = 0;
+
+do_exit:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return result;
+}
+
+
+
+static int record_read(const int p_fd, struct output *const p_out, unsigned long long *const p_stalls)
+{
+	struct writer writer;
+	int cur = 0, result = -1, error;
+	size_t fill = 0;
+	ssize_t count;
+
+	memset(&writer, 0, sizeof(writer));
+	writer.out = p_out;
+	pthread_mutex_init(&writer.lock, NULL);
+	pthread_cond_init(&writer.cond, NULL);
+	if(((writer.buf[0] = malloc(g_opt.buf_size)) == NULL) || ((writer.buf[1] = malloc(g_opt.buf_size)) == NULL)) {
+		process_errnum(ENOMEM);
+		goto do_exit;
+	}
+	if((errno = pthread_create(&writer.id, NULL, writer_main, &writer)) != 0) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+
+	while(!g_stop) {
+		count = read(p_fd, writer.buf[cur] + fill, g_opt.buf_size - fill);
+		if(count > 0)
+			fill += count;
+		else if(count == 0)
+			break;
+		else if(errno == EINTR)
+			continue;
+		else if(errno != EAGAIN) {
+			process_errnum(errno);
+			break;
+		}
+
+		/* Hand the buffer over when it is nearly full, or when the device ran dry so the file does not lag behind. */
+		if((fill > 0) && ((count == -1) || (g_opt.buf_size - fill < READ_MIN))) {
+			pthread_mutex_lock(&writer.lock);
+			writer.len[cur] = fill;
+			writer.full[cur] = 1;
+			pthread_cond_broadcast(&writer.cond);
+			cur ^= 1;
+			if(writer.full[cur] && (writer.error == 0))
+				++writer.stalls;
+			while(writer.full[cur] && (writer.error == 0))
+				pthread_cond_wait(&writer.cond, &writer.lock);
+			error = writer.error;
+			pthread_mutex_unlock(&writer.lock);
+			fill = 0;
+			if(error != 0)
+				break;
+		}
+		if((count == -1) && (wait_input(p_fd) == -1))
+			break;
+	}
+
+	/* Write out the rest and wait for the writer. */
+	pthread_mutex_lock(&writer.lock);
+	if(fill > 0) {
+		writer.len[cur] = fill;
+		writer.full[cur] = 1;
+	}
+	writer.done = 1;
+	pthread_cond_broadcast(&writer.cond);
+	pthread_mutex_unlock(&writer.lock);
+	pthread_join(writer.id, NULL);
+	if(writer.error != 0)
+		process_errnum(writer.error);
+	else
+		result = 0;
+	*p_stalls = writer.stalls;
+
+do_exit:
+	free(writer.buf[0]);
+	free(writer.buf[1]);
+	pthread_cond_destroy(&writer.cond);
+	pthread_mutex_destroy(&writer.lock);
+	return result;
+}
+
+
+
+static void *writer_main(void *p_arg)
+{
+	struct writer *writer = p_arg;
+	int cur = 0, error = 0;
+
+	for(;;) {
+		pthread_mutex_lock(&writer->lock);
+		while(!writer->full[cur] && !writer->done)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		if(!writer->full[cur]) {
+			pthread_mutex_unlock(&writer->lock);
+			break;
+		}
+		pthread_mutex_unlock(&writer->lock);
+
+		/* The buffer holds whole records, so a rotation here never splits one. */
+		if((rotate(writer->out) == -1) || (write_all(writer->out->fd, writer->buf[cur], writer->len[cur]) == -1))
+			error = errno;
+		else {
+			writer->out->bytes += writer->len[cur];
+			writer->out->total += writer->len[cur];
+		}
+
+		pthread_mutex_lock(&writer->lock);
+		writer->full[cur] = 0;
+		writer->error = error;
+		pthread_cond_broadcast(&writer->cond);
+		pthread_mutex_unlock(&writer->lock);
+		if(error != 0)
+			break;
+		cur ^= 1;
+	}
+	return NULL;
+}
+
+
+
+static int wait_input(const int p_fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = p_fd;
+	pfd.events = POLLIN;
+	if((poll(&pfd, 1, POLL_MS) == -1) && (errno != EINTR)) {
+		process_errnum(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static int rotate(struct output *const p_out)
+{
+	struct khrec_file_hdr hdr;
+	char name[512];
+
+	if(p_out->fd != -1) {
+		if((p_out->bytes < g_opt.max_bytes) && ((g_opt.max_ns == 0) || (now_ns(CLOCK_MONOTONIC) - p_out->opened_ns < g_opt.max_ns)))
+			return 0;
+		close(p_out->fd);
+	}
+
+	snprintf(name, sizeof(name), "%s.%06u%s", g_opt.prefix, p_out->seq, KHREC_SUFFIX);
+	if((p_out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = KHREC_MAGIC;
+	hdr.version = KHREC_VERSION;
+	hdr.flags = p_out->flags;
+	hdr.seq = p_out->seq;
+	hdr.start_ns = now_ns(CLOCK_REALTIME);
+	if(write_all(p_out->fd, (const unsigned char*)&hdr, sizeof(hdr)) == -1) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	++p_out->seq;
+	p_out->bytes = 0;
+	p_out->opened_ns = now_ns(CLOCK_MONOTONIC);
+	return 0;
+}
+
+
+
+static int write_all(const int p_fd, const unsigned char *p_buf, size_t p_len)
+{
+	ssize_t count;
+
+	while(p_len > 0) {
+		if((count = write(p_fd, p_buf, p_len)) == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		p_buf += count;
+		p_len -= count;
+	}
+	return 0;
+}
+
+
+
+static unsigned long long read_drops(const char *const p_device)
+{
+	char path[512], copy[256], buf[32];
+	unsigned long long drops = 0;
+	int fd;
+	ssize_t count;
+
+	snprintf(copy, sizeof(copy), "%s", p_device);
+	snprintf(path, sizeof(path), "%s/%s/drops", KHELLO_SYSFS_DIR, basename(copy));
+	if((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	if((count = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[count] = 0;
+		drops = strtoull(buf, NULL, 10);
+	}
+	close(fd);
+	return drops;
+}
+
+
+
+static unsigned long long now_ns(const clockid_t p_clock)
+{
+	struct timespec ts;
+
+	clock_gettime(p_clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+static void handle_signal(int p_sig)
+{
+	g_stop = 1;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
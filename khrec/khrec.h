@@ -0,0 +1,34 @@
+/** @file khrec.h
+ * Format of the recordings written by khrec.
+ *
+ * A recording is a series of files named <prefix>.<seq>.khr, seq counting from 000000. Each file starts with a struct khrec_file_hdr.
+ * With KHREC_F_HDR set, the rest of the file is a sequence of records as read() returns them with KHELLO_RECV_HDR:
+ * a struct khello_rec_hdr followed by len payload bytes. Files are only rotated between reads, so no record spans two files.
+ * Without KHREC_F_HDR the input was not a khello device and the rest of the file is the raw byte stream.
+ */
+
+#ifndef KHREC_H
+#define KHREC_H
+
+#include <linux/types.h>
+
+
+#define KHREC_MAGIC 0x3152484b /**< "KHR1" when read as bytes on a little-endian machine. */
+#define KHREC_VERSION 1 /**< Version of the format described here. */
+#define KHREC_SUFFIX ".khr" /**< Suffix of recording files. */
+
+#define KHREC_F_HDR 0x0001 /**< Records are framed by struct khello_rec_hdr. */
+
+
+/** Header at the start of every recording file. */
+struct khrec_file_hdr {
+	__u32 magic; /**< KHREC_MAGIC. */
+	__u32 version; /**< KHREC_VERSION. */
+	__u32 flags; /**< KHREC_F_* flags. */
+	__u32 seq; /**< Position of the file in the recording, starting at 0. */
+	__u64 start_ns; /**< CLOCK_REALTIME when the file was opened. */
+	__u64 reserved; /**< 0. */
+};
+
+
+#endif
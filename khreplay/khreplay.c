@@ -0,0 +1,495 @@
+/** @file khreplay.c
+ * Rate-controlled replay of recordings made by khrec.
+ *
+ * The recording files are mapped with mmap, like try_mmap does with "FILE", and their records are written back into a channel.
+ * Records are submitted in batches with khl_send_batch() straight from the mapping. libkhello uses KHELLO_IOC_SEND_BATCH, or writev() on modules without the ioctl.
+ * The pacing is one of:
+ * orig     the original inter-arrival times, taken from the enqueue timestamps in the recording, optionally sped up or slowed down.
+ * rate:n   a fixed rate of n records per second.
+ * max      as fast as possible, full batches.
+ * A batch takes the records that are due. When the replay falls behind, the records it owes go out together in full batches.
+ *
+ * Usage:
+ * After loading the kernel module and recording with khrec.
+ * Replay a recording into /dev/khello with its original timing: "./khreplay khello.*.khr"
+ * Replay it 10 times faster into /dev/khello1: "./khreplay -d /dev/khello1 -t orig -x 10 khello.*.khr"
+ * Measure driver throughput, 5 times over: "./khreplay -t max -l 5 khello.*.khr"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <libgen.h>
+#include <time.h>
+#include "../libkhello/libkhello.h"
+#include "../khrec/khrec.h"
+
+
+#define DEVICE "/dev/khello" /**< The character device. */
+#define MAX_FILES 4096 /**< Maximum number of recording files. */
+#define BATCH 64 /**< Default records per batch. */
+#define SPIN_NS 50000ULL /**< Waits shorter than this spin instead of sleeping, for accurate pacing. */
+
+#define PACE_ORIG 0 /**< Original inter-arrival times. */
+#define PACE_RATE 1 /**< Fixed rate. */
+#define PACE_MAX 2 /**< As fast as possible. */
+
+
+/** Options of the run. */
+struct options {
+	const char *device; /**< Device to replay into. */
+	int pace; /**< PACE_*. */
+	double rate; /**< Records per second for PACE_RATE. */
+	double speed; /**< Speed factor for PACE_ORIG. 2 replays twice as fast. */
+	int batch; /**< Records per batch. */
+	int loops; /**< Number of times the recording is replayed. */
+};
+
+/** A mapped recording file. */
+struct recording {
+	const char *name; /**< File name. */
+	const unsigned char *map; /**< The mapping. */
+	size_t size; /**< Size of the mapping. */
+	int partial; /**< 1 once a partial record at the end was reported. */
+};
+
+/** Position in the recording. */
+struct cursor {
+	int file; /**< Index in g_files. */
+	size_t pos; /**< Offset of the next record in the file. */
+};
+
+/** A record found in the recording. */
+struct record {
+	struct khello_rec_hdr hdr; /**< Its header, copied because records are not aligned. */
+	const unsigned char *data; /**< Its payload, in the mapping. */
+};
+
+/** Counters of the run. */
+struct counters {
+	unsigned long long records; /**< Records submitted. */
+	unsigned long long bytes; /**< Payload bytes submitted. */
+	unsigned long long ops; /**< System calls made to submit them. */
+	unsigned long long late_max; /**< Largest delay of a batch behind its schedule, in ns. */
+	unsigned long long late_sum; /**< Sum of the delays of all batches, in ns. */
+	unsigned long long elapsed; /**< Time spent replaying, in ns. */
+};
+
+
+static struct options g_opt; /**< Options of the run. */
+static struct recording g_files[MAX_FILES]; /**< The recording, in order. */
+static int g_num_files = 0; /**< Number of entries in g_files. */
+static volatile sig_atomic_t g_stop = 0; /**< Set by the signal handler to end the replay. */
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[]);
+
+/** Maps a recording file and checks its header.
+ *  @param p_name The file.
+ *  @param p_file Receives the mapping.
+ *  @return 0 if OK. Else -1.
+ */
+static int map_file(const char *const p_name, struct recording *const p_file);
+
+/** Finds the record at a cursor, moving to the next file when needed. The cursor is not advanced.
+ *  @param p_cur The cursor.
+ *  @param p_rec Receives the record.
+ *  @return 1 if a record was found. 0 at the end of the recording.
+ */
+static int peek_record(struct cursor *const p_cur, struct record *const p_rec);
+
+/** Replays the recording once.
+ *  @param p_chan The device.
+ *  @param p_count Counters to add to.
+ *  @return 0 if OK. Else -1.
+ */
+static int replay(struct khl_channel *const p_chan, struct counters *const p_count);
+
+/** Submits records to the device, in one batch or, with -b 1, one write() each.
+ *  @param p_chan The device.
+ *  @param p_iov The records.
+ *  @param p_num Number of records.
+ *  @param p_count Counters to add to, including the records sent before an error.
+ *  @return 0 if every record was sent. Else -1.
+ */
+static int submit(struct khl_channel *const p_chan, const struct iovec *const p_iov, const int p_num, struct counters *const p_count);
+
+/** Returns the time a record is due, relative to the start of the replay.
+ *  @param p_rec The record.
+ *  @param p_index Position of the record in the recording.
+ *  @param p_base Enqueue time of the first record.
+ */
+static unsigned long long due_ns(const struct record *const p_rec, const unsigned long long p_index, const unsigned long long p_base);
+
+/** Waits until a point in time, sleeping first and spinning for the last SPIN_NS.
+ *  @param p_when The time on CLOCK_MONOTONIC in ns.
+ */
+static void wait_until(const unsigned long long p_when);
+
+/** Reads the drops counter of a device from sysfs.
+ *  @return The counter, or 0 if it cannot be read.
+ */
+static unsigned long long read_drops(const char *const p_device);
+
+/** Returns the current CLOCK_MONOTONIC time in ns. */
+static unsigned long long now_ns();
+
+/** Stops the replay on SIGINT or SIGTERM. */
+static void handle_signal(int p_sig);
+
+/** Process the value set in erno.
+ *  @param The errno itself.
+ */
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	int opened = 0, i, result = 1;
+	struct khl_channel chan;
+	struct counters count;
+	struct sigaction action;
+	unsigned long long drops;
+
+	if(check_args(argc, argv) == -1) {
+		printf("Usage: khreplay [-d device] [-t orig|rate:n|max] [-x speed] [-b batch] [-l loops] file...\n");
+		return 0;
+	}
+	memset(&count, 0, sizeof(count));
+	for(i = optind; i < argc; ++i) {
+		if(g_num_files == MAX_FILES) {
+			fprintf(stderr, "At most %d files\n", MAX_FILES);
+			goto do_exit;
+		}
+		if(map_file(argv[i], &g_files[g_num_files]) == -1)
+			goto do_exit;
+		++g_num_files;
+	}
+
+	if(khl_open(&chan, g_opt.device, O_WRONLY) == -1) {
+		khl_perror(g_opt.device, errno);
+		goto do_exit;
+	}
+	opened = 1;
+	if((g_opt.batch > 1) && !(chan.caps & KHL_CAP_BATCH))
+		fprintf(stderr, "%s: no KHELLO_IOC_SEND_BATCH, using writev()\n", g_opt.device);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	drops = read_drops(g_opt.device);
+	for(i = 0; (i < g_opt.loops) && !g_stop; ++i) {
+		if(replay(&chan, &count) == -1)
+			goto do_exit;
+	}
+	drops = read_drops(g_opt.device) - drops;
+
+	printf("records %llu  bytes %llu  %.3f s  %.0f records/s  %.2f MB/s  records per call %.1f  late mean %.1f us max %.1f us  records dropped by the device %llu\n",
+		count.records, count.bytes, count.elapsed / 1e9, count.elapsed ? count.records * 1e9 / count.elapsed : 0.0,
+		count.elapsed ? count.bytes * 1e3 / count.elapsed : 0.0, count.ops ? (double)count.records / count.ops : 0.0,
+		count.ops ? count.late_sum / 1e3 / count.ops : 0.0, count.late_max / 1e3, drops);
+	result = 0;
+
+do_exit:
+	for(i = 0; i < g_num_files; ++i)
+		munmap((void*)g_files[i].map, g_files[i].size);
+	if(opened)
+		khl_close(&chan);
+	return result;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[])
+{
+	int c;
+
+	g_opt.device = DEVICE;
+	g_opt.pace = PACE_ORIG;
+	g_opt.rate = 0;
+	g_opt.speed = 1;
+	g_opt.batch = BATCH;
+	g_opt.loops = 1;
+
+	while((c = getopt(p_num, p_args, "d:t:x:b:l:")) != -1) {
+		switch(c) {
+			case 'd':
+				g_opt.device = optarg;
+				break;
+			case 't':
+				if(strcmp(optarg, "orig") == 0)
+					g_opt.pace = PACE_ORIG;
+				else if(strcmp(optarg, "max") == 0)
+					g_opt.pace = PACE_MAX;
+				else if((strncmp(optarg, "rate:", 5) == 0) && ((g_opt.rate = atof(optarg + 5)) > 0))
+					g_opt.pace = PACE_RATE;
+				else
+					return -1;
+				break;
+			case 'x':
+				if((g_opt.speed = atof(optarg)) <= 0)
+					return -1;
+				break;
+			case 'b':
+				if(((g_opt.batch = atoi(optarg)) < 1) || (g_opt.batch > KHELLO_BATCH_MAX))
+					return -1;
+				break;
+			case 'l':
+				if((g_opt.loops = atoi(optarg)) < 1)
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return (optind < p_num) ? 0 : -1;
+}
+
+
+
+static int map_file(const char *const p_name, struct recording *const p_file)
+{
+	struct khrec_file_hdr hdr;
+	struct stat s_stat;
+	void *map;
+	int fd;
+
+	if((fd = open(p_name, O_RDONLY)) == -1) {
+		fprintf(stderr, "%s: %s\n", p_name, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &s_stat) == -1) {
+		fprintf(stderr, "%s: %s\n", p_name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if(s_stat.st_size < (off_t)sizeof(hdr)) {
+		fprintf(stderr, "%s: not a khrec recording\n", p_name);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, s_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", p_name, strerror(errno));
+		return -1;
+	}
+	/* The file is read once, front to back. */
+	madvise(map, s_stat.st_size, MADV_SEQUENTIAL);
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if((hdr.magic != KHREC_MAGIC) || (hdr.version != KHREC_VERSION)) {
+		fprintf(stderr, "%s: not a khrec recording\n", p_name);
+		munmap(map, s_stat.st_size);
+		return -1;
+	}
+	if(!(hdr.flags & KHREC_F_HDR)) {
+		fprintf(stderr, "%s: raw recording without record boundaries\n", p_name);
+		munmap(map, s_stat.st_size);
+		return -1;
+	}
+	p_file->name = p_name;
+	p_file->map = map;
+	p_file->size = s_stat.st_size;
+	return 0;
+}
+
+
+
+static int peek_record(struct cursor *const p_cur, struct record *const p_rec)
+{
+	struct recording *file;
+
+	while(p_cur->file < g_num_files) {
+		file = &g_files[p_cur->file];
+		if(p_cur->pos + sizeof(struct khello_rec_hdr) <= file->size) {
+			memcpy(&p_rec->hdr, file->map + p_cur->pos, sizeof(struct khello_rec_hdr));
+			if((p_rec->hdr.len <= KHELLO_RECORD_MAX) && (p_cur->pos + sizeof(struct khello_rec_hdr) + p_rec->hdr.len <= file->size)) {
+				p_rec->data = file->map + p_cur->pos + sizeof(struct khello_rec_hdr);
+				return 1;
+			}
+		}
+		/* A recorder that was killed can leave a partial record at the end. */
+		if((p_cur->pos < file->size) && !file->partial) {
+			file->partial = 1;
+			fprintf(stderr, "%s: %zu bytes of a partial record ignored\n", file->name, file->size - p_cur->pos);
+		}
+		++p_cur->file;
+		p_cur->pos = sizeof(struct khrec_file_hdr);
+	}
+	return 0;
+}
+
+
+
+static int replay(struct khl_channel *const p_chan, struct counters *const p_count)
+{
+	struct iovec iov[KHELLO_BATCH_MAX];
+	struct cursor cur = { 0, sizeof(struct khrec_file_hdr) };
+	struct record rec;
+	unsigned long long start, now, due, base = 0, index = 0, prev = 0;
+	int num, more;
+
+	if((more = peek_record(&cur, &rec)) == 1)
+		base = rec.hdr.enq_ns;
+	start = now_ns();
+	while(more && !g_stop) {
+		/* Wait for the first record of the batch. Out of order timestamps are sent at once. */
+		due = due_ns(&rec, index, base);
+		prev = (due > prev) ? due : prev;
+		if(g_opt.pace != PACE_MAX)
+			wait_until(start + prev);
+		now = now_ns() - start;
+		if((g_opt.pace != PACE_MAX) && (now > prev)) {
+			p_count->late_sum += now - prev;
+			if(now - prev > p_count->late_max)
+				p_count->late_max = now - prev;
+		}
+
+		/* Take every record that is due, up to a full batch. */
+		num = 0;
+		do {
+			iov[num].iov_base = (void*)rec.data;
+			iov[num].iov_len = rec.hdr.len;
+			++num;
+			++index;
+			cur.pos += sizeof(struct khello_rec_hdr) + rec.hdr.len;
+			if((more = peek_record(&cur, &rec)) == 1) {
+				due = due_ns(&rec, index, base);
+				prev = (due > prev) ? due : prev;
+			}
+		} while(more && (num < g_opt.batch) && ((g_opt.pace == PACE_MAX) || (prev <= now)));
+
+		if(submit(p_chan, iov, num, p_count) == -1)
+			return -1;
+	}
+	p_count->elapsed += now_ns() - start;
+	return 0;
+}
+
+
+
+static int submit(struct khl_channel *const p_chan, const struct iovec *const p_iov, const int p_num, struct counters *const p_count)
+{
+	int i, sent, done = 0, result = 0;
+
+	if(g_opt.batch > 1) {
+		/* Batches are at most KHELLO_BATCH_MAX records: one ioctl or one writev(). A batch stopped part way is resumed
+		 * from the first record not sent, so a bad record fails the replay instead of silently dropping the rest. */
+		while(done < p_num) {
+			if((sent = khl_send_batch(p_chan, p_iov + done, p_num - done)) == -1) {
+				process_errnum(errno);
+				result = -1;
+				break;
+			}
+			++p_count->ops;
+			done += sent;
+		}
+	} else {
+		for(; done < p_num; ++done) {
+			if(khl_send(p_chan, p_iov[done].iov_base, p_iov[done].iov_len) == -1) {
+				process_errnum(errno);
+				result = -1;
+				break;
+			}
+			++p_count->ops;
+		}
+	}
+	p_count->records += done;
+	for(i = 0; i < done; ++i)
+		p_count->bytes += p_iov[i].iov_len;
+	return result;
+}
+
+
+
+static unsigned long long due_ns(const struct record *const p_rec, const unsigned long long p_index, const unsigned long long p_base)
+{
+	switch(g_opt.pace) {
+		case PACE_ORIG:
+			return (p_rec->hdr.enq_ns > p_base) ? (p_rec->hdr.enq_ns - p_base) / g_opt.speed : 0;
+		case PACE_RATE:
+			return p_index * 1e9 / g_opt.rate;
+		default:
+			return 0;
+	}
+}
+
+
+
+static void wait_until(const unsigned long long p_when)
+{
+	struct timespec next;
+	unsigned long long now = now_ns();
+
+	/* Sleeping wakes up late by tens of microseconds, so sleep only for the bulk of the wait. */
+	if(p_when > now + SPIN_NS) {
+		next.tv_sec = (p_when - SPIN_NS) / 1000000000ULL;
+		next.tv_nsec = (p_when - SPIN_NS) % 1000000000ULL;
+		while(!g_stop && (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR))
+			;
+	}
+	while(!g_stop && (now_ns() < p_when))
+		;
+}
+
+
+
+static unsigned long long read_drops(const char *const p_device)
+{
+	char path[512], copy[256], buf[32];
+	unsigned long long drops = 0;
+	int fd;
+	ssize_t count;
+
+	snprintf(copy, sizeof(copy), "%s", p_device);
+	snprintf(path, sizeof(path), "%s/%s/drops", KHELLO_SYSFS_DIR, basename(copy));
+	if((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	if((count = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[count] = 0;
+		drops = strtoull(buf, NULL, 10);
+	}
+	close(fd);
+	return drops;
+}
+
+
+
+static unsigned long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+static void handle_signal(int p_sig)
+{
+	g_stop = 1;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
@@ -0,0 +1,843 @@
+/** @file khschema.c
+ * Schema compiler for khello message layouts.
+ *
+ * Reads a compact schema of messages and generates C and C++ accessors that read the fields straight out of a record, in a read buffer or a ring slot, without decoding it.
+ * Fixed fields sit at fixed offsets, aligned to their size. Variable-length fields ("bytes" and "string") keep a 16-bit length in the fixed part and their bytes in the tail,
+ * after the fixed part, in schema order. The C header has offset macros and static inline getters and setters; the C++ header has constexpr field metadata, a View and a Builder per message.
+ * Accessors use memcpy, so records need not be aligned; compilers turn it into a plain load.
+ *
+ * Schema:
+ * # comment
+ * message Tick {
+ *     u64 seq;
+ *     f64 price;
+ *     char symbol[8];
+ *     string venue;
+ * }
+ * Types: u8 i8 u16 i16 u32 i32 u64 i64 f32 f64 char, arrays of them with [n], and the variable-length bytes and string.
+ *
+ * Usage:
+ * Generate tick.h and tick.hpp from tick.khs: "./khschema tick.khs"
+ * Generate only C++ into gen/tick.hpp, in namespace md: "./khschema -l cpp -n md -o gen/tick tick.khs"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "../khello2/khello.h"
+
+
+#define NAME_MAX_LEN 64 /**< Longest message or field name, with its terminating 0. */
+#define MAX_MESSAGES 64 /**< Most messages in a schema. */
+#define MAX_FIELDS 64 /**< Most fields in a message. */
+#define MAX_ARRAY 4096 /**< Largest array. */
+#define LEN_SIZE 2 /**< Size of the length of a variable-length field. */
+
+#define LANG_C 0x01 /**< Generate the C header. */
+#define LANG_CPP 0x02 /**< Generate the C++ header. */
+
+#define TOK_END 0 /**< End of the schema. */
+#define TOK_NAME 1 /**< An identifier. */
+#define TOK_NUMBER 2 /**< A decimal number. */
+#define TOK_PUNCT 3 /**< One of { } [ ] ; */
+
+
+/** A field type. */
+struct type {
+	const char *name; /**< Name in the schema. */
+	unsigned int size; /**< Size in bytes, LEN_SIZE for variable-length types. */
+	const char *c_type; /**< C and C++ type of a value. */
+	const char *kind; /**< Name of the khschema::Kind value. */
+	int varlen; /**< 1 for variable-length types. */
+};
+
+/** A field of a message. */
+struct field {
+	char name[NAME_MAX_LEN]; /**< Field name. */
+	const struct type *type; /**< Its type. */
+	unsigned int count; /**< Array length, 0 for a scalar. */
+	unsigned int offset; /**< Offset in the fixed part. For a variable-length field, offset of its length. */
+	int line; /**< Line in the schema, for errors. */
+};
+
+/** A message. */
+struct message {
+	char name[NAME_MAX_LEN]; /**< Message name, as written. */
+	char lower[NAME_MAX_LEN * 2]; /**< snake_case prefix of the C functions. */
+	char upper[NAME_MAX_LEN * 2]; /**< UPPER_CASE prefix of the C macros. */
+	struct field fields[MAX_FIELDS]; /**< The fields, in schema order. */
+	int num_fields; /**< Number of fields. */
+	int num_varlen; /**< Number of variable-length fields. */
+	unsigned int fixed_size; /**< Size of the fixed part. */
+};
+
+/** Parser state. */
+struct parser {
+	const char *file; /**< Schema file name, for errors. */
+	const char *pos; /**< Next character. */
+	int line; /**< Current line. */
+	int tok; /**< TOK_* of the current token. */
+	char text[NAME_MAX_LEN]; /**< Text of the current token. */
+};
+
+
+/** The field types. */
+static const struct type g_types[] = {
+	{ "u8", 1, "uint8_t", "U8", 0 },
+	{ "i8", 1, "int8_t", "I8", 0 },
+	{ "u16", 2, "uint16_t", "U16", 0 },
+	{ "i16", 2, "int16_t", "I16", 0 },
+	{ "u32", 4, "uint32_t", "U32", 0 },
+	{ "i32", 4, "int32_t", "I32", 0 },
+	{ "u64", 8, "uint64_t", "U64", 0 },
+	{ "i64", 8, "int64_t", "I64", 0 },
+	{ "f32", 4, "float", "F32", 0 },
+	{ "f64", 8, "double", "F64", 0 },
+	{ "char", 1, "char", "CHAR", 0 },
+	{ "bytes", LEN_SIZE, "uint16_t", "BYTES", 1 },
+	{ "string", LEN_SIZE, "uint16_t", "STRING", 1 },
+};
+
+/** Field names that would collide with the generated helpers. */
+static const char *g_reserved[] = { "size", "check", "init", "fields", "fixed_size", "num_varlen", "msg", NULL };
+
+/** C and C++ keywords, which cannot name a message or a field: the headers use names as written. */
+static const char *g_keywords[] = {
+	"alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break", "case", "catch", "char", "char8_t", "char16_t", "char32_t",
+	"class", "compl", "concept", "const", "consteval", "constexpr", "constinit", "const_cast", "continue", "co_await", "co_return", "co_yield", "decltype",
+	"default", "delete", "do", "double", "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false", "float", "for", "friend", "goto", "if",
+	"inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq", "nullptr", "operator", "or", "or_eq", "private", "protected",
+	"public", "register", "reinterpret_cast", "requires", "restrict", "return", "short", "signed", "sizeof", "static", "static_assert", "static_cast",
+	"struct", "switch", "template", "this", "thread_local", "throw", "true", "try", "typedef", "typeid", "typename", "union", "unsigned", "using",
+	"virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq", "_Alignas", "_Alignof", "_Atomic", "_Bool", "_Complex", "_Generic",
+	"_Imaginary", "_Noreturn", "_Static_assert", "_Thread_local", NULL
+};
+
+static struct message g_messages[MAX_MESSAGES]; /**< The messages parsed. */
+static int g_num_messages = 0; /**< Number of messages. */
+
+
+/** Parses the whole schema into g_messages.
+ *  @param p_file Schema file name.
+ *  @param p_text Its content, 0-terminated.
+ *  @return 0 if OK. Else -1, after printing the error.
+ */
+static int parse(const char *const p_file, const char *const p_text);
+
+/** Parses one message, after the keyword "message".
+ *  @return 0 if OK. Else -1, after printing the error.
+ */
+static int parse_message(struct parser *const p_parser);
+
+/** Tells whether a name is a C or C++ keyword.
+ *  @return 1 if it is. Else 0.
+ */
+static int is_keyword(const char *const p_name);
+
+/** Reads the next token into p_parser->tok and p_parser->text.
+ *  @return 0 if OK. Else -1 on an invalid character or a name too long, after printing the error.
+ */
+static int next_token(struct parser *const p_parser);
+
+/** Reads the next token and checks it is a given punctuation.
+ *  @return 0 if OK. Else -1, after printing the error.
+ */
+static int expect(struct parser *const p_parser, const char p_punct);
+
+/** Prints a schema error with its position. */
+static void parse_error(const struct parser *const p_parser, const char *const p_msg, const char *const p_arg);
+
+/** Computes the offsets and sizes of a message. Fixed fields are aligned to the size of their type, in schema order. */
+static void lay_out(struct message *const p_msg);
+
+/** Writes the C header.
+ *  @param p_out The output file.
+ *  @param p_guard Include guard.
+ *  @param p_source Schema file name, for the banner.
+ */
+static void gen_c(FILE *const p_out, const char *const p_guard, const char *const p_source);
+
+/** Writes the C++ header.
+ *  @param p_out The output file.
+ *  @param p_guard Include guard.
+ *  @param p_source Schema file name, for the banner.
+ *  @param p_ns Namespace of the messages.
+ */
+static void gen_cpp(FILE *const p_out, const char *const p_guard, const char *const p_source, const char *const p_ns);
+
+/** Writes the expression of the offset of a variable-length field's bytes, i.e. the fixed size plus the lengths of the variable-length fields before it.
+ *  @param p_out The output file.
+ *  @param p_msg The message.
+ *  @param p_index Index of the field.
+ *  @param p_cpp 1 for the C++ View, 0 for the C functions.
+ */
+static void gen_tail_offset(FILE *const p_out, const struct message *const p_msg, const int p_index, const int p_cpp);
+
+/** Writes the private len_at() helper of a View or Builder, which reads the length of a variable-length field.
+ *  @param p_out The output file.
+ */
+static void gen_len_at(FILE *const p_out);
+
+/** Writes one header to a file.
+ *  @return 0 if OK. Else -1.
+ */
+static int write_header(const char *const p_path, const int p_lang, const char *const p_source, const char *const p_ns);
+
+/** Builds an identifier from a name: snake_case, or UPPER_CASE if p_upper. */
+static void make_ident(char *const p_out, const char *const p_name, const int p_upper);
+
+/** Reads a whole file.
+ *  @return Its content, 0-terminated, to free(). NULL on error.
+ */
+static char *read_file(const char *const p_path);
+
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	const char *prefix = NULL, *ns = "khschema";
+	char *text = NULL, *copy = NULL, *dot, path[1024];
+	int opt, lang = LANG_C | LANG_CPP, result = 1, i;
+
+	while((opt = getopt(argc, argv, "o:n:l:")) != -1) {
+		switch(opt) {
+			case 'o':
+				prefix = optarg;
+				break;
+			case 'n':
+				ns = optarg;
+				break;
+			case 'l':
+				if(strcmp(optarg, "c") == 0)
+					lang = LANG_C;
+				else if(strcmp(optarg, "cpp") == 0)
+					lang = LANG_CPP;
+				else if(strcmp(optarg, "both") != 0)
+					goto do_usage;
+				break;
+			default:
+				goto do_usage;
+		}
+	}
+	if(optind != argc - 1)
+		goto do_usage;
+
+	if((text = read_file(argv[optind])) == NULL)
+		goto do_exit;
+	if(parse(argv[optind], text) == -1)
+		goto do_exit;
+	for(i = 0; i < g_num_messages; ++i) {
+		if(g_messages[i].fixed_size > KHELLO_RECORD_MAX)
+			fprintf(stderr, "%s: message %s: fixed part of %u bytes is over the %d bytes of a device record, it fits only %s\n", argv[optind], g_messages[i].name,
+				g_messages[i].fixed_size, KHELLO_RECORD_MAX, (g_messages[i].fixed_size > KHELLO_RING_DATA_MAX) ? "the shared arena" : "a ring slot or the shared arena");
+	}
+
+	/* Default prefix: the schema file without its extension. */
+	if(prefix == NULL) {
+		if((copy = strdup(argv[optind])) == NULL) {
+			process_errnum(errno);
+			goto do_exit;
+		}
+		if(((dot = strrchr(copy, '.')) != NULL) && (strchr(dot, '/') == NULL))
+			*dot = 0;
+		prefix = copy;
+	}
+	if(lang & LANG_C) {
+		snprintf(path, sizeof(path), "%s.h", prefix);
+		if(write_header(path, LANG_C, argv[optind], ns) == -1)
+			goto do_exit;
+	}
+	if(lang & LANG_CPP) {
+		snprintf(path, sizeof(path), "%s.hpp", prefix);
+		if(write_header(path, LANG_CPP, argv[optind], ns) == -1)
+			goto do_exit;
+	}
+	result = 0;
+	goto do_exit;
+
+do_usage:
+	printf("Usage: khschema [-l c|cpp|both] [-n namespace] [-o prefix] schema.khs\n");
+	result = 0;
+
+do_exit:
+	free(copy);
+	free(text);
+	return result;
+}
+
+
+
+static int parse(const char *const p_file, const char *const p_text)
+{
+	struct parser parser;
+
+	parser.file = p_file;
+	parser.pos = p_text;
+	parser.line = 1;
+	if(next_token(&parser) == -1)
+		return -1;
+	while(parser.tok != TOK_END) {
+		if((parser.tok != TOK_NAME) || (strcmp(parser.text, "message") != 0)) {
+			parse_error(&parser, "expected \"message\", found", parser.text);
+			return -1;
+		}
+		if(parse_message(&parser) == -1)
+			return -1;
+	}
+	if(g_num_messages == 0) {
+		parse_error(&parser, "no message in the schema", NULL);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static int parse_message(struct parser *const p_parser)
+{
+	struct message *msg;
+	struct field *field;
+	unsigned int i;
+	int j;
+
+	if(g_num_messages == MAX_MESSAGES) {
+		parse_error(p_parser, "too many messages", NULL);
+		return -1;
+	}
+	msg = &g_messages[g_num_messages];
+	memset(msg, 0, sizeof(struct message));
+	if((next_token(p_parser) == -1) || (p_parser->tok != TOK_NAME)) {
+		parse_error(p_parser, "expected a message name", NULL);
+		return -1;
+	}
+	strcpy(msg->name, p_parser->text);
+	if(is_keyword(msg->name)) {
+		parse_error(p_parser, "message name is a C or C++ keyword:", msg->name);
+		return -1;
+	}
+	for(j = 0; j < g_num_messages; ++j) {
+		if(strcmp(g_messages[j].name, msg->name) == 0) {
+			parse_error(p_parser, "message defined twice:", msg->name);
+			return -1;
+		}
+	}
+	if(expect(p_parser, '{') == -1)
+		return -1;
+
+	for(;;) {
+		if(next_token(p_parser) == -1)
+			return -1;
+		if((p_parser->tok == TOK_PUNCT) && (p_parser->text[0] == '}'))
+			break;
+		if(p_parser->tok != TOK_NAME) {
+			parse_error(p_parser, "expected a field type, found", p_parser->text);
+			return -1;
+		}
+		if(msg->num_fields == MAX_FIELDS) {
+			parse_error(p_parser, "too many fields in", msg->name);
+			return -1;
+		}
+		field = &msg->fields[msg->num_fields];
+		field->line = p_parser->line;
+		for(i = 0; i < sizeof(g_types) / sizeof(g_types[0]); ++i) {
+			if(strcmp(g_types[i].name, p_parser->text) == 0)
+				field->type = &g_types[i];
+		}
+		if(field->type == NULL) {
+			parse_error(p_parser, "unknown type", p_parser->text);
+			return -1;
+		}
+
+		if((next_token(p_parser) == -1) || (p_parser->tok != TOK_NAME)) {
+			parse_error(p_parser, "expected a field name", NULL);
+			return -1;
+		}
+		strcpy(field->name, p_parser->text);
+		if(is_keyword(field->name)) {
+			parse_error(p_parser, "field name is a C or C++ keyword:", field->name);
+			return -1;
+		}
+		for(j = 0; g_reserved[j] != NULL; ++j) {
+			if(strcmp(g_reserved[j], field->name) == 0) {
+				parse_error(p_parser, "reserved field name", field->name);
+				return -1;
+			}
+		}
+		for(j = 0; j < msg->num_fields; ++j) {
+			if(strcmp(msg->fields[j].name, field->name) == 0) {
+				parse_error(p_parser, "field defined twice:", field->name);
+				return -1;
+			}
+		}
+
+		if(next_token(p_parser) == -1)
+			return -1;
+		if((p_parser->tok == TOK_PUNCT) && (p_parser->text[0] == '[')) {
+			if(field->type->varlen) {
+				parse_error(p_parser, "variable-length fields cannot be arrays:", field->name);
+				return -1;
+			}
+			if((next_token(p_parser) == -1) || (p_parser->tok != TOK_NUMBER) || ((field->count = atoi(p_parser->text)) < 1) || (field->count > MAX_ARRAY)) {
+				parse_error(p_parser, "expected an array length from 1 to 4096 for", field->name);
+				return -1;
+			}
+			if(expect(p_parser, ']') == -1)
+				return -1;
+			if(next_token(p_parser) == -1)
+				return -1;
+		}
+		if((p_parser->tok != TOK_PUNCT) || (p_parser->text[0] != ';')) {
+			parse_error(p_parser, "expected ';' after", field->name);
+			return -1;
+		}
+		if(field->type->varlen)
+			++msg->num_varlen;
+		++msg->num_fields;
+	}
+	if(msg->num_fields == 0) {
+		parse_error(p_parser, "empty message", msg->name);
+		return -1;
+	}
+
+	/* An optional ';' after the closing brace. */
+	if(next_token(p_parser) == -1)
+		return -1;
+	if((p_parser->tok == TOK_PUNCT) && (p_parser->text[0] == ';') && (next_token(p_parser) == -1))
+		return -1;
+	make_ident(msg->lower, msg->name, 0);
+	make_ident(msg->upper, msg->name, 1);
+	lay_out(msg);
+	++g_num_messages;
+	return 0;
+}
+
+
+
+static int is_keyword(const char *const p_name)
+{
+	int i;
+
+	for(i = 0; g_keywords[i] != NULL; ++i) {
+		if(strcmp(g_keywords[i], p_name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+
+
+static int next_token(struct parser *const p_parser)
+{
+	const char *start;
+	size_t len;
+
+	/* Skip blanks and comments. */
+	for(;;) {
+		while(isspace((unsigned char)*p_parser->pos)) {
+			if(*p_parser->pos == '\n')
+				++p_parser->line;
+			++p_parser->pos;
+		}
+		if(*p_parser->pos != '#')
+			break;
+		while((*p_parser->pos != 0) && (*p_parser->pos != '\n'))
+			++p_parser->pos;
+	}
+
+	start = p_parser->pos;
+	if(*start == 0) {
+		p_parser->tok = TOK_END;
+		strcpy(p_parser->text, "end of file");
+		return 0;
+	}
+	if(isalpha((unsigned char)*start) || (*start == '_')) {
+		while(isalnum((unsigned char)*p_parser->pos) || (*p_parser->pos == '_'))
+			++p_parser->pos;
+		p_parser->tok = TOK_NAME;
+	} else if(isdigit((unsigned char)*start)) {
+		while(isdigit((unsigned char)*p_parser->pos))
+			++p_parser->pos;
+		p_parser->tok = TOK_NUMBER;
+	} else if(strchr("{}[];", *start) != NULL) {
+		++p_parser->pos;
+		p_parser->tok = TOK_PUNCT;
+	} else {
+		p_parser->text[0] = *start;
+		p_parser->text[1] = 0;
+		parse_error(p_parser, "invalid character", p_parser->text);
+		return -1;
+	}
+	if((len = p_parser->pos - start) >= NAME_MAX_LEN) {
+		parse_error(p_parser, "name too long", NULL);
+		return -1;
+	}
+	memcpy(p_parser->text, start, len);
+	p_parser->text[len] = 0;
+	return 0;
+}
+
+
+
+static int expect(struct parser *const p_parser, const char p_punct)
+{
+	char want[4] = { '\'', p_punct, '\'', 0 };
+
+	if(next_token(p_parser) == -1)
+		return -1;
+	if((p_parser->tok != TOK_PUNCT) || (p_parser->text[0] != p_punct)) {
+		fprintf(stderr, "%s:%d: expected %s, found %s\n", p_parser->file, p_parser->line, want, p_parser->text);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static void parse_error(const struct parser *const p_parser, const char *const p_msg, const char *const p_arg)
+{
+	if(p_arg != NULL)
+		fprintf(stderr, "%s:%d: %s %s\n", p_parser->file, p_parser->line, p_msg, p_arg);
+	else
+		fprintf(stderr, "%s:%d: %s\n", p_parser->file, p_parser->line, p_msg);
+}
+
+
+
+static void lay_out(struct message *const p_msg)
+{
+	struct field *field;
+	unsigned int offset = 0, align;
+	int i;
+
+	for(i = 0; i < p_msg->num_fields; ++i) {
+		field = &p_msg->fields[i];
+		align = field->type->size;
+		offset = (offset + align - 1) & ~(align - 1);
+		field->offset = offset;
+		offset += field->type->size * (field->count ? field->count : 1);
+	}
+	p_msg->fixed_size = offset;
+}
+
+
+
+static void gen_c(FILE *const p_out, const char *const p_guard, const char *const p_source)
+{
+	const struct message *msg;
+	const struct field *field;
+	char up[NAME_MAX_LEN * 2];
+	int m, i, varlen;
+
+	fprintf(p_out, "/** @file\n * Accessors of the messages of %s. Generated by khschema, do not edit.\n", p_source);
+	fprintf(p_out, " * Getters read a field straight out of a record; records need not be aligned. Set variable-length fields in schema order, after the fixed ones.\n */\n\n");
+	fprintf(p_out, "#ifndef %s\n#define %s\n\n#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n\n", p_guard, p_guard);
+
+	for(m = 0; m < g_num_messages; ++m) {
+		msg = &g_messages[m];
+		fprintf(p_out, "\n/* message %s: fixed part of %u bytes, %d variable-length field%s. */\n", msg->name, msg->fixed_size, msg->num_varlen, (msg->num_varlen == 1) ? "" : "s");
+		fprintf(p_out, "#define %s_FIXED_SIZE %u\n", msg->upper, msg->fixed_size);
+		for(i = 0; i < msg->num_fields; ++i) {
+			make_ident(up, msg->fields[i].name, 1);
+			fprintf(p_out, "#define %s_%s_%s %u\n", msg->upper, up, msg->fields[i].type->varlen ? "LEN_OFFSET" : "OFFSET", msg->fields[i].offset);
+		}
+
+		fprintf(p_out, "\n/** Clears the fixed part of message %s before it is filled. */\n", msg->name);
+		fprintf(p_out, "static inline void %s_init(void *p_msg)\n{\n\tmemset(p_msg, 0, %s_FIXED_SIZE);\n}\n", msg->lower, msg->upper);
+
+		for(i = 0, varlen = 0; i < msg->num_fields; ++i) {
+			field = &msg->fields[i];
+			make_ident(up, field->name, 1);
+			if(field->type->varlen) {
+				fprintf(p_out, "\n/** Length of %s. */\n", field->name);
+				fprintf(p_out, "static inline uint16_t %s_%s_len(const void *p_msg)\n{\n\tuint16_t len;\n\n", msg->lower, field->name);
+				fprintf(p_out, "\tmemcpy(&len, (const unsigned char*)p_msg + %s_%s_LEN_OFFSET, sizeof(len));\n\treturn len;\n}\n", msg->upper, up);
+				fprintf(p_out, "\n/** Bytes of %s, in the tail of the record. */\n", field->name);
+				fprintf(p_out, "static inline const %s *%s_%s(const void *p_msg)\n{\n\treturn (const %s*)((const unsigned char*)p_msg + ", (field->type->name[0] == 's') ? "char" : "unsigned char",
+					msg->lower, field->name, (field->type->name[0] == 's') ? "char" : "unsigned char");
+				gen_tail_offset(p_out, msg, i, 0);
+				fprintf(p_out, ");\n}\n");
+				fprintf(p_out, "\n/** Sets %s. The variable-length fields before it must be set already. */\n", field->name);
+				fprintf(p_out, "static inline void %s_set_%s(void *p_msg, const void *p_data, const uint16_t p_len)\n{\n", msg->lower, field->name);
+				fprintf(p_out, "\tmemcpy((unsigned char*)p_msg + %s_%s_LEN_OFFSET, &p_len, sizeof(p_len));\n\tmemcpy((unsigned char*)p_msg + ", msg->upper, up);
+				gen_tail_offset(p_out, msg, i, 0);
+				fprintf(p_out, ", p_data, p_len);\n}\n");
+				++varlen;
+			} else if(field->count && (strcmp(field->type->name, "char") == 0)) {
+				fprintf(p_out, "\n/** %s, %u characters, not 0-terminated when full. */\n", field->name, field->count);
+				fprintf(p_out, "static inline const char *%s_%s(const void *p_msg)\n{\n\treturn (const char*)p_msg + %s_%s_OFFSET;\n}\n", msg->lower, field->name, msg->upper, up);
+				fprintf(p_out, "\n/** Sets %s from a string, truncated to %u characters and padded with 0. */\n", field->name, field->count);
+				fprintf(p_out, "static inline void %s_set_%s(void *p_msg, const char *p_value)\n{\n\tsize_t len = 0;\n\n", msg->lower, field->name);
+				fprintf(p_out, "\twhile((len < %u) && (p_value[len] != '\\0'))\n\t\t++len;\n", field->count);
+				fprintf(p_out, "\tmemcpy((char*)p_msg + %s_%s_OFFSET, p_value, len);\n\tmemset((char*)p_msg + %s_%s_OFFSET + len, 0, %u - len);\n}\n", msg->upper, up, msg->upper, up, field->count);
+			} else if(field->count) {
+				fprintf(p_out, "\n/** Element p_index of %s, of %u. */\n", field->name, field->count);
+				fprintf(p_out, "static inline %s %s_%s(const void *p_msg, const size_t p_index)\n{\n\t%s value;\n\n", field->type->c_type, msg->lower, field->name, field->type->c_type);
+				fprintf(p_out, "\tmemcpy(&value, (const unsigned char*)p_msg + %s_%s_OFFSET + p_index * sizeof(value), sizeof(value));\n\treturn value;\n}\n", msg->upper, up);
+				fprintf(p_out, "\n/** Sets element p_index of %s. */\n", field->name);
+				fprintf(p_out, "static inline void %s_set_%s(void *p_msg, const size_t p_index, const %s p_value)\n{\n", msg->lower, field->name, field->type->c_type);
+				fprintf(p_out, "\tmemcpy((unsigned char*)p_msg + %s_%s_OFFSET + p_index * sizeof(p_value), &p_value, sizeof(p_value));\n}\n", msg->upper, up);
+			} else {
+				fprintf(p_out, "\n/** Reads %s. */\n", field->name);
+				fprintf(p_out, "static inline %s %s_%s(const void *p_msg)\n{\n\t%s value;\n\n", field->type->c_type, msg->lower, field->name, field->type->c_type);
+				fprintf(p_out, "\tmemcpy(&value, (const unsigned char*)p_msg + %s_%s_OFFSET, sizeof(value));\n\treturn value;\n}\n", msg->upper, up);
+				fprintf(p_out, "\n/** Sets %s. */\n", field->name);
+				fprintf(p_out, "static inline void %s_set_%s(void *p_msg, const %s p_value)\n{\n", msg->lower, field->name, field->type->c_type);
+				fprintf(p_out, "\tmemcpy((unsigned char*)p_msg + %s_%s_OFFSET, &p_value, sizeof(p_value));\n}\n", msg->upper, up);
+			}
+		}
+
+		fprintf(p_out, "\n/** Size of message %s, its fixed part and tail. */\n", msg->name);
+		fprintf(p_out, "static inline size_t %s_size(const void *p_msg)\n{\n%s\treturn ", msg->lower, (msg->num_varlen == 0) ? "\t(void)p_msg;\n" : "");
+		gen_tail_offset(p_out, msg, msg->num_fields, 0);
+		fprintf(p_out, ";\n}\n");
+		fprintf(p_out, "\n/** Tells whether a record of p_len bytes holds a whole %s. Check records from other processes before reading them. */\n", msg->name);
+		fprintf(p_out, "static inline int %s_check(const void *p_msg, const size_t p_len)\n{\n", msg->lower);
+		fprintf(p_out, "\treturn (p_len >= %s_FIXED_SIZE) && (%s_size(p_msg) <= p_len);\n}\n", msg->upper, msg->lower);
+	}
+	fprintf(p_out, "\n#endif\n");
+}
+
+
+
+static void gen_cpp(FILE *const p_out, const char *const p_guard, const char *const p_source, const char *const p_ns)
+{
+	const struct message *msg;
+	const struct field *field;
+	const char *elem;
+	int m, i;
+
+	fprintf(p_out, "/** @file\n * Views and builders of the messages of %s. Generated by khschema, do not edit.\n", p_source);
+	fprintf(p_out, " * A View reads fields straight out of a record, which need not be aligned. A Builder fills one; set variable-length fields in schema order, after the fixed ones.\n */\n\n");
+	fprintf(p_out, "#ifndef %s\n#define %s\n\n#include <cstddef>\n#include <cstdint>\n#include <cstring>\n#include <string_view>\n\n", p_guard, p_guard);
+
+	/* Shared by every generated header. */
+	fprintf(p_out, "\n#ifndef KHSCHEMA_FIELD_DEFINED\n#define KHSCHEMA_FIELD_DEFINED\nnamespace khschema {\n\n");
+	fprintf(p_out, "/** Type of a field. */\nenum class Kind { U8, I8, U16, I16, U32, I32, U64, I64, F32, F64, CHAR, BYTES, STRING };\n\n");
+	fprintf(p_out, "/** Layout of a field. */\nstruct Field {\n\tconst char *name; /**< Field name. */\n\tKind kind; /**< Its type. */\n");
+	fprintf(p_out, "\tstd::size_t offset; /**< Offset in the fixed part. For a variable-length field, offset of its 16-bit length. */\n");
+	fprintf(p_out, "\tstd::size_t size; /**< Size of one element, 2 for a variable-length field. */\n\tstd::size_t count; /**< Array length, 0 for a scalar. */\n");
+	fprintf(p_out, "\tbool varlen; /**< The bytes are in the tail. */\n};\n\n");
+	fprintf(p_out, "/** Bytes of a variable-length field, in the record. */\nstruct Bytes {\n\tconst unsigned char *data;\n\tstd::size_t size;\n};\n\n}\n#endif\n\n");
+
+	fprintf(p_out, "\nnamespace %s {\n", p_ns);
+	for(m = 0; m < g_num_messages; ++m) {
+		msg = &g_messages[m];
+
+		/* Layout. */
+		fprintf(p_out, "\n\n/** Layout of message %s. */\nstruct %s {\n", msg->name, msg->name);
+		fprintf(p_out, "\tstatic constexpr std::size_t fixed_size = %u; /**< Size of the fixed part. */\n", msg->fixed_size);
+		fprintf(p_out, "\tstatic constexpr std::size_t num_varlen = %d; /**< Variable-length fields. */\n", msg->num_varlen);
+		for(i = 0; i < msg->num_fields; ++i)
+			fprintf(p_out, "\tstatic constexpr std::size_t %s_offset = %u;\n", msg->fields[i].name, msg->fields[i].offset);
+		fprintf(p_out, "\tstatic constexpr khschema::Field fields[] = {\n");
+		for(i = 0; i < msg->num_fields; ++i) {
+			field = &msg->fields[i];
+			fprintf(p_out, "\t\t{ \"%s\", khschema::Kind::%s, %u, %u, %u, %s },\n", field->name, field->type->kind, field->offset, field->type->size, field->count,
+				field->type->varlen ? "true" : "false");
+		}
+		fprintf(p_out, "\t};\n};\n");
+
+		/* View. */
+		fprintf(p_out, "\n/** Reads message %s in place. */\nclass %sView {\npublic:\n", msg->name, msg->name);
+		fprintf(p_out, "\texplicit constexpr %sView(const void *p_msg) noexcept : msg(static_cast<const unsigned char *>(p_msg))\n\t{\n\t}\n", msg->name);
+		fprintf(p_out, "\n\t/** Tells whether a record of p_len bytes holds a whole %s. */\n", msg->name);
+		fprintf(p_out, "\tstatic bool check(const void *p_msg, const std::size_t p_len) noexcept\n\t{\n");
+		fprintf(p_out, "\t\treturn (p_len >= %s::fixed_size) && (%sView(p_msg).size() <= p_len);\n\t}\n", msg->name, msg->name);
+		for(i = 0; i < msg->num_fields; ++i) {
+			field = &msg->fields[i];
+			elem = field->type->c_type;
+			if(field->type->varlen) {
+				fprintf(p_out, "\n\t%s %s() const noexcept\n\t{\n", (field->type->name[0] == 's') ? "std::string_view" : "khschema::Bytes", field->name);
+				fprintf(p_out, "\t\tstd::uint16_t len;\n\n\t\tstd::memcpy(&len, msg + %s::%s_offset, sizeof(len));\n", msg->name, field->name);
+				if(field->type->name[0] == 's')
+					fprintf(p_out, "\t\treturn std::string_view(reinterpret_cast<const char *>(msg + ");
+				else
+					fprintf(p_out, "\t\treturn khschema::Bytes{ msg + ");
+				gen_tail_offset(p_out, msg, i, 1);
+				fprintf(p_out, (field->type->name[0] == 's') ? "), len);\n\t}\n" : ", len };\n\t}\n");
+			} else if(field->count && (strcmp(field->type->name, "char") == 0)) {
+				fprintf(p_out, "\n\t/** Up to the first 0, at most %u characters. */\n", field->count);
+				fprintf(p_out, "\tstd::string_view %s() const noexcept\n\t{\n\t\tconst char *str = reinterpret_cast<const char *>(msg + %s::%s_offset);\n\t\tstd::size_t len = 0;\n\n",
+					field->name, msg->name, field->name);
+				fprintf(p_out, "\t\twhile((len < %u) && (str[len] != 0))\n\t\t\t++len;\n\t\treturn std::string_view(str, len);\n\t}\n", field->count);
+			} else if(field->count) {
+				fprintf(p_out, "\n\t%s%s %s(const std::size_t p_index) const noexcept\n\t{\n\t\t%s%s value;\n\n", (elem[0] == 'u' || elem[0] == 'i') ? "std::" : "", elem,
+					field->name, (elem[0] == 'u' || elem[0] == 'i') ? "std::" : "", elem);
+				fprintf(p_out, "\t\tstd::memcpy(&value, msg + %s::%s_offset + p_index * sizeof(value), sizeof(value));\n\t\treturn value;\n\t}\n", msg->name, field->name);
+			} else {
+				fprintf(p_out, "\n\t%s%s %s() const noexcept\n\t{\n\t\t%s%s value;\n\n", (elem[0] == 'u' || elem[0] == 'i') ? "std::" : "", elem, field->name,
+					(elem[0] == 'u' || elem[0] == 'i') ? "std::" : "", elem);
+				fprintf(p_out, "\t\tstd::memcpy(&value, msg + %s::%s_offset, sizeof(value));\n\t\treturn value;\n\t}\n", msg->name, field->name);
+			}
+		}
+		fprintf(p_out, "\n\t/** Size of the record, fixed part and tail. */\n\tstd::size_t size() const noexcept\n\t{\n\t\treturn ");
+		gen_tail_offset(p_out, msg, msg->num_fields, 1);
+		fprintf(p_out, ";\n\t}\n\nprivate:\n\tconst unsigned char *msg; /**< The record. */\n");
+		gen_len_at(p_out);
+		fprintf(p_out, "};\n");
+
+		/* Builder. */
+		fprintf(p_out, "\n/** Fills message %s in place. The buffer must hold its fixed part and tail. */\nclass %sBuilder {\npublic:\n", msg->name, msg->name);
+		fprintf(p_out, "\texplicit %sBuilder(void *p_msg) noexcept : msg(static_cast<unsigned char *>(p_msg))\n\t{\n\t\tstd::memset(msg, 0, %s::fixed_size);\n\t}\n", msg->name, msg->name);
+		for(i = 0; i < msg->num_fields; ++i) {
+			field = &msg->fields[i];
+			elem = field->type->c_type;
+			if(field->type->varlen) {
+				fprintf(p_out, "\n\t/** The variable-length fields before it must be set already. */\n");
+				fprintf(p_out, "\t%sBuilder &%s(const void *p_data, const std::uint16_t p_len) noexcept\n\t{\n", msg->name, field->name);
+				fprintf(p_out, "\t\tstd::memcpy(msg + %s::%s_offset, &p_len, sizeof(p_len));\n\t\tstd::memcpy(msg + ", msg->name, field->name);
+				gen_tail_offset(p_out, msg, i, 1);
+				fprintf(p_out, ", p_data, p_len);\n");
+				fprintf(p_out, "\t\treturn *this;\n\t}\n");
+				if(field->type->name[0] == 's') {
+					fprintf(p_out, "\n\t%sBuilder &%s(const std::string_view p_value) noexcept\n\t{\n", msg->name, field->name);
+					fprintf(p_out, "\t\treturn %s(p_value.data(), static_cast<std::uint16_t>(p_value.size()));\n\t}\n", field->name);
+				}
+			} else if(field->count && (strcmp(field->type->name, "char") == 0)) {
+				fprintf(p_out, "\n\t/** Truncated to %u characters and padded with 0. */\n", field->count);
+				fprintf(p_out, "\t%sBuilder &%s(const std::string_view p_value) noexcept\n\t{\n", msg->name, field->name);
+				fprintf(p_out, "\t\tconst std::size_t len = (p_value.size() < %u) ? p_value.size() : %u;\n\n", field->count, field->count);
+				fprintf(p_out, "\t\tstd::memcpy(msg + %s::%s_offset, p_value.data(), len);\n\t\tstd::memset(msg + %s::%s_offset + len, 0, %u - len);\n\t\treturn *this;\n\t}\n",
+					msg->name, field->name, msg->name, field->name, field->count);
+			} else if(field->count) {
+				fprintf(p_out, "\n\t%sBuilder &%s(const std::size_t p_index, const %s%s p_value) noexcept\n\t{\n", msg->name, field->name,
+					(elem[0] == 'u' || elem[0] == 'i') ? "std::" : "", elem);
+				fprintf(p_out, "\t\tstd::memcpy(msg + %s::%s_offset + p_index * sizeof(p_value), &p_value, sizeof(p_value));\n\t\treturn *this;\n\t}\n", msg->name, field->name);
+			} else {
+				fprintf(p_out, "\n\t%sBuilder &%s(const %s%s p_value) noexcept\n\t{\n", msg->name, field->name, (elem[0] == 'u' || elem[0] == 'i') ? "std::" : "", elem);
+				fprintf(p_out, "\t\tstd::memcpy(msg + %s::%s_offset, &p_value, sizeof(p_value));\n\t\treturn *this;\n\t}\n", msg->name, field->name);
+			}
+		}
+		fprintf(p_out, "\n\t/** Size of the record built so far. */\n\tstd::size_t size() const noexcept\n\t{\n\t\treturn ");
+		gen_tail_offset(p_out, msg, msg->num_fields, 1);
+		fprintf(p_out, ";\n\t}\n\nprivate:\n\tunsigned char *msg; /**< The record. */\n");
+		gen_len_at(p_out);
+		fprintf(p_out, "};\n");
+	}
+	fprintf(p_out, "\n\n}\n\n#endif\n");
+}
+
+
+
+static void gen_tail_offset(FILE *const p_out, const struct message *const p_msg, const int p_index, const int p_cpp)
+{
+	int i;
+
+	fprintf(p_out, p_cpp ? "%s::fixed_size" : "%s_FIXED_SIZE", p_cpp ? p_msg->name : p_msg->upper);
+	for(i = 0; i < p_index; ++i) {
+		if(!p_msg->fields[i].type->varlen)
+			continue;
+		if(p_cpp)
+			fprintf(p_out, " + len_at(%s::%s_offset)", p_msg->name, p_msg->fields[i].name);
+		else
+			fprintf(p_out, " + %s_%s_len(p_msg)", p_msg->lower, p_msg->fields[i].name);
+	}
+}
+
+
+
+static void gen_len_at(FILE *const p_out)
+{
+	fprintf(p_out, "\n\tstd::size_t len_at(const std::size_t p_offset) const noexcept\n\t{\n\t\tstd::uint16_t len;\n\n");
+	fprintf(p_out, "\t\tstd::memcpy(&len, msg + p_offset, sizeof(len));\n\t\treturn len;\n\t}\n");
+}
+
+
+
+static int write_header(const char *const p_path, const int p_lang, const char *const p_source, const char *const p_ns)
+{
+	char guard[1024], *copy;
+	const char *base;
+	FILE *out;
+	size_t i;
+
+	/* The guard is built from the file name, e.g. TICK_HPP. */
+	if((copy = strdup(p_path)) == NULL) {
+		process_errnum(errno);
+		return -1;
+	}
+	base = basename(copy);
+	for(i = 0; (base[i] != 0) && (i < sizeof(guard) - 1); ++i)
+		guard[i] = isalnum((unsigned char)base[i]) ? toupper((unsigned char)base[i]) : '_';
+	guard[i] = 0;
+	free(copy);
+
+	if((out = fopen(p_path, "w")) == NULL) {
+		fprintf(stderr, "%s: ", p_path);
+		process_errnum(errno);
+		return -1;
+	}
+	if(p_lang == LANG_C)
+		gen_c(out, guard, p_source);
+	else
+		gen_cpp(out, guard, p_source, p_ns);
+	if(fclose(out) != 0) {
+		fprintf(stderr, "%s: ", p_path);
+		process_errnum(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static void make_ident(char *const p_out, const char *const p_name, const int p_upper)
+{
+	size_t i, j = 0;
+
+	/* A capital after a lower-case letter or digit starts a new word: OrderBook -> order_book. */
+	for(i = 0; p_name[i] != 0; ++i) {
+		if(isupper((unsigned char)p_name[i]) && (i > 0) && (islower((unsigned char)p_name[i - 1]) || isdigit((unsigned char)p_name[i - 1])))
+			p_out[j++] = '_';
+		p_out[j++] = p_upper ? toupper((unsigned char)p_name[i]) : tolower((unsigned char)p_name[i]);
+	}
+	p_out[j] = 0;
+}
+
+
+
+static char *read_file(const char *const p_path)
+{
+	FILE *in;
+	char *text = NULL;
+	long size;
+
+	if((in = fopen(p_path, "r")) == NULL) {
+		fprintf(stderr, "%s: ", p_path);
+		process_errnum(errno);
+		return NULL;
+	}
+	if((fseek(in, 0, SEEK_END) == -1) || ((size = ftell(in)) == -1) || (fseek(in, 0, SEEK_SET) == -1)) {
+		fprintf(stderr, "%s: ", p_path);
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if((text = malloc(size + 1)) == NULL) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if(fread(text, 1, size, in) != (size_t)size) {
+		fprintf(stderr, "%s: read error\n", p_path);
+		free(text);
+		text = NULL;
+		goto do_exit;
+	}
+	text[size] = 0;
+
+do_exit:
+	fclose(in);
+	return text;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
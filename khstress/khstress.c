@@ -0,0 +1,559 @@
+/** @file khstress.c
+ * Multi-threaded stress and throughput tool for khello devices.
+ *
+ * N writer and M reader threads hammer one or more devices, each thread pinned to a chosen CPU. Record sizes follow a configurable distribution.
+ * After a warmup phase the counters are reset and the steady phase is measured. The tool reports per-thread and aggregate throughput,
+ * per-thread system call time percentiles and context switches, and the records the devices dropped.
+ * Writers normally never sleep in the driver, so voluntary context switches of a writer count the times it waited for a device lock.
+ *
+ * Usage:
+ * After loading the kernel module.
+ * 4 writers and 1 reader on /dev/khello: "./khstress -w 4 -r 1"
+ * 8 writers over 4 channels, pinned to CPUs 0-7, sizes uniform in 8..32: "./khstress -w 8 -r 4 -d /dev/khello -d /dev/khello1 -d /dev/khello2 -d /dev/khello3 -c 0,1,2,3,4,5,6,7 -z uniform:8:32"
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <time.h>
+#include "../khello2/khello.h"
+
+
+#define DEVICE "/dev/khello" /**< The character device. */
+#define MAX_DEVICES 64 /**< Maximum number of -d options. */
+#define MAX_THREADS 1024 /**< Maximum number of writers plus readers. */
+#define READ_SIZE (64 * 1024) /**< Bytes requested per read. */
+#define OP_BUCKETS 64 /**< log2 buckets of the system call time histogram. */
+
+#define PHASE_WARMUP 0 /**< Running, not counted. */
+#define PHASE_STEADY 1 /**< Running and counted. */
+#define PHASE_STOP 2 /**< Threads exit. */
+
+#define DIST_FIXED 0 /**< Every record has size a. */
+#define DIST_UNIFORM 1 /**< Sizes uniform in [a, b]. */
+#define DIST_BIMODAL 2 /**< Size a, or b with probability pct percent. */
+
+
+/** Record size distribution. */
+struct size_dist {
+	int kind; /**< DIST_*. */
+	int a; /**< See DIST_*. */
+	int b; /**< See DIST_*. */
+	int pct; /**< See DIST_BIMODAL. */
+};
+
+/** Options of the run. */
+struct options {
+	int writers; /**< Number of writer threads. */
+	int readers; /**< Number of reader threads. */
+	const char *devices[MAX_DEVICES]; /**< Devices. Threads are spread over them in turn. */
+	int num_devices; /**< Number of entries in devices. */
+	int cpus[MAX_THREADS]; /**< CPUs, used by writers then readers in turn. */
+	int num_cpus; /**< Number of entries in cpus. 0 leaves threads unpinned. */
+	struct size_dist dist; /**< Record sizes. */
+	int batch; /**< Records per KHELLO_IOC_SEND_BATCH. 0 uses write(). */
+	int warmup; /**< Warmup seconds. */
+	int duration; /**< Steady state seconds. */
+};
+
+/** State and counters of one thread. Aligned so threads do not share cache lines. */
+struct thread {
+	pthread_t id; /**< The thread. */
+	int index; /**< Position in g_threads. */
+	int writer; /**< 1 for a writer, 0 for a reader. */
+	int cpu; /**< Pinned CPU, -1 if not pinned. */
+	int device; /**< Index in options.devices. */
+	int error; /**< errno of a failure that ended the thread, else 0. */
+	unsigned long long ops; /**< System calls made in the steady phase. */
+	unsigned long long records; /**< Records written or read in the steady phase. */
+	unsigned long long bytes; /**< Payload bytes written or read in the steady phase. */
+	unsigned long long empty; /**< Reads that found the device empty. */
+	unsigned long long op_hist[OP_BUCKETS]; /**< System call time, bucket i counts [2^i, 2^(i+1)) ns. */
+	long nvcsw; /**< Voluntary context switches in the steady phase. */
+	long nivcsw; /**< Involuntary context switches in the steady phase. */
+} __attribute__((aligned(64)));
+
+
+static struct options g_opt; /**< Options of the run. */
+static struct thread *g_threads = NULL; /**< Writers followed by readers. */
+static volatile int g_phase = PHASE_WARMUP; /**< Current PHASE_*. */
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[]);
+
+/** Parses a size distribution: "fixed:n", "uniform:min:max" or "bimodal:small:large:pct".
+ *  @return 0 if OK. Else -1.
+ */
+static int parse_dist(const char *p_arg, struct size_dist *const p_dist);
+
+/** Entry point of the writer threads. */
+static void *writer_main(void *p_arg);
+
+/** Entry point of the reader threads. */
+static void *reader_main(void *p_arg);
+
+/** Pins the calling thread to its CPU and opens its device.
+ *  @param p_thread The thread.
+ *  @param p_flags Flags for open().
+ *  @return The file descriptor, or -1 with p_thread->error set.
+ */
+static int thread_start(struct thread *const p_thread, const int p_flags);
+
+/** Called by a thread on every loop. Tells whether to count the next operation, and takes the context switches when the steady phase starts and ends.
+ *  @param p_thread The thread.
+ *  @param p_seen The last phase seen by the thread. Updated.
+ *  @param p_usage Context switches at the start of the steady phase.
+ *  @return 1 if the operation that follows is counted, 0 if not, -1 if the thread must exit.
+ */
+static int thread_phase(struct thread *const p_thread, int *const p_seen, struct rusage *const p_usage);
+
+/** Returns the next record size of a thread.
+ *  @param p_seed Random state of the thread.
+ */
+static int next_size(unsigned int *const p_seed);
+
+/** Adds a system call time to the histogram of a thread. */
+static void add_op(struct thread *const p_thread, const unsigned long long p_ns);
+
+/** Returns a percentile of the system call time of a thread, as the upper bound of its bucket in ns. */
+static unsigned long long op_percentile(const struct thread *const p_thread, const double p_pct);
+
+/** Reads the drops counter of a device from sysfs.
+ *  @return The counter, or 0 if it could not be read.
+ */
+static unsigned long long read_drops(const char *const p_device);
+
+/** Prints the results of the steady phase. */
+static void report(const unsigned long long *const p_drops);
+
+/** Returns CLOCK_MONOTONIC in nanoseconds. */
+static unsigned long long now_ns();
+
+/** Process the value set in erno.
+ *  @param The errno itself.
+ */
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	int i, total, started = 0;
+	unsigned long long drops[MAX_DEVICES];
+	struct timespec pause;
+
+	if(check_args(argc, argv) == -1) {
+		printf("Usage: khstress [-w writers] [-r readers] [-d device]... [-c cpu,cpu,...] [-z fixed:n|uniform:min:max|bimodal:small:large:pct] [-b batch] [-W warmup_s] [-t steady_s]\n");
+		return 0;
+	}
+	total = g_opt.writers + g_opt.readers;
+	if((g_threads = aligned_alloc(64, total * sizeof(struct thread))) == NULL) {
+		process_errnum(ENOMEM);
+		return 1;
+	}
+	memset(g_threads, 0, total * sizeof(struct thread));
+
+	for(i = 0; i < total; ++i) {
+		g_threads[i].index = i;
+		g_threads[i].writer = (i < g_opt.writers);
+		g_threads[i].cpu = (g_opt.num_cpus > 0) ? g_opt.cpus[i % g_opt.num_cpus] : -1;
+		g_threads[i].device = (g_threads[i].writer ? i : i - g_opt.writers) % g_opt.num_devices;
+		if((errno = pthread_create(&g_threads[i].id, NULL, g_threads[i].writer ? writer_main : reader_main, &g_threads[i])) != 0) {
+			process_errnum(errno);
+			g_phase = PHASE_STOP;
+			break;
+		}
+		++started;
+	}
+
+	if(started == total) {
+		pause.tv_sec = g_opt.warmup;
+		pause.tv_nsec = 0;
+		nanosleep(&pause, NULL);
+		for(i = 0; i < g_opt.num_devices; ++i)
+			drops[i] = read_drops(g_opt.devices[i]);
+		__atomic_store_n(&g_phase, PHASE_STEADY, __ATOMIC_RELEASE);
+		pause.tv_sec = g_opt.duration;
+		nanosleep(&pause, NULL);
+		__atomic_store_n(&g_phase, PHASE_STOP, __ATOMIC_RELEASE);
+		for(i = 0; i < g_opt.num_devices; ++i)
+			drops[i] = read_drops(g_opt.devices[i]) - drops[i];
+	}
+	for(i = 0; i < started; ++i)
+		pthread_join(g_threads[i].id, NULL);
+	if(started == total)
+		report(drops);
+
+	free(g_threads);
+	return 0;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[])
+{
+	int c;
+	char *cpu, *save;
+
+	memset(&g_opt, 0, sizeof(g_opt));
+	g_opt.writers = 1;
+	g_opt.readers = 1;
+	g_opt.dist.kind = DIST_FIXED;
+	g_opt.dist.a = KHELLO_RECORD_MAX;
+	g_opt.warmup = 1;
+	g_opt.duration = 5;
+	while((c = getopt(p_num, p_args, "w:r:d:c:z:b:W:t:")) != -1) {
+		switch(c) {
+			case 'w':
+				if((g_opt.writers = atoi(optarg)) < 0)
+					return -1;
+				break;
+			case 'r':
+				if((g_opt.readers = atoi(optarg)) < 0)
+					return -1;
+				break;
+			case 'd':
+				if(g_opt.num_devices == MAX_DEVICES)
+					return -1;
+				g_opt.devices[g_opt.num_devices++] = optarg;
+				break;
+			case 'c':
+				for(cpu = strtok_r(optarg, ",", &save); (cpu != NULL) && (g_opt.num_cpus < MAX_THREADS); cpu = strtok_r(NULL, ",", &save))
+					g_opt.cpus[g_opt.num_cpus++] = atoi(cpu);
+				break;
+			case 'z':
+				if(parse_dist(optarg, &g_opt.dist) == -1)
+					return -1;
+				break;
+			case 'b':
+				if(((g_opt.batch = atoi(optarg)) < 0) || (g_opt.batch > KHELLO_BATCH_MAX))
+					return -1;
+				break;
+			case 'W':
+				if((g_opt.warmup = atoi(optarg)) < 0)
+					return -1;
+				break;
+			case 't':
+				if((g_opt.duration = atoi(optarg)) < 1)
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	if((g_opt.writers + g_opt.readers < 1) || (g_opt.writers + g_opt.readers > MAX_THREADS))
+		return -1;
+	if(g_opt.num_devices == 0)
+		g_opt.devices[g_opt.num_devices++] = DEVICE;
+	return 0;
+}
+
+
+
+static int parse_dist(const char *p_arg, struct size_dist *const p_dist)
+{
+	memset(p_dist, 0, sizeof(struct size_dist));
+	if(sscanf(p_arg, "fixed:%d", &p_dist->a) == 1)
+		p_dist->kind = DIST_FIXED;
+	else if(sscanf(p_arg, "uniform:%d:%d", &p_dist->a, &p_dist->b) == 2)
+		p_dist->kind = DIST_UNIFORM;
+	else if(sscanf(p_arg, "bimodal:%d:%d:%d", &p_dist->a, &p_dist->b, &p_dist->pct) == 3)
+		p_dist->kind = DIST_BIMODAL;
+	else
+		return -1;
+	/* The device truncates records to KHELLO_RECORD_MAX, so larger sizes would only be counted wrongly. */
+	if((p_dist->a < 0) || (p_dist->a > KHELLO_RECORD_MAX) || (p_dist->b < 0) || (p_dist->b > KHELLO_RECORD_MAX))
+		return -1;
+	if((p_dist->kind == DIST_UNIFORM) && (p_dist->b < p_dist->a))
+		return -1;
+	if((p_dist->pct < 0) || (p_dist->pct > 100))
+		return -1;
+	return 0;
+}
+
+
+
+static void *writer_main(void *p_arg)
+{
+	struct thread *thread = p_arg;
+	struct khello_msg msgs[KHELLO_BATCH_MAX];
+	struct khello_batch batch;
+	unsigned char data[KHELLO_RECORD_MAX];
+	unsigned long long start;
+	unsigned int seed = thread->index + 1;
+	int fd, i, size, count, seen = PHASE_WARMUP, counted;
+	size_t bytes;
+	struct rusage usage;
+
+	if((fd = thread_start(thread, O_WRONLY)) == -1)
+		return NULL;
+	memset(data, 'w', sizeof(data));
+	while((counted = thread_phase(thread, &seen, &usage)) != -1) {
+		start = now_ns();
+		if(g_opt.batch == 0) {
+			size = next_size(&seed);
+			if(write(fd, data, size) == -1) {
+				thread->error = errno;
+				break;
+			}
+			count = 1;
+			bytes = size;
+		} else {
+			for(i = 0, bytes = 0; i < g_opt.batch; ++i) {
+				msgs[i].addr = (uintptr_t)data;
+				msgs[i].len = next_size(&seed);
+				msgs[i].reserved = 0;
+				bytes += msgs[i].len;
+			}
+			batch.msgs = (uintptr_t)msgs;
+			batch.count = g_opt.batch;
+			batch.done = 0;
+			if((count = ioctl(fd, KHELLO_IOC_SEND_BATCH, &batch)) == -1) {
+				thread->error = errno;
+				break;
+			}
+		}
+		if(counted) {
+			add_op(thread, now_ns() - start);
+			++thread->ops;
+			thread->records += count;
+			thread->bytes += bytes;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+
+
+static void *reader_main(void *p_arg)
+{
+	struct thread *thread = p_arg;
+	struct khello_rec_hdr hdr;
+	unsigned long long start;
+	unsigned char *buf;
+	__u32 flags = KHELLO_RECV_HDR;
+	ssize_t count, pos;
+	int fd, seen = PHASE_WARMUP, counted;
+	struct pollfd pfd;
+	struct rusage usage;
+
+	if((buf = malloc(READ_SIZE)) == NULL) {
+		thread->error = ENOMEM;
+		return NULL;
+	}
+	if((fd = thread_start(thread, O_RDONLY | O_NONBLOCK)) == -1) {
+		free(buf);
+		return NULL;
+	}
+	/* Record headers let the reader count records and payload bytes exactly. */
+	if(ioctl(fd, KHELLO_IOC_SET_RECV, &flags) == -1) {
+		thread->error = errno;
+		goto do_exit;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while((counted = thread_phase(thread, &seen, &usage)) != -1) {
+		start = now_ns();
+		count = read(fd, buf, READ_SIZE);
+		if(counted)
+			add_op(thread, now_ns() - start);
+		if(count == -1) {
+			if(errno != EAGAIN) {
+				thread->error = errno;
+				break;
+			}
+			if(counted)
+				++thread->empty;
+			poll(&pfd, 1, 100); /* Short timeout so the end of the run is noticed. */
+			continue;
+		}
+		if(!counted)
+			continue;
+		++thread->ops;
+		for(pos = 0; pos + (ssize_t)sizeof(hdr) <= count; pos += sizeof(hdr) + hdr.len) {
+			memcpy(&hdr, buf + pos, sizeof(hdr));
+			++thread->records;
+			thread->bytes += hdr.len;
+		}
+	}
+
+do_exit:
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+
+
+static int thread_start(struct thread *const p_thread, const int p_flags)
+{
+	cpu_set_t set;
+	int fd;
+
+	if(p_thread->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(p_thread->cpu, &set);
+		if((errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+			p_thread->error = errno;
+			return -1;
+		}
+	}
+	if((fd = open(g_opt.devices[p_thread->device], p_flags)) == -1)
+		p_thread->error = errno;
+	return fd;
+}
+
+
+
+static int thread_phase(struct thread *const p_thread, int *const p_seen, struct rusage *const p_usage)
+{
+	struct rusage usage;
+	int phase = __atomic_load_n(&g_phase, __ATOMIC_ACQUIRE);
+
+	if(phase == *p_seen)
+		return (phase == PHASE_STEADY);
+	if(phase == PHASE_STOP) {
+		/* Save the context switches of the steady phase, if the thread saw it. */
+		if((*p_seen == PHASE_STEADY) && (getrusage(RUSAGE_THREAD, &usage) == 0)) {
+			p_thread->nvcsw = usage.ru_nvcsw - p_usage->ru_nvcsw;
+			p_thread->nivcsw = usage.ru_nivcsw - p_usage->ru_nivcsw;
+		}
+		*p_seen = phase;
+		return -1;
+	}
+	*p_seen = phase;
+	getrusage(RUSAGE_THREAD, p_usage);
+	return 1;
+}
+
+
+
+static int next_size(unsigned int *const p_seed)
+{
+	switch(g_opt.dist.kind) {
+		case DIST_UNIFORM:
+			return g_opt.dist.a + rand_r(p_seed) % (g_opt.dist.b - g_opt.dist.a + 1);
+		case DIST_BIMODAL:
+			return (rand_r(p_seed) % 100 < g_opt.dist.pct) ? g_opt.dist.b : g_opt.dist.a;
+		default:
+			return g_opt.dist.a;
+	}
+}
+
+
+
+static void add_op(struct thread *const p_thread, const unsigned long long p_ns)
+{
+	++p_thread->op_hist[(p_ns > 0) ? 63 - __builtin_clzll(p_ns) : 0];
+}
+
+
+
+static unsigned long long op_percentile(const struct thread *const p_thread, const double p_pct)
+{
+	unsigned long long total = 0, seen = 0;
+	int i;
+
+	for(i = 0; i < OP_BUCKETS; ++i)
+		total += p_thread->op_hist[i];
+	for(i = 0; i < OP_BUCKETS; ++i) {
+		seen += p_thread->op_hist[i];
+		if((seen > 0) && (seen >= total * p_pct))
+			return (2ULL << i) - 1;
+	}
+	return 0;
+}
+
+
+
+static unsigned long long read_drops(const char *const p_device)
+{
+	char path[512], copy[256], buf[32];
+	unsigned long long drops = 0;
+	int fd;
+	ssize_t count;
+
+	snprintf(copy, sizeof(copy), "%s", p_device);
+	snprintf(path, sizeof(path), "%s/%s/drops", KHELLO_SYSFS_DIR, basename(copy));
+	if((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	if((count = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[count] = 0;
+		drops = strtoull(buf, NULL, 10);
+	}
+	close(fd);
+	return drops;
+}
+
+
+
+static void report(const unsigned long long *const p_drops)
+{
+	struct thread *thread;
+	unsigned long long records[2] = { 0, 0 }, bytes[2] = { 0, 0 }, ops[2] = { 0, 0 }, drops = 0;
+	long vcsw[2] = { 0, 0 }, ivcsw[2] = { 0, 0 };
+	double secs = g_opt.duration;
+	int i;
+
+	printf("thread role    cpu device            ops/s   records/s       MB/s  p50 op ns  p99 op ns     vcsw    ivcsw      empty\n");
+	for(i = 0; i < g_opt.writers + g_opt.readers; ++i) {
+		thread = &g_threads[i];
+		if(thread->error != 0) {
+			printf("%6d %-6s  failed: %s\n", i, thread->writer ? "writer" : "reader", strerror(thread->error));
+			continue;
+		}
+		printf("%6d %-6s %4d %-14s %10.0f %11.0f %10.2f %10llu %10llu %8ld %8ld %10llu\n", i, thread->writer ? "writer" : "reader", thread->cpu,
+			g_opt.devices[thread->device], thread->ops / secs, thread->records / secs, thread->bytes / secs / 1e6,
+			op_percentile(thread, 0.5), op_percentile(thread, 0.99), thread->nvcsw, thread->nivcsw, thread->empty);
+		records[thread->writer] += thread->records;
+		bytes[thread->writer] += thread->bytes;
+		ops[thread->writer] += thread->ops;
+		vcsw[thread->writer] += thread->nvcsw;
+		ivcsw[thread->writer] += thread->nivcsw;
+	}
+	for(i = 1; i >= 0; --i) {
+		if((i ? g_opt.writers : g_opt.readers) == 0)
+			continue;
+		printf("total  %-6s %4s %-14s %10.0f %11.0f %10.2f %10s %10s %8ld %8ld\n", i ? "writer" : "reader", "", "",
+			ops[i] / secs, records[i] / secs, bytes[i] / secs / 1e6, "", "", vcsw[i], ivcsw[i]);
+	}
+	for(i = 0; i < g_opt.num_devices; ++i)
+		drops += p_drops[i];
+	printf("steady phase %d s, records dropped by the devices: %llu\n", g_opt.duration, drops);
+}
+
+
+
+static unsigned long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	fprintf(stderr, "%s\n", strerror(p_errnum));
+}
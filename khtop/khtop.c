@@ -0,0 +1,364 @@
+/** @file khtop.c
+ * Live terminal monitor for khello devices. Shows per-device rates, occupancy, drops, queueing latency percentiles and reader/writer counts.
+ *
+ * The statistics are read from the sysfs attributes exported by the khello2 kernel module. The attribute files are opened once and re-read with pread() at each refresh so monitoring costs a few system calls per device.
+ *
+ * Usage:
+ * After loading the kernel module.
+ * Refresh every 500 ms: "./khtop"
+ * Refresh every 200 ms: "./khtop -i 200"
+ * Print 5 refreshes and exit: "./khtop -n 5"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include "../khello2/khello.h"
+
+
+#define MAX_CHANNELS 4096 /**< Maximum number of devices monitored. */
+#define OUT_SIZE (256 * 1024) /**< Size of the buffer holding one screen. */
+
+
+/** Attributes read for each device. The order matches g_attr_names. */
+enum attr_index {
+	A_RING_SIZE,
+	A_BYTES_QUEUED,
+	A_RECORDS_QUEUED,
+	A_HIGH_WATER,
+	A_DROPS,
+	A_BYTES_OUT,
+	A_RECORDS_IN,
+	A_RECORDS_OUT,
+	A_READERS,
+	A_WRITERS,
+	A_LATENCY_HIST,
+	NUM_ATTRS
+};
+
+static const char *const g_attr_names[NUM_ATTRS] = {
+	"ring_size", "bytes_queued", "records_queued", "high_water", "drops",
+	"bytes_out", "records_in", "records_out", "readers", "writers", "latency_hist"
+};
+
+
+/** State of one monitored device. */
+struct channel {
+	char name[64]; /**< Device name. */
+	int fd[NUM_ATTRS]; /**< Open attribute files. */
+	unsigned long long val[NUM_ATTRS]; /**< Latest values. Unused for A_LATENCY_HIST. */
+	unsigned long long prev[NUM_ATTRS]; /**< Values at the previous refresh. */
+	unsigned long long hist[KHELLO_LAT_BUCKETS]; /**< Latest latency histogram. */
+	unsigned long long prev_hist[KHELLO_LAT_BUCKETS]; /**< Latency histogram at the previous refresh. */
+};
+
+
+static struct channel *g_channels = NULL; /**< Monitored devices. */
+static int g_num_channels = 0; /**< Number of entries in g_channels. */
+static char *g_out = NULL; /**< Screen buffer. Written with a single write() per refresh. */
+
+
+/** Check the arguments on the command line.
+ *  @param p_num Number of arguments
+ *  @param p_args List of arguments
+ *  @param p_interval Returns the refresh interval in milliseconds.
+ *  @param p_count Returns the number of refreshes, 0 for no limit.
+ *  @return 0 if arguments are OK. Else -1.
+ */
+static int check_args(const int p_num, char *p_args[], long *p_interval, long *p_count);
+
+/** Opens the attribute files of all devices under KHELLO_SYSFS_DIR. Closes previously opened files.
+ *  @return Number of devices found, or -1 on error.
+ */
+static int scan_channels();
+
+/** Closes the attribute files of all devices. */
+static void close_channels();
+
+/** Reads the current attribute values of a device.
+ *  @param p_chan The device.
+ *  @return 0 if OK. -1 if an attribute could not be read, usually because the device was removed.
+ */
+static int sample_channel(struct channel *const p_chan);
+
+/** Formats a duration in nanoseconds in a short human readable form.
+ *  @param p_ns The duration.
+ *  @param p_buf Output buffer.
+ *  @param p_size Size of p_buf.
+ */
+static void format_ns(const unsigned long long p_ns, char *p_buf, const size_t p_size);
+
+/** Returns a latency percentile from the histogram delta of a device.
+ *  @param p_chan The device.
+ *  @param p_pct Percentile between 0 and 1.
+ *  @return Upper bound in nanoseconds of the bucket holding the percentile. 0 if there were no samples.
+ */
+static unsigned long long percentile(const struct channel *const p_chan, const double p_pct);
+
+/** Compares two devices for sorting by descending number of queued records. */
+static int compare_queued(const void *p_a, const void *p_b);
+
+/** Draws one screen.
+ *  @param p_secs Seconds elapsed since the previous refresh.
+ */
+static void draw(const double p_secs);
+
+/** Process the value set in erno.
+ *  @param The errno itself.
+ */
+static void process_errnum(const int p_errnum);
+
+
+
+int main(int argc, char *argv[])
+{
+	long interval, count, i;
+	int c;
+	struct timespec now, last, pause;
+	double secs;
+
+	if(check_args(argc, argv, &interval, &count) == -1) {
+		printf("Usage: khtop [-i interval_ms] [-n count]\n");
+		return 0;
+	}
+
+	if(((g_channels = calloc(MAX_CHANNELS, sizeof(struct channel))) == NULL) || ((g_out = malloc(OUT_SIZE)) == NULL)) {
+		process_errnum(ENOMEM);
+		goto do_exit;
+	}
+	if(scan_channels() == -1)
+		goto do_exit;
+
+	/* Take a first sample so the first screen shows rates. */
+	for(c = 0; c < g_num_channels; ++c)
+		sample_channel(&g_channels[c]);
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	pause.tv_sec = interval / 1000;
+	pause.tv_nsec = (interval % 1000) * 1000000;
+
+	for(i = 0; (count == 0) || (i < count); ++i) {
+		nanosleep(&pause, NULL);
+		for(c = 0; c < g_num_channels; ++c) {
+			if(sample_channel(&g_channels[c]) == -1) { /* A device went away, so start again. */
+				if(scan_channels() == -1)
+					goto do_exit;
+				break;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		last = now;
+		if(c == g_num_channels)
+			draw(secs);
+	}
+
+do_exit:
+	close_channels();
+	free(g_channels);
+	free(g_out);
+	return 0;
+}
+
+
+
+static int check_args(const int p_num, char *p_args[], long *p_interval, long *p_count)
+{
+	int c;
+
+	*p_interval = 500;
+	*p_count = 0;
+	while((c = getopt(p_num, p_args, "i:n:")) != -1) {
+		switch(c) {
+			case 'i':
+				if((*p_interval = atol(optarg)) < 10)
+					return -1;
+				break;
+			case 'n':
+				if((*p_count = atol(optarg)) < 0)
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+
+static int scan_channels()
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct channel *chan;
+	char path[512];
+	int i;
+
+	close_channels();
+	if((dir = opendir(KHELLO_SYSFS_DIR)) == NULL) {
+		process_errnum(errno);
+		return -1;
+	}
+	while(((entry = readdir(dir)) != NULL) && (g_num_channels < MAX_CHANNELS)) {
+		if(entry->d_name[0] == '.')
+			continue;
+		chan = &g_channels[g_num_channels];
+		memset(chan, 0, sizeof(struct channel));
+		snprintf(chan->name, sizeof(chan->name), "%.63s", entry->d_name);
+		for(i = 0; i < NUM_ATTRS; ++i) {
+			snprintf(path, sizeof(path), "%s/%s/%s", KHELLO_SYSFS_DIR, entry->d_name, g_attr_names[i]);
+			if((chan->fd[i] = open(path, O_RDONLY)) == -1)
+				break;
+		}
+		if(i < NUM_ATTRS) { /* Not a khello device, or from an older module. */
+			while(--i >= 0)
+				close(chan->fd[i]);
+			continue;
+		}
+		sample_channel(chan);
+		memcpy(chan->prev, chan->val, sizeof(chan->prev));
+		memcpy(chan->prev_hist, chan->hist, sizeof(chan->prev_hist));
+		++g_num_channels;
+	}
+	closedir(dir);
+	return g_num_channels;
+}
+
+
+
+static void close_channels()
+{
+	int c, i;
+
+	for(c = 0; c < g_num_channels; ++c)
+		for(i = 0; i < NUM_ATTRS; ++i)
+			close(g_channels[c].fd[i]);
+	g_num_channels = 0;
+}
+
+
+
+static int sample_channel(struct channel *const p_chan)
+{
+	char buf[1024], *pos, *end;
+	ssize_t count;
+	int i, b;
+
+	memcpy(p_chan->prev, p_chan->val, sizeof(p_chan->prev));
+	memcpy(p_chan->prev_hist, p_chan->hist, sizeof(p_chan->prev_hist));
+	for(i = 0; i < NUM_ATTRS; ++i) {
+		if((count = pread(p_chan->fd[i], buf, sizeof(buf) - 1, 0)) <= 0)
+			return -1;
+		buf[count] = 0;
+		if(i != A_LATENCY_HIST) {
+			p_chan->val[i] = strtoull(buf, NULL, 0);
+			continue;
+		}
+		pos = buf;
+		for(b = 0; b < KHELLO_LAT_BUCKETS; ++b) {
+			p_chan->hist[b] = strtoull(pos, &end, 10);
+			if(end == pos)
+				break;
+			pos = end;
+		}
+	}
+	return 0;
+}
+
+
+
+static void format_ns(const unsigned long long p_ns, char *p_buf, const size_t p_size)
+{
+	if(p_ns == 0)
+		snprintf(p_buf, p_size, "-");
+	else if(p_ns < 1000ULL)
+		snprintf(p_buf, p_size, "%lluns", p_ns);
+	else if(p_ns < 1000000ULL)
+		snprintf(p_buf, p_size, "%.1fus", p_ns / 1e3);
+	else if(p_ns < 1000000000ULL)
+		snprintf(p_buf, p_size, "%.1fms", p_ns / 1e6);
+	else
+		snprintf(p_buf, p_size, "%.1fs", p_ns / 1e9);
+}
+
+
+
+static unsigned long long percentile(const struct channel *const p_chan, const double p_pct)
+{
+	unsigned long long total = 0, sum = 0;
+	int b;
+
+	for(b = 0; b < KHELLO_LAT_BUCKETS; ++b)
+		total += p_chan->hist[b] - p_chan->prev_hist[b];
+	if(total == 0)
+		return 0;
+	for(b = 0; b < KHELLO_LAT_BUCKETS; ++b) {
+		sum += p_chan->hist[b] - p_chan->prev_hist[b];
+		if(sum >= total * p_pct)
+			break;
+	}
+	if(b >= KHELLO_LAT_BUCKETS)
+		b = KHELLO_LAT_BUCKETS - 1;
+	return 2ULL << b;
+}
+
+
+
+static int compare_queued(const void *p_a, const void *p_b)
+{
+	const struct channel *a = p_a, *b = p_b;
+
+	if(a->val[A_RECORDS_QUEUED] != b->val[A_RECORDS_QUEUED])
+		return (a->val[A_RECORDS_QUEUED] < b->val[A_RECORDS_QUEUED]) ? 1 : -1;
+	return strcmp(a->name, b->name);
+}
+
+
+
+static void draw(const double p_secs)
+{
+	struct channel *chan;
+	char p50[16], p99[16], p999[16];
+	size_t len = 0;
+	int c;
+
+	qsort(g_channels, g_num_channels, sizeof(struct channel), compare_queued);
+	len += snprintf(g_out + len, OUT_SIZE - len, "\033[H\033[2Jkhtop - %d devices, %.0f ms interval\n\n", g_num_channels, p_secs * 1000);
+	len += snprintf(g_out + len, OUT_SIZE - len, "%-16s %8s %8s %8s %8s %10s %10s %10s %10s %4s %4s %8s %8s %8s\n",
+		"DEVICE", "RING", "QUEUED", "QBYTES", "HWM", "DROPS/s", "IN/s", "OUT/s", "OUT KB/s", "RD", "WR", "P50", "P99", "P99.9");
+	for(c = 0; (c < g_num_channels) && (len < OUT_SIZE - 256); ++c) {
+		chan = &g_channels[c];
+		format_ns(percentile(chan, 0.5), p50, sizeof(p50));
+		format_ns(percentile(chan, 0.99), p99, sizeof(p99));
+		format_ns(percentile(chan, 0.999), p999, sizeof(p999));
+		len += snprintf(g_out + len, OUT_SIZE - len, "%-16s %8llu %8llu %8llu %8llu %10.0f %10.0f %10.0f %10.1f %4llu %4llu %8s %8s %8s\n",
+			chan->name,
+			chan->val[A_RING_SIZE],
+			chan->val[A_RECORDS_QUEUED],
+			chan->val[A_BYTES_QUEUED],
+			chan->val[A_HIGH_WATER],
+			(chan->val[A_DROPS] - chan->prev[A_DROPS]) / p_secs,
+			(chan->val[A_RECORDS_IN] - chan->prev[A_RECORDS_IN]) / p_secs,
+			(chan->val[A_RECORDS_OUT] - chan->prev[A_RECORDS_OUT]) / p_secs,
+			(chan->val[A_BYTES_OUT] - chan->prev[A_BYTES_OUT]) / p_secs / 1024,
+			chan->val[A_READERS],
+			chan->val[A_WRITERS],
+			p50, p99, p999);
+	}
+	if(write(STDOUT_FILENO, g_out, len) == -1)
+		process_errnum(errno);
+}
+
+
+
+static void process_errnum(const int p_errnum)
+{
+	printf("%s\n", strerror(p_errnum));
+}
@@ -0,0 +1,608 @@
+/** @file dispatch.c
+ * Work-stealing dispatcher of libkhello. See dispatch.h.
+ *
+ * The deques follow "Correct and Efficient Work-Stealing for Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013), with a fixed capacity:
+ * an owner that finds its deque full leaves the rest in its inboxes until it has room.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "dispatch.h"
+
+
+#define DEQUE_SIZE 4096 /**< Records a worker's deque holds. A power of 2. */
+#define INBOX_SIZE 512 /**< Records an inbox holds. A power of 2, at least one full batch. */
+#define BATCH_BYTES 4096 /**< Read buffer of a batch. */
+#define BATCH_RECS (BATCH_BYTES / sizeof(struct khello_rec_hdr) + 1) /**< Most records in a batch. */
+#define BATCHES 64 /**< Batches per I/O thread. When all are in use the I/O thread waits for the workers. */
+#define POLL_MS 100 /**< Longest wait of an I/O thread for records, so it notices khl_dispatch_stop(). */
+#define SLEEP_MS 10 /**< Longest sleep of an idle worker. Wakeups are explicit; this only bounds the cost of a lost one. */
+#define NAP_NS 50000 /**< Wait of an I/O thread that is ahead of the workers. */
+#define CACHE_LINE 64
+
+
+/** A batch: one read of a channel, and the items pointing into it. Freed when its last record has been handled. */
+struct khl_buf {
+	struct khl_buf *next; /**< Next free batch. */
+	struct khl_io *io; /**< I/O thread owning the batch. */
+	int refs; /**< Records not yet handled. */
+	unsigned char data[BATCH_BYTES]; /**< The bytes read. */
+	struct khl_item items[BATCH_RECS]; /**< The records. */
+};
+
+/** Single-producer single-consumer queue from an I/O thread to a worker. */
+struct inbox {
+	unsigned int head __attribute__((aligned(CACHE_LINE))); /**< Next item to fill. Written by the I/O thread. */
+	unsigned int tail __attribute__((aligned(CACHE_LINE))); /**< Next item to take. Written by the worker. */
+	struct khl_item *items[INBOX_SIZE] __attribute__((aligned(CACHE_LINE)));
+};
+
+/** Chase-Lev deque. The owner pushes and pops at bottom, thieves steal at top. */
+struct deque {
+	long top __attribute__((aligned(CACHE_LINE))); /**< Oldest item. Advanced by thieves and by the owner taking the last item. */
+	long bottom __attribute__((aligned(CACHE_LINE))); /**< One past the newest item. Written by the owner. */
+	struct khl_item *items[DEQUE_SIZE] __attribute__((aligned(CACHE_LINE)));
+};
+
+/** A worker thread. */
+struct worker {
+	struct deque deque; /**< Records to handle. */
+	struct khl_dispatch *disp; /**< The dispatcher. */
+	int index; /**< Index of the worker. */
+	unsigned int seed; /**< State of the victim picker. */
+	int sleeping; /**< Non-zero while the worker sleeps or is about to. */
+	pthread_mutex_t lock; /**< Protects the sleep. */
+	pthread_cond_t cond; /**< Signalled to wake the worker. */
+	pthread_t thread;
+	unsigned long long handled __attribute__((aligned(CACHE_LINE))); /**< Records handled. */
+	unsigned long long steals; /**< Records stolen. */
+	unsigned long long sleeps; /**< Sleeps taken. */
+};
+
+/** An I/O thread, reading one channel. */
+struct khl_io {
+	struct khl_dispatch *disp; /**< The dispatcher. */
+	struct khl_channel *chan; /**< The channel read. */
+	int index; /**< Index of the channel. */
+	int next_worker; /**< Worker given the next batch. */
+	int error; /**< errno of the read that stopped the thread, 0 if none. */
+	struct khl_buf *bufs; /**< The batches. */
+	struct khl_buf *free; /**< Free batches, used by this thread only. */
+	struct khl_buf *freed __attribute__((aligned(CACHE_LINE))); /**< Batches freed by the workers, taken all at once by this thread. */
+	pthread_t thread;
+	unsigned long long records __attribute__((aligned(CACHE_LINE))); /**< Records read. */
+	unsigned long long batches; /**< Reads made. */
+	unsigned long long stalls; /**< Waits for the workers. */
+};
+
+/** The dispatcher. */
+struct khl_dispatch {
+	khl_handler fn; /**< The handler. */
+	void *arg; /**< Its argument. */
+	int num_workers;
+	int num_io;
+	int stop; /**< Set to stop the I/O threads. */
+	int io_done; /**< Set once the I/O threads have stopped, so the workers exit when they run dry. */
+	struct worker *workers; /**< The workers, cache-line aligned. */
+	struct khl_io io[KHL_DISPATCH_CHANS_MAX]; /**< The I/O threads. */
+	struct inbox *inboxes; /**< Inbox of worker w from I/O thread i at i * num_workers + w. */
+};
+
+
+/** Reads a channel into batches and hands them to the workers. A pthread start routine.
+ *  @param p_io The I/O thread.
+ *  @return NULL.
+ */
+static void *io_main(void *p_io);
+
+/** Hands a batch to the next worker whose inbox has room, and wakes it if it sleeps.
+ *  @param p_io The I/O thread.
+ *  @param p_buf The batch.
+ *  @param p_num Number of records in it.
+ */
+static void io_hand_over(struct khl_io *const p_io, struct khl_buf *const p_buf, const int p_num);
+
+/** Takes a free batch, waiting while the workers hold all of them.
+ *  @return The batch, or NULL if the dispatcher stops meanwhile.
+ */
+static struct khl_buf *io_get_buf(struct khl_io *const p_io);
+
+/** Handles records until the I/O threads have stopped and no record is left. A pthread start routine.
+ *  @param p_worker The worker.
+ *  @return NULL.
+ */
+static void *worker_main(void *p_worker);
+
+/** Moves the records of the worker's inboxes into its deque, as far as it has room.
+ *  @return Number of records moved.
+ */
+static int worker_refill(struct worker *const p_worker);
+
+/** Steals one record from another worker, trying each once from a random start.
+ *  @return The record, or NULL if none was found.
+ */
+static struct khl_item *worker_steal(struct worker *const p_worker);
+
+/** Sleeps until woken, or SLEEP_MS, unless there is work after all. */
+static void worker_sleep(struct worker *const p_worker);
+
+/** Tells whether any inbox of the worker or any deque has records. */
+static int worker_has_work(const struct worker *const p_worker);
+
+/** Runs the handler on a record and frees its batch if it was the last one. */
+static void worker_run(struct worker *const p_worker, struct khl_item *const p_item);
+
+/** Wakes a worker if it sleeps. Called after publishing work, so the store and the check of sleeping cannot both miss. */
+static void wake(struct worker *const p_worker);
+
+/** Pushes a record at the bottom of a deque. Owner only.
+ *  @return 0 if OK. -1 if the deque is full.
+ */
+static int deque_push(struct deque *const p_deque, struct khl_item *const p_item);
+
+/** Pops the newest record of a deque. Owner only.
+ *  @return The record, or NULL if the deque is empty.
+ */
+static struct khl_item *deque_pop(struct deque *const p_deque);
+
+/** Steals the oldest record of a deque. Any thread.
+ *  @return The record, or NULL if the deque is empty or another thread took it first.
+ */
+static struct khl_item *deque_steal(struct deque *const p_deque);
+
+/** Number of records in a deque, approximately when read by another thread. */
+static long deque_size(const struct deque *const p_deque);
+
+
+
+struct khl_dispatch *khl_dispatch_start(struct khl_channel *const p_chans, const int p_num_chans, const int p_workers, const khl_handler p_fn, void *const p_arg)
+{
+	struct khl_dispatch *disp;
+	int i, j, init_workers = 0, started_io = 0, started_workers = 0, result;
+
+	if((p_num_chans < 1) || (p_num_chans > KHL_DISPATCH_CHANS_MAX) || (p_workers < 1) || (p_workers > KHL_DISPATCH_WORKERS_MAX) || (p_fn == NULL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if((disp = calloc(1, sizeof(struct khl_dispatch))) == NULL)
+		return NULL;
+	disp->fn = p_fn;
+	disp->arg = p_arg;
+	disp->num_workers = p_workers;
+	disp->num_io = p_num_chans;
+	if(((result = posix_memalign((void**)&disp->workers, CACHE_LINE, p_workers * sizeof(struct worker))) != 0) ||
+		((result = posix_memalign((void**)&disp->inboxes, CACHE_LINE, p_num_chans * p_workers * sizeof(struct inbox))) != 0)) {
+		errno = result;
+		goto do_error;
+	}
+	memset(disp->workers, 0, p_workers * sizeof(struct worker));
+	memset(disp->inboxes, 0, p_num_chans * p_workers * sizeof(struct inbox));
+
+	for(i = 0; i < p_num_chans; ++i) {
+		disp->io[i].disp = disp;
+		disp->io[i].chan = &p_chans[i];
+		disp->io[i].index = i;
+		disp->io[i].next_worker = i % p_workers;
+		if((disp->io[i].bufs = calloc(BATCHES, sizeof(struct khl_buf))) == NULL)
+			goto do_error;
+		for(j = 0; j < BATCHES; ++j) {
+			disp->io[i].bufs[j].io = &disp->io[i];
+			disp->io[i].bufs[j].next = disp->io[i].free;
+			disp->io[i].free = &disp->io[i].bufs[j];
+		}
+	}
+	for(; init_workers < p_workers; ++init_workers) {
+		disp->workers[init_workers].disp = disp;
+		disp->workers[init_workers].index = init_workers;
+		disp->workers[init_workers].seed = init_workers * 2654435761u + 1;
+		pthread_mutex_init(&disp->workers[init_workers].lock, NULL);
+		pthread_cond_init(&disp->workers[init_workers].cond, NULL);
+	}
+
+	/* Workers first, so the first batches find them. */
+	for(; started_workers < p_workers; ++started_workers) {
+		if((result = pthread_create(&disp->workers[started_workers].thread, NULL, worker_main, &disp->workers[started_workers])) != 0) {
+			errno = result;
+			goto do_error;
+		}
+	}
+	for(; started_io < p_num_chans; ++started_io) {
+		if((result = pthread_create(&disp->io[started_io].thread, NULL, io_main, &disp->io[started_io])) != 0) {
+			errno = result;
+			goto do_error;
+		}
+	}
+	return disp;
+
+do_error:
+	result = errno;
+	__atomic_store_n(&disp->stop, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < started_io; ++i)
+		pthread_join(disp->io[i].thread, NULL);
+	__atomic_store_n(&disp->io_done, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < started_workers; ++i) {
+		wake(&disp->workers[i]);
+		pthread_join(disp->workers[i].thread, NULL);
+	}
+	for(i = 0; i < p_num_chans; ++i)
+		free(disp->io[i].bufs);
+	/* Only the workers reached by the init loop have a lock and a condition variable. */
+	for(i = 0; i < init_workers; ++i) {
+		pthread_mutex_destroy(&disp->workers[i].lock);
+		pthread_cond_destroy(&disp->workers[i].cond);
+	}
+	free(disp->workers);
+	free(disp->inboxes);
+	free(disp);
+	errno = result;
+	return NULL;
+}
+
+
+
+int khl_dispatch_stop(struct khl_dispatch *const p_disp)
+{
+	int i, error = 0;
+
+	__atomic_store_n(&p_disp->stop, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < p_disp->num_io; ++i) {
+		pthread_join(p_disp->io[i].thread, NULL);
+		if(p_disp->io[i].error != 0)
+			error = p_disp->io[i].error;
+	}
+	/* Every record read is in an inbox or a deque now; the workers exit once they have handled them all. */
+	__atomic_store_n(&p_disp->io_done, 1, __ATOMIC_SEQ_CST);
+	for(i = 0; i < p_disp->num_workers; ++i)
+		wake(&p_disp->workers[i]);
+	for(i = 0; i < p_disp->num_workers; ++i) {
+		pthread_join(p_disp->workers[i].thread, NULL);
+		pthread_mutex_destroy(&p_disp->workers[i].lock);
+		pthread_cond_destroy(&p_disp->workers[i].cond);
+	}
+	for(i = 0; i < p_disp->num_io; ++i)
+		free(p_disp->io[i].bufs);
+	free(p_disp->workers);
+	free(p_disp->inboxes);
+	free(p_disp);
+	if(error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+
+
+void khl_dispatch_stats(const struct khl_dispatch *const p_disp, struct khl_dispatch_stats *const p_stats)
+{
+	const struct worker *worker;
+	int i;
+
+	memset(p_stats, 0, sizeof(struct khl_dispatch_stats));
+	for(i = 0; i < p_disp->num_io; ++i) {
+		p_stats->records += __atomic_load_n(&p_disp->io[i].records, __ATOMIC_RELAXED);
+		p_stats->batches += __atomic_load_n(&p_disp->io[i].batches, __ATOMIC_RELAXED);
+		p_stats->stalls += __atomic_load_n(&p_disp->io[i].stalls, __ATOMIC_RELAXED);
+	}
+	for(i = 0; i < p_disp->num_workers; ++i) {
+		worker = &p_disp->workers[i];
+		p_stats->handled_by[i] = __atomic_load_n(&worker->handled, __ATOMIC_RELAXED);
+		p_stats->handled += p_stats->handled_by[i];
+		p_stats->steals += __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+		p_stats->sleeps += __atomic_load_n(&worker->sleeps, __ATOMIC_RELAXED);
+	}
+}
+
+
+
+static void *io_main(void *p_io)
+{
+	struct khl_io *io = p_io;
+	struct khl_record recs[BATCH_RECS];
+	struct khl_buf *buf;
+	int num, i, ready;
+
+	while(!__atomic_load_n(&io->disp->stop, __ATOMIC_ACQUIRE)) {
+		if((buf = io_get_buf(io)) == NULL)
+			break;
+		if((ready = khl_wait_readable(io->chan, POLL_MS)) <= 0) {
+			if((ready == -1) && (errno != EINTR)) {
+				io->error = errno;
+				break;
+			}
+			buf->next = io->free;
+			io->free = buf;
+			continue;
+		}
+		if((num = khl_recv(io->chan, buf->data, BATCH_BYTES, recs, BATCH_RECS)) <= 0) {
+			buf->next = io->free;
+			io->free = buf;
+			if((num == -1) && (errno != EAGAIN) && (errno != EINTR)) {
+				io->error = errno;
+				break;
+			}
+			continue;
+		}
+		for(i = 0; i < num; ++i) {
+			buf->items[i].rec = recs[i];
+			buf->items[i].chan = io->index;
+			buf->items[i].buf = buf;
+		}
+		buf->refs = num;
+		__atomic_store_n(&io->records, io->records + num, __ATOMIC_RELAXED);
+		__atomic_store_n(&io->batches, io->batches + 1, __ATOMIC_RELAXED);
+		io_hand_over(io, buf, num);
+	}
+	return NULL;
+}
+
+
+
+static void io_hand_over(struct khl_io *const p_io, struct khl_buf *const p_buf, const int p_num)
+{
+	struct khl_dispatch *disp = p_io->disp;
+	struct timespec nap = { 0, NAP_NS };
+	struct inbox *inbox;
+	unsigned int head;
+	int w, tries, i;
+
+	/* Round robin, skipping workers whose inbox is too full for the batch. */
+	for(tries = 0; ; ++tries) {
+		w = p_io->next_worker;
+		p_io->next_worker = (w + 1) % disp->num_workers;
+		inbox = &disp->inboxes[p_io->index * disp->num_workers + w];
+		head = inbox->head;
+		if(INBOX_SIZE - (head - __atomic_load_n(&inbox->tail, __ATOMIC_ACQUIRE)) >= (unsigned int)p_num)
+			break;
+		if((tries + 1) % disp->num_workers == 0) {
+			__atomic_store_n(&p_io->stalls, p_io->stalls + 1, __ATOMIC_RELAXED);
+			nanosleep(&nap, NULL);
+		}
+	}
+	for(i = 0; i < p_num; ++i)
+		inbox->items[(head + i) & (INBOX_SIZE - 1)] = &p_buf->items[i];
+	__atomic_store_n(&inbox->head, head + p_num, __ATOMIC_RELEASE);
+	wake(&disp->workers[w]);
+}
+
+
+
+static struct khl_buf *io_get_buf(struct khl_io *const p_io)
+{
+	struct timespec nap = { 0, NAP_NS };
+	struct khl_buf *buf;
+
+	while(p_io->free == NULL) {
+		/* Take every batch the workers freed at once, so there is no ABA problem on the stack. */
+		if((p_io->free = __atomic_exchange_n(&p_io->freed, NULL, __ATOMIC_ACQUIRE)) != NULL)
+			break;
+		if(__atomic_load_n(&p_io->disp->stop, __ATOMIC_ACQUIRE))
+			return NULL;
+		__atomic_store_n(&p_io->stalls, p_io->stalls + 1, __ATOMIC_RELAXED);
+		nanosleep(&nap, NULL);
+	}
+	buf = p_io->free;
+	p_io->free = buf->next;
+	return buf;
+}
+
+
+
+static void *worker_main(void *p_worker)
+{
+	struct worker *worker = p_worker;
+	struct khl_dispatch *disp = worker->disp;
+	struct khl_item *item;
+	int moved, i;
+
+	for(;;) {
+		/* A backlog is worth waking a sleeping worker to steal from it. */
+		if(((moved = worker_refill(worker)) > 0) && (deque_size(&worker->deque) > 1)) {
+			for(i = 1; i < disp->num_workers; ++i) {
+				if(__atomic_load_n(&disp->workers[(worker->index + i) % disp->num_workers].sleeping, __ATOMIC_RELAXED)) {
+					wake(&disp->workers[(worker->index + i) % disp->num_workers]);
+					break;
+				}
+			}
+		}
+		if((item = deque_pop(&worker->deque)) != NULL) {
+			worker_run(worker, item);
+			continue;
+		}
+		if((item = worker_steal(worker)) != NULL) {
+			__atomic_store_n(&worker->steals, worker->steals + 1, __ATOMIC_RELAXED);
+			worker_run(worker, item);
+			continue;
+		}
+		/* The I/O threads have stopped and handed over everything: done once the inboxes are empty too. */
+		if(__atomic_load_n(&disp->io_done, __ATOMIC_ACQUIRE) && (worker_refill(worker) == 0) && (deque_size(&worker->deque) == 0))
+			break;
+		worker_sleep(worker);
+	}
+	return NULL;
+}
+
+
+
+static int worker_refill(struct worker *const p_worker)
+{
+	struct khl_dispatch *disp = p_worker->disp;
+	struct inbox *inbox;
+	unsigned int tail, head;
+	int i, moved = 0;
+
+	for(i = 0; i < disp->num_io; ++i) {
+		inbox = &disp->inboxes[i * disp->num_workers + p_worker->index];
+		tail = inbox->tail;
+		head = __atomic_load_n(&inbox->head, __ATOMIC_ACQUIRE);
+		for(; tail != head; ++tail, ++moved) {
+			if(deque_push(&p_worker->deque, inbox->items[tail & (INBOX_SIZE - 1)]) == -1)
+				break;
+		}
+		__atomic_store_n(&inbox->tail, tail, __ATOMIC_RELEASE);
+	}
+	return moved;
+}
+
+
+
+static struct khl_item *worker_steal(struct worker *const p_worker)
+{
+	struct khl_dispatch *disp = p_worker->disp;
+	struct khl_item *item;
+	int start, i, victim;
+
+	if(disp->num_workers == 1)
+		return NULL;
+	start = rand_r(&p_worker->seed) % disp->num_workers;
+	for(i = 0; i < disp->num_workers; ++i) {
+		victim = (start + i) % disp->num_workers;
+		if(victim == p_worker->index)
+			continue;
+		if((item = deque_steal(&disp->workers[victim].deque)) != NULL)
+			return item;
+	}
+	return NULL;
+}
+
+
+
+static void worker_sleep(struct worker *const p_worker)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += SLEEP_MS * 1000000L;
+	if(until.tv_nsec >= 1000000000L) {
+		until.tv_nsec -= 1000000000L;
+		++until.tv_sec;
+	}
+	pthread_mutex_lock(&p_worker->lock);
+	/* Announce the sleep, then look again. Either the waker sees the flag or this thread sees the work. */
+	__atomic_store_n(&p_worker->sleeping, 1, __ATOMIC_SEQ_CST);
+	if(!worker_has_work(p_worker) && !__atomic_load_n(&p_worker->disp->io_done, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&p_worker->sleeps, p_worker->sleeps + 1, __ATOMIC_RELAXED);
+		pthread_cond_timedwait(&p_worker->cond, &p_worker->lock, &until);
+	}
+	__atomic_store_n(&p_worker->sleeping, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&p_worker->lock);
+}
+
+
+
+static int worker_has_work(const struct worker *const p_worker)
+{
+	const struct khl_dispatch *disp = p_worker->disp;
+	const struct inbox *inbox;
+	int i;
+
+	for(i = 0; i < disp->num_io; ++i) {
+		inbox = &disp->inboxes[i * disp->num_workers + p_worker->index];
+		if(__atomic_load_n(&inbox->head, __ATOMIC_SEQ_CST) != inbox->tail)
+			return 1;
+	}
+	for(i = 0; i < disp->num_workers; ++i) {
+		if(deque_size(&disp->workers[i].deque) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+
+
+static void worker_run(struct worker *const p_worker, struct khl_item *const p_item)
+{
+	struct khl_buf *buf = p_item->buf;
+	struct khl_io *io = buf->io;
+
+	p_worker->disp->fn(p_worker->disp->arg, p_item, p_worker->index);
+	__atomic_store_n(&p_worker->handled, p_worker->handled + 1, __ATOMIC_RELAXED);
+	if(__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	/* Last record of the batch: give it back to its I/O thread. */
+	buf->next = __atomic_load_n(&io->freed, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&io->freed, &buf->next, buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+
+
+static void wake(struct worker *const p_worker)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&p_worker->sleeping, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&p_worker->lock);
+	pthread_cond_signal(&p_worker->cond);
+	pthread_mutex_unlock(&p_worker->lock);
+}
+
+
+
+static int deque_push(struct deque *const p_deque, struct khl_item *const p_item)
+{
+	const long bottom = __atomic_load_n(&p_deque->bottom, __ATOMIC_RELAXED);
+	const long top = __atomic_load_n(&p_deque->top, __ATOMIC_ACQUIRE);
+
+	if(bottom - top >= DEQUE_SIZE)
+		return -1;
+	__atomic_store_n(&p_deque->items[bottom & (DEQUE_SIZE - 1)], p_item, __ATOMIC_RELAXED);
+	/* A release store rather than a fence and a relaxed store: the same ordering, and one ThreadSanitizer can follow. */
+	__atomic_store_n(&p_deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+
+static struct khl_item *deque_pop(struct deque *const p_deque)
+{
+	const long bottom = __atomic_load_n(&p_deque->bottom, __ATOMIC_RELAXED) - 1;
+	struct khl_item *item = NULL;
+	long top;
+
+	__atomic_store_n(&p_deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&p_deque->top, __ATOMIC_RELAXED);
+	if(top <= bottom) {
+		item = __atomic_load_n(&p_deque->items[bottom & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+		if(top == bottom) {
+			/* Last item: race the thieves for it. */
+			if(!__atomic_compare_exchange_n(&p_deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				item = NULL;
+			__atomic_store_n(&p_deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		}
+	} else
+		__atomic_store_n(&p_deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	return item;
+}
+
+
+
+static struct khl_item *deque_steal(struct deque *const p_deque)
+{
+	long top = __atomic_load_n(&p_deque->top, __ATOMIC_ACQUIRE), bottom;
+	struct khl_item *item;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&p_deque->bottom, __ATOMIC_ACQUIRE);
+	if(top >= bottom)
+		return NULL;
+	item = __atomic_load_n(&p_deque->items[top & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&p_deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return item;
+}
+
+
+
+static long deque_size(const struct deque *const p_deque)
+{
+	const long size = __atomic_load_n(&p_deque->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&p_deque->top, __ATOMIC_RELAXED);
+
+	return (size > 0) ? size : 0;
+}
@@ -0,0 +1,76 @@
+/** @file dispatch.h
+ * Work-stealing dispatcher of libkhello: fans the records of khello channels out to a pool of worker threads.
+ *
+ * One I/O thread per channel drains it in batches of whole records with khl_recv() and hands each batch to a worker through a single-producer single-consumer inbox.
+ * Every worker moves its inboxes into its own Chase-Lev deque and runs the handler on the records it pops from the bottom; a worker with nothing to do steals the oldest
+ * records from the top of another worker's deque. A slow record therefore holds up only the worker running it: the records queued behind it are taken by the others.
+ * There is no lock on the dispatch path. Idle workers sleep and are woken only when a batch is handed to them, or to steal when another worker has a backlog.
+ * Handlers run in parallel and records are not handled in order.
+ */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "libkhello.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define KHL_DISPATCH_WORKERS_MAX 64 /**< Most worker threads. */
+#define KHL_DISPATCH_CHANS_MAX 16 /**< Most channels, one I/O thread each. */
+
+struct khl_buf;
+struct khl_dispatch;
+
+/** A record handed to a handler. */
+struct khl_item {
+	struct khl_record rec; /**< The record. rec.data is valid until the handler returns. */
+	int chan; /**< Index of the channel it was read from. */
+	struct khl_buf *buf; /**< Batch holding the record. Internal. */
+};
+
+/** Handles one record. Called from the worker threads, in parallel.
+ *  @param p_arg The argument given to khl_dispatch_start().
+ *  @param p_item The record.
+ *  @param p_worker Index of the worker thread running it.
+ */
+typedef void (*khl_handler)(void *p_arg, const struct khl_item *p_item, int p_worker);
+
+/** Counters of a dispatcher. */
+struct khl_dispatch_stats {
+	unsigned long long records; /**< Records read by the I/O threads. */
+	unsigned long long batches; /**< Reads made by the I/O threads. */
+	unsigned long long handled; /**< Records handled. */
+	unsigned long long steals; /**< Records handled by a worker that stole them. */
+	unsigned long long sleeps; /**< Times a worker went to sleep for lack of work. */
+	unsigned long long stalls; /**< Times an I/O thread waited for a free batch or a worker with room, i.e. the workers were behind. */
+	unsigned long long handled_by[KHL_DISPATCH_WORKERS_MAX]; /**< Records handled by each worker. */
+};
+
+
+/** Starts the I/O and worker threads.
+ *  @param p_chans The channels, open for reading. Not owned: they must stay open until khl_dispatch_stop() returns.
+ *  @param p_num_chans Number of channels, 1 to KHL_DISPATCH_CHANS_MAX.
+ *  @param p_workers Number of worker threads, 1 to KHL_DISPATCH_WORKERS_MAX.
+ *  @param p_fn The handler.
+ *  @param p_arg Passed to p_fn.
+ *  @return The dispatcher, or NULL with errno set.
+ */
+struct khl_dispatch *khl_dispatch_start(struct khl_channel *const p_chans, const int p_num_chans, const int p_workers, const khl_handler p_fn, void *const p_arg);
+
+/** Stops reading, lets the workers handle every record already read, joins the threads and frees the dispatcher.
+ *  @return 0 if OK. -1 with errno set if an I/O thread stopped on a read error.
+ */
+int khl_dispatch_stop(struct khl_dispatch *const p_disp);
+
+/** Takes the counters of a running dispatcher. They are read without stopping it, so they are not an exact snapshot. */
+void khl_dispatch_stats(const struct khl_dispatch *const p_disp, struct khl_dispatch_stats *const p_stats);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
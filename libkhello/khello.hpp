@@ -0,0 +1,272 @@
+/** @file khello.hpp
+ * Typed C++ layer over libkhello, header-only.
+ *
+ * khello::Channel<T> passes messages of type T through the shared ring of a khello device, built and read in place in the ring slots:
+ * the producer reserves a slot, fills the T in it and publishes it; the consumer is handed a const T& into the slot and releases it afterwards.
+ * No copy is made and no length is kept by the caller. T must be trivially copyable and fit a slot with its alignment; this is checked at compile time.
+ * Channel<khello::Bytes> is the variable-length specialization, for records of up to KHELLO_RING_DATA_MAX bytes.
+ * Errors are reported with std::system_error. Waiting follows the doorbell protocol of struct khello_ring, through khl_ring_wait() and khl_ring_notify().
+ *
+ * Example:
+ *	struct Tick { std::uint64_t seq; double price; };
+ *	khello::Channel<Tick> chan("/dev/khello");
+ *	chan.emplace(Tick{ 1, 99.5 });                        // producer
+ *	chan.recv([](const Tick &p_tick) { use(p_tick); });   // consumer
+ */
+
+#ifndef KHELLO_HPP
+#define KHELLO_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include "libkhello.h"
+
+
+namespace khello {
+
+
+/** Alignment guaranteed for the payload of a ring slot: the ring is page-aligned and the slots and their payload sit at multiples of it. */
+constexpr std::size_t SLOT_ALIGN = 8;
+
+static_assert(offsetof(struct khello_ring, slot) % SLOT_ALIGN == 0, "ring slots must start on an 8-byte boundary");
+static_assert(sizeof(struct khello_ring_slot) % SLOT_ALIGN == 0, "ring slots must be a multiple of 8 bytes");
+static_assert(offsetof(struct khello_ring_slot, data) % SLOT_ALIGN == 0, "slot payload must start on an 8-byte boundary");
+
+/** Sleeps on the doorbell are re-armed after this long, so a lost peer does not hang the caller in the kernel. */
+constexpr unsigned int WAIT_MS = 1000;
+
+
+/** A variable-length record. Channel<Bytes> keeps the length in the slot. */
+struct Bytes {
+	const unsigned char *data; /**< The payload, in the ring slot. */
+	std::size_t len; /**< Payload length. */
+};
+
+
+/** Slot handling of a message type, chosen at compile time.
+ *  The primary template is for fixed-size messages: every slot holds one T and its length is sizeof(T).
+ */
+template<typename T>
+struct SlotTraits {
+	static_assert(std::is_trivially_copyable<T>::value, "Channel<T> messages are copied between processes as bytes and must be trivially copyable");
+	static_assert(sizeof(T) <= KHELLO_RING_DATA_MAX, "Channel<T> messages must fit a ring slot, KHELLO_RING_DATA_MAX bytes");
+	static_assert(alignof(T) <= SLOT_ALIGN, "Channel<T> messages must not need more than 8-byte alignment");
+
+	static constexpr bool fixed = true; /**< Every record has the same length. */
+	static constexpr __u32 size = sizeof(T); /**< Length of a record, the largest one if not fixed. */
+	using slot_type = T; /**< What a reserved slot is filled with. */
+};
+
+/** Variable-length records: a reserved slot is raw bytes and the producer gives the length when publishing. */
+template<>
+struct SlotTraits<Bytes> {
+	static constexpr bool fixed = false;
+	static constexpr __u32 size = KHELLO_RING_DATA_MAX;
+	using slot_type = unsigned char;
+};
+
+
+/** A typed channel over the shared ring of one khello device. One process produces and one consumes; an object is not thread-safe. */
+template<typename T>
+class Channel {
+public:
+	using traits = SlotTraits<T>;
+	using slot_type = typename traits::slot_type;
+
+	/** Opens the device and maps its shared ring.
+	 *  @param p_path The device.
+	 *  @throw std::system_error If the device cannot be opened, or has no ring or a different layout (ENOTSUP).
+	 */
+	explicit Channel(const char *const p_path = KHL_DEVICE)
+	{
+		if(khl_open(&chan, p_path, O_RDWR) == -1)
+			throw std::system_error(errno, std::generic_category(), p_path);
+		if(khl_ring_map(&chan) == -1) {
+			const int errnum = errno;
+
+			khl_close(&chan);
+			throw std::system_error(errnum, std::generic_category(), p_path);
+		}
+	}
+
+	~Channel()
+	{
+		khl_close(&chan);
+	}
+
+	Channel(const Channel &) = delete;
+	Channel &operator=(const Channel &) = delete;
+
+	/** Reserves the next slot without waiting.
+	 *  @return The slot to fill, or nullptr if the ring is full. Publish it with publish().
+	 */
+	slot_type *try_reserve() noexcept
+	{
+		const __u32 head = chan.ring->head; /* Only the producer writes head. */
+
+		if(head - __atomic_load_n(&chan.ring->tail, __ATOMIC_ACQUIRE) >= KHELLO_RING_SLOTS)
+			return nullptr;
+		return reinterpret_cast<slot_type *>(chan.ring->slot[head & (KHELLO_RING_SLOTS - 1)].data);
+	}
+
+	/** Reserves the next slot. Spins while the ring is full, then sleeps until the consumer makes space.
+	 *  @return The slot to fill. Publish it with publish().
+	 *  @throw std::system_error If the wait fails, EINTR included.
+	 */
+	slot_type *reserve()
+	{
+		slot_type *slot;
+		int spins = 0;
+
+		while((slot = try_reserve()) == nullptr) {
+			if(++spins < KHL_SPIN_LIMIT)
+				continue;
+			wait(KHELLO_RING_EV_SPACE);
+			spins = 0;
+		}
+		return slot;
+	}
+
+	/** Publishes the reserved slot and rings the consumer's doorbell if it waits.
+	 *  @param p_len Length of the record. Only Channel<Bytes> takes it; at most KHELLO_RING_DATA_MAX.
+	 */
+	void publish(const __u32 p_len = traits::size) noexcept
+	{
+		const __u32 head = chan.ring->head;
+
+		chan.ring->slot[head & (KHELLO_RING_SLOTS - 1)].len = traits::fixed ? traits::size : ((p_len < traits::size) ? p_len : traits::size);
+		__atomic_store_n(&chan.ring->head, head + 1, __ATOMIC_RELEASE);
+		KHELLO_PROBE2(send, chan.fd, p_len);
+		/* Order the head store before the flag load, pairing with the barrier in khl_ring_wait(). */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		khl_ring_notify(&chan, KHELLO_RING_EV_DATA);
+	}
+
+	/** Builds a message in the next slot and publishes it.
+	 *  @param p_args Arguments of the constructor of T.
+	 */
+	template<typename... Args>
+	void emplace(Args &&... p_args)
+	{
+		static_assert(traits::fixed, "Channel<Bytes> records are sent with send(data, len)");
+		new(reserve()) T(std::forward<Args>(p_args)...);
+		publish();
+	}
+
+	/** Sends a copy of a message, for callers that already built it elsewhere. */
+	void send(const T &p_msg)
+	{
+		static_assert(traits::fixed, "Channel<Bytes> records are sent with send(data, len)");
+		std::memcpy(reserve(), &p_msg, sizeof(T));
+		publish();
+	}
+
+	/** Sends a variable-length record. Channel<Bytes> only.
+	 *  @param p_data The payload.
+	 *  @param p_len Its length, truncated to KHELLO_RING_DATA_MAX.
+	 */
+	void send(const void *const p_data, std::size_t p_len)
+	{
+		static_assert(!traits::fixed, "fixed-size channels send a T");
+		if(p_len > traits::size)
+			p_len = traits::size;
+		std::memcpy(reserve(), p_data, p_len);
+		publish(p_len);
+	}
+
+	/** Hands every published record, up to p_max, to a function without waiting, then releases their slots with one store.
+	 *  Records of a fixed-size channel whose length is not sizeof(T) are skipped and counted in skipped().
+	 *  @param p_fn Called with a const T&, or a Bytes for Channel<Bytes>, valid only during the call.
+	 *  @param p_max Most records to take.
+	 *  @return Number of records taken, 0 if the ring is empty.
+	 */
+	template<typename F>
+	int try_recv(F &&p_fn, const int p_max = KHELLO_RING_SLOTS)
+	{
+		__u32 tail = chan.ring->tail; /* Only the consumer writes tail. */
+		const __u32 head = __atomic_load_n(&chan.ring->head, __ATOMIC_ACQUIRE);
+		int num = 0;
+
+		if(head == tail)
+			return 0;
+		KHELLO_PROBE2(batch_start, chan.fd, head - tail);
+		for(; (tail != head) && (num < p_max); ++tail, ++num) {
+			const struct khello_ring_slot &slot = chan.ring->slot[tail & (KHELLO_RING_SLOTS - 1)];
+
+			deliver(p_fn, slot);
+		}
+		__atomic_store_n(&chan.ring->tail, tail, __ATOMIC_RELEASE);
+		KHELLO_PROBE2(batch_end, chan.fd, num);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		khl_ring_notify(&chan, KHELLO_RING_EV_SPACE);
+		return num;
+	}
+
+	/** Like try_recv(), but spins while the ring is empty, then sleeps until the producer publishes.
+	 *  @return Number of records taken, at least 1.
+	 *  @throw std::system_error If the wait fails, EINTR included.
+	 */
+	template<typename F>
+	int recv(F &&p_fn, const int p_max = KHELLO_RING_SLOTS)
+	{
+		int num, spins = 0;
+
+		while((num = try_recv(p_fn, p_max)) == 0) {
+			if(++spins < KHL_SPIN_LIMIT)
+				continue;
+			wait(KHELLO_RING_EV_DATA);
+			spins = 0;
+		}
+		return num;
+	}
+
+	/** Records of the wrong length skipped by a fixed-size channel. Non-zero when the peer uses another T. */
+	unsigned long long skipped() const noexcept
+	{
+		return mismatched;
+	}
+
+	/** The underlying libkhello channel, for stats, doorbell counters and the non-ring calls. */
+	struct khl_channel &raw() noexcept
+	{
+		return chan;
+	}
+
+private:
+	/** Calls the consumer's function on one slot, with the view matching the slot handling. */
+	template<typename F>
+	void deliver(F &p_fn, const struct khello_ring_slot &p_slot)
+	{
+		const __u32 len = p_slot.len;
+
+		if constexpr(traits::fixed) {
+			if(len != traits::size) {
+				++mismatched;
+				return;
+			}
+			p_fn(*std::launder(reinterpret_cast<const T *>(p_slot.data)));
+		} else
+			p_fn(Bytes{ p_slot.data, (len < traits::size) ? len : traits::size });
+	}
+
+	/** Sleeps on the doorbell. A timeout only re-arms the wait. */
+	void wait(const __u32 p_event)
+	{
+		if((khl_ring_wait(&chan, p_event, WAIT_MS) == -1) && (errno != ETIMEDOUT))
+			throw std::system_error(errno, std::generic_category(), "khl_ring_wait");
+	}
+
+	struct khl_channel chan; /**< The device and its mapped ring. */
+	unsigned long long mismatched = 0; /**< Records skipped for their length. */
+};
+
+
+}
+
+#endif
@@ -0,0 +1,198 @@
+/** @file khello_arena.hpp
+ * std::pmr memory resource over the shared data arena of a khello device, header-only.
+ *
+ * khello::ArenaResource maps the arena at page KHELLO_MMAP_ARENA_PGOFF (see struct khello_arena in khello.h) and hands out its bytes with a circular bump allocator.
+ * A producer builds messages, pmr containers included, directly in shared memory and publishes them by offset, typically as an ArenaRef through a khello::Channel<ArenaRef>.
+ * The consumer reads them in place and calls release() once it is done, in publishing order; the space is then reused by later allocations.
+ * deallocate() does nothing: memory comes back only when the consumer releases past it, so a message may grow and reallocate freely before it is published.
+ *
+ * Offsets are the same in both processes, addresses are not. Publish pointer-free messages by offset, or map the arena at the same address in both processes
+ * (the p_addr argument) before sharing containers that hold pointers, such as std::pmr::vector.
+ * A pmr container also stores a pointer to the producer's ArenaResource object, which is not valid in the consumer. The consumer can only read such a container
+ * in place, with the arena mapped at the same address, and must never allocate or free through it: no insertions, no resizing, no destruction.
+ *
+ * Example:
+ *	khello::Channel<khello::ArenaRef> chan("/dev/khello");
+ *	khello::ArenaResource arena(chan.raw());
+ *	std::pmr::vector<Order> *orders = arena.make<std::pmr::vector<Order>>(&arena);   // producer
+ *	orders->push_back(order);
+ *	chan.emplace(arena.ref(orders));
+ *	chan.recv([&](const khello::ArenaRef &p_ref) { use(arena.at<std::pmr::vector<Order>>(p_ref)); arena.release(p_ref); });   // consumer
+ */
+
+#ifndef KHELLO_ARENA_HPP
+#define KHELLO_ARENA_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory_resource>
+#include <new>
+#include <system_error>
+#include <utility>
+#include <sys/mman.h>
+#include "libkhello.h"
+
+
+namespace khello {
+
+
+/** A message published in the arena. Small enough for a ring slot. */
+struct ArenaRef {
+	std::uint64_t off; /**< Offset of the message from the start of the arena. */
+	std::uint64_t end; /**< Value of khello_arena.alloc once the message was built. The consumer releases up to it. */
+};
+
+
+/** Memory resource over the arena of one device. One process allocates and one releases; an object is not thread-safe. */
+class ArenaResource : public std::pmr::memory_resource {
+public:
+	/** Maps the arena of a channel and checks its header.
+	 *  @param p_chan The channel, opened O_RDWR. It must outlive the resource.
+	 *  @param p_addr Address to map the arena at, or nullptr to let the kernel choose. Must be free: the mapping fails with EEXIST otherwise.
+	 *  @throw std::system_error If the arena cannot be mapped, or the module has none (ENOTSUP).
+	 */
+	explicit ArenaResource(struct khl_channel &p_chan, void *const p_addr = nullptr)
+	{
+		void *map;
+
+		size = p_chan.page_size << KHELLO_ARENA_ORDER;
+		map = mmap(p_addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | ((p_addr != nullptr) ? MAP_FIXED_NOREPLACE : 0), p_chan.fd,
+			KHELLO_MMAP_ARENA_PGOFF * p_chan.page_size);
+		if(map == MAP_FAILED)
+			throw std::system_error(errno, std::generic_category(), "arena mmap");
+		arena = static_cast<struct khello_arena *>(map);
+		if((arena->magic != KHELLO_ARENA_MAGIC) || (arena->size != size) || (arena->data_off < sizeof(struct khello_arena))) {
+			munmap(map, size);
+			throw std::system_error(ENOTSUP, std::generic_category(), "arena layout");
+		}
+		base = static_cast<unsigned char *>(map);
+		capacity = size - arena->data_off;
+	}
+
+	~ArenaResource() override
+	{
+		munmap(arena, size);
+	}
+
+	ArenaResource(const ArenaResource &) = delete;
+	ArenaResource &operator=(const ArenaResource &) = delete;
+
+	/** Builds an object in the arena. Producer side.
+	 *  @param p_args Arguments of the constructor of T.
+	 *  @return The object. It is never destroyed by the resource.
+	 */
+	template<typename T, typename... Args>
+	T *make(Args &&... p_args)
+	{
+		return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(p_args)...);
+	}
+
+	/** Describes a finished message for publishing. Every allocation made for it must be done by then.
+	 *  @param p_msg The message, inside the arena.
+	 */
+	ArenaRef ref(const void *const p_msg) const noexcept
+	{
+		return ArenaRef{ offset(p_msg), __atomic_load_n(&arena->alloc, __ATOMIC_RELAXED) };
+	}
+
+	/** Returns the message an ArenaRef points at. Consumer side. */
+	template<typename T>
+	const T *at(const ArenaRef &p_ref) const noexcept
+	{
+		return std::launder(reinterpret_cast<const T *>(base + p_ref.off));
+	}
+
+	/** Offset of an address inside the arena. */
+	std::uint64_t offset(const void *const p_ptr) const noexcept
+	{
+		return static_cast<const unsigned char *>(p_ptr) - base;
+	}
+
+	/** Releases a consumed message and everything allocated before it. Consumer side, in publishing order. */
+	void release(const ArenaRef &p_ref) noexcept
+	{
+		__atomic_store_n(&arena->freed, p_ref.end, __ATOMIC_RELEASE);
+	}
+
+	/** Bytes allocated and not yet released, wasted tails of wrapped allocations included. */
+	std::uint64_t in_use() const noexcept
+	{
+		return __atomic_load_n(&arena->alloc, __ATOMIC_RELAXED) - __atomic_load_n(&arena->freed, __ATOMIC_ACQUIRE);
+	}
+
+	/** Usable bytes of the arena. */
+	std::size_t max_size() const noexcept
+	{
+		return capacity;
+	}
+
+	/** The arena header, e.g. for its counters. */
+	const struct khello_arena *header() const noexcept
+	{
+		return arena;
+	}
+
+protected:
+	/** Bump-allocates from the arena, wrapping to its start when the block does not fit before the end.
+	 *  Spins, then naps, while the consumer has not released enough.
+	 *  @throw std::bad_alloc If the block is larger than the arena, or the consumer releases nothing for WAIT_MS.
+	 */
+	void *do_allocate(const std::size_t p_bytes, const std::size_t p_align) override
+	{
+		const std::uint64_t alloc = arena->alloc; /* Only the producer writes alloc. */
+		std::uint64_t pos = arena->data_off + alloc % capacity, need, start;
+		struct timespec nap = { 0, NAP_NS };
+		unsigned long long naps = 0;
+		int spins = 0;
+
+		if((p_align > size) || (p_bytes > capacity))
+			throw std::bad_alloc();
+		start = (pos + p_align - 1) & ~static_cast<std::uint64_t>(p_align - 1);
+		/* Skip the tail of the arena when the block does not fit before the end. */
+		if(start + p_bytes > size) {
+			start = (arena->data_off + p_align - 1) & ~static_cast<std::uint64_t>(p_align - 1);
+			if(start + p_bytes > size)
+				throw std::bad_alloc();
+			need = (size - pos) + (start - arena->data_off) + p_bytes;
+		} else
+			need = (start - pos) + p_bytes;
+		if(need > capacity)
+			throw std::bad_alloc();
+
+		while(alloc + need - __atomic_load_n(&arena->freed, __ATOMIC_ACQUIRE) > capacity) {
+			if(++spins < KHL_SPIN_LIMIT)
+				continue;
+			if(++naps * NAP_NS >= WAIT_NS)
+				throw std::bad_alloc();
+			nanosleep(&nap, nullptr);
+		}
+		__atomic_store_n(&arena->alloc, alloc + need, __ATOMIC_RELEASE);
+		return base + start;
+	}
+
+	/** Does nothing: the space comes back when the consumer releases past it. */
+	void do_deallocate(void *, std::size_t, std::size_t) override
+	{
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &p_other) const noexcept override
+	{
+		return this == &p_other;
+	}
+
+private:
+	static constexpr long NAP_NS = 50000; /**< Sleep between checks once spinning gave up. */
+	static constexpr unsigned long long WAIT_NS = 1000000000ULL; /**< Longest wait for the consumer before std::bad_alloc. */
+
+	struct khello_arena *arena; /**< The mapped arena. */
+	unsigned char *base; /**< The same, as bytes. */
+	std::size_t size; /**< Size of the mapping. */
+	std::size_t capacity; /**< Usable bytes. */
+};
+
+
+}
+
+#endif
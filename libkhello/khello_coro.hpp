@@ -0,0 +1,495 @@
+/** @file khello_coro.hpp
+ * C++20 coroutine layer over libkhello, header-only.
+ *
+ * khello::EventLoop runs any number of khello::Task coroutines on one thread, on top of one epoll instance.
+ * khello::AsyncChannel opens a device non-blocking and registers it with the loop, edge-triggered. Its awaitables try the operation at once, unless others already wait for it,
+ * and suspend only if it would block:
+ *	khello::Batch batch = co_await chan.recv_batch();   // every record one read() returns, with their headers
+ *	co_await chan.send(msg);                            // one record, a trivially copyable msg or (data, len)
+ * Suspended readers of a channel queue in FIFO order. When the device becomes readable the loop reads on behalf of the first one, then the next, until a read would block,
+ * so each wakeup serves as many readers as there are records and the others stay asleep. Writers are served the same way; the module never blocks writes, so they rarely wait.
+ * Errors are thrown as std::system_error from the co_await. A task that throws stops EventLoop::run(), which rethrows.
+ *
+ * Example, 1000 consumers on one thread:
+ *	khello::Task consume(khello::AsyncChannel &p_chan)
+ *	{
+ *		for(;;)
+ *			for(const struct khl_record &rec : co_await p_chan.recv_batch())
+ *				use(rec);
+ *	}
+ *
+ *	khello::EventLoop loop;
+ *	khello::AsyncChannel chan(loop, "/dev/khello");
+ *	for(int i = 0; i < 1000; ++i)
+ *		loop.spawn(consume(chan));
+ *	loop.run();
+ */
+
+#ifndef KHELLO_CORO_HPP
+#define KHELLO_CORO_HPP
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "libkhello.h"
+
+
+namespace khello {
+
+
+class EventLoop;
+class AsyncChannel;
+
+constexpr std::size_t BATCH_BYTES = 4096; /**< Default buffer of a Batch. Holds 73 records of KHELLO_RECORD_MAX bytes with their headers. */
+
+
+/** A coroutine run by an EventLoop. Created suspended; EventLoop::spawn() starts it and the frame frees itself when it returns. */
+class Task {
+public:
+	struct promise_type {
+		EventLoop *loop = nullptr; /**< Set by EventLoop::spawn(). */
+
+		Task get_return_object() noexcept
+		{
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void() noexcept
+		{
+		}
+
+		void unhandled_exception() noexcept;
+
+		~promise_type();
+	};
+
+	Task(Task &&p_other) noexcept : handle(std::exchange(p_other.handle, nullptr))
+	{
+	}
+
+	/** Frees a task that was never spawned. */
+	~Task()
+	{
+		if(handle)
+			handle.destroy();
+	}
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	Task &operator=(Task &&) = delete;
+
+private:
+	friend class EventLoop;
+
+	explicit Task(const std::coroutine_handle<promise_type> p_handle) noexcept : handle(p_handle)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle; /**< The coroutine, until spawned. */
+};
+
+
+/** Single-threaded loop resuming tasks when their channels are ready. */
+class EventLoop {
+public:
+	/** @throw std::system_error If epoll cannot be created. */
+	EventLoop()
+	{
+		if((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+			throw std::system_error(errno, std::generic_category(), "epoll_create1");
+	}
+
+	/** Frees the tasks still queued to run. Tasks waiting on a channel are freed by the channel, which must be destroyed first. */
+	~EventLoop()
+	{
+		for(const std::coroutine_handle<> handle : ready)
+			handle.destroy();
+		close(epfd);
+	}
+
+	EventLoop(const EventLoop &) = delete;
+	EventLoop &operator=(const EventLoop &) = delete;
+
+	/** Queues a task to start on the next turn of run(). May be called from a task. */
+	void spawn(Task &&p_task)
+	{
+		std::coroutine_handle<Task::promise_type> handle = std::exchange(p_task.handle, nullptr);
+
+		handle.promise().loop = this;
+		++tasks;
+		ready.push_back(handle);
+	}
+
+	/** Runs tasks until all have returned or stop() is called.
+	 *  @throw The first exception a task let escape, or std::system_error if epoll fails.
+	 */
+	void run()
+	{
+		struct epoll_event events[MAX_EVENTS];
+		std::exception_ptr thrown;
+		int num, i;
+
+		stopping = false;
+		while(!stopping && (tasks > 0)) {
+			while(!ready.empty() && !stopping) {
+				const std::coroutine_handle<> handle = ready.front();
+
+				ready.pop_front();
+				handle.resume();
+				if(error) {
+					thrown = std::exchange(error, nullptr);
+					std::rethrow_exception(thrown);
+				}
+			}
+			if(stopping || (tasks == 0))
+				break;
+			if((num = epoll_wait(epfd, events, MAX_EVENTS, -1)) == -1) {
+				if(errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::generic_category(), "epoll_wait");
+			}
+			for(i = 0; i < num; ++i)
+				notify(static_cast<AsyncChannel *>(events[i].data.ptr), events[i].events);
+		}
+	}
+
+	/** Makes run() return after the task running now suspends. */
+	void stop() noexcept
+	{
+		stopping = true;
+	}
+
+	/** Number of tasks spawned and not yet returned. */
+	std::size_t size() const noexcept
+	{
+		return tasks;
+	}
+
+private:
+	friend class AsyncChannel;
+	friend struct Task::promise_type;
+
+	static constexpr int MAX_EVENTS = 64; /**< Events taken per epoll_wait(). */
+
+	/** Serves the waiters of a ready channel. Defined after AsyncChannel. */
+	void notify(AsyncChannel *const p_chan, const std::uint32_t p_events);
+
+	int epfd; /**< The epoll instance. */
+	std::deque<std::coroutine_handle<>> ready; /**< Tasks to resume, in order. */
+	std::size_t tasks = 0; /**< Tasks spawned and not yet returned. */
+	std::exception_ptr error; /**< Exception escaping the task run last. */
+	bool stopping = false; /**< Set by stop(). */
+};
+
+
+inline void Task::promise_type::unhandled_exception() noexcept
+{
+	loop->error = std::current_exception();
+}
+
+
+inline Task::promise_type::~promise_type()
+{
+	if(loop != nullptr)
+		--loop->tasks;
+}
+
+
+/** Records received with one read(), iterable as struct khl_record. The buffer is kept from one receive to the next. */
+class Batch {
+public:
+	/** @param p_bytes Size of the read buffer. */
+	explicit Batch(const std::size_t p_bytes = BATCH_BYTES) : buf(p_bytes), recs((p_bytes > 0) ? p_bytes / sizeof(struct khello_rec_hdr) + 1 : 0)
+	{
+	}
+
+	const struct khl_record *begin() const noexcept
+	{
+		return recs.data();
+	}
+
+	const struct khl_record *end() const noexcept
+	{
+		return recs.data() + count;
+	}
+
+	std::size_t size() const noexcept
+	{
+		return count;
+	}
+
+	const struct khl_record &operator[](const std::size_t p_index) const noexcept
+	{
+		return recs[p_index];
+	}
+
+private:
+	friend class AsyncChannel;
+
+	std::vector<unsigned char> buf; /**< Bytes read, the records point into it. */
+	std::vector<struct khl_record> recs; /**< The records. */
+	std::size_t count = 0; /**< Records in recs. */
+};
+
+
+/** A khello device used from tasks. Must outlive the tasks using it and be destroyed before its loop. */
+class AsyncChannel {
+	/** A suspended operation, queued on the channel until the loop completes it. */
+	struct Op {
+		std::coroutine_handle<> handle; /**< The task to resume. */
+		Op *next = nullptr; /**< Next waiter in the queue. */
+		int errnum = 0; /**< errno of a failed operation. */
+
+		/** Tries the operation without blocking.
+		 *  @return false if it would block. true once done or failed, with errnum set.
+		 */
+		virtual bool attempt() = 0;
+
+	protected:
+		~Op() = default;
+	};
+
+	/** FIFO of suspended operations. */
+	struct Queue {
+		Op *head = nullptr;
+		Op *tail = nullptr;
+	};
+
+public:
+	/** Awaitable receive of a batch of records.
+	 *  @tparam Own true to return a new Batch, false to fill the caller's and return the number of records.
+	 */
+	template<bool Own>
+	class RecvAwaiter : public Op {
+	public:
+		RecvAwaiter(AsyncChannel &p_chan, Batch *const p_batch) : chan(p_chan), target(p_batch)
+		{
+		}
+
+		bool await_ready()
+		{
+			/* Try at once only if no reader is queued, so a new reader cannot take a record ahead of them. */
+			return (chan.readers.head == nullptr) && attempt();
+		}
+
+		void await_suspend(const std::coroutine_handle<> p_handle)
+		{
+			handle = p_handle;
+			chan.push(chan.readers, this);
+		}
+
+		auto await_resume()
+		{
+			if(errnum != 0)
+				throw std::system_error(errnum, std::generic_category(), "khl_recv");
+			if constexpr(Own)
+				return std::move(own);
+			else
+				return target->count;
+		}
+
+		bool attempt() override
+		{
+			Batch &batch = Own ? own : *target;
+			const int num = khl_recv(&chan.chan, batch.buf.data(), batch.buf.size(), batch.recs.data(), batch.recs.size());
+
+			if(num == -1) {
+				if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					return false;
+				errnum = errno;
+				return true;
+			}
+			batch.count = num;
+			return true;
+		}
+
+	private:
+		AsyncChannel &chan; /**< The channel read. */
+		Batch *target; /**< The caller's batch, if not Own. */
+		Batch own{ Own ? BATCH_BYTES : 0 }; /**< The batch returned, if Own. */
+	};
+
+	/** Awaitable send of one record. */
+	class SendAwaiter : public Op {
+	public:
+		SendAwaiter(AsyncChannel &p_chan, const void *const p_data, const std::size_t p_len) : chan(p_chan), data(p_data), len(p_len)
+		{
+		}
+
+		bool await_ready()
+		{
+			return (chan.writers.head == nullptr) && attempt();
+		}
+
+		void await_suspend(const std::coroutine_handle<> p_handle)
+		{
+			handle = p_handle;
+			chan.push(chan.writers, this);
+		}
+
+		void await_resume()
+		{
+			if(errnum != 0)
+				throw std::system_error(errnum, std::generic_category(), "khl_send");
+		}
+
+		bool attempt() override
+		{
+			if(khl_send(&chan.chan, data, len) == -1) {
+				if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					return false;
+				errnum = errno;
+			}
+			return true;
+		}
+
+	private:
+		AsyncChannel &chan; /**< The channel written. */
+		const void *data; /**< The record. */
+		std::size_t len; /**< Its length. */
+	};
+
+	/** Opens a device non-blocking and registers it with a loop.
+	 *  @param p_loop The loop.
+	 *  @param p_path The device.
+	 *  @param p_flags O_RDONLY, O_WRONLY or O_RDWR. O_NONBLOCK is added.
+	 *  @throw std::system_error If the device cannot be opened or registered.
+	 */
+	AsyncChannel(EventLoop &p_loop, const char *const p_path = KHL_DEVICE, const int p_flags = O_RDWR) : loop(p_loop)
+	{
+		struct epoll_event event;
+
+		if(khl_open(&chan, p_path, p_flags | O_NONBLOCK) == -1)
+			throw std::system_error(errno, std::generic_category(), p_path);
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = this;
+		if(epoll_ctl(loop.epfd, EPOLL_CTL_ADD, chan.fd, &event) == -1) {
+			const int errnum = errno;
+
+			khl_close(&chan);
+			throw std::system_error(errnum, std::generic_category(), p_path);
+		}
+	}
+
+	/** Frees the tasks still waiting on the channel and closes it. */
+	~AsyncChannel()
+	{
+		epoll_ctl(loop.epfd, EPOLL_CTL_DEL, chan.fd, nullptr);
+		destroy(readers);
+		destroy(writers);
+		khl_close(&chan);
+	}
+
+	AsyncChannel(const AsyncChannel &) = delete;
+	AsyncChannel &operator=(const AsyncChannel &) = delete;
+
+	/** Receives every record one read() returns, waiting if there is none. co_await gives a Batch. */
+	RecvAwaiter<true> recv_batch()
+	{
+		return RecvAwaiter<true>(*this, nullptr);
+	}
+
+	/** Same, reusing the caller's Batch. co_await gives the number of records. */
+	RecvAwaiter<false> recv_batch(Batch &p_batch)
+	{
+		return RecvAwaiter<false>(*this, &p_batch);
+	}
+
+	/** Sends one record. The data must stay valid until the co_await returns. */
+	SendAwaiter send(const void *const p_data, const std::size_t p_len)
+	{
+		return SendAwaiter(*this, p_data, p_len);
+	}
+
+	/** Sends a message as one record. */
+	template<typename T>
+	SendAwaiter send(const T &p_msg)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "records are sent as bytes and must be trivially copyable");
+		return SendAwaiter(*this, &p_msg, sizeof(T));
+	}
+
+	/** The underlying libkhello channel. */
+	struct khl_channel &raw() noexcept
+	{
+		return chan;
+	}
+
+private:
+	friend class EventLoop;
+
+	/** Queues a suspended operation. */
+	static void push(Queue &p_queue, Op *const p_op) noexcept
+	{
+		p_op->next = nullptr;
+		if(p_queue.tail != nullptr)
+			p_queue.tail->next = p_op;
+		else
+			p_queue.head = p_op;
+		p_queue.tail = p_op;
+	}
+
+	/** Completes queued operations in order until one would block, and schedules their tasks. */
+	void serve(Queue &p_queue)
+	{
+		Op *op;
+
+		while(((op = p_queue.head) != nullptr) && op->attempt()) {
+			if((p_queue.head = op->next) == nullptr)
+				p_queue.tail = nullptr;
+			loop.ready.push_back(op->handle);
+		}
+	}
+
+	/** Frees the tasks of queued operations. */
+	static void destroy(Queue &p_queue) noexcept
+	{
+		Op *op, *next;
+
+		for(op = p_queue.head; op != nullptr; op = next) {
+			next = op->next; /* The operation lives in the frame destroyed. */
+			op->handle.destroy();
+		}
+		p_queue.head = p_queue.tail = nullptr;
+	}
+
+	EventLoop &loop; /**< The loop the channel is registered with. */
+	struct khl_channel chan; /**< The device. */
+	Queue readers; /**< Receives waiting for records. */
+	Queue writers; /**< Sends waiting for room. */
+};
+
+
+inline void EventLoop::notify(AsyncChannel *const p_chan, const std::uint32_t p_events)
+{
+	/* Errors and hangups are reported by the operations themselves. */
+	if(p_events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		p_chan->serve(p_chan->readers);
+	if(p_events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+		p_chan->serve(p_chan->writers);
+}
+
+
+}
+
+#endif
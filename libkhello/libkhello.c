@@ -0,0 +1,581 @@
+/** @file libkhello.c
+ * Userland client library for the khello devices. See libkhello.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "libkhello.h"
+
+
+#define KHL_WAIT_MS 1000 /**< Sleeps of khl_ring_send() and khl_ring_recv() are re-armed after this long, so a lost peer does not hang them in the kernel. */
+#define KHL_NAP_NS 50000 /**< Poll interval of khl_ring_wait() on modules without KHELLO_IOC_RING_WAIT. */
+
+
+/** A counter of the statistics page and its sysfs attribute. */
+struct khl_attr {
+	const char *name; /**< Attribute name. */
+	size_t offset; /**< Offset in struct khello_stats_page. */
+	size_t size; /**< Size of the field, 4 or 8. */
+};
+
+/** Counters read from sysfs when the statistics page cannot be mapped. */
+static const struct khl_attr g_attrs[] = {
+	{ "ring_size", offsetof(struct khello_stats_page, ring_size), sizeof(__u32) },
+	{ "readers", offsetof(struct khello_stats_page, readers), sizeof(__u32) },
+	{ "writers", offsetof(struct khello_stats_page, writers), sizeof(__u32) },
+	{ "mode", offsetof(struct khello_stats_page, mode), sizeof(__u32) },
+	{ "records_queued", offsetof(struct khello_stats_page, records_queued), sizeof(__u64) },
+	{ "bytes_queued", offsetof(struct khello_stats_page, bytes_queued), sizeof(__u64) },
+	{ "high_water", offsetof(struct khello_stats_page, high_water), sizeof(__u64) },
+	{ "drops", offsetof(struct khello_stats_page, drops), sizeof(__u64) },
+	{ "bytes_in", offsetof(struct khello_stats_page, bytes_in), sizeof(__u64) },
+	{ "bytes_out", offsetof(struct khello_stats_page, bytes_out), sizeof(__u64) },
+	{ "records_in", offsetof(struct khello_stats_page, records_in), sizeof(__u64) },
+	{ "records_out", offsetof(struct khello_stats_page, records_out), sizeof(__u64) },
+};
+
+
+/** Tells whether a shared ring event has happened, from the indices in the ring. Same test as the module makes before sleeping. */
+static int khl_ring_ready(const struct khello_ring *const p_ring, const __u32 p_event);
+
+/** Sleeps on an emulated doorbell until it is rung. A doorbell rung before the sleep is kept in the eventfd count, so it is not lost either.
+ *  @param p_fd The eventfd.
+ *  @param p_timeout_ms Longest wait. 0 waits until the doorbell or a signal.
+ *  @return 0 if the doorbell was rung. -1 with errno set: ETIMEDOUT on timeout, EINTR if a signal interrupted the wait.
+ */
+static int khl_emu_wait(const int p_fd, const unsigned int p_timeout_ms);
+
+/** Reads one sysfs attribute of a device.
+ *  @return 0 if OK. Else -1.
+ */
+static int khl_read_attr(const char *const p_name, const char *const p_attr, unsigned long long *const p_value);
+
+
+
+int khl_open(struct khl_channel *const p_chan, const char *p_path, const int p_flags)
+{
+	int fd;
+
+	if(p_path == NULL)
+		p_path = KHL_DEVICE;
+	if((fd = open(p_path, p_flags)) == -1)
+		return -1;
+	khl_attach(p_chan, fd, p_path);
+	p_chan->owned = 1;
+	return 0;
+}
+
+
+
+int khl_attach(struct khl_channel *const p_chan, const int p_fd, const char *const p_path)
+{
+	struct khello_batch batch = { 0, 0, 0 };
+	struct khello_ring_wait wait = { KHELLO_RING_EV_SPACE + 1, 0 };
+	__u32 flags = KHELLO_RECV_HDR;
+	char copy[256];
+	void *map;
+	int saved = errno;
+
+	memset(p_chan, 0, sizeof(struct khl_channel));
+	p_chan->fd = p_fd;
+	p_chan->page_size = sysconf(_SC_PAGE_SIZE);
+	if(p_path != NULL) {
+		snprintf(copy, sizeof(copy), "%s", p_path);
+		snprintf(p_chan->name, sizeof(p_chan->name), "%s", basename(copy));
+	}
+
+	/* Each probe fails with ENOTTY on modules that predate it. The descriptor may belong to the caller, so keep its flags for khl_close(). */
+	if((ioctl(p_fd, KHELLO_IOC_GET_RECV, &p_chan->recv_flags) == 0) && (ioctl(p_fd, KHELLO_IOC_SET_RECV, &flags) == 0))
+		p_chan->caps |= KHL_CAP_HDR;
+	if(ioctl(p_fd, KHELLO_IOC_SEND_BATCH, &batch) == 0)
+		p_chan->caps |= KHL_CAP_BATCH;
+	/* An unknown event is rejected with EINVAL before anything sleeps. */
+	if((ioctl(p_fd, KHELLO_IOC_RING_WAIT, &wait) == -1) && (errno == EINVAL))
+		p_chan->caps |= KHL_CAP_RING_WAIT;
+	/* The statistics page does not count as a data mapping, so mapping it has no side effect. */
+	map = mmap(NULL, p_chan->page_size, PROT_READ, MAP_SHARED, p_fd, KHELLO_MMAP_STATS_PGOFF * p_chan->page_size);
+	if(map != MAP_FAILED) {
+		p_chan->stats = map;
+		p_chan->caps |= KHL_CAP_STATS;
+	}
+	errno = saved;
+	return 0;
+}
+
+
+
+int khl_emu_create(struct khl_channel *const p_chan)
+{
+	struct khello_ring ring;
+	struct khello_arena arena;
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+	int fd, data_fd = -1, space_fd = -1, saved;
+
+	if((fd = memfd_create("khello", MFD_CLOEXEC)) == -1)
+		return -1;
+	if(ftruncate(fd, KHL_EMU_PAGES * page_size) == -1)
+		goto do_error;
+
+	/* Set the headers the module sets when it creates a device. The rest of the memfd reads as zeros, like the module's zeroed pages. */
+	memset(&ring, 0, sizeof(ring));
+	ring.magic = KHELLO_RING_MAGIC;
+	ring.slots = KHELLO_RING_SLOTS;
+	ring.slot_size = sizeof(struct khello_ring_slot);
+	ring.data_off = offsetof(struct khello_ring, slot);
+	if(pwrite(fd, &ring, offsetof(struct khello_ring, slot), KHELLO_MMAP_RING_PGOFF * page_size) == -1)
+		goto do_error;
+	memset(&arena, 0, sizeof(arena));
+	arena.magic = KHELLO_ARENA_MAGIC;
+	arena.size = page_size << KHELLO_ARENA_ORDER;
+	arena.data_off = sizeof(struct khello_arena);
+	if(pwrite(fd, &arena, sizeof(arena), KHELLO_MMAP_ARENA_PGOFF * page_size) == -1)
+		goto do_error;
+
+	/* Non-blocking: the count is read only after poll() reported it set. */
+	if(((data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) || ((space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1))
+		goto do_error;
+	if(khl_emu_attach(p_chan, fd, data_fd, space_fd) == 0)
+		return 0;
+
+do_error:
+	saved = errno;
+	if(space_fd != -1)
+		close(space_fd);
+	if(data_fd != -1)
+		close(data_fd);
+	close(fd);
+	errno = saved;
+	return -1;
+}
+
+
+
+int khl_emu_attach(struct khl_channel *const p_chan, const int p_memfd, const int p_data_fd, const int p_space_fd)
+{
+	struct khello_ring ring;
+	ssize_t count;
+
+	memset(p_chan, 0, sizeof(struct khl_channel));
+	p_chan->fd = p_memfd;
+	p_chan->page_size = sysconf(_SC_PAGE_SIZE);
+	if((count = pread(p_memfd, &ring, offsetof(struct khello_ring, slot), KHELLO_MMAP_RING_PGOFF * p_chan->page_size)) == -1)
+		return -1;
+	if((count != offsetof(struct khello_ring, slot)) || (ring.magic != KHELLO_RING_MAGIC)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	p_chan->owned = 1;
+	p_chan->caps = KHL_CAP_EMU;
+	p_chan->doorbell[KHELLO_RING_EV_DATA] = p_data_fd;
+	p_chan->doorbell[KHELLO_RING_EV_SPACE] = p_space_fd;
+	return 0;
+}
+
+
+
+void khl_close(struct khl_channel *const p_chan)
+{
+	if(p_chan->ring != NULL)
+		munmap(p_chan->ring, p_chan->page_size);
+	if(p_chan->stats != NULL)
+		munmap((void*)p_chan->stats, p_chan->page_size);
+	if(p_chan->owned && (p_chan->fd != -1))
+		close(p_chan->fd);
+	else if((p_chan->caps & KHL_CAP_HDR) && (p_chan->fd != -1))
+		ioctl(p_chan->fd, KHELLO_IOC_SET_RECV, &p_chan->recv_flags);
+	if(p_chan->caps & KHL_CAP_EMU) {
+		close(p_chan->doorbell[KHELLO_RING_EV_DATA]);
+		close(p_chan->doorbell[KHELLO_RING_EV_SPACE]);
+	}
+	p_chan->ring = NULL;
+	p_chan->stats = NULL;
+	p_chan->fd = -1;
+	p_chan->caps = 0;
+}
+
+
+
+int khl_send(struct khl_channel *const p_chan, const void *const p_data, const size_t p_len)
+{
+	ssize_t count;
+
+	while((count = write(p_chan->fd, p_data, p_len)) == -1) {
+		if(errno != EINTR)
+			return -1;
+	}
+	KHELLO_PROBE2(send, p_chan->fd, count);
+	return 0;
+}
+
+
+
+int khl_send_batch(struct khl_channel *const p_chan, const struct iovec *const p_iov, const int p_count)
+{
+	struct khello_msg msgs[KHELLO_BATCH_MAX];
+	struct khello_batch batch;
+	int done = 0, num, i, result;
+
+	KHELLO_PROBE2(batch_start, p_chan->fd, p_count);
+	while(done < p_count) {
+		/* KHELLO_BATCH_MAX is also the IOV_MAX of Linux. */
+		num = (p_count - done < KHELLO_BATCH_MAX) ? p_count - done : KHELLO_BATCH_MAX;
+		if(p_chan->caps & KHL_CAP_BATCH) {
+			for(i = 0; i < num; ++i) {
+				msgs[i].addr = (uintptr_t)p_iov[done + i].iov_base;
+				msgs[i].len = p_iov[done + i].iov_len;
+				msgs[i].reserved = 0;
+			}
+			batch.msgs = (uintptr_t)msgs;
+			batch.count = num;
+			batch.done = 0;
+			result = ioctl(p_chan->fd, KHELLO_IOC_SEND_BATCH, &batch);
+		} else /* The module writes each iovec as its own record. */
+			result = (writev(p_chan->fd, p_iov + done, num) == -1) ? -1 : num;
+		if(result == -1) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(result == 0)
+			break;
+		done += result;
+	}
+	KHELLO_PROBE2(batch_end, p_chan->fd, done);
+	return ((done > 0) || (p_count == 0)) ? done : -1;
+}
+
+
+
+int khl_recv(struct khl_channel *const p_chan, void *const p_buf, const size_t p_size, struct khl_record *const p_recs, const int p_max)
+{
+	const unsigned char *buf = p_buf;
+	struct khello_rec_hdr hdr;
+	ssize_t count;
+	size_t pos;
+	int num = 0;
+
+	while((count = read(p_chan->fd, p_buf, p_size)) == -1) {
+		if(errno != EINTR)
+			return -1;
+	}
+	KHELLO_PROBE2(receive, p_chan->fd, count);
+	if(count == 0)
+		return 0;
+	/* Older modules have no record headers: the read is the record. */
+	if(!(p_chan->caps & KHL_CAP_HDR)) {
+		p_recs[0].data = buf;
+		p_recs[0].len = count;
+		p_recs[0].clock = KHELLO_CLOCK_MONOTONIC;
+		p_recs[0].enq_ns = 0;
+		return 1;
+	}
+	for(pos = 0; (pos + sizeof(hdr) <= (size_t)count) && (num < p_max); pos += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, buf + pos, sizeof(hdr));
+		if(pos + sizeof(hdr) + hdr.len > (size_t)count)
+			break;
+		p_recs[num].data = buf + pos + sizeof(hdr);
+		p_recs[num].len = hdr.len;
+		p_recs[num].clock = hdr.clock;
+		p_recs[num].enq_ns = hdr.enq_ns;
+		++num;
+	}
+	return num;
+}
+
+
+
+int khl_wait_readable(struct khl_channel *const p_chan, const int p_timeout_ms)
+{
+	struct pollfd pfd;
+	int ready;
+
+	pfd.fd = p_chan->fd;
+	pfd.events = POLLIN;
+	KHELLO_PROBE1(wait_start, p_chan->fd);
+	ready = poll(&pfd, 1, p_timeout_ms);
+	KHELLO_PROBE2(wait_end, p_chan->fd, ready);
+	return ready;
+}
+
+
+
+int khl_ring_map(struct khl_channel *const p_chan)
+{
+	struct khello_ring *ring;
+
+	if(p_chan->ring != NULL)
+		return 0;
+	if(p_chan->page_size < sizeof(struct khello_ring)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	ring = mmap(NULL, p_chan->page_size, PROT_READ | PROT_WRITE, MAP_SHARED, p_chan->fd, KHELLO_MMAP_RING_PGOFF * p_chan->page_size);
+	if(ring == MAP_FAILED)
+		return -1;
+	if((ring->magic != KHELLO_RING_MAGIC) || (ring->slots != KHELLO_RING_SLOTS) || (ring->slot_size != sizeof(struct khello_ring_slot))) {
+		munmap(ring, p_chan->page_size);
+		errno = ENOTSUP;
+		return -1;
+	}
+	p_chan->ring = ring;
+	p_chan->caps |= KHL_CAP_RING;
+	return 0;
+}
+
+
+
+int khl_ring_send(struct khl_channel *const p_chan, const void *const p_data, const size_t p_len)
+{
+	struct khello_ring *ring = p_chan->ring;
+	struct khello_ring_slot *slot;
+	__u32 head;
+	int spins = 0;
+
+	if((ring == NULL) || (p_len > KHELLO_RING_DATA_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+	head = ring->head; /* Only the producer writes head. */
+
+	/* Wait for a free slot: spin briefly, then sleep on the doorbell. */
+	while(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= KHELLO_RING_SLOTS) {
+		if(++spins < KHL_SPIN_LIMIT)
+			continue;
+		if((khl_ring_wait(p_chan, KHELLO_RING_EV_SPACE, KHL_WAIT_MS) == -1) && (errno != ETIMEDOUT))
+			return -1;
+		spins = 0;
+	}
+
+	slot = &ring->slot[head & (KHELLO_RING_SLOTS - 1)];
+	memcpy(slot->data, p_data, p_len);
+	slot->len = p_len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	KHELLO_PROBE2(send, p_chan->fd, p_len);
+
+	/* Order the head store before the flag load, pairing with the barrier in khl_ring_wait(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	khl_ring_notify(p_chan, KHELLO_RING_EV_DATA);
+	return 0;
+}
+
+
+
+int khl_ring_recv(struct khl_channel *const p_chan, const khl_ring_fn p_fn, void *const p_arg, const int p_max)
+{
+	struct khello_ring *ring = p_chan->ring;
+	struct khello_ring_slot *slot;
+	__u32 tail, head, len;
+	int spins = 0, num = 0;
+
+	if(ring == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	tail = ring->tail; /* Only the consumer writes tail. */
+	while((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail) {
+		if(++spins < KHL_SPIN_LIMIT)
+			continue;
+		if((khl_ring_wait(p_chan, KHELLO_RING_EV_DATA, KHL_WAIT_MS) == -1) && (errno != ETIMEDOUT))
+			return -1;
+		spins = 0;
+	}
+
+	/* Read everything published, then release the slots with one store. */
+	KHELLO_PROBE2(batch_start, p_chan->fd, head - tail);
+	for(; (tail != head) && (num < p_max); ++tail, ++num) {
+		slot = &ring->slot[tail & (KHELLO_RING_SLOTS - 1)];
+		if((len = slot->len) > KHELLO_RING_DATA_MAX)
+			len = KHELLO_RING_DATA_MAX;
+		p_fn(p_arg, slot->data, len);
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	KHELLO_PROBE2(batch_end, p_chan->fd, num);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	khl_ring_notify(p_chan, KHELLO_RING_EV_SPACE);
+	return num;
+}
+
+
+
+int khl_ring_wait(struct khl_channel *const p_chan, const __u32 p_event, const unsigned int p_timeout_ms)
+{
+	struct khello_ring *ring = p_chan->ring;
+	struct khello_ring_wait wait;
+	struct timespec nap = { 0, KHL_NAP_NS };
+	unsigned long long naps = 0;
+	__u32 *flag;
+	int result = 0;
+
+	if((ring == NULL) || (p_event > KHELLO_RING_EV_SPACE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	flag = (p_event == KHELLO_RING_EV_DATA) ? &ring->cons_wait : &ring->prod_wait;
+
+	/* Set the flag, then look again. Either the peer sees the flag or this side sees the peer's update. */
+	__atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!khl_ring_ready(ring, p_event)) {
+		++p_chan->waits;
+		KHELLO_PROBE1(wait_start, p_chan->fd);
+		if(p_chan->caps & KHL_CAP_EMU)
+			result = khl_emu_wait(p_chan->doorbell[p_event], p_timeout_ms);
+		else if(p_chan->caps & KHL_CAP_RING_WAIT) {
+			wait.event = p_event;
+			wait.timeout_ms = p_timeout_ms;
+			result = ioctl(p_chan->fd, KHELLO_IOC_RING_WAIT, &wait);
+		} else { /* Older module without the doorbell: nap and look again. */
+			while(!khl_ring_ready(ring, p_event)) {
+				if((p_timeout_ms > 0) && (++naps * KHL_NAP_NS >= p_timeout_ms * 1000000ULL)) {
+					errno = ETIMEDOUT;
+					result = -1;
+					break;
+				}
+				if(nanosleep(&nap, NULL) == -1) {
+					result = -1;
+					break;
+				}
+			}
+		}
+		KHELLO_PROBE2(wait_end, p_chan->fd, result);
+	}
+	__atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+	return result;
+}
+
+
+
+void khl_ring_notify(struct khl_channel *const p_chan, const __u32 p_event)
+{
+	const __u64 one = 1;
+	__u32 *flag;
+
+	if(p_chan->ring == NULL)
+		return;
+	flag = (p_event == KHELLO_RING_EV_DATA) ? &p_chan->ring->cons_wait : &p_chan->ring->prod_wait;
+	/* The plain load keeps the common case, a peer that is not waiting, free of atomic writes. */
+	if((__atomic_load_n(flag, __ATOMIC_RELAXED) == 0) || (__atomic_exchange_n(flag, 0, __ATOMIC_ACQ_REL) == 0))
+		return;
+	KHELLO_PROBE2(doorbell, p_chan->fd, p_event);
+	++p_chan->doorbells;
+	/* A peer on an older module naps and does not need the call. */
+	if(p_chan->caps & KHL_CAP_EMU) {
+		if(write(p_chan->doorbell[(p_event == KHELLO_RING_EV_DATA) ? KHELLO_RING_EV_DATA : KHELLO_RING_EV_SPACE], &one, sizeof(one)) == -1)
+			return;
+	} else if(p_chan->caps & KHL_CAP_RING_WAIT)
+		ioctl(p_chan->fd, KHELLO_IOC_RING_NOTIFY);
+}
+
+
+
+int khl_stats(struct khl_channel *const p_chan, struct khello_stats_page *const p_stats)
+{
+	unsigned long long value;
+	__u32 seq;
+	size_t i;
+	int found = 0;
+
+	if(p_chan->stats != NULL) {
+		/* Retry while an update is in progress or one happened during the copy. */
+		do {
+			while((seq = __atomic_load_n(&p_chan->stats->seq, __ATOMIC_ACQUIRE)) & 1)
+				;
+			memcpy(p_stats, p_chan->stats, sizeof(struct khello_stats_page));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while(__atomic_load_n(&p_chan->stats->seq, __ATOMIC_RELAXED) != seq);
+		return 0;
+	}
+
+	memset(p_stats, 0, sizeof(struct khello_stats_page));
+	for(i = 0; i < sizeof(g_attrs) / sizeof(g_attrs[0]); ++i) {
+		if(khl_read_attr(p_chan->name, g_attrs[i].name, &value) == -1)
+			continue;
+		if(g_attrs[i].size == sizeof(__u32))
+			*(__u32*)((char*)p_stats + g_attrs[i].offset) = value;
+		else
+			*(__u64*)((char*)p_stats + g_attrs[i].offset) = value;
+		++found;
+	}
+	if(found == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+
+
+void khl_perror(const char *const p_what, const int p_errnum)
+{
+	if(p_what != NULL)
+		fprintf(stderr, "%s: %s\n", p_what, strerror(p_errnum));
+	else
+		fprintf(stderr, "%s\n", strerror(p_errnum));
+}
+
+
+
+static int khl_ring_ready(const struct khello_ring *const p_ring, const __u32 p_event)
+{
+	if(p_event == KHELLO_RING_EV_DATA)
+		return __atomic_load_n(&p_ring->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&p_ring->tail, __ATOMIC_RELAXED);
+	return __atomic_load_n(&p_ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&p_ring->tail, __ATOMIC_ACQUIRE) < KHELLO_RING_SLOTS;
+}
+
+
+
+static int khl_emu_wait(const int p_fd, const unsigned int p_timeout_ms)
+{
+	struct pollfd pfd;
+	__u64 count;
+	int ready;
+
+	pfd.fd = p_fd;
+	pfd.events = POLLIN;
+	if((ready = poll(&pfd, 1, (p_timeout_ms == 0) ? -1 : (int)p_timeout_ms)) == -1)
+		return -1;
+	if(ready == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	/* Reset the count so the next sleep waits for the next doorbell. */
+	if((read(p_fd, &count, sizeof(count)) == -1) && (errno != EAGAIN))
+		return -1;
+	return 0;
+}
+
+
+
+static int khl_read_attr(const char *const p_name, const char *const p_attr, unsigned long long *const p_value)
+{
+	char path[512], buf[32];
+	ssize_t count;
+	int fd;
+
+	if(p_name[0] == 0)
+		return -1;
+	snprintf(path, sizeof(path), "%s/%s/%s", KHELLO_SYSFS_DIR, p_name, p_attr);
+	if((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	count = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(count <= 0)
+		return -1;
+	buf[count] = 0;
+	*p_value = strtoull(buf, NULL, 10);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/** @file libkhello.h
+ * Userland client library for the khello devices created by the khello2 kernel module.
+ *
+ * A channel is opened with khl_open(), or an already open descriptor is wrapped with khl_attach(). Both probe what the module supports
+ * and record it in khl_channel.caps, so the other calls take the fastest path available and fall back on older modules:
+ * khl_send_batch()  one KHELLO_IOC_SEND_BATCH per 1024 records, else writev().
+ * khl_recv()        records with their struct khello_rec_hdr (KHELLO_RECV_HDR), else each read() is one record.
+ * khl_ring_*()      the shared ring of page KHELLO_MMAP_RING_PGOFF, sleeping in KHELLO_IOC_RING_WAIT, else in short naps.
+ * khl_stats()       the read-only statistics page, else the sysfs attributes.
+ * khl_emu_create() sets up a channel without the module: the same device mapping in a memfd, with eventfds for the ring doorbell. The khl_ring_*() calls
+ * then run the same protocol between processes that share it, e.g. after fork(), which makes it a reference to check and measure the module's ring against.
+ * Calls return -1 with errno set on failure, like the system calls they wrap. A channel is not thread-safe; the ring has one producer and one consumer.
+ */
+
+#ifndef LIBKHELLO_H
+#define LIBKHELLO_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "../khello2/khello.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define KHL_DEVICE "/dev/khello" /**< Device opened by khl_open() when no path is given. */
+#define KHL_NAME_MAX 64 /**< Longest device name kept for the sysfs fallback. */
+
+#define KHL_CAP_HDR		0x0001 /**< Records are read with their struct khello_rec_hdr. */
+#define KHL_CAP_BATCH		0x0002 /**< KHELLO_IOC_SEND_BATCH is available. */
+#define KHL_CAP_RING_WAIT	0x0004 /**< KHELLO_IOC_RING_WAIT and KHELLO_IOC_RING_NOTIFY are available. */
+#define KHL_CAP_RING		0x0008 /**< The shared ring is mapped. Set by khl_ring_map(). */
+#define KHL_CAP_STATS		0x0010 /**< The read-only statistics page is mapped. */
+#define KHL_CAP_EMU		0x0020 /**< The channel is an emulation of the device mapping in a memfd. Set by khl_emu_create() and khl_emu_attach(). */
+
+#define KHL_EMU_PAGES (KHELLO_MMAP_ARENA_PGOFF + (1 << KHELLO_ARENA_ORDER)) /**< Size of an emulated device mapping, in pages: ring, statistics page and arena at their device offsets. */
+
+#define KHL_SPIN_LIMIT 1000 /**< Polls of an empty or full ring before khl_ring_send() and khl_ring_recv() sleep. */
+
+
+/** An open khello channel. */
+struct khl_channel {
+	int fd; /**< The device. */
+	int owned; /**< 1 if khl_close() closes fd, 0 after khl_attach(). */
+	__u32 recv_flags; /**< KHELLO_RECV_* flags fd had before KHL_CAP_HDR was set on it. Restored by khl_close() when fd is not owned. */
+	unsigned int caps; /**< KHL_CAP_* flags. */
+	char name[KHL_NAME_MAX]; /**< Device name under KHELLO_SYSFS_DIR. */
+	struct khello_ring *ring; /**< The shared ring, NULL until khl_ring_map(). */
+	const struct khello_stats_page *stats; /**< The statistics page, NULL on modules without it. */
+	size_t page_size; /**< Size of each mapping. */
+	unsigned long long doorbells; /**< KHELLO_IOC_RING_NOTIFY calls made. */
+	unsigned long long waits; /**< Sleeps taken waiting on the ring. */
+	int doorbell[2]; /**< With KHL_CAP_EMU, the eventfds standing in for KHELLO_IOC_RING_WAIT and KHELLO_IOC_RING_NOTIFY, indexed by KHELLO_RING_EV_*. */
+};
+
+/** A record returned by khl_recv(). */
+struct khl_record {
+	const unsigned char *data; /**< The payload, inside the buffer given to khl_recv(). */
+	__u32 len; /**< Payload length. */
+	__u32 clock; /**< KHELLO_CLOCK_* of enq_ns. */
+	__u64 enq_ns; /**< Time the record was written, 0 without KHL_CAP_HDR. */
+};
+
+/** Called by khl_ring_recv() for each record, while the record is still in its slot.
+ *  @param p_arg The argument given to khl_ring_recv().
+ *  @param p_data The payload.
+ *  @param p_len Payload length.
+ */
+typedef void (*khl_ring_fn)(void *p_arg, const unsigned char *p_data, __u32 p_len);
+
+
+/** Opens a channel and probes what the module supports.
+ *  @param p_chan The channel to set up.
+ *  @param p_path The device, or NULL for KHL_DEVICE.
+ *  @param p_flags open() flags: O_RDONLY, O_WRONLY or O_RDWR, optionally O_NONBLOCK. The shared ring needs O_RDWR.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int khl_open(struct khl_channel *const p_chan, const char *p_path, const int p_flags);
+
+/** Wraps a descriptor opened by the caller and probes what the module supports. khl_close() leaves the descriptor open.
+ *  The probe sets KHELLO_RECV_HDR on the descriptor, so read() on it returns record headers until khl_close() restores its previous flags.
+ *  @param p_chan The channel to set up.
+ *  @param p_fd The device.
+ *  @param p_path Its path, for the sysfs fallback of khl_stats(). May be NULL.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int khl_attach(struct khl_channel *const p_chan, const int p_fd, const char *const p_path);
+
+/** Sets up a channel emulating a device without the module: a memfd of KHL_EMU_PAGES pages laid out as the device mapping, whose header the module would set,
+ *  and one eventfd per KHELLO_RING_EV_* as the doorbell. Only the shared ring and arena are emulated: records cannot be sent or received with write() and read().
+ *  Map the ring with khl_ring_map() as on a device. A child forked afterwards shares the memfd, the eventfds and the mappings.
+ *  @param p_chan The channel to set up.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int khl_emu_create(struct khl_channel *const p_chan);
+
+/** Wraps an emulated device set up by khl_emu_create() in another process, e.g. with descriptors passed over a Unix socket. khl_close() closes the descriptors.
+ *  @param p_chan The channel to set up.
+ *  @param p_memfd The memfd.
+ *  @param p_data_fd The eventfd of KHELLO_RING_EV_DATA, doorbell[0] of the creator.
+ *  @param p_space_fd The eventfd of KHELLO_RING_EV_SPACE, doorbell[1] of the creator.
+ *  @return 0 if OK. Else -1 with errno set, ENOTSUP if the memfd is not laid out as a device mapping.
+ */
+int khl_emu_attach(struct khl_channel *const p_chan, const int p_memfd, const int p_data_fd, const int p_space_fd);
+
+/** Unmaps what the channel mapped and closes it. */
+void khl_close(struct khl_channel *const p_chan);
+
+/** Sends one record.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int khl_send(struct khl_channel *const p_chan, const void *const p_data, const size_t p_len);
+
+/** Sends records, one per iovec, with as few system calls as the module allows.
+ *  @param p_iov The records. Each is truncated to KHELLO_RECORD_MAX by the module.
+ *  @param p_count Number of records.
+ *  @return Number of records queued, p_count unless an error stopped it part way. -1 with errno set if none was.
+ */
+int khl_send_batch(struct khl_channel *const p_chan, const struct iovec *const p_iov, const int p_count);
+
+/** Receives as many whole records as fit in a buffer with one read().
+ *  @param p_buf The buffer. The records point into it.
+ *  @param p_size Its size. Must hold at least one record and its header.
+ *  @param p_recs Receives the records.
+ *  @param p_max Size of p_recs. Make it at least p_size / sizeof(struct khello_rec_hdr).
+ *  @return Number of records. 0 if the device is empty. -1 with errno set, EAGAIN for an empty non-blocking channel.
+ */
+int khl_recv(struct khl_channel *const p_chan, void *const p_buf, const size_t p_size, struct khl_record *const p_recs, const int p_max);
+
+/** Waits until records can be read.
+ *  @param p_timeout_ms Longest wait, -1 for no limit.
+ *  @return 1 if readable. 0 on timeout. -1 with errno set.
+ */
+int khl_wait_readable(struct khl_channel *const p_chan, const int p_timeout_ms);
+
+/** Maps the shared ring and checks its layout. Needs a channel opened O_RDWR.
+ *  @return 0 if OK. Else -1 with errno set, ENOTSUP if the module has no ring or a different layout.
+ */
+int khl_ring_map(struct khl_channel *const p_chan);
+
+/** Writes one record to the shared ring. Spins while the ring is full, then sleeps until the consumer makes space, and rings its doorbell if it waits.
+ *  @param p_data The payload.
+ *  @param p_len Payload length, at most KHELLO_RING_DATA_MAX.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int khl_ring_send(struct khl_channel *const p_chan, const void *const p_data, const size_t p_len);
+
+/** Reads every record published in the shared ring, up to p_max, and releases their slots with one store.
+ *  Spins while the ring is empty, then sleeps until the producer publishes, and rings its doorbell if it waits.
+ *  @param p_fn Called for each record.
+ *  @param p_arg Passed to p_fn.
+ *  @param p_max Most records to read.
+ *  @return Number of records read. -1 with errno set.
+ */
+int khl_ring_recv(struct khl_channel *const p_chan, const khl_ring_fn p_fn, void *const p_arg, const int p_max);
+
+/** Sleeps until a shared ring event, following the doorbell protocol of struct khello_ring. Modules without KHELLO_IOC_RING_WAIT are polled every 50 us.
+ *  An emulated device sleeps on its eventfd instead of the ioctl.
+ *  @param p_event KHELLO_RING_EV_DATA or KHELLO_RING_EV_SPACE.
+ *  @param p_timeout_ms Longest wait. 0 waits until the event or a signal.
+ *  @return 0 if the event happened. -1 with errno set: ETIMEDOUT on timeout, EINTR if a signal interrupted the wait.
+ */
+int khl_ring_wait(struct khl_channel *const p_chan, const __u32 p_event, const unsigned int p_timeout_ms);
+
+/** Rings the doorbell of the peer if it waits for an event, clearing its flag so one doorbell serves one sleep.
+ *  @param p_event KHELLO_RING_EV_DATA to wake the consumer, KHELLO_RING_EV_SPACE to wake the producer.
+ */
+void khl_ring_notify(struct khl_channel *const p_chan, const __u32 p_event);
+
+/** Takes a consistent snapshot of the statistics of the channel.
+ *  @param p_stats Receives the statistics. Without the statistics page only the counters exported in sysfs are filled.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int khl_stats(struct khl_channel *const p_chan, struct khello_stats_page *const p_stats);
+
+/** Prints an error on stderr like perror(), for the tools built on the library.
+ *  @param p_what What failed, e.g. the device name. May be NULL.
+ *  @param p_errnum The errno value.
+ */
+void khl_perror(const char *const p_what, const int p_errnum);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
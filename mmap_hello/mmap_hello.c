@@ -1,69 +1,235 @@
-/** @file try_mmap.c 
- *  Illustrates the mmap operation that uses mmap to write to a file "FILE".
- * 
+/** @file mmap_hello.c
+ *  Shared ring client for the khello device. Passes records between processes through the ring in the shared memory page of /dev/khello, without system calls.
+ *
+ *  The producer fills a slot and publishes it by storing head with release semantics. The consumer loads head with acquire semantics, reads the slots and releases them by storing tail.
+ *  A side that runs out of work spins briefly, then sets its wait flag and sleeps in KHELLO_IOC_RING_WAIT. The other side rings the doorbell with KHELLO_IOC_RING_NOTIFY only when it sees the flag set.
+ *  The ring protocol is implemented by libkhello, see khl_ring_send() and khl_ring_recv(), and struct khello_ring in khello.h.
+ *
  *  Usage:
- *  Edit the file "FILE" with some text. Make sure there is at least 10 chars inside or an error could occur.
- *  run try_mmap. The characrters "mama" will be written from the 5th position in the text file.
+ *  After loading the kernel module.
+ *  Pass 1000000 records of 32 bytes between two processes and report the rate: "./mmap_hello"
+ *  Pass 5000000 records of 8 bytes: "./mmap_hello both 5000000 8"
+ *  Produce and consume from two terminals: "./mmap_hello consume 1000000" and "./mmap_hello produce 1000000"
  */
 
 #include <sys/types.h>
-#include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <time.h>
+#include "../libkhello/libkhello.h"
 
 
 #define FILE "/dev/khello"
+#define MIN_SIZE 8 /**< Records carry a 64-bit sequence number. */
 
 
+/** Counters of one side of the ring. */
+struct counters {
+	unsigned long long records; /**< Records produced or consumed. */
+	unsigned long long bytes; /**< Payload bytes produced or consumed. */
+	unsigned long long doorbells; /**< KHELLO_IOC_RING_NOTIFY calls. */
+	unsigned long long waits; /**< KHELLO_IOC_RING_WAIT calls. */
+	unsigned long long disorder; /**< Records not following the previous one, consumer only. */
+	unsigned long long expect; /**< Sequence number of the next record, consumer only. */
+};
+
+
+/** Writes records to the ring.
+ *  @param p_chan The channel, with the ring mapped.
+ *  @param p_count Number of records.
+ *  @param p_size Payload size of each record.
+ *  @param p_cnt Returns the counters.
+ *  @return 0 if OK. Else -1.
+ */
+static int produce(struct khl_channel *const p_chan, const long p_count, const int p_size, struct counters *const p_cnt);
+
+/** Reads records from the ring.
+ *  @param p_chan The channel, with the ring mapped.
+ *  @param p_count Number of records.
+ *  @param p_cnt Returns the counters.
+ *  @return 0 if OK. Else -1.
+ */
+static int consume(struct khl_channel *const p_chan, const long p_count, struct counters *const p_cnt);
+
+/** Checks the sequence number of a record read from the ring. A khl_ring_fn.
+ *  @param p_arg The counters.
+ *  @param p_data The payload.
+ *  @param p_len Payload length.
+ */
+static void check_record(void *p_arg, const unsigned char *p_data, __u32 p_len);
+
+/** Prints the rate of one side. */
+static void report(const char *const p_side, const struct counters *const p_cnt, const double p_secs);
+
+/** Returns CLOCK_MONOTONIC in seconds. */
+static double now_secs();
+
 static void process_perror(const int p_err);
 
 
 int main(int argc, char *argv[])
 {
-	int fd = -1;
-	unsigned char *buf = NULL;
-	
+	int opened = 0, size = 32, status, produce_side = 1, consume_side = 1, result = 0;
+	long count = 1000000;
+	double start;
+	struct khl_channel chan;
+	struct counters cnt;
+	pid_t pid = -1;
+
+	if(argc >= 2) {
+		if(strcmp(argv[1], "produce") == 0)
+			consume_side = 0;
+		else if(strcmp(argv[1], "consume") == 0)
+			produce_side = 0;
+		else if(strcmp(argv[1], "both") != 0) {
+			printf("Usage: mmap_hello [both|produce|consume] [count] [size]\n");
+			return 0;
+		}
+	}
+	if((argc >= 3) && ((count = atol(argv[2])) < 1))
+		count = 1;
+	if(argc >= 4)
+		size = atoi(argv[3]);
+	if(size < MIN_SIZE)
+		size = MIN_SIZE;
+	if(size > KHELLO_RING_DATA_MAX)
+		size = KHELLO_RING_DATA_MAX;
+
 	/* Opens the file. */
-	if((fd = open(FILE, O_RDWR)) == -1) {
+	if(khl_open(&chan, FILE, O_RDWR) == -1) {
 		process_perror(errno);
 		goto do_exit;
 	}
-	
-	
-	/* Get pagesize. Not required in this example but done as an exercise. */
-	printf("Pagesize: %ld\n", sysconf(_SC_PAGE_SIZE));
-	
-	
-	/* Perform mmap. */
-	buf = mmap(NULL, 32, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if((void*)buf == MAP_FAILED) {
-		process_perror(errno);
-		printf("Mmap error\n");
-		buf = NULL;
+	opened = 1;
+	if(khl_ring_map(&chan) == -1) {
+		if(errno == ENOTSUP)
+			printf("The module has no shared ring or a different layout. Rebuild with its khello.h.\n");
+		else
+			process_perror(errno);
 		goto do_exit;
 	}
-	
-	/* Perform a write */
-	memcpy(buf, "haha", 4);
-	buf[4] = 0;
 
-	
+	/* Both sides: the child consumes, the parent produces. */
+	if(produce_side && consume_side) {
+		if((pid = fork()) == -1) {
+			process_perror(errno);
+			goto do_exit;
+		}
+		if(pid == 0)
+			produce_side = 0;
+		else
+			consume_side = 0;
+	}
+
+	memset(&cnt, 0, sizeof(cnt));
+	start = now_secs();
+	if(produce_side)
+		result = produce(&chan, count, size, &cnt);
+	else
+		result = consume(&chan, count, &cnt);
+	cnt.doorbells = chan.doorbells;
+	cnt.waits = chan.waits;
+	if(result == 0)
+		report(produce_side ? "producer" : "consumer", &cnt, now_secs() - start);
+	if(pid == 0) {
+		fflush(stdout);
+		_exit(result == 0 ? 0 : 1);
+	}
+	if(pid > 0)
+		waitpid(pid, &status, 0);
+
 do_exit:
-	if(buf != NULL) {
-		if(munmap(buf, 32) == -1)
+	if(opened)
+		khl_close(&chan);
+	return 0;
+}
+
+
+
+static int produce(struct khl_channel *const p_chan, const long p_count, const int p_size, struct counters *const p_cnt)
+{
+	unsigned char data[KHELLO_RING_DATA_MAX];
+	unsigned long long seq;
+	long i;
+
+	memset(data, 'm', sizeof(data));
+	for(i = 0; i < p_count; ++i) {
+		seq = i;
+		memcpy(data, &seq, sizeof(seq));
+		if(khl_ring_send(p_chan, data, p_size) == -1) {
+			if(errno == EINTR) {
+				--i;
+				continue;
+			}
 			process_perror(errno);
+			return -1;
+		}
+		++p_cnt->records;
+		p_cnt->bytes += p_size;
 	}
-	if(fd != -1)
-		close(fd);
 	return 0;
 }
 
 
 
+static int consume(struct khl_channel *const p_chan, const long p_count, struct counters *const p_cnt)
+{
+	unsigned long long left;
+
+	while((left = p_count - p_cnt->records) > 0) {
+		if(khl_ring_recv(p_chan, check_record, p_cnt, (left < KHELLO_RING_SLOTS) ? left : KHELLO_RING_SLOTS) == -1) {
+			if(errno == EINTR)
+				continue;
+			process_perror(errno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+
+static void check_record(void *p_arg, const unsigned char *p_data, __u32 p_len)
+{
+	struct counters *cnt = p_arg;
+	unsigned long long seq;
+
+	memcpy(&seq, p_data, sizeof(seq));
+	if((cnt->records > 0) && (seq != cnt->expect))
+		++cnt->disorder;
+	cnt->expect = seq + 1;
+	++cnt->records;
+	cnt->bytes += p_len;
+}
+
+
+
+static void report(const char *const p_side, const struct counters *const p_cnt, const double p_secs)
+{
+	printf("%s: %llu records in %.3f s, %.0f msgs/s, %.1f MB/s, %llu doorbells, %llu waits", p_side, p_cnt->records, p_secs,
+		p_cnt->records / p_secs, p_cnt->bytes / p_secs / 1e6, p_cnt->doorbells, p_cnt->waits);
+	if(strcmp(p_side, "consumer") == 0)
+		printf(", %llu out of order", p_cnt->disorder);
+	printf("\n");
+}
+
+
+
+static double now_secs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
 static void process_perror(const int p_err)
 {
 	printf("%s\n", strerror(p_err));
@@ -0,0 +1,205 @@
+/** @file rt.c
+ * Real-time profile for latency-critical khello clients. See rt.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "../khello2/khello.h"
+#include "rt.h"
+
+
+#define RT_ISOLATED "/sys/devices/system/cpu/isolated" /**< CPUs removed from the scheduler with isolcpus=, as a CPU list. */
+
+
+/** Returns the bucket of a value. */
+static int rt_hist_index(const unsigned long long p_value);
+
+
+
+int rt_pick_cpu(const int p_index, int *const p_isolated)
+{
+	char buf[1024], *pos, *end;
+	long first, last, cpu;
+	int fd, seen = 0;
+	ssize_t count;
+	cpu_set_t set;
+
+	*p_isolated = 0;
+	if((fd = open(RT_ISOLATED, O_RDONLY)) != -1) {
+		count = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		buf[(count > 0) ? count : 0] = 0;
+		/* A list such as "2-3,6". */
+		for(pos = buf; (*pos >= '0') && (*pos <= '9'); pos = end + 1) {
+			first = last = strtol(pos, &end, 10);
+			if(*end == '-')
+				last = strtol(end + 1, &end, 10);
+			for(cpu = first; cpu <= last; ++cpu) {
+				if(seen++ == p_index) {
+					*p_isolated = 1;
+					return cpu;
+				}
+			}
+			if(*end != ',')
+				break;
+		}
+	}
+
+	if(sched_getaffinity(0, sizeof(set), &set) == -1)
+		return -1;
+	for(cpu = CPU_SETSIZE - 1; cpu >= 0; --cpu) {
+		if(CPU_ISSET(cpu, &set) && (seen++ == p_index))
+			return cpu;
+	}
+	return -1;
+}
+
+
+
+int rt_enter(const int p_cpu, const int p_index)
+{
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+	struct sched_param param;
+	cpu_set_t set;
+	int cpu = p_cpu, isolated = 0, result = 0;
+	size_t i;
+
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		fprintf(stderr, "rt: mlockall: %s\n", strerror(errno));
+		result = -1;
+	}
+	for(i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+
+	if(cpu < 0)
+		cpu = rt_pick_cpu(p_index, &isolated);
+	CPU_ZERO(&set);
+	if(cpu >= 0)
+		CPU_SET(cpu, &set);
+	if(cpu < 0) {
+		fprintf(stderr, "rt: no CPU to pin to\n");
+		result = -1;
+	} else if(sched_setaffinity(0, sizeof(set), &set) == -1) {
+		fprintf(stderr, "rt: cannot pin to CPU %d: %s\n", cpu, strerror(errno));
+		result = -1;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = RT_PRIORITY;
+	if(sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+		fprintf(stderr, "rt: SCHED_FIFO: %s\n", strerror(errno));
+		result = -1;
+	}
+	fprintf(stderr, "rt: CPU %d%s, SCHED_FIFO %d%s\n", cpu, isolated ? " (isolated)" : "", RT_PRIORITY, (result == 0) ? ", memory locked" : ", incomplete");
+	return result;
+}
+
+
+
+void rt_prefault(void *const p_buf, const size_t p_size)
+{
+	volatile unsigned char *buf = p_buf;
+	size_t i;
+
+	for(i = 0; i < p_size; i += 4096)
+		buf[i] = buf[i];
+	if(p_size > 0)
+		buf[p_size - 1] = buf[p_size - 1];
+}
+
+
+
+unsigned long long rt_clock_ns(const __u32 p_clock)
+{
+	struct timespec ts;
+
+	switch(p_clock) {
+		case KHELLO_CLOCK_MONOTONIC_RAW:
+			clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+			break;
+		case KHELLO_CLOCK_REALTIME:
+			clock_gettime(CLOCK_REALTIME, &ts);
+			break;
+		default:
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			break;
+	}
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+void rt_hist_add(struct rt_hist *const p_hist, const unsigned long long p_value)
+{
+	if((p_hist->n == 0) || (p_value < p_hist->min))
+		p_hist->min = p_value;
+	if(p_value > p_hist->max)
+		p_hist->max = p_value;
+	++p_hist->count[rt_hist_index(p_value)];
+	++p_hist->n;
+	p_hist->sum += p_value;
+}
+
+
+
+unsigned long long rt_hist_percentile(const struct rt_hist *const p_hist, const double p_pct)
+{
+	unsigned long long seen = 0, target = p_hist->n * p_pct;
+	int i;
+
+	for(i = 0; i < RT_HIST_BUCKETS; ++i) {
+		seen += p_hist->count[i];
+		if((seen > target) || (seen == p_hist->n))
+			return (rt_hist_value(i) < p_hist->max) ? rt_hist_value(i) : p_hist->max;
+	}
+	return p_hist->max;
+}
+
+
+
+void rt_hist_print(const struct rt_hist *const p_hist, const char *const p_name)
+{
+	static const double pcts[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+	unsigned int i;
+
+	if(p_hist->n == 0) {
+		fprintf(stderr, "%s: no samples\n", p_name);
+		return;
+	}
+	fprintf(stderr, "%s: n %llu  min %llu  mean %.0f", p_name, p_hist->n, p_hist->min, p_hist->sum / p_hist->n);
+	for(i = 0; i < sizeof(pcts) / sizeof(pcts[0]); ++i)
+		fprintf(stderr, "  p%g %llu", pcts[i] * 100, rt_hist_percentile(p_hist, pcts[i]));
+	fprintf(stderr, "  max %llu ns\n", p_hist->max);
+}
+
+
+
+static int rt_hist_index(const unsigned long long p_value)
+{
+	int msb;
+
+	if(p_value < (1 << RT_HIST_SUB_BITS))
+		return p_value;
+	msb = 63 - __builtin_clzll(p_value);
+	return ((msb - RT_HIST_SUB_BITS + 1) << RT_HIST_SUB_BITS) | ((p_value >> (msb - RT_HIST_SUB_BITS)) & ((1 << RT_HIST_SUB_BITS) - 1));
+}
+
+
+
+unsigned long long rt_hist_value(const int p_index)
+{
+	int shift;
+
+	if(p_index < (1 << RT_HIST_SUB_BITS))
+		return p_index;
+	shift = (p_index >> RT_HIST_SUB_BITS) - 1;
+	return ((((unsigned long long)(p_index & ((1 << RT_HIST_SUB_BITS) - 1)) | (1 << RT_HIST_SUB_BITS)) + 1) << shift) - 1;
+}
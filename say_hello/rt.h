@@ -0,0 +1,79 @@
+/** @file rt.h
+ * Real-time profile for latency-critical khello clients: locked and prefaulted memory, a pinned CPU and SCHED_FIFO.
+ * The clients then busy-poll their devices and use the histogram below to report the jitter they observed.
+ */
+
+#ifndef RT_H
+#define RT_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+
+#define RT_PRIORITY 80 /**< SCHED_FIFO priority set by rt_enter(). */
+#define RT_STACK_PREFAULT (256 * 1024) /**< Bytes of stack touched by rt_enter() so it does not fault later. */
+
+#define RT_HIST_SUB_BITS 4 /**< Each power of 2 is split in 2^RT_HIST_SUB_BITS buckets, about 6% resolution. */
+#define RT_HIST_BUCKETS (64 << RT_HIST_SUB_BITS) /**< Buckets covering all 64-bit values. */
+
+
+/** Log-linear histogram of durations in ns. */
+struct rt_hist {
+	unsigned long long count[RT_HIST_BUCKETS]; /**< Samples per bucket. */
+	unsigned long long n; /**< Number of samples. */
+	unsigned long long min; /**< Smallest sample. */
+	unsigned long long max; /**< Largest sample. */
+	double sum; /**< Sum of samples. */
+};
+
+
+/** Chooses a CPU for a real-time process: the p_index-th CPU in /sys/devices/system/cpu/isolated,
+ *  or if no CPU is isolated the p_index-th allowed CPU counting from the highest, which is least likely to handle housekeeping.
+ *  @param p_index 0 for the first process of a tool, 1 for a second one that must not share the CPU.
+ *  @param p_isolated Set to 1 if the CPU is isolated, else 0.
+ *  @return The CPU, or -1 if none is found.
+ */
+int rt_pick_cpu(const int p_index, int *const p_isolated);
+
+/** Applies the real-time profile to the calling thread: mlockall(MCL_CURRENT | MCL_FUTURE), prefaults RT_STACK_PREFAULT bytes of stack,
+ *  pins to a CPU and switches to SCHED_FIFO at RT_PRIORITY. Steps that fail are reported on stderr and the others still apply.
+ *  Memory locks are not inherited by fork(), so a child process calls this again.
+ *  @param p_cpu The CPU, or -1 to choose one with rt_pick_cpu().
+ *  @param p_index Passed to rt_pick_cpu().
+ *  @return 0 if every step succeeded. Else -1. CAP_SYS_NICE and CAP_IPC_LOCK, or root, are needed for all of them.
+ */
+int rt_enter(const int p_cpu, const int p_index);
+
+/** Touches every page of a buffer so its first real use does not take page faults.
+ *  @param p_buf The buffer.
+ *  @param p_size Its size.
+ */
+void rt_prefault(void *const p_buf, const size_t p_size);
+
+/** Reads the clock the module used for a record's timestamps.
+ *  @param p_clock KHELLO_CLOCK_* from struct khello_rec_hdr.
+ *  @return The time in ns.
+ */
+unsigned long long rt_clock_ns(const __u32 p_clock);
+
+/** Adds a sample to a histogram. */
+void rt_hist_add(struct rt_hist *const p_hist, const unsigned long long p_value);
+
+/** Returns the largest value held by a bucket.
+ *  @param p_index Bucket between 0 and RT_HIST_BUCKETS - 1.
+ */
+unsigned long long rt_hist_value(const int p_index);
+
+/** Returns a percentile of a histogram.
+ *  @param p_pct Percentile between 0 and 1.
+ *  @return Upper bound of the bucket holding the percentile.
+ */
+unsigned long long rt_hist_percentile(const struct rt_hist *const p_hist, const double p_pct);
+
+/** Prints one line with the count, min, mean, P50 to P99.99 and max of a histogram to stderr.
+ *  @param p_name What the samples are.
+ */
+void rt_hist_print(const struct rt_hist *const p_hist, const char *const p_name);
+
+
+#endif
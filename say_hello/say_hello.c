@@ -5,6 +5,11 @@
  * After loading the kernel module.
  * To read from the device: "./say_hello read"
  * To write to the device: ./say_hello write something"
+ * To print records as they arrive until interrupted: "./say_hello stream [raw|hex|len]"
+ * To write records read from stdin: "./say_hello ingest [lines|len] [batch|writev] < file"
+ * To measure io_uring against read()/write(): "./say_hello uring <read|write|compare> [depth] [count]"
+ * To print records from several devices tagged by device: "./say_hello fanin [raw|hex|len] [device...]"
+ * To run stream or fanin with the real-time profile and report jitter: "./say_hello --rt[=cpu] stream ..."
  * 
  */
 
@@ -15,9 +20,39 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <glob.h>
+#include <libgen.h>
+#include "../khello2/khello.h"
+#include "uring.h"
+#include "rt.h"
 
 
 #define DEVICE "/dev/khello" /**< The character device. */
+#define STREAM_IN_SIZE (256 * 1024) /**< Bytes requested from the device per read in stream mode. */
+#define STREAM_OUT_SIZE (1024 * 1024) /**< Size of the stdout buffer in stream mode. */
+
+/* Output formats of stream mode. */
+#define FORMAT_RAW 0 /**< Payloads are written back to back. */
+#define FORMAT_HEX 1 /**< Each payload is written as a line of hex digits. */
+#define FORMAT_LEN 2 /**< Each payload is preceded by its length as a 32-bit integer in host byte order. */
+
+#define INGEST_IN_SIZE (1024 * 1024) /**< Bytes read from stdin at a time in ingest mode. */
+
+#define URING_READ_SIZE 4096 /**< Bytes requested per read in uring mode. */
+
+#define FANIN_IN_SIZE (64 * 1024) /**< Bytes read from one device before moving to the next in fanin mode. */
+#define FANIN_TAG_MAX 32 /**< Longest device name printed as a tag in fanin mode, including the separator. */
+
+
+static volatile sig_atomic_t g_stop = 0; /**< Set by the signal handler to end stream mode. */
+static int g_rt = 0; /**< 1 to run stream and fanin with the real-time profile of rt.h and busy-poll. */
+static int g_rt_cpu = -1; /**< CPU for the real-time profile, -1 to let rt_enter() choose. */
 
 
 /** Check the arguments on the command line.
@@ -42,12 +77,122 @@ static void do_read();
 
 static void do_write(const char *const p_msg);
 
+/** Reads records from the device until interrupted and writes them to stdout.
+ *  The device stays open. The program waits for records with epoll, drains all available records with large reads and buffers the output.
+ *  @param p_format One of the FORMAT_* values.
+ */
+static void do_stream(const int p_format);
+
+/** Reads records from several devices until interrupted and writes them to stdout, tagged by device.
+ *  Devices are multiplexed with one epoll instance and ready devices are drained one read at a time in turn,
+ *  so a busy device cannot starve the others.
+ *  @param p_format FORMAT_RAW, FORMAT_HEX or FORMAT_LEN.
+ *  @param p_num Number of device names or glob patterns in p_names. If 0, DEVICE "*" is used.
+ *  @param p_names The device names or glob patterns.
+ */
+static void do_fanin(const int p_format, const int p_num, char *p_names[]);
+
+/** Formats one record into an output buffer, as described for stream mode.
+ *  @param p_out The buffer. Must have room for 2 * p_len + 4 bytes.
+ *  @param p_format FORMAT_RAW, FORMAT_HEX or FORMAT_LEN.
+ *  @param p_payload The record payload.
+ *  @param p_len Length of the payload.
+ *  @return Number of bytes written to p_out.
+ */
+static size_t format_record(unsigned char *const p_out, const int p_format, const unsigned char *const p_payload, const __u32 p_len);
+
+/** Reads records from stdin and writes them to the device in batches until end of file.
+ *  @param p_format FORMAT_LEN for length-prefixed records as written by stream mode, else one record per line.
+ *  @param p_use_writev 1 to submit batches with writev(), 0 to use KHELLO_IOC_SEND_BATCH. KHELLO_IOC_SEND_BATCH falls back to writev() on modules without it.
+ */
+static void do_ingest(const int p_format, int p_use_writev);
+
+/** Submits a batch of records to the device.
+ *  @param p_fd The device.
+ *  @param p_msgs The records.
+ *  @param p_iov The same records as iovecs.
+ *  @param p_count Number of records.
+ *  @param p_use_writev 1 to use writev(). Set to 1 if the device does not support KHELLO_IOC_SEND_BATCH.
+ *  @return 0 if all records were queued. Else -1.
+ */
+static int submit(const int p_fd, struct khello_msg *const p_msgs, const struct iovec *const p_iov, const int p_count, int *const p_use_writev);
+
+/** Runs read or write operations through io_uring and reports their rate. "compare" also runs them with plain read()/write().
+ *  @param p_op "read", "write" or "compare".
+ *  @param p_depth Number of operations kept in flight.
+ *  @param p_count Number of operations to run.
+ */
+static void do_uring(const char *const p_op, const int p_depth, const long p_count);
+
+/** Runs operations on the device with one read() or write() system call each, like do_read() and do_write().
+ *  @param p_write 1 to write records, 0 to read.
+ *  @param p_count Number of operations to run.
+ *  @param p_bytes Returns the number of bytes transferred.
+ *  @return Elapsed seconds, or -1 on error.
+ */
+static double run_plain(const int p_write, const long p_count, unsigned long long *const p_bytes);
+
+/** Runs operations on the device through io_uring, using a registered file and registered buffers.
+ *  Every operation is a single fixed-buffer read or write. Each system call submits the replacements for all completions reaped since the previous one,
+ *  so up to p_depth operations are queued per call. Multishot reads are not used: they need provided buffers instead of registered ones and a device
+ *  that takes non-blocking reads (FMODE_NOWAIT), which khello does not set. Linked reads are not used either, since a link only orders operations.
+ *  @param p_write 1 to write records, 0 to read.
+ *  @param p_depth Number of operations kept in flight.
+ *  @param p_count Number of operations to run.
+ *  @param p_bytes Returns the number of bytes transferred.
+ *  @return Elapsed seconds, or -1 on error.
+ */
+static double run_uring(const int p_write, const int p_depth, const long p_count, unsigned long long *const p_bytes);
+
+/** Prints the rate of a run.
+ *  @param p_engine Name of the engine.
+ *  @param p_write 1 if the run wrote records.
+ *  @param p_count Number of operations run.
+ *  @param p_secs Elapsed seconds.
+ *  @param p_bytes Bytes transferred.
+ */
+static void report(const char *const p_engine, const int p_write, const long p_count, const double p_secs, const unsigned long long p_bytes);
+
+/** Writes a buffer completely to stdout.
+ *  @param p_buf Data to write.
+ *  @param p_len Number of bytes in p_buf.
+ *  @return 0 if OK. Else -1.
+ */
+static int write_out(const unsigned char *p_buf, size_t p_len);
+
+/** Accounts one busy-poll of the real-time profile.
+ *  @param p_ready Number of ready devices the poll returned.
+ *  @param p_idle_at Time of the previous empty poll, 0 if the previous poll found data.
+ *  @param p_gaps Histogram of the time between consecutive empty polls. Anything above the cost of a poll is jitter: interrupts, preemption, SMIs.
+ *  @return 1 if the poll found nothing.
+ */
+static int poll_idle(const int p_ready, unsigned long long *const p_idle_at, struct rt_hist *const p_gaps);
+
+/** Adds the time a record spent in the device to a histogram. The clock is read again only when the record uses a different one.
+ *  @param p_hdr The record header.
+ *  @param p_first 1 for the first record of a read, which always reads the clock.
+ *  @param p_clock The clock last read.
+ *  @param p_now The time last read.
+ *  @param p_latency The histogram.
+ */
+static void add_latency(const struct khello_rec_hdr *const p_hdr, const int p_first, __u32 *const p_clock, unsigned long long *const p_now, struct rt_hist *const p_latency);
+
+/** Ends stream mode on SIGINT or SIGTERM. */
+static void handle_signal(int p_sig);
+
 
 
 int main(int argc, char *argv[])
 {
-	int operation; /* Operation to execute. 1=read. 2=write. */
+	int operation, format; /* Operation to execute. 1=read. 2=write. 3=stream. 4=ingest. 5=uring. 6=fanin. */
 
+	/* --rt[=cpu] before the operation applies the real-time profile to stream and fanin. */
+	if((argc >= 2) && (strncmp(argv[1], "--rt", 4) == 0) && ((argv[1][4] == 0) || (argv[1][4] == '='))) {
+		g_rt = 1;
+		g_rt_cpu = (argv[1][4] == '=') ? atoi(argv[1] + 5) : -1;
+		--argc;
+		++argv;
+	}
 	/* Check input arguments and decide on operation to carry out. */
 	if((operation = check_args(argc, argv)) == -1) {
 		printf("Incorrect args. Abort.\n");
@@ -62,6 +207,35 @@ int main(int argc, char *argv[])
 		case 2:
 			do_write(argv[2]);
 			break;
+		case 3:
+			if((argc < 3) || (strcmp(argv[2], "raw") == 0))
+				do_stream(FORMAT_RAW);
+			else if(strcmp(argv[2], "hex") == 0)
+				do_stream(FORMAT_HEX);
+			else if(strcmp(argv[2], "len") == 0)
+				do_stream(FORMAT_LEN);
+			else
+				printf("Incorrect args. Abort.\n");
+			break;
+		case 4:
+			do_ingest(((argc >= 3) && (strcmp(argv[2], "len") == 0)) ? FORMAT_LEN : FORMAT_RAW,
+				(argc >= 4) && (strcmp(argv[3], "writev") == 0));
+			break;
+		case 5:
+			do_uring(argv[2], (argc >= 4) ? atoi(argv[3]) : 32, (argc >= 5) ? atol(argv[4]) : 1000000);
+			break;
+		case 6:
+			/* The format is optional, anything else starts the device list. */
+			format = FORMAT_RAW;
+			if((argc >= 3) && (strcmp(argv[2], "hex") == 0))
+				format = FORMAT_HEX;
+			else if((argc >= 3) && (strcmp(argv[2], "len") == 0))
+				format = FORMAT_LEN;
+			if((argc >= 3) && ((format != FORMAT_RAW) || (strcmp(argv[2], "raw") == 0)))
+				do_fanin(format, argc - 3, argv + 3);
+			else
+				do_fanin(format, argc - 2, argv + 2);
+			break;
 		default:
 			break;
 	}
@@ -82,6 +256,18 @@ static int check_args(const int p_num, char *p_args[])
 	if((strcmp(p_args[1], "write")==0) && (p_num >= 3))
 		return 2;
 	
+	if(strcmp(p_args[1], "stream")==0)
+		return 3;
+	
+	if(strcmp(p_args[1], "ingest")==0)
+		return 4;
+	
+	if((strcmp(p_args[1], "uring")==0) && (p_num >= 3))
+		return 5;
+	
+	if(strcmp(p_args[1], "fanin")==0)
+		return 6;
+	
 	return -1;
 }
 
@@ -97,6 +283,7 @@ static void do_read()
 		return;
 	}
 	if((count = read(fd, buf, 32)) != -1) {
+		KHELLO_PROBE2(receive, fd, count);
 		buf[count -1] = 0;
 		printf("READ from %s: %s\n", DEVICE, buf);
 	} else
@@ -118,9 +305,10 @@ static void do_write(const char *const p_msg)
 		process_errnum(errno);
 		return;
 	}
-	if(write(fd, p_msg, count) != -1)
+	if(write(fd, p_msg, count) != -1) {
+		KHELLO_PROBE2(send, fd, count);
 		printf("WRITE to %s: %s\n", DEVICE, p_msg);
-	else 
+	} else 
 		process_errnum(errno);
 	
 	
@@ -129,7 +317,664 @@ static void do_write(const char *const p_msg)
 
 
 
+static void do_stream(const int p_format)
+{
+	int fd = -1, epfd = -1, ready;
+	__u32 flags = KHELLO_RECV_HDR, len, deq_clock = 0;
+	ssize_t count = 0, pos;
+	size_t out_len = 0, records;
+	unsigned char *in = NULL, *out = NULL, *payload;
+	unsigned long long idle_at = 0, deq_ns = 0;
+	struct khello_rec_hdr hdr;
+	struct epoll_event event;
+	struct sigaction action;
+	struct rt_hist *gaps = NULL, *latency = NULL;
+	
+	if(((in = malloc(STREAM_IN_SIZE)) == NULL) || ((out = malloc(STREAM_OUT_SIZE)) == NULL) ||
+		(g_rt && (((gaps = calloc(1, sizeof(struct rt_hist))) == NULL) || ((latency = calloc(1, sizeof(struct rt_hist))) == NULL)))) {
+		process_errnum(ENOMEM);
+		goto do_exit;
+	}
+	if((fd = open(DEVICE, O_RDONLY | O_NONBLOCK)) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	/* Ask for record headers so record boundaries are kept. */
+	if(ioctl(fd, KHELLO_IOC_SET_RECV, &flags) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if((epfd = epoll_create1(0)) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	if(g_rt) {
+		rt_enter(g_rt_cpu, 0);
+		rt_prefault(in, STREAM_IN_SIZE);
+		rt_prefault(out, STREAM_OUT_SIZE);
+	}
+	
+	while(!g_stop) {
+		/* The real-time profile busy-polls: epoll_wait() returns at once. */
+		KHELLO_PROBE1(wait_start, fd);
+		ready = epoll_wait(epfd, &event, 1, g_rt ? 0 : -1);
+		KHELLO_PROBE2(wait_end, fd, ready);
+		if(ready == -1) {
+			if(errno == EINTR)
+				continue;
+			process_errnum(errno);
+			break;
+		}
+		if(g_rt && poll_idle(ready, &idle_at, gaps))
+			continue;
+		
+		/* Drain everything available, or until stopped. Output is only flushed when the buffer fills or the device is empty. */
+		while(!g_stop && ((count = read(fd, in, STREAM_IN_SIZE)) > 0)) {
+			KHELLO_PROBE2(receive, fd, count);
+			KHELLO_PROBE2(batch_start, fd, 0);
+			records = 0;
+			for(pos = 0; pos + (ssize_t)sizeof(hdr) <= count; pos += sizeof(hdr) + len) {
+				memcpy(&hdr, in + pos, sizeof(hdr));
+				len = hdr.len;
+				payload = in + pos + sizeof(hdr);
+				if(g_rt)
+					add_latency(&hdr, records == 0, &deq_clock, &deq_ns, latency);
+				if(out_len + 2 * len + 4 > STREAM_OUT_SIZE) {
+					if(write_out(out, out_len) == -1)
+						goto do_exit;
+					out_len = 0;
+				}
+				out_len += format_record(out + out_len, p_format, payload, len);
+				++records;
+			}
+			KHELLO_PROBE2(batch_end, fd, records);
+		}
+		if((count == -1) && (errno != EAGAIN)) {
+			process_errnum(errno);
+			break;
+		}
+		if(write_out(out, out_len) == -1)
+			break;
+		out_len = 0;
+	}
+	write_out(out, out_len);
+	if(g_rt) {
+		rt_hist_print(gaps, "poll gap");
+		rt_hist_print(latency, "record latency");
+	}
+	
+do_exit:
+	if(epfd != -1)
+		close(epfd);
+	if(fd != -1)
+		close(fd);
+	free(in);
+	free(out);
+	free(gaps);
+	free(latency);
+}
+
+
+
+static void do_fanin(const int p_format, const int p_num, char *p_names[])
+{
+	char *default_name = DEVICE "*", tag[FANIN_TAG_MAX];
+	int epfd = -1, ready, i, n, first = 0, busy;
+	__u32 flags = KHELLO_RECV_HDR, len, index, deq_clock = 0;
+	ssize_t count, pos;
+	size_t out_len = 0, records, tag_len;
+	unsigned char *in = NULL, *out = NULL, *ready_list = NULL;
+	unsigned long long idle_at = 0, deq_ns = 0;
+	struct rt_hist *gaps = NULL, *latency = NULL;
+	int *fds = NULL;
+	struct khello_rec_hdr hdr;
+	struct epoll_event *events = NULL, event;
+	struct sigaction action;
+	glob_t names;
+	
+	/* Expand the patterns. Names that match nothing are kept so open() reports the error. */
+	memset(&names, 0, sizeof(names));
+	if(p_num == 0)
+		glob(default_name, 0, NULL, &names);
+	for(i = 0; i < p_num; ++i)
+		glob(p_names[i], GLOB_NOCHECK | ((i > 0) ? GLOB_APPEND : 0), NULL, &names);
+	if((n = names.gl_pathc) == 0) {
+		fprintf(stderr, "No device matches %s\n", default_name);
+		goto do_exit;
+	}
+	
+	if(((in = malloc(FANIN_IN_SIZE)) == NULL) || ((out = malloc(STREAM_OUT_SIZE)) == NULL) ||
+		((fds = malloc(n * sizeof(int))) == NULL) || ((ready_list = calloc(n, 1)) == NULL) ||
+		((events = malloc(n * sizeof(struct epoll_event))) == NULL) ||
+		(g_rt && (((gaps = calloc(1, sizeof(struct rt_hist))) == NULL) || ((latency = calloc(1, sizeof(struct rt_hist))) == NULL)))) {
+		process_errnum(ENOMEM);
+		goto do_exit;
+	}
+	for(i = 0; i < n; ++i)
+		fds[i] = -1;
+	if((epfd = epoll_create1(0)) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	for(i = 0; i < n; ++i) {
+		if((fds[i] = open(names.gl_pathv[i], O_RDONLY | O_NONBLOCK)) == -1) {
+			fprintf(stderr, "%s: ", names.gl_pathv[i]);
+			process_errnum(errno);
+			goto do_exit;
+		}
+		/* Ask for record headers so record boundaries are kept. */
+		if(ioctl(fds[i], KHELLO_IOC_SET_RECV, &flags) == -1) {
+			fprintf(stderr, "%s: ", names.gl_pathv[i]);
+			process_errnum(errno);
+			goto do_exit;
+		}
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event) == -1) {
+			process_errnum(errno);
+			goto do_exit;
+		}
+	}
+	
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	if(g_rt) {
+		rt_enter(g_rt_cpu, 0);
+		rt_prefault(in, FANIN_IN_SIZE);
+		rt_prefault(out, STREAM_OUT_SIZE);
+	}
+	
+	while(!g_stop) {
+		KHELLO_PROBE1(wait_start, epfd);
+		ready = epoll_wait(epfd, events, n, g_rt ? 0 : -1);
+		KHELLO_PROBE2(wait_end, epfd, ready);
+		if(ready == -1) {
+			if(errno == EINTR)
+				continue;
+			process_errnum(errno);
+			break;
+		}
+		if(g_rt && poll_idle(ready, &idle_at, gaps))
+			continue;
+		for(i = 0; i < ready; ++i)
+			ready_list[events[i].data.u32] = 1;
+		
+		/* Round-robin over the ready devices, one read each per round, until all are empty.
+		 * The starting device moves on every wakeup so no device is always served first. */
+		do {
+			busy = 0;
+			for(index = 0; index < (__u32)n; ++index) {
+				i = (first + index) % n;
+				if(!ready_list[i])
+					continue;
+				if((count = read(fds[i], in, FANIN_IN_SIZE)) <= 0) {
+					ready_list[i] = 0;
+					if((count == -1) && (errno != EAGAIN)) {
+						fprintf(stderr, "%s: ", names.gl_pathv[i]);
+						process_errnum(errno);
+						goto do_exit;
+					}
+					continue;
+				}
+				busy = 1;
+				KHELLO_PROBE2(receive, fds[i], count);
+				KHELLO_PROBE2(batch_start, fds[i], 0);
+				if(p_format == FORMAT_LEN)
+					tag_len = 0;
+				else
+					tag_len = snprintf(tag, sizeof(tag), "%.*s ", FANIN_TAG_MAX - 2, basename(names.gl_pathv[i]));
+				records = 0;
+				for(pos = 0; pos + (ssize_t)sizeof(hdr) <= count; pos += sizeof(hdr) + len) {
+					memcpy(&hdr, in + pos, sizeof(hdr));
+					len = hdr.len;
+					if(g_rt)
+						add_latency(&hdr, records == 0, &deq_clock, &deq_ns, latency);
+					if(out_len + FANIN_TAG_MAX + 2 * len + 5 > STREAM_OUT_SIZE) {
+						if(write_out(out, out_len) == -1)
+							goto do_exit;
+						out_len = 0;
+					}
+					/* Text formats start each line with the device name, len starts each record with the device index. */
+					if(p_format == FORMAT_LEN) {
+						index = i;
+						memcpy(out + out_len, &index, sizeof(index));
+						out_len += sizeof(index);
+					} else {
+						memcpy(out + out_len, tag, tag_len);
+						out_len += tag_len;
+					}
+					out_len += format_record(out + out_len, p_format, in + pos + sizeof(hdr), len);
+					if((p_format == FORMAT_RAW) && ((len == 0) || (out[out_len - 1] != '\n')))
+						out[out_len++] = '\n';
+					++records;
+				}
+				KHELLO_PROBE2(batch_end, fds[i], records);
+			}
+		} while(busy && !g_stop);
+		first = (first + 1) % n;
+		
+		if(write_out(out, out_len) == -1)
+			break;
+		out_len = 0;
+	}
+	write_out(out, out_len);
+	if(g_rt) {
+		rt_hist_print(gaps, "poll gap");
+		rt_hist_print(latency, "record latency");
+	}
+	
+do_exit:
+	if(epfd != -1)
+		close(epfd);
+	for(i = 0; (fds != NULL) && (i < n); ++i) {
+		if(fds[i] != -1)
+			close(fds[i]);
+	}
+	globfree(&names);
+	free(fds);
+	free(ready_list);
+	free(events);
+	free(in);
+	free(out);
+	free(gaps);
+	free(latency);
+}
+
+
+
+static size_t format_record(unsigned char *const p_out, const int p_format, const unsigned char *const p_payload, const __u32 p_len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t out_len = 0;
+	__u32 i;
+	
+	switch(p_format) {
+		case FORMAT_HEX:
+			for(i = 0; i < p_len; ++i) {
+				p_out[out_len++] = hex[p_payload[i] >> 4];
+				p_out[out_len++] = hex[p_payload[i] & 0xf];
+			}
+			p_out[out_len++] = '\n';
+			break;
+		case FORMAT_LEN:
+			memcpy(p_out, &p_len, sizeof(p_len));
+			out_len += sizeof(p_len);
+			/* Fall through */
+		default:
+			memcpy(p_out + out_len, p_payload, p_len);
+			out_len += p_len;
+			break;
+	}
+	return out_len;
+}
+
+
+
+static void do_ingest(const int p_format, int p_use_writev)
+{
+	int fd = -1, count = 0, eof = 0;
+	unsigned char *in = NULL, *end;
+	size_t avail = 0, pos = 0, len;
+	ssize_t got;
+	__u32 prefix;
+	unsigned long long total = 0;
+	struct khello_msg msgs[KHELLO_BATCH_MAX];
+	struct iovec iov[KHELLO_BATCH_MAX];
+	
+	if((in = malloc(INGEST_IN_SIZE)) == NULL) {
+		process_errnum(ENOMEM);
+		goto do_exit;
+	}
+	if((fd = open(DEVICE, O_WRONLY)) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	
+	while(!eof || (pos < avail)) {
+		/* Split the buffered input into records. */
+		for(;;) {
+			if(p_format == FORMAT_LEN) {
+				if(avail - pos < sizeof(prefix))
+					break;
+				memcpy(&prefix, in + pos, sizeof(prefix));
+				if(prefix > INGEST_IN_SIZE - sizeof(prefix)) {
+					fprintf(stderr, "Record of %u bytes is too long. Abort.\n", prefix);
+					goto do_exit;
+				}
+				if(avail - pos - sizeof(prefix) < prefix)
+					break;
+				pos += sizeof(prefix);
+				len = prefix;
+			} else {
+				if(pos == avail)
+					break;
+				if((end = memchr(in + pos, '\n', avail - pos)) != NULL)
+					len = end - (in + pos);
+				else if(eof || ((pos == 0) && (avail == INGEST_IN_SIZE))) /* Last line, or a line longer than the buffer. */
+					len = avail - pos;
+				else
+					break;
+			}
+			msgs[count].addr = (uintptr_t)(in + pos);
+			msgs[count].len = (len > KHELLO_RECORD_MAX) ? KHELLO_RECORD_MAX : len;
+			msgs[count].reserved = 0;
+			iov[count].iov_base = in + pos;
+			iov[count].iov_len = msgs[count].len;
+			pos += len;
+			if((p_format != FORMAT_LEN) && (pos < avail) && (in[pos] == '\n'))
+				++pos;
+			if(++count == KHELLO_BATCH_MAX) {
+				if(submit(fd, msgs, iov, count, &p_use_writev) == -1)
+					goto do_exit;
+				total += count;
+				count = 0;
+			}
+		}
+		if(eof && (pos < avail)) {
+			fprintf(stderr, "Incomplete record at end of input. Ignored.\n");
+			pos = avail;
+		}
+		
+		/* The pending records point into the buffer, so submit them before it is reused. */
+		if(count > 0) {
+			if(submit(fd, msgs, iov, count, &p_use_writev) == -1)
+				goto do_exit;
+			total += count;
+			count = 0;
+		}
+		if(eof)
+			break;
+		memmove(in, in + pos, avail - pos);
+		avail -= pos;
+		pos = 0;
+		if((got = read(STDIN_FILENO, in + avail, INGEST_IN_SIZE - avail)) == -1) {
+			if(errno == EINTR)
+				continue;
+			process_errnum(errno);
+			goto do_exit;
+		}
+		if(got == 0)
+			eof = 1;
+		avail += got;
+	}
+	
+do_exit:
+	fprintf(stderr, "INGEST to %s: %llu records\n", DEVICE, total);
+	if(fd != -1)
+		close(fd);
+	free(in);
+}
+
+
+
+static int submit(const int p_fd, struct khello_msg *const p_msgs, const struct iovec *const p_iov, const int p_count, int *const p_use_writev)
+{
+	struct khello_batch batch;
+	ssize_t bytes = 0;
+	int result, i;
+	
+	KHELLO_PROBE2(batch_start, p_fd, p_count);
+	if(!*p_use_writev) {
+		batch.msgs = (uintptr_t)p_msgs;
+		batch.count = p_count;
+		batch.done = 0;
+		if((result = ioctl(p_fd, KHELLO_IOC_SEND_BATCH, &batch)) == -1) {
+			if(errno != ENOTTY) {
+				process_errnum(errno);
+				return -1;
+			}
+			*p_use_writev = 1; /* Older module. */
+		} else if(result != p_count) {
+			fprintf(stderr, "Only %d of %d records queued.\n", result, p_count);
+			return -1;
+		}
+	}
+	if(*p_use_writev) {
+		if((bytes = writev(p_fd, p_iov, p_count)) == -1) {
+			process_errnum(errno);
+			return -1;
+		}
+	} else {
+		for(i = 0; i < p_count; ++i)
+			bytes += p_msgs[i].len;
+	}
+	KHELLO_PROBE2(send, p_fd, bytes);
+	KHELLO_PROBE2(batch_end, p_fd, p_count);
+	return 0;
+}
+
+
+
+static void do_uring(const char *const p_op, const int p_depth, const long p_count)
+{
+	unsigned long long bytes;
+	double secs;
+	int write_op;
+	
+	if((p_depth < 1) || (p_depth > 4096) || (p_count < 1)) {
+		printf("Incorrect args. Abort.\n");
+		return;
+	}
+	for(write_op = 1; write_op >= 0; --write_op) {
+		if((strcmp(p_op, "compare") != 0) && (strcmp(p_op, write_op ? "write" : "read") != 0))
+			continue;
+		if(strcmp(p_op, "compare") == 0) {
+			if((secs = run_plain(write_op, p_count, &bytes)) < 0)
+				return;
+			report("plain", write_op, p_count, secs, bytes);
+		}
+		if((secs = run_uring(write_op, p_depth, p_count, &bytes)) < 0)
+			return;
+		report("io_uring", write_op, p_count, secs, bytes);
+	}
+}
+
+
+
+static double run_plain(const int p_write, const long p_count, unsigned long long *const p_bytes)
+{
+	unsigned char buf[URING_READ_SIZE];
+	struct timespec start, end;
+	ssize_t count;
+	long i;
+	int fd;
+	
+	*p_bytes = 0;
+	memset(buf, 'k', sizeof(buf));
+	if((fd = open(DEVICE, p_write ? O_WRONLY : O_RDONLY)) == -1) {
+		process_errnum(errno);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < p_count; ++i) {
+		if(p_write)
+			count = write(fd, buf, KHELLO_RECORD_MAX);
+		else
+			count = read(fd, buf, URING_READ_SIZE);
+		if(count == -1) {
+			process_errnum(errno);
+			close(fd);
+			return -1;
+		}
+		*p_bytes += count;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(fd);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+
+
+static double run_uring(const int p_write, const int p_depth, const long p_count, unsigned long long *const p_bytes)
+{
+	struct uring ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct iovec *iov = NULL;
+	struct timespec start, end;
+	unsigned char *bufs = NULL;
+	size_t size = p_write ? KHELLO_RECORD_MAX : URING_READ_SIZE;
+	long submitted = 0, completed = 0;
+	double secs = -1;
+	int fd = -1, i, res;
+	
+	*p_bytes = 0;
+	memset(&ring, 0, sizeof(ring));
+	if((fd = open(DEVICE, p_write ? O_WRONLY : O_RDONLY)) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if(uring_setup(&ring, p_depth) == -1) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	if((posix_memalign((void**)&bufs, 4096, p_depth * size) != 0) || ((iov = calloc(p_depth, sizeof(struct iovec))) == NULL)) {
+		process_errnum(ENOMEM);
+		goto do_exit;
+	}
+	memset(bufs, 'k', p_depth * size);
+	for(i = 0; i < p_depth; ++i) {
+		iov[i].iov_base = bufs + i * size;
+		iov[i].iov_len = size;
+	}
+	/* Registered files and buffers save the per-operation file lookup and page pinning. */
+	if((uring_register_files(&ring, &fd, 1) == -1) || (uring_register_buffers(&ring, iov, p_depth) == -1)) {
+		process_errnum(errno);
+		goto do_exit;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; (i < p_depth) && (submitted < p_count); ++i, ++submitted) {
+		sqe = uring_get_sqe(&ring);
+		sqe->opcode = p_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+		sqe->addr = (uintptr_t)iov[i].iov_base;
+		sqe->len = size;
+		sqe->buf_index = i;
+		sqe->user_data = i;
+	}
+	/* One system call per pass: submit the queued operations, wait for at least one, then queue a replacement for each completion. */
+	while(completed < p_count) {
+		KHELLO_PROBE2(batch_start, fd, ring.to_submit);
+		if(uring_submit(&ring, 1) == -1) {
+			process_errnum(errno);
+			goto do_exit;
+		}
+		while((cqe = uring_peek_cqe(&ring)) != NULL) {
+			res = cqe->res;
+			i = cqe->user_data;
+			uring_cqe_seen(&ring);
+			if(res < 0) {
+				process_errnum(-res);
+				goto do_exit;
+			}
+			*p_bytes += res;
+			++completed;
+			if(submitted < p_count) { /* Reuse the buffer for the next operation. */
+				sqe = uring_get_sqe(&ring);
+				sqe->opcode = p_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+				sqe->flags = IOSQE_FIXED_FILE;
+				sqe->fd = 0;
+				sqe->addr = (uintptr_t)iov[i].iov_base;
+				sqe->len = size;
+				sqe->buf_index = i;
+				sqe->user_data = i;
+				++submitted;
+			}
+		}
+		KHELLO_PROBE2(batch_end, fd, completed);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	
+do_exit:
+	uring_close(&ring);
+	if(fd != -1)
+		close(fd);
+	free(bufs);
+	free(iov);
+	return secs;
+}
+
+
+
+static void report(const char *const p_engine, const int p_write, const long p_count, const double p_secs, const unsigned long long p_bytes)
+{
+	printf("%-8s %-5s: %ld ops in %.3f s, %.0f ops/s, %.1f MB/s\n", p_engine, p_write ? "write" : "read",
+		p_count, p_secs, p_count / p_secs, p_bytes / p_secs / 1e6);
+}
+
+
+
+static int write_out(const unsigned char *p_buf, size_t p_len)
+{
+	ssize_t count;
+	
+	while(p_len > 0) {
+		if((count = write(STDOUT_FILENO, p_buf, p_len)) == -1) {
+			if(errno == EINTR)
+				continue;
+			process_errnum(errno);
+			return -1;
+		}
+		p_buf += count;
+		p_len -= count;
+	}
+	return 0;
+}
+
+
+
+static int poll_idle(const int p_ready, unsigned long long *const p_idle_at, struct rt_hist *const p_gaps)
+{
+	unsigned long long now;
+	
+	if(p_ready > 0) {
+		*p_idle_at = 0;
+		return 0;
+	}
+	now = rt_clock_ns(KHELLO_CLOCK_MONOTONIC);
+	if(*p_idle_at != 0)
+		rt_hist_add(p_gaps, now - *p_idle_at);
+	*p_idle_at = now;
+	return 1;
+}
+
+
+
+static void add_latency(const struct khello_rec_hdr *const p_hdr, const int p_first, __u32 *const p_clock, unsigned long long *const p_now, struct rt_hist *const p_latency)
+{
+	if(p_first || (p_hdr->clock != *p_clock)) {
+		*p_clock = p_hdr->clock;
+		*p_now = rt_clock_ns(*p_clock);
+	}
+	rt_hist_add(p_latency, (*p_now > p_hdr->enq_ns) ? *p_now - p_hdr->enq_ns : 0);
+}
+
+
+
+static void handle_signal(int p_sig)
+{
+	g_stop = 1;
+}
+
+
+
 static void process_errnum(const int p_errnum)
 {
-	printf("%s\n", strerror(p_errnum));
+	fprintf(stderr, "%s\n", strerror(p_errnum));
 }
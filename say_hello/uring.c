@@ -0,0 +1,153 @@
+/** @file uring.c
+ * Minimal io_uring wrapper built on the raw system calls. See uring.h.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "uring.h"
+
+
+
+int uring_setup(struct uring *const p_ring, const unsigned int p_entries)
+{
+	struct io_uring_params params;
+	void *sq_ptr, *cq_ptr, *sqes;
+	size_t sq_size, cq_size, sqes_size;
+	int fd;
+
+	memset(p_ring, 0, sizeof(struct uring));
+	memset(&params, 0, sizeof(params));
+	if((fd = syscall(__NR_io_uring_setup, p_entries, &params)) == -1)
+		return -1;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(sq_ptr == MAP_FAILED)
+		goto do_error;
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else if((cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		munmap(sq_ptr, sq_size);
+		goto do_error;
+	}
+	if((sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		if(cq_ptr != sq_ptr)
+			munmap(cq_ptr, cq_size);
+		munmap(sq_ptr, sq_size);
+		goto do_error;
+	}
+
+	p_ring->fd = fd;
+	p_ring->entries = params.sq_entries;
+	p_ring->sq_head = (unsigned int*)((char*)sq_ptr + params.sq_off.head);
+	p_ring->sq_tail = (unsigned int*)((char*)sq_ptr + params.sq_off.tail);
+	p_ring->sq_mask = (unsigned int*)((char*)sq_ptr + params.sq_off.ring_mask);
+	p_ring->sq_array = (unsigned int*)((char*)sq_ptr + params.sq_off.array);
+	p_ring->sqes = sqes;
+	p_ring->cq_head = (unsigned int*)((char*)cq_ptr + params.cq_off.head);
+	p_ring->cq_tail = (unsigned int*)((char*)cq_ptr + params.cq_off.tail);
+	p_ring->cq_mask = (unsigned int*)((char*)cq_ptr + params.cq_off.ring_mask);
+	p_ring->cqes = (struct io_uring_cqe*)((char*)cq_ptr + params.cq_off.cqes);
+	p_ring->sq_ptr = sq_ptr;
+	p_ring->cq_ptr = cq_ptr;
+	p_ring->sq_size = sq_size;
+	p_ring->cq_size = cq_size;
+	p_ring->sqes_size = sqes_size;
+	return 0;
+
+do_error:
+	close(fd);
+	return -1;
+}
+
+
+
+void uring_close(struct uring *const p_ring)
+{
+	if(p_ring->sqes != NULL)
+		munmap(p_ring->sqes, p_ring->sqes_size);
+	if((p_ring->cq_ptr != NULL) && (p_ring->cq_ptr != p_ring->sq_ptr))
+		munmap(p_ring->cq_ptr, p_ring->cq_size);
+	if(p_ring->sq_ptr != NULL)
+		munmap(p_ring->sq_ptr, p_ring->sq_size);
+	if(p_ring->fd > 0)
+		close(p_ring->fd);
+	memset(p_ring, 0, sizeof(struct uring));
+}
+
+
+
+int uring_register_files(struct uring *const p_ring, const int *const p_fds, const unsigned int p_count)
+{
+	return syscall(__NR_io_uring_register, p_ring->fd, IORING_REGISTER_FILES, p_fds, p_count);
+}
+
+
+
+int uring_register_buffers(struct uring *const p_ring, const struct iovec *const p_iov, const unsigned int p_count)
+{
+	return syscall(__NR_io_uring_register, p_ring->fd, IORING_REGISTER_BUFFERS, p_iov, p_count);
+}
+
+
+
+struct io_uring_sqe *uring_get_sqe(struct uring *const p_ring)
+{
+	unsigned int head, tail = *p_ring->sq_tail + p_ring->to_submit;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(p_ring->sq_head, __ATOMIC_ACQUIRE);
+	if(tail - head >= p_ring->entries)
+		return NULL;
+	sqe = &p_ring->sqes[tail & *p_ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	p_ring->sq_array[tail & *p_ring->sq_mask] = tail & *p_ring->sq_mask;
+	++p_ring->to_submit;
+	return sqe;
+}
+
+
+
+int uring_submit(struct uring *const p_ring, const unsigned int p_wait_nr)
+{
+	unsigned int count = p_ring->to_submit;
+	int result;
+
+	/* Publish the new entries before the kernel looks at the tail. */
+	__atomic_store_n(p_ring->sq_tail, *p_ring->sq_tail + count, __ATOMIC_RELEASE);
+	p_ring->to_submit = 0;
+	do {
+		result = syscall(__NR_io_uring_enter, p_ring->fd, count, p_wait_nr, p_wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while((result == -1) && (errno == EINTR));
+	return result;
+}
+
+
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *const p_ring)
+{
+	unsigned int head = *p_ring->cq_head;
+
+	if(head == __atomic_load_n(p_ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &p_ring->cqes[head & *p_ring->cq_mask];
+}
+
+
+
+void uring_cqe_seen(struct uring *const p_ring)
+{
+	__atomic_store_n(p_ring->cq_head, *p_ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,79 @@
+/** @file uring.h
+ * Minimal io_uring wrapper built on the raw system calls, so the client does not depend on liburing.
+ * Only what the khello clients need is provided: one ring, registered files and buffers, fixed reads and writes.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+
+/** An io_uring instance and its mapped submission and completion queues. */
+struct uring {
+	int fd; /**< The io_uring file descriptor. */
+	unsigned int entries; /**< Number of submission queue entries. */
+	unsigned int *sq_head; /**< Submission queue head, advanced by the kernel. */
+	unsigned int *sq_tail; /**< Submission queue tail, advanced by the application. */
+	unsigned int *sq_mask; /**< Submission queue index mask. */
+	unsigned int *sq_array; /**< Submission queue index array. */
+	struct io_uring_sqe *sqes; /**< Submission queue entries. */
+	unsigned int *cq_head; /**< Completion queue head, advanced by the application. */
+	unsigned int *cq_tail; /**< Completion queue tail, advanced by the kernel. */
+	unsigned int *cq_mask; /**< Completion queue index mask. */
+	struct io_uring_cqe *cqes; /**< Completion queue entries. */
+	void *sq_ptr; /**< Mapping of the submission queue ring. */
+	void *cq_ptr; /**< Mapping of the completion queue ring. Same as sq_ptr on kernels with IORING_FEAT_SINGLE_MMAP. */
+	size_t sq_size; /**< Size of the sq_ptr mapping. */
+	size_t cq_size; /**< Size of the cq_ptr mapping. */
+	size_t sqes_size; /**< Size of the sqes mapping. */
+	unsigned int to_submit; /**< Entries queued since the last uring_submit(). */
+};
+
+
+/** Creates an io_uring and maps its queues.
+ *  @param p_ring The ring to set up.
+ *  @param p_entries Number of submission queue entries.
+ *  @return 0 if OK. Else -1 with errno set. ENOSYS means the kernel has no io_uring.
+ */
+int uring_setup(struct uring *const p_ring, const unsigned int p_entries);
+
+/** Unmaps the queues and closes the ring.
+ *  @param p_ring The ring.
+ */
+void uring_close(struct uring *const p_ring);
+
+/** Registers files with the ring so entries can refer to them by index with IOSQE_FIXED_FILE.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int uring_register_files(struct uring *const p_ring, const int *const p_fds, const unsigned int p_count);
+
+/** Registers buffers with the ring so IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED can use them by index.
+ *  @return 0 if OK. Else -1 with errno set.
+ */
+int uring_register_buffers(struct uring *const p_ring, const struct iovec *const p_iov, const unsigned int p_count);
+
+/** Returns the next free submission queue entry, cleared. The entry is queued by uring_submit().
+ *  @return The entry, or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *const p_ring);
+
+/** Submits the queued entries and optionally waits for completions.
+ *  @param p_ring The ring.
+ *  @param p_wait_nr Number of completions to wait for.
+ *  @return Number of entries submitted. Else -1 with errno set.
+ */
+int uring_submit(struct uring *const p_ring, const unsigned int p_wait_nr);
+
+/** Returns the oldest completion, if any. Call uring_cqe_seen() when done with it.
+ *  @return The completion, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *const p_ring);
+
+/** Releases the completion returned by uring_peek_cqe().
+ *  @param p_ring The ring.
+ */
+void uring_cqe_seen(struct uring *const p_ring);
+
+
+#endif